@@ -1 +1,4 @@
 COMPONENT_ADD_INCLUDEDIRS=.
+
+# The hub's web pages are packed into the application (main/eq3_webfs.c)
+CFLAGS += -DMG_ENABLE_PACKED_FS=1
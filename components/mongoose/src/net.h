@@ -57,6 +57,7 @@ struct mg_connection {
   unsigned is_closing : 1;     // Close and free the connection immediately
   unsigned is_readable : 1;    // Connection is ready to read
   unsigned is_writable : 1;    // Connection is ready to write
+  unsigned is_full : 1;        // Stop reads, until cleared
 };
 
 void mg_mgr_poll(struct mg_mgr *, int ms);
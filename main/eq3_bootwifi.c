@@ -8,12 +8,13 @@
  */
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
-#include <esp_ota_ops.h>
+#include <freertos/semphr.h>
 #include <esp_log.h>
 #include <esp_err.h>
 #include <esp_system.h>
 #include <esp_event.h>
 #include <esp_wifi.h>
+#include <esp_timer.h>
 #include <nvs.h>
 #include <nvs_flash.h>
 #include <driver/gpio.h>
@@ -27,84 +28,28 @@
 #include "eq3_main.h"
 #include "eq3_gap.h"
 #include "eq3_wifi.h"
+#include "eq3_metrics.h"
+#include "eq3_broker.h"
+#include "eq3_config.h"
+#include "eq3_trvs.h"
+#include "eq3_journal.h"
+#include "eq3_events.h"
+#include "eq3_webtask.h"
+#include "eq3_ota.h"
+#include "eq3_multipart.h"
+#include "eq3_form.h"
+#include "eq3_routes.h"
 
 /* Webcontent */
 #include "eq3_htmlpages.h"
 
-// If the structure of a record saved for a subsequent reboot changes
-// then consider using semver to change the version number or else
-// we may try and boot with the wrong data.
-#define KEY_VERSION "version"
-/* Previous config version 1 */
-uint32_t g_v1_version=0x0100;
-/* Previous config version 2 */
-uint32_t g_v2_version=0x0200;
-/* Newer config version 3 */
-uint32_t g_version=0x0300;
-
 /* esp netif object representing the WIFI AP */
 static esp_netif_t *ap_netif = NULL;
 static esp_netif_t *sta_netif = NULL;
 
-#define KEY_CONNECTION_INFO "connectionInfo" // Key used in NVS for connection info
+#define KEY_FAST_CONNECT "fastConnect"       // Key used in NVS for the last access point we got an IP from
 #define BOOTWIFI_NAMESPACE "bootwifi"        // Namespace in NVS for bootwifi
-#define SSID_SIZE (32)                       // Maximum SSID size
-#define USERNAME_SIZE (64)                   // Maximum username size
-#define PASSWORD_SIZE (64)                   // Maximum password size
-#define ID_SIZE       (32)                   // Maximum MQTT clientID size
-#define MAX_URL_SIZE  (256)                  // Maximum url length
-#define SERVER_SIZE      (64)                // Maximum length of sntp/dns server url
-#define SNTP_TIMEZONE_SIZE (35)              // Maximum length of timezone parameter
-
-/* Non-volatile configuration parameters */
 
-/* This is the older config structure (used here to read config from previous versions of code) */
-typedef struct {
-    char ssid[SSID_SIZE];
-    char password[PASSWORD_SIZE];
-    char mqtturl[MAX_URL_SIZE];
-    char mqttuser[USERNAME_SIZE];
-    char mqttpass[PASSWORD_SIZE];
-    char mqttid[ID_SIZE];
-    tcpip_adapter_ip_info_t ipInfo;          // Optional static IP information
-} v1_connection_info_t;
-#define V1_CONNECTION_INFO_SIZE sizeof(v1_connection_info_t);
-
-/* Newer config structure - nvs save will place this structure in flash */
-typedef struct {
-    char ssid[SSID_SIZE];
-    char password[PASSWORD_SIZE];
-    char mqtturl[MAX_URL_SIZE];
-    char mqttuser[USERNAME_SIZE];
-    char mqttpass[PASSWORD_SIZE];
-    char mqttid[ID_SIZE];
-    tcpip_adapter_ip_info_t ipInfo;          // Optional static IP information
-    int ntpenabled;
-    char ntpserver[SERVER_SIZE];
-    char ntptimezone[SNTP_TIMEZONE_SIZE];
-} v2_connection_info_t;
-#define V2_CONNECTION_INFO_SIZE sizeof(v2_connection_info_t);
-
-typedef struct {
-    char ssid[SSID_SIZE];
-    char password[PASSWORD_SIZE];
-    char mqtturl[MAX_URL_SIZE];
-    char mqttuser[USERNAME_SIZE];
-    char mqttpass[PASSWORD_SIZE];
-    char mqttid[ID_SIZE];
-    esp_netif_ip_info_t ipInfo;          // Optional static IP information
-    int ntpenabled;
-    char ntpserver[SERVER_SIZE];
-    char ntptimezone[SNTP_TIMEZONE_SIZE];
-    char ntpserver2[SERVER_SIZE];
-    char dnsservers[2][SERVER_SIZE];
-    char spare[550];
-} connection_info_t;
-
-static connection_info_t connectionInfo;
-int getConnectionInfo(connection_info_t *pConnectionInfo);
-
-static void saveConnectionInfo(connection_info_t *pConnectionInfo);
 static void becomeAccessPoint();
 static void bootWiFi2();
 
@@ -116,55 +61,103 @@ static bootwifi_parms_t g_parms = NULL;
 
 static bool sta_configured = false;           // Are we in STA mode?
 
+/* Channel and BSSID of the last access point we got an IP from - a directed connect
+ * to it skips the full channel scan. The DHCP lease is restored by lwip (LWIP_DHCP_RESTORE_LAST_IP) */
+typedef struct {
+    char ssid[SSID_SIZE];
+    uint8_t bssid[6];
+    uint8_t channel;
+} fast_connect_t;
+static fast_connect_t fastConnect;
+static bool fast_valid = false;               // fastConnect matches the configured ssid
+static bool fast_attempt = false;             // The current connect attempt is directed
+
+/* Time to get an IP address */
+static struct wifi_timing timing;
+static int64_t connect_start = 0;             // Start of the current (re)connect
+static bool sta_connected = false;            // Do we have an IP address
+
 /* ===================== Status log code ================================= */
-#define NUM_LOG_ENTRIES 40
-static char *log_entries[NUM_LOG_ENTRIES];
+/* The log is a byte ring buffer of variable length records, each a header
+ * followed by the (unterminated) text. The time is kept raw and only
+ * formatted when the log page is served. Adding a record drops as many of
+ * the oldest records as needed to make room for it. */
+#define LOG_SIZE       CONFIG_EQ3_LOG_SIZE
+#define LOG_MAX_TEXT   (LOG_SIZE / 4)          // Longer entries are truncated
+#define LOG_TIME_LEN   64                      // Room for a formatted time and " - "
+#define LOG_VALID_TIME 1546300800              // Times before 2019 mean the clock isn't set
+
+struct log_header {
+    uint32_t time;                              // 0 if the time wasn't known
+    uint16_t len;                               // Length of the text that follows
+};
+
+static uint8_t log_buf[LOG_SIZE];
+static int log_head = 0;                        // Where the next record is written
+static int log_tail = 0;                        // Oldest record
+static int log_used = 0;                        // Bytes in use
+static int log_count = 0;                       // Records in the buffer
+static uint32_t log_added = 0;                  // Records ever added - the newest is log_added - 1
+static SemaphoreHandle_t log_lock = NULL;
+
+/* Copy in/out of the ring, wrapping at the end */
+static void log_write(int pos, const void *data, int len){
+    int first = LOG_SIZE - pos < len ? LOG_SIZE - pos : len;
+    memcpy(&log_buf[pos], data, first);
+    memcpy(log_buf, (const uint8_t *)data + first, len - first);
+}
 
-/* Initialise the log array */
+static void log_read(int pos, void *data, int len){
+    int first = LOG_SIZE - pos < len ? LOG_SIZE - pos : len;
+    memcpy(data, &log_buf[pos], first);
+    memcpy((uint8_t *)data + first, log_buf, len - first);
+}
+
+/* Initialise the log */
 void eq3_log_init(void){
-    for(int i=0; i<NUM_LOG_ENTRIES; i++)
-        log_entries[i] = NULL;
+    if(log_lock == NULL)
+        log_lock = xSemaphoreCreateMutex();
+    log_head = log_tail = log_used = log_count = 0;
+    log_added = 0;
 }
 
-/* Add a new log entry to the top of the array */
+/* Add a new log entry */
 void eq3_add_log(char *log){
-    char strftime_buf[64] = {0};
-    if(connectionInfo.ntpenabled != 0){
-        time_t now = 0;
-        struct tm timeinfo = { 0 };
-        time(&now);
-        localtime_r(&now, &timeinfo);
-        strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
-    }
-    char *newlog = malloc(strlen(log) + strlen(strftime_buf) + 4);
-    if(newlog != NULL){
-        int stridx = 0;
-        if(connectionInfo.ntpenabled != 0)
-            stridx += sprintf(newlog, "%s - ", strftime_buf);
-        strcpy(&newlog[stridx], log);
-        if(log_entries[NUM_LOG_ENTRIES - 1] != NULL)
-            free(log_entries[NUM_LOG_ENTRIES - 1]);
-        for(int i = NUM_LOG_ENTRIES - 2; i >= 0; i--){
-            log_entries[i+1] = log_entries[i];
-        }
-        log_entries[0] = newlog;
-    }
-}
+    struct log_header header;
+    time_t now = 0;
+    int len = strlen(log);
 
-/* Calculate the number of log entries in the array */
-static int eq3_num_logs(void){
-    int ret = 0;
-    for(int i = 0; i < (NUM_LOG_ENTRIES - 1); i++){
-        if(log_entries[i] != NULL)
-            ret++;
+    if(log_lock == NULL)
+        return;
+    if(len > LOG_MAX_TEXT)
+        len = LOG_MAX_TEXT;
+    time(&now);
+    header.time = now > LOG_VALID_TIME ? (uint32_t)now : 0;
+    header.len = len;
+
+    xSemaphoreTake(log_lock, portMAX_DELAY);
+    /* Drop the oldest records until the new one fits */
+    while(log_used + sizeof(header) + len > LOG_SIZE){
+        struct log_header oldest;
+        log_read(log_tail, &oldest, sizeof(oldest));
+        log_tail = (log_tail + sizeof(oldest) + oldest.len) % LOG_SIZE;
+        log_used -= sizeof(oldest) + oldest.len;
+        log_count--;
     }
-    return ret;
+    log_write(log_head, &header, sizeof(header));
+    log_write((log_head + sizeof(header)) % LOG_SIZE, log, len);
+    log_head = (log_head + sizeof(header) + len) % LOG_SIZE;
+    log_used += sizeof(header) + len;
+    log_count++;
+    log_added++;
+    xSemaphoreGive(log_lock);
 }
 
 /* ===================== Mongoose webserver code ========================= */
 
 static int g_mongooseStarted = 0; // Has the mongoose server started?
 static int g_mongooseStopRequest = 0; // Request to stop the mongoose server.
+#define MONGOOSE_POLL_MAX_MS 10000  // Longest sleep with no timers due - other tasks wake it with eq3_webtask
 
 #ifdef removed
 /**
@@ -204,258 +197,932 @@ static char *mongoose_eventToString(int ev) {
 } //eventToString
 #endif
 
-// Convert a Mongoose string type to a string.
-static char *mgStrToStr(struct mg_str mgStr) {
-    if(mgStr.len == 0)
+/* Small fixed pages - sent straight from flash into the send buffer */
+static void mongoose_serve_content(struct mg_connection *nc, const char *content, bool footer){
+    const char *foot = footer ? pagefooter : pageemptyfooter;
+    size_t contlen = content != NULL ? strlen(content) : 0;
+    mg_printf(nc, "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: %u\r\n\r\n",
+              (unsigned)(strlen(pageheader) + contlen + strlen(foot)));
+    mg_send(nc, pageheader, strlen(pageheader));
+    mg_send(nc, content, contlen);
+    mg_send(nc, foot, strlen(foot));
+}
+
+/* Pages that grow with the log, the registry or the journal are streamed with chunked encoding
+ * a few rows at a time whenever the send buffer runs low, so the memory they need doesn't depend
+ * on how many rows there are. The stream state rides on the connection (fn_data) */
+#define STREAM_SEND_LOW    1024
+#define LOG_STREAM_BATCH   8            /* Log records located per walk of the ring */
+
+/* A stream had nothing to send yet - poll again straight away rather than sleeping */
+static bool stream_yielded = false;
+
+struct mongoose_stream;
+/* Add the next part of a stream - returns true once the content is complete. Adding nothing
+ * (without completing) gives the other connections a turn before it is called again. A stream
+ * that can't go on sets is_draining and returns true - the connection closes without the
+ * last chunk so the client can tell the content is incomplete */
+typedef bool (*mongoose_stream_fill)(struct mg_connection *nc, struct mongoose_stream *stream);
+
+struct mongoose_stream {
+    mongoose_stream_fill fill;
+    union {
+        int next_trv;                   /* Registry index of the next TRV */
+        struct {
+            uint32_t next;              /* Record number of the next (older) record */
+            int left;                   /* Records still to send */
+        } log;
+        struct journal_query query;
+    };
+};
+
+static void mongoose_chunk_str(struct mg_connection *nc, const char *str){
+    mg_http_write_chunk(nc, str, strlen(str));
+}
+
+/* Send the response headers and attach a stream to the connection - NULL (with an error sent) if there is no memory */
+static struct mongoose_stream *mongoose_stream_start(struct mg_connection *nc, const char *content_type, mongoose_stream_fill fill){
+    struct mongoose_stream *stream = calloc(1, sizeof(struct mongoose_stream));
+    if(stream == NULL){
+        mg_http_reply(nc, 503, "Content-Type: text/plain\r\n", "No memory\n");
         return NULL;
-    char *retStr = (char *) malloc(mgStr.len + 1);
-    memcpy(retStr, mgStr.ptr, mgStr.len);
-    retStr[mgStr.len] = 0;
-    return retStr;
-} // mgStrToStr
-
-static int mongoose_serve_content(struct mg_connection *nc, char *content, bool footer){
-    int apploc = 0;
-    int rc = 0;
-    int contlen = 0;
-    if(content != NULL)
-        contlen = strlen(content);
-    /* Hopefully 20 characters is enough for the version */
-    char *htmlstr = malloc(strlen(pageheader) + strlen(pagefooter) + contlen + 1);
-    if(htmlstr != NULL){
-        apploc += sprintf(&htmlstr[apploc], pageheader);
-        if(content != NULL){
-            //apploc += sprintf(&htmlstr[apploc], content);
-            strcpy(&htmlstr[apploc], content);
-            apploc += strlen(content);
+    }
+    stream->fill = fill;
+    mg_printf(nc, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nCache-Control: no-store\r\nTransfer-Encoding: chunked\r\n\r\n", content_type);
+    nc->fn_data = stream;
+    return stream;
+}
+
+/* Top up the send buffer - called once the stream is set up and then as the buffer drains */
+static void mongoose_stream_more(struct mg_connection *nc){
+    struct mongoose_stream *stream = (struct mongoose_stream *)nc->fn_data;
+    while(stream != NULL && nc->send.len <= STREAM_SEND_LOW){
+        size_t sent = nc->send.len;
+        if(stream->fill(nc, stream) == true){
+            if(nc->is_draining == 0)
+                mg_http_write_chunk(nc, "", 0);
+            nc->fn_data = NULL;
+            free(stream);
+            stream = NULL;
+        }else if(nc->send.len == sent){
+            stream_yielded = true;
+            break;
         }
-        if(footer == true)
-            apploc += sprintf(&htmlstr[apploc], pagefooter);
-        else
-            apploc += sprintf(&htmlstr[apploc], pageemptyfooter);
-        mg_http_reply(nc, 200, "Content-Type: text/html\n", "%s", htmlstr);
-        free(htmlstr);
-    }else{
-        ESP_LOGI(tag, "No free memory to server web page");
-        rc = -1;
     }
-    return rc;
 }
 
-/* Serve the configuration webpage */
-static int mongoose_serve_config_page(struct mg_connection *nc){
-    int rc = getConnectionInfo(&connectionInfo);
-    //char *htmlstr = malloc(strlen(selectap) + 100);
-    char *htmlstr = malloc(3100);
-    const char nullstr[] = "";
-    char *sptr = (char *)nullstr, *pptr = (char *)nullstr, *murlptr = (char *)nullstr, *muserptr = (char *)nullstr, *mpassptr = (char *)nullstr, *midptr = (char *)nullstr;
-    char *ibuf = (char *)nullstr, *gbuf = (char *)nullstr, *mbuf = (char *)nullstr;
+/* Static pages are gzip compressed in the packed filesystem (main/web - see tools/packweb.sh) and
+ * sent straight from flash. Browsers revalidate them with the ETag so a repeat load is a bodiless 304 */
+static void mongoose_serve_page(struct mg_connection *nc, struct mg_http_message *message, const char *path){
+    struct mg_http_serve_opts opts = {
+        .root_dir = "/web",
+        .extra_headers = "Content-Encoding: gzip\r\nCache-Control: no-cache\r\n",
+        .fs = &mg_fs_packed,
+    };
+    mg_http_serve_file(nc, message, path, &opts);
+}
+
+static void mongoose_json_error(struct mg_connection *nc, int code, const char *message){
+    mg_http_reply(nc, code, "Content-Type: application/json\r\nCache-Control: no-store\r\n", "{\"error\":\"%s\"}\n", message);
+}
+
+/* Json replies are written straight into the send buffer. The Content-Length is reserved as a
+ * fixed width field and filled in by mongoose_json_end() once the body is complete */
+#define JSON_LENGTH_WIDTH 10
+#define JSON_HEADERS "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nCache-Control: no-store\r\nContent-Length: %*s\r\n\r\n"
+
+/* Length of the mongoose_json_start() headers - the %*s is replaced by JSON_LENGTH_WIDTH spaces */
+#define JSON_HEADER_LEN (sizeof(JSON_HEADERS) - 1 - 3 + JSON_LENGTH_WIDTH)
+
+/* Make room for len more bytes in the send buffer - false if there is no memory */
+static bool mongoose_send_space(struct mg_connection *nc, size_t len){
+    return nc->send.size - nc->send.len >= len || mg_iobuf_resize(&nc->send, nc->send.len + len) != 0;
+}
+
+/* Start a json reply - returns where the body starts, or 0 (with a 503 sent) if there is no memory */
+static size_t mongoose_json_start(struct mg_connection *nc){
+    if(mongoose_send_space(nc, JSON_HEADER_LEN) == false){
+        mongoose_json_error(nc, 503, "No memory");
+        nc->is_draining = 1;
+        return 0;
+    }
+    mg_printf(nc, JSON_HEADERS, JSON_LENGTH_WIDTH, "");
+    return nc->send.len;
+}
+
+/* Append to a json reply. Mongoose appends nothing when the send buffer can't grow, so a failed
+ * append drains the connection and mongoose_json_end() drops the reply rather than send it cut short */
+static void mongoose_json_send(struct mg_connection *nc, const void *buf, size_t len){
+    if(len > 0 && nc->is_draining == 0 && mg_send(nc, buf, len) == false)
+        nc->is_draining = 1;
+}
+
+static void mongoose_json_printf(struct mg_connection *nc, const char *fmt, ...){
+    char mem[128], *buf = mem;
+    va_list ap;
+    int len;
+    va_start(ap, fmt);
+    len = mg_vasprintf(&buf, sizeof(mem), fmt, ap);
+    va_end(ap);
+    if(len < 0)
+        nc->is_draining = 1;
+    else
+        mongoose_json_send(nc, buf, len);
+    if(buf != mem)
+        free(buf);
+}
+
+static void mongoose_json_end(struct mg_connection *nc, size_t body){
+    char length[JSON_LENGTH_WIDTH + 1];
+    if(body == 0)
+        return;
+    if(nc->is_draining){
+        /* Part of the body is missing - the client sees the connection close without a reply */
+        ESP_LOGE(tag, "No memory for a json reply");
+        nc->send.len = body - JSON_HEADER_LEN;
+        return;
+    }
+    snprintf(length, sizeof(length), "%*u", JSON_LENGTH_WIDTH, (unsigned)(nc->send.len - body));
+    memcpy(nc->send.buf + body - 4 - JSON_LENGTH_WIDTH, length, JSON_LENGTH_WIDTH);
+}
+
+/* Characters of a json string with '"', '\' and control characters escaped */
+static void mongoose_json_chars(struct mg_connection *nc, const char *value, size_t len){
+    const char *run = value;
+    for(const char *ch = value; ch < value + len; ch++){
+        if(*ch == '"' || *ch == '\\' || (unsigned char)*ch < 0x20){
+            mongoose_json_send(nc, run, ch - run);
+            mongoose_json_printf(nc, "\\u%04x", (unsigned char)*ch);
+            run = ch + 1;
+        }
+    }
+    mongoose_json_send(nc, run, value + len - run);
+}
+
+/* "key":"value" with the value escaped */
+static void mongoose_json_str(struct mg_connection *nc, const char *key, const char *value){
+    mongoose_json_printf(nc, "\"%s\":\"", key);
+    mongoose_json_chars(nc, value, strlen(value));
+    mongoose_json_send(nc, "\"", 1);
+}
+
+/* Settings for the configuration page - passwords are never sent as they could be read by anyone
+ * who joins the AP the hub falls back to when it can't connect */
+static void mongoose_serve_config_json(struct mg_connection *nc, struct mg_http_message *message){
     char ipbuf[20], gwbuf[20], maskbuf[20];
-    if(rc == 0){
-        sptr = connectionInfo.ssid;
-        /* DO NOT serve current password as this can be read from the client if the ESP32 has dropped into AP mode when it couldn't connect as STA */
-        //pptr = connectionInfo.password;
-        murlptr = connectionInfo.mqtturl;
-        muserptr = connectionInfo.mqttuser;
-        /* DO NOT serve current password as this can be read from the client if the ESP32 has dropped into AP mode when it couldn't connect as STA */
-        //mpassptr = connectionInfo.mqttpass;
-        midptr = connectionInfo.mqttid;
-        if(connectionInfo.ipInfo.ip.addr != 0)
-            ibuf = (char *)inet_ntop(AF_INET, &connectionInfo.ipInfo.ip, ipbuf, sizeof(ipbuf));
-        if(connectionInfo.ipInfo.gw.addr != 0)
-            gbuf = (char *)inet_ntop(AF_INET, &connectionInfo.ipInfo.gw, gwbuf, sizeof(gwbuf));
-        if(connectionInfo.ipInfo.netmask.addr != 0)
-            mbuf = (char *)inet_ntop(AF_INET, &connectionInfo.ipInfo.netmask, maskbuf, sizeof(maskbuf));
+    const char *statusformat;
+    uint32_t addr;
+    size_t body;
+
+    ipbuf[0] = gwbuf[0] = maskbuf[0] = 0;
+    if((addr = config_get_u32(CFG_IP)) != 0)
+        inet_ntop(AF_INET, &addr, ipbuf, sizeof(ipbuf));
+    if((addr = config_get_u32(CFG_GW)) != 0)
+        inet_ntop(AF_INET, &addr, gwbuf, sizeof(gwbuf));
+    if((addr = config_get_u32(CFG_NETMASK)) != 0)
+        inet_ntop(AF_INET, &addr, maskbuf, sizeof(maskbuf));
+    switch(config_get_int(CFG_STATUSFORMAT)){
+        case STATUS_FORMAT_CBOR:
+            statusformat = "cbor";
+            break;
+        case STATUS_FORMAT_BOTH:
+            statusformat = "both";
+            break;
+        default:
+            statusformat = "json";
+            break;
+    }
+
+    body = mongoose_json_start(nc);
+    mongoose_json_send(nc, "{", 1);
+    mongoose_json_str(nc, "ssid", config_get_str(CFG_SSID));
+    mongoose_json_send(nc, ",", 1);
+    mongoose_json_str(nc, "mqtturl", config_get_str(CFG_MQTTURL));
+    mongoose_json_send(nc, ",", 1);
+    mongoose_json_str(nc, "mqttuser", config_get_str(CFG_MQTTUSER));
+    mongoose_json_send(nc, ",", 1);
+    mongoose_json_str(nc, "mqttid", config_get_str(CFG_MQTTID));
+    mongoose_json_printf(nc, ",\"ntpenabled\":%s,", config_get_int(CFG_NTPENABLED) != 0 ? "true" : "false");
+    mongoose_json_str(nc, "ntpserver1", config_get_str(CFG_NTPSERVER));
+    mongoose_json_send(nc, ",", 1);
+    mongoose_json_str(nc, "ntpserver2", config_get_str(CFG_NTPSERVER2));
+    mongoose_json_send(nc, ",", 1);
+    mongoose_json_str(nc, "ntptimezone", config_get_str(CFG_NTPTIMEZONE));
+    mongoose_json_printf(nc, ",\"ip\":\"%s\",\"gw\":\"%s\",\"netmask\":\"%s\",", ipbuf, gwbuf, maskbuf);
+    mongoose_json_str(nc, "dns1ip", config_get_str(CFG_DNS1));
+    mongoose_json_send(nc, ",", 1);
+    mongoose_json_str(nc, "dns2ip", config_get_str(CFG_DNS2));
+    mongoose_json_printf(nc, ",\"pertrvstatus\":%s,\"statusformat\":\"%s\"}", config_get_int(CFG_PERTRVSTATUS) != 0 ? "true" : "false", statusformat);
+    mongoose_json_end(nc, body);
+}
+
+/* Closing html of a streamed page */
+static bool mongoose_stream_page_end(struct mg_connection *nc, const char *foot){
+    mongoose_chunk_str(nc, foot);
+    mongoose_chunk_str(nc, pagefooter);
+    return true;
+}
+
+/* Start a streamed page listing the registry - or say why there is nothing to list */
+static void mongoose_stream_trvs(struct mg_connection *nc, const char *head, mongoose_stream_fill fill){
+    if(trv_count() == 0){
+        if(eq3gap_get_device_list(NULL, NULL) == EQ3_SCAN_UNDERWAY)
+            mongoose_serve_content(nc, scanning, true);
+        else
+            mongoose_serve_content(nc, nodevices, true);
+        return;
+    }
+    if(mongoose_stream_start(nc, "text/html", fill) == NULL)
+        return;
+    mongoose_chunk_str(nc, pageheader);
+    mongoose_chunk_str(nc, head);
+    mongoose_stream_more(nc);
+}
+
+/* One row of the known device list page - from the registry so it is available before the first scan completes */
+static bool mongoose_fill_device_list(struct mg_connection *nc, struct mongoose_stream *stream){
+    struct trv_info trv;
+    char state[24] = "";
+    if(trv_get_index(stream->next_trv++, &trv) == false)
+        return mongoose_stream_page_end(nc, devlistfoot);
+    if(trv.state.valid)
+        sprintf(state, "%d.%d&deg;C %d%%", trv.state.temp_x2 >> 1, (trv.state.temp_x2 & 1) ? 5 : 0, trv.state.valve);
+    mg_http_printf_chunk(nc, devlistentry, trv.name[0] != 0 ? trv.name : "Device:", trv.bda[0], trv.bda[1], trv.bda[2],
+                         trv.bda[3], trv.bda[4], trv.bda[5], trv.rssi, state);
+    return false;
+}
+
+/* One TRV option of the command page */
+static bool mongoose_fill_command_list(struct mg_connection *nc, struct mongoose_stream *stream){
+    struct trv_info trv;
+    char bleaddr[18];
+    if(trv_get_index(stream->next_trv++, &trv) == false)
+        return mongoose_stream_page_end(nc, command_post_device);
+    sprintf(bleaddr, "%02X:%02X:%02X:%02X:%02X:%02X", trv.bda[0], trv.bda[1], trv.bda[2], trv.bda[3], trv.bda[4], trv.bda[5]);
+    mg_http_printf_chunk(nc, select_device_entry, bleaddr, trv.name[0] != 0 ? trv.name : bleaddr);
+    return false;
+}
+
+/* A log record as a table row (call with log_lock held) - the text goes straight from the ring into the send buffer */
+static void mongoose_log_row(struct mg_connection *nc, int pos){
+    static const char entryhead[] = "<tr><td>";
+    static const char entryfoot[] = "</td></tr>";
+    struct log_header header;
+    char prefix[sizeof(entryhead) + LOG_TIME_LEN];
+    int prefixlen, text, first;
+
+    log_read(pos, &header, sizeof(header));
+    prefixlen = sprintf(prefix, "%s", entryhead);
+    if(header.time != 0){
+        time_t logtime = header.time;
+        struct tm timeinfo = { 0 };
+        localtime_r(&logtime, &timeinfo);
+        prefixlen += strftime(&prefix[prefixlen], LOG_TIME_LEN - 3, "%c", &timeinfo);
+        prefixlen += sprintf(&prefix[prefixlen], " - ");
+    }
+    text = (pos + sizeof(header)) % LOG_SIZE;
+    first = LOG_SIZE - text < header.len ? LOG_SIZE - text : header.len;
+    mg_printf(nc, "%X\r\n", (unsigned)(prefixlen + header.len + strlen(entryfoot)));
+    mg_send(nc, prefix, prefixlen);
+    mg_send(nc, &log_buf[text], first);
+    mg_send(nc, log_buf, header.len - first);
+    mg_send(nc, entryfoot, strlen(entryfoot));
+    mg_send(nc, "\r\n", 2);
+}
+
+/* The next few log records, newest first. Records can only be walked oldest first so
+ * each batch is located from the tail. Records dropped to make room while the page
+ * is being sent end it early */
+static bool mongoose_fill_log(struct mg_connection *nc, struct mongoose_stream *stream){
+    int offsets[LOG_STREAM_BATCH];
+    uint32_t oldest, first;
+    int count, pos;
+
+    if(stream->log.left <= 0)
+        return mongoose_stream_page_end(nc, loglistfoot);
+    xSemaphoreTake(log_lock, portMAX_DELAY);
+    oldest = log_added - log_count;
+    if(stream->log.next - oldest >= (uint32_t)log_count){
+        xSemaphoreGive(log_lock);
+        stream->log.left = 0;
+        return false;
+    }
+    count = stream->log.next - oldest + 1;
+    if(count > LOG_STREAM_BATCH)
+        count = LOG_STREAM_BATCH;
+    if(count > stream->log.left)
+        count = stream->log.left;
+    first = stream->log.next - count + 1;
+    pos = log_tail;
+    for(uint32_t record = oldest; record <= stream->log.next; record++){
+        struct log_header header;
+        if(record >= first)
+            offsets[record - first] = pos;
+        log_read(pos, &header, sizeof(header));
+        pos = (pos + sizeof(header) + header.len) % LOG_SIZE;
+    }
+    for(int entry = count - 1; entry >= 0; entry--)
+        mongoose_log_row(nc, offsets[entry]);
+    xSemaphoreGive(log_lock);
+    stream->log.next = first - 1;
+    stream->log.left -= count;
+    return false;
+}
+
+/* Serve the logs page - newest entry first */
+static void mongoose_serve_log(struct mg_connection *nc, struct mg_http_message *message){
+    struct mongoose_stream *stream = mongoose_stream_start(nc, "text/html", mongoose_fill_log);
+    if(stream == NULL)
+        return;
+    xSemaphoreTake(log_lock, portMAX_DELAY);
+    stream->log.next = log_added - 1;
+    stream->log.left = log_count;
+    xSemaphoreGive(log_lock);
+    mongoose_chunk_str(nc, pageheader);
+    mongoose_chunk_str(nc, loglisthead);
+    mongoose_stream_more(nc);
+}
+
+/* Journal records are formatted straight into the send buffer as a chunk whose size
+ * is filled in afterwards (leading zeros are allowed in a chunk size) */
+#define JOURNAL_CHUNK_LEN  2048
+#define JOURNAL_FILL_READS 4            /* journal_query_read() calls per fill - bounds the flash read in one go */
+#define CHUNK_SIZE_WIDTH   8
+
+static bool mongoose_fill_journal(struct mg_connection *nc, struct mongoose_stream *stream){
+    struct journal_query *query = &stream->query;
+    char *chunk, size[CHUNK_SIZE_WIDTH + 3];
+    int len = 0;
+
+    if(query->done == true){
+        mongoose_chunk_str(nc, "]}");
+        return true;
+    }
+    if(mongoose_send_space(nc, CHUNK_SIZE_WIDTH + JOURNAL_CHUNK_LEN + 4) == false){
+        /* No memory - cut the response short (without the last chunk) */
+        nc->is_draining = 1;
+        return true;
+    }
+    chunk = (char *)nc->send.buf + nc->send.len + CHUNK_SIZE_WIDTH + 2;
+    /* Fill the chunk - a query that matches little can need many reads so it carries on next poll */
+    for(int reads = 0; reads < JOURNAL_FILL_READS && query->done == false && len < JOURNAL_CHUNK_LEN - JOURNAL_JSON_MAX; reads++)
+        len += journal_query_read(query, &chunk[len], JOURNAL_CHUNK_LEN - len);
+    if(len > 0){
+        snprintf(size, sizeof(size), "%0*X\r\n", CHUNK_SIZE_WIDTH, (unsigned)len);
+        memcpy(nc->send.buf + nc->send.len, size, CHUNK_SIZE_WIDTH + 2);
+        memcpy(chunk + len, "\r\n", 2);
+        nc->send.len += CHUNK_SIZE_WIDTH + 2 + len + 2;
+    }
+    return false;
+}
+
+/* Start a journal query e.g. /journal?trv=lounge&from=1700000000&limit=100 */
+static void mongoose_serve_journal(struct mg_connection *nc, struct mg_http_message *message){
+    struct journal_query query;
+    struct mongoose_stream *stream;
+    if(journal_query_parse(&query, message->query.ptr, message->query.len) == false){
+        mg_http_reply(nc, 400, "Content-Type: text/plain\r\n", "Invalid journal query\n");
+        return;
+    }
+    if((stream = mongoose_stream_start(nc, "application/json", mongoose_fill_journal)) == NULL)
+        return;
+    stream->query = query;
+    mongoose_chunk_str(nc, "{\"records\":[");
+    mongoose_stream_more(nc);
+}
+
+/* Hub status for the status page */
+static void mongoose_serve_status_json(struct mg_connection *nc, struct mg_http_message *message){
+    const char *status;
+    size_t body;
+    switch(ismqttconnected()){
+        case MQTT_CONFIG_ERROR:
+            status = "Config error";
+            break;
+        case MQTT_CONNECTED:
+            status = "Connected";
+            break;
+        case MQTT_NOT_CONNECTED:
+        default:
+            status = "Not connected";
+            break;
+    }
+    body = mongoose_json_start(nc);
+    mongoose_json_printf(nc, "{\"configured\":%s,\"version\":\"%s.%s%s\",\"uptime\":%u,\"mqtt\":\"%s\",", sta_configured ? "true" : "false",
+              EQ3_MAJVER, EQ3_MINVER, EQ3_EXTRAVER, (unsigned)(esp_timer_get_time() / 1000000), status);
+    mongoose_json_str(nc, "mqtturl", config_get_str(CFG_MQTTURL));
+    mongoose_json_send(nc, ",", 1);
+    mongoose_json_str(nc, "mqttid", config_get_str(CFG_MQTTID));
+    mongoose_json_send(nc, "}", 1);
+    mongoose_json_end(nc, body);
+}
+
+/* The firmware upload in progress */
+static struct {
+    unsigned long conn;                     /* Connection it is arriving on (0 for none) */
+    bool form;                              /* A multipart/form-data upload - otherwise the body is the image */
+    bool done;                              /* The whole image has been passed on */
+    int image_part;                         /* Form part holding the image (-1 until it is found) */
+    int remaining;                          /* Body not yet used */
+    struct multipart parser;
+} ota_upload;
+
+/* Server the results page after the OTA completes/fails */
+static void mongoose_serve_ota_result(struct mg_connection *nc, struct mg_http_message *message){
+    char htmlstr[sizeof(uploadsuccess) + 100];
+    struct ota_status status;
+    ota_get_status(&status);
+    if(status.state == OTA_SUCCESS){
+        int ms = status.upload_ms > 0 ? status.upload_ms : 1;
+        snprintf(htmlstr, sizeof(htmlstr), uploadsuccess, status.size, ms / 1000, (ms % 1000) / 100,
+                 (int)((uint64_t)status.size * 1000 / 1024 / ms), status.flash_ms, status.stall_ms, status.stalls);
+    }else if(status.state == OTA_FAILED){
+        snprintf(htmlstr, sizeof(htmlstr), uploadfailed, status.error != NULL ? status.error : "unknown error");
+    }else if(status.state == OTA_IDLE){
+        snprintf(htmlstr, sizeof(htmlstr), uploadfailed, "no update since restart");
+    }else{
+        snprintf(htmlstr, sizeof(htmlstr), uploadrunning, status.size);
     }
-    sprintf(htmlstr, selectap, sptr, pptr, murlptr, muserptr, mpassptr, midptr, connectionInfo.ntpenabled != 0 ? "checked=\"checked\"" : "", connectionInfo.ntpserver, connectionInfo.ntpserver2, connectionInfo.ntptimezone, ibuf == NULL ? nullstr : ibuf, gbuf == NULL ? nullstr : gbuf, mbuf == NULL ? nullstr : mbuf, connectionInfo.dnsservers[0], connectionInfo.dnsservers[1]);
     mongoose_serve_content(nc, htmlstr, true);
-    free(htmlstr);
-    //nc->flags |= MG_F_SEND_AND_CLOSE;
-    return 0;
 }
 
-/* Serve a found device list page */
-static int mongoose_serve_device_list(struct mg_connection *nc){
-    int wridx = 0;
-    struct found_device *devwalk = NULL;
-    int numdevices;
-    enum eq3_scanstate listres = eq3gap_get_device_list(&devwalk, &numdevices);
-    if(listres == EQ3_SCAN_COMPLETE){
-        
-        char *devlisthtml = malloc(strlen(devlisthead) + strlen(devlistfoot) + ((strlen(devlistentry) + 22) * numdevices));
-        if(devlisthtml != NULL){
-            /* Copy header into buffer */
-            wridx += sprintf(&devlisthtml[wridx], devlisthead);
-            /* Collate device list in buffer */
-            while(devwalk != NULL){
-                wridx += sprintf(&devlisthtml[wridx], devlistentry, devwalk->bda[0], devwalk->bda[1], devwalk->bda[2], 
-                     devwalk->bda[3], devwalk->bda[4], devwalk->bda[5], devwalk->rssi); 	
-                devwalk = devwalk->next;
-            }
-        
-            /* Copy footer into buffer */
-            wridx += sprintf(&devlisthtml[wridx], devlistfoot);
-            mongoose_serve_content(nc, devlisthtml, true);
-            free(devlisthtml);
+/* From the ota writer (arg is the upload connection id) - there is room for more of the image or the update has finished */
+static void mongoose_ota_notify(struct mg_mgr *mgr, void *arg){
+    struct mg_connection *nc;
+    struct ota_status status;
+    unsigned long id = (unsigned long)(uintptr_t)arg;
+    if(mgr == NULL || id != ota_upload.conn)
+        return;
+    for(nc = mgr->conns; nc != NULL && nc->id != id; nc = nc->next)
+        ;
+    if(nc == NULL)
+        return;
+    ota_get_status(&status);
+    if(status.state == OTA_SUCCESS || status.state == OTA_FAILED){
+        ota_upload.conn = 0;
+        nc->is_full = 0;
+        mongoose_serve_content(nc, uploadcomplete, true);
+        nc->is_draining = 1;
+    }else if(nc->is_full && status.state == OTA_RUNNING){
+        nc->is_full = 0;
+        if(ota_upload.done == true){
+            if(ota_finish() == false)
+                nc->is_full = 1;
         }else{
-            mongoose_serve_content(nc, NULL, true);
+            /* Pass what is already in the receive buffer through the http parser again then carry on reading */
+            nc->pfn(nc, MG_EV_READ, NULL, nc->pfn_data);
         }
-    }else if(listres == EQ3_SCAN_UNDERWAY){
-        /* Still scanning */
-        mongoose_serve_content(nc, (char *)scanning, true);
-    }else{
-        /* No devices found */
-        mongoose_serve_content(nc, (char *)nodevices, true);
     }
-    //nc->flags |= MG_F_SEND_AND_CLOSE;
-    return 0;
 }
 
-static int mongoose_serve_command_list(struct mg_connection *nc){
-    int wridx = 0;
-    struct found_device *devwalk = NULL;
-    int numdevices;
-    enum eq3_scanstate listres = eq3gap_get_device_list(&devwalk, &numdevices);
-    if(listres == EQ3_SCAN_COMPLETE){
-        char *devlisthtml = malloc(strlen(command_device_head) + strlen(command_post_device) + (((2 * strlen(select_device_entry)) + 30) * numdevices));
-        if(devlisthtml != NULL){
-            /* Copy header into buffer */
-            wridx += sprintf(&devlisthtml[wridx], command_device_head);
-            /* Collate device list in buffer */
-            while(devwalk != NULL){
-                char bleaddr[18];
-                sprintf(bleaddr, "%02X:%02X:%02X:%02X:%02X:%02X", devwalk->bda[0], devwalk->bda[1], devwalk->bda[2], devwalk->bda[3], devwalk->bda[4], devwalk->bda[5]);
-                wridx += sprintf(&devlisthtml[wridx], select_device_entry, bleaddr, bleaddr);
-                devwalk = devwalk->next;
+/* Pass the next part of a firmware upload (in, len) to the ota writer - returns how much was used.
+ * The rest stays in the receive buffer until more arrives or the writer has room. complete is set
+ * if in is the whole body. The upload complete page is sent once the image has been checked */
+static int mongoose_ota_upload(struct mg_connection *nc, struct mg_http_message *message, const char *in, int len, bool complete){
+    const char *failed = NULL;
+    int used = 0, datalen, taken;
+    bool paused = false, all_in;
+
+    if(ota_upload.conn != nc->id){
+        struct mg_str *content_type = mg_http_get_header(message, "Content-Type");
+        /* The image is passed on as it arrives so it can't be chunk encoded */
+        if(mg_http_get_header(message, "Transfer-Encoding") != NULL){
+            mg_http_reply(nc, 411, "Content-Type: text/plain\r\n", "Content-Length required\n");
+            nc->is_draining = 1;
+        }else if(ota_upload.conn != 0){
+            mg_http_reply(nc, 503, "Content-Type: text/plain\r\n", "Update already in progress\n");
+            nc->is_draining = 1;
+        }else if(ota_begin(mongoose_ota_notify, (void *)(uintptr_t)nc->id) == false){
+            /* The status page says why */
+            mongoose_serve_content(nc, uploadcomplete, true);
+            nc->is_draining = 1;
+        }
+        if(nc->is_draining)
+            return len;
+        ota_upload.conn = nc->id;
+        ota_upload.form = multipart_init(&ota_upload.parser, content_type != NULL ? *content_type : mg_str_n(NULL, 0));
+        ota_upload.done = false;
+        ota_upload.image_part = -1;
+        ota_upload.remaining = message->body.len;
+    }
+    /* The rest of the body is in - if it is used up without ending the upload it never will */
+    all_in = complete == true || len >= ota_upload.remaining;
+
+    if(ota_upload.form == true){
+        struct multipart *mp = &ota_upload.parser;
+        for(;;){
+            used += multipart_parse(mp, &in[used], len - used, &datalen);
+            if(datalen == 0)
+                break;
+            /* The image is the first file in the form - anything else is skipped */
+            if(ota_upload.image_part < 0 && mp->part.filename[0] != 0){
+                ota_upload.image_part = mp->part.index;
+                ESP_LOGI(tag, "Receiving %s (%s)", mp->part.filename, mp->part.content_type);
+            }
+            taken = mp->part.index == ota_upload.image_part ? ota_write((const uint8_t *)&in[used], datalen) : datalen;
+            used += taken;
+            if(taken < datalen){
+                paused = true;
+                break;
             }
-        
-            /* Copy footer into buffer */
-            wridx += sprintf(&devlisthtml[wridx], command_post_device);
-            mongoose_serve_content(nc, devlisthtml, true);
-            free(devlisthtml);
-        }else{
-            mongoose_serve_content(nc, NULL, true);
         }
-    }else if(listres == EQ3_SCAN_UNDERWAY){
-        /* Still scanning */
-        mongoose_serve_content(nc, (char *)scanning, true);
+        if(mp->state == MULTIPART_ERROR)
+            failed = "Not a valid form upload";
+        else if(mp->state == MULTIPART_DONE && ota_upload.image_part < 0)
+            failed = "No file in the upload";
+        ota_upload.done = mp->state == MULTIPART_DONE;
+        ota_upload.remaining -= used;
     }else{
-        /* No devices found */
-        mongoose_serve_content(nc, (char *)nodevices, true);
+        used = ota_write((const uint8_t *)in, len < ota_upload.remaining ? len : ota_upload.remaining);
+        ota_upload.remaining -= used;
+        paused = used < len && ota_upload.remaining > 0;
+        ota_upload.done = ota_upload.remaining == 0;
+    }
+
+    if(failed == NULL && ota_upload.done == true){
+        if(ota_finish() == false)
+            paused = true;
+    }else if(failed == NULL && (complete == true || (all_in == true && paused == false))){
+        /* e.g. a form without its closing delimiter */
+        failed = "Upload incomplete";
+    }
+    if(failed != NULL){
+        ota_abort(failed);
+        paused = true;
     }
-    //nc->flags |= MG_F_SEND_AND_CLOSE;
-    return 0;
+    /* Stop reading until mongoose_ota_notify */
+    if(paused == true)
+        nc->is_full = 1;
+    return used;
 }
-        
-/* Serve the logs page */
-static int mongoose_serve_log(struct mg_connection *nc){
-    int numlogs = eq3_num_logs();
-    int wridx = 0;
-    char *loglisthtml = malloc(strlen(loglisthead) + strlen(loglistfoot) + (135 + 18) * numlogs);
-    if(loglisthtml != NULL){
-        wridx += sprintf(&loglisthtml[wridx], loglisthead);
-        for(int logcount = 0; logcount < numlogs; logcount++){
-            //wridx += sprintf(&loglisthtml[wridx], loglistentry, log_entries[logcount]);
-            wridx += sprintf(&loglisthtml[wridx], "<tr><td>");
-            strncpy(&loglisthtml[wridx], log_entries[logcount], strlen(log_entries[logcount]));
-            wridx += strlen(log_entries[logcount]);
-            wridx += sprintf(&loglisthtml[wridx], "</tr></td>");
+
+/* ========================= Json api (/api/v1) ========================== */
+
+/* Largest queue listing */
+#define API_QUEUE_MAX 32
+
+static const char *json_bool(bool value){
+    return value ? "true" : "false";
+}
+
+/* A registry entry with the state the TRV last reported (null if it hasn't reported since it was added) */
+static void mongoose_json_trv(struct mg_connection *nc, const struct trv_info *trv){
+    const struct trv_last_state *state = &trv->state;
+    int count = 0;
+    mongoose_json_printf(nc, "{\"bleaddr\":\"%02X:%02X:%02X:%02X:%02X:%02X\",", trv->bda[0], trv->bda[1], trv->bda[2], trv->bda[3], trv->bda[4], trv->bda[5]);
+    mongoose_json_str(nc, "name", trv->name);
+    mongoose_json_printf(nc, ",\"rssi\":%d,\"groups\":[", trv->rssi);
+    for(int group = 0; group < TRV_GROUPS; group++){
+        if(trv->groups & (1 << group))
+            mongoose_json_printf(nc, "%s%d", count++ > 0 ? "," : "", group + 1);
+    }
+    if(state->valid == false){
+        mongoose_json_printf(nc, "],\"state\":null}");
+        return;
+    }
+    mongoose_json_printf(nc, "],\"state\":{\"time\":%u,\"temp\":\"%d.%d\",\"valve\":%d,\"mode\":\"%s\"", (unsigned)state->time,
+              state->temp_x2 >> 1, (state->temp_x2 & 1) ? 5 : 0, state->valve,
+              (state->flags & MANUAL) ? "manual" : (state->flags & AWAY) ? "holiday" : "auto");
+    mongoose_json_printf(nc, ",\"boost\":%s,\"window\":%s,\"locked\":%s,\"battery\":\"%s\"", json_bool(state->flags & BOOST),
+              json_bool(state->flags & WINDOW), json_bool(state->flags & LOCKED), (state->flags & LOW_BATTERY) ? "LOW" : "GOOD");
+    if(state->has_offset)
+        mongoose_json_printf(nc, ",\"offsetTemp\":\"%s%d.%d\"", state->offset_x2 < 0 ? "-" : "", abs(state->offset_x2) >> 1, (abs(state->offset_x2) & 1) ? 5 : 0);
+    mongoose_json_printf(nc, "}}");
+}
+
+/* GET /api/v1/devices */
+static void mongoose_api_devices(struct mg_connection *nc, struct mg_http_message *message){
+    struct trv_info trv;
+    size_t body = mongoose_json_start(nc);
+    mongoose_json_printf(nc, "{\"scanning\":%s,\"devices\":[", json_bool(eq3gap_get_device_list(NULL, NULL) == EQ3_SCAN_UNDERWAY));
+    for(int idx = 0; trv_get_index(idx, &trv) == true; idx++){
+        if(idx > 0)
+            mongoose_json_send(nc, ",", 1);
+        mongoose_json_trv(nc, &trv);
+    }
+    mongoose_json_send(nc, "]}", 2);
+    mongoose_json_end(nc, body);
+}
+
+/* GET /api/v1/devices/<address or name> */
+#define API_DEVICE_PREFIX "/api/v1/devices/"
+
+static void mongoose_api_device(struct mg_connection *nc, struct mg_http_message *message){
+    struct trv_info trv;
+    const char *trvname = message->uri.ptr + sizeof(API_DEVICE_PREFIX) - 1;
+    size_t body;
+    if(trv_parse(trvname, message->uri.len - (sizeof(API_DEVICE_PREFIX) - 1), trv.bda) == false || trv_get(trv.bda, &trv) == false){
+        mongoose_json_error(nc, 404, "Unknown TRV");
+        return;
+    }
+    body = mongoose_json_start(nc);
+    mongoose_json_trv(nc, &trv);
+    mongoose_json_end(nc, body);
+}
+
+/* GET /api/v1/queue - the command being run (attempts > 0) is first */
+static void mongoose_api_queue(struct mg_connection *nc, struct mg_http_message *message){
+    struct eq3_queue_entry *queue = malloc(API_QUEUE_MAX * sizeof(struct eq3_queue_entry));
+    int length;
+    size_t body;
+    if(queue == NULL){
+        mongoose_json_error(nc, 503, "No memory");
+        return;
+    }
+    length = queue_list(queue, API_QUEUE_MAX);
+    body = mongoose_json_start(nc);
+    mongoose_json_printf(nc, "{\"length\":%d,\"queue\":[", length);
+    for(int idx = 0; idx < length && idx < API_QUEUE_MAX; idx++){
+        struct eq3_queue_entry *entry = &queue[idx];
+        mongoose_json_printf(nc, "%s{\"id\":%u,\"bleaddr\":\"%02X:%02X:%02X:%02X:%02X:%02X\",\"command\":\"%s\",\"param\":%d,\"age_ms\":%d,\"attempts\":%d",
+                  idx > 0 ? "," : "", (unsigned)entry->id, entry->bda[0], entry->bda[1], entry->bda[2], entry->bda[3], entry->bda[4], entry->bda[5],
+                  entry->command != NULL ? entry->command : "", entry->param, entry->age_ms, entry->attempts);
+        /* Request ids are checked for json safe characters when they are queued */
+        if(entry->reqid[0] != 0)
+            mongoose_json_printf(nc, ",\"reqid\":\"%s\"", entry->reqid);
+        mongoose_json_send(nc, "}", 1);
+    }
+    mongoose_json_send(nc, "]}", 2);
+    mongoose_json_end(nc, body);
+    free(queue);
+}
+
+/* GET /api/v1/metrics - the report published on <outtopicbase>/metrics, formatted in place */
+static void mongoose_api_metrics(struct mg_connection *nc, struct mg_http_message *message){
+    size_t body;
+    if(mongoose_send_space(nc, JSON_HEADER_LEN + METRICS_REPORT_LEN) == false){
+        mongoose_json_error(nc, 503, "No memory");
+        return;
+    }
+    body = mongoose_json_start(nc);
+    nc->send.len += metrics_report((char *)nc->send.buf + nc->send.len, nc->send.size - nc->send.len, queue_list(NULL, 0));
+    mongoose_json_end(nc, body);
+}
+
+/* GET /api/v1/log - oldest first, times are 0 if the clock wasn't set */
+static void mongoose_api_log(struct mg_connection *nc, struct mg_http_message *message){
+    size_t body = mongoose_json_start(nc);
+    int pos;
+    mongoose_json_send(nc, "{\"log\":[", 8);
+    xSemaphoreTake(log_lock, portMAX_DELAY);
+    pos = log_tail;
+    for(int entry = 0; entry < log_count; entry++){
+        struct log_header header;
+        int text, first;
+        log_read(pos, &header, sizeof(header));
+        text = (pos + sizeof(header)) % LOG_SIZE;
+        mongoose_json_printf(nc, "%s{\"time\":%u,\"text\":\"", entry > 0 ? "," : "", (unsigned)header.time);
+        /* The text can wrap round the end of the ring */
+        first = LOG_SIZE - text < header.len ? LOG_SIZE - text : header.len;
+        mongoose_json_chars(nc, (const char *)&log_buf[text], first);
+        mongoose_json_chars(nc, (const char *)log_buf, header.len - first);
+        mongoose_json_send(nc, "\"}", 2);
+        pos = (text + header.len) % LOG_SIZE;
+    }
+    xSemaphoreGive(log_lock);
+    mongoose_json_send(nc, "]}", 2);
+    mongoose_json_end(nc, body);
+}
+
+/* A /set field that is missing or a single word */
+static bool mongoose_set_word(const struct mg_str *field){
+    return field == NULL || memchr(field->ptr, ' ', field->len) == NULL;
+}
+
+/* Queue a command e.g. /set?device=lounge&command=settemp&value=21.5&id=abc
+ * The reply has the command id and the number of commands ahead of it */
+static void mongoose_serve_set(struct mg_connection *nc, struct mg_http_message *message){
+    const struct mg_str *device, *command, *value, *id;
+    char request[EQ3_MAX_REQUEST_LEN];
+    char reqid[EQ3_REQID_LEN] = "";
+    struct eq3_queued queued;
+    struct form query;
+    int reqlen;
+
+    form_parse(&query, (char *)message->query.ptr, message->query.len);
+    device = form_get(&query, "device");
+    command = form_get(&query, "command");
+    value = form_get(&query, "value");
+    id = form_get(&query, "id");
+    if(device != NULL && command != NULL){
+        /* The fields are joined with spaces after decoding, so one with a space would add words to the request */
+        if(mongoose_set_word(device) == false || mongoose_set_word(command) == false || mongoose_set_word(value) == false || mongoose_set_word(id) == false){
+            mongoose_json_error(nc, 400, "device, command, value and id can't contain spaces");
+            return;
+        }
+        if(value != NULL)
+            reqlen = snprintf(request, sizeof(request), "%.*s %.*s %.*s", (int)device->len, device->ptr, (int)command->len, command->ptr, (int)value->len, value->ptr);
+        else
+            reqlen = snprintf(request, sizeof(request), "%.*s %.*s", (int)device->len, device->ptr, (int)command->len, command->ptr);
+        /* Optional request id echoed in the status report */
+        if(id != NULL && id->len >= sizeof(reqid)){
+            mongoose_json_error(nc, 400, "id is too long");
+            return;
         }
-        wridx += sprintf(&loglisthtml[wridx], loglistfoot);
+        if(id != NULL && id->len > 0){
+            memcpy(reqid, id->ptr, id->len);
+            reqid[id->len] = 0;
+            if(reqlen < sizeof(request))
+                reqlen += snprintf(request + reqlen, sizeof(request) - reqlen, " id=%s", reqid);
+        }
+        /* A cut short request could run a different command, or lose its id */
+        if(reqlen >= sizeof(request)){
+            mongoose_json_error(nc, 400, "Request is too long");
+            return;
+        }
+        ESP_LOGI(tag, "Http set command %s\n", request);
+        if(handle_request_queued(request, &queued) == 0){
+            size_t body = mongoose_json_start(nc);
+            mongoose_json_printf(nc, "{\"id\":%u,\"position\":%d,\"pending\":%s", (unsigned)queued.id, queued.position, json_bool(queued.pending));
+            /* The request id was validated when the command was queued */
+            if(reqid[0] != 0)
+                mongoose_json_printf(nc, ",\"reqid\":\"%s\"", reqid);
+            mongoose_json_send(nc, "}", 1);
+            mongoose_json_end(nc, body);
+        }else{
+            mongoose_json_error(nc, 400, "Invalid command");
+        }
+    }else{
+        mongoose_json_error(nc, 400, "device and command are required");
+    }
+}
+
+/* ============================ Request routes ============================ */
+
+/* / - the configuration page until the hub has been set up */
+static void mongoose_serve_root(struct mg_connection *nc, struct mg_http_message *message){
+    mongoose_serve_page(nc, message, sta_configured == false ? "/web/config.html" : "/web/index.html");
+}
+
+/* /web/<page> */
+static void mongoose_serve_web(struct mg_connection *nc, struct mg_http_message *message){
+    char path[48];
+    if(message->uri.len >= sizeof(path)){
+        mg_http_reply(nc, 404, "Content-Type: text/plain\r\n", "Not found\n");
+        return;
     }
-    mongoose_serve_content(nc, loglisthtml, true);
-    free(loglisthtml);
-    //nc->flags |= MG_F_SEND_AND_CLOSE;
-    return 0;
+    memcpy(path, message->uri.ptr, message->uri.len);
+    path[message->uri.len] = 0;
+    mongoose_serve_page(nc, message, path);
 }
 
-/* Serve the status page */
-static int mongoose_serve_status(struct mg_connection *nc){
+/* POST /configSubmit - the configuration form */
+static void mongoose_serve_config_submit(struct mg_connection *nc, struct mg_http_message *message){
+    /* Large enough for any config string */
+    char value[MAX_URL_SIZE];
+    struct form form;
+    uint32_t addr;
+    ESP_LOGD(tag, "- body: %.*s", message->body.len, message->body.ptr);
+    form_parse(&form, (char *)message->body.ptr, message->body.len);
+    form_get_str(&form, "ssid", value, SSID_SIZE);
+    config_set_str(CFG_SSID, value);
+    /* Passwords are never served so an empty password leaves the current one - as does one too long to store */
+    if(form_get_str(&form, "password", value, PASSWORD_SIZE) > 0){
+        config_set_str(CFG_PASSWORD, value);
+        ESP_LOGI(tag, "Set STA password to %s", value);
+    }
+    form_get_str(&form, "mqtturl", value, MAX_URL_SIZE);
+    config_set_str(CFG_MQTTURL, value);
+    form_get_str(&form, "mqttuser", value, USERNAME_SIZE);
+    config_set_str(CFG_MQTTUSER, value);
+    if(form_get_str(&form, "mqttpass", value, PASSWORD_SIZE) > 0){
+        config_set_str(CFG_MQTTPASS, value);
+        ESP_LOGI(tag, "Set MQTT password to %s", value);
+    }
+    form_get_str(&form, "mqttid", value, ID_SIZE);
+    config_set_str(CFG_MQTTID, value);
+
+    form_get_str(&form, "ntpenabled", value, 10);
+    config_set_int(CFG_NTPENABLED, strncmp(value, "true", 4) == 0 ? 1 : 0);
+    form_get_str(&form, "ntpserver1", value, SERVER_SIZE);
+    config_set_str(CFG_NTPSERVER, value);
+    form_get_str(&form, "ntpserver2", value, SERVER_SIZE);
+    config_set_str(CFG_NTPSERVER2, value);
+    form_get_str(&form, "ntptimezone", value, SNTP_TIMEZONE_SIZE);
+    config_set_str(CFG_NTPTIMEZONE, value);
+
+    addr = 0;
+    if (form_get_str(&form, "ip", value, 20) > 0)
+        inet_pton(AF_INET, value, &addr);
+    config_set_u32(CFG_IP, addr);
+    addr = 0;
+    if (form_get_str(&form, "gw", value, 20) > 0)
+        inet_pton(AF_INET, value, &addr);
+    config_set_u32(CFG_GW, addr);
+    addr = 0;
+    if (form_get_str(&form, "netmask", value, 20) > 0)
+        inet_pton(AF_INET, value, &addr);
+    config_set_u32(CFG_NETMASK, addr);
+    form_get_str(&form, "dns1ip", value, SERVER_SIZE);
+    config_set_str(CFG_DNS1, value);
+    form_get_str(&form, "dns2ip", value, SERVER_SIZE);
+    config_set_str(CFG_DNS2, value);
+
+    form_get_str(&form, "pertrvstatus", value, 10);
+    config_set_int(CFG_PERTRVSTATUS, strncmp(value, "true", 4) == 0 ? 1 : 0);
+
+    form_get_str(&form, "statusformat", value, 10);
+    if(strcmp(value, "cbor") == 0)
+        config_set_int(CFG_STATUSFORMAT, STATUS_FORMAT_CBOR);
+    else if(strcmp(value, "both") == 0)
+        config_set_int(CFG_STATUSFORMAT, STATUS_FORMAT_BOTH);
+    else
+        config_set_int(CFG_STATUSFORMAT, STATUS_FORMAT_JSON);
+
+    ESP_LOGI(tag, "ssid: %s, password: %s", config_get_str(CFG_SSID), config_get_str(CFG_PASSWORD));
+
+    /* Only the changed settings are written */
+    config_commit();
+
     if(sta_configured == false){
-        mongoose_serve_content(nc, (char *)apstatus, true);
-        //nc->flags |= MG_F_SEND_AND_CLOSE;
+        ESP_LOGI(tag, "Config applied while in AP mode - switch to STA");
+        mg_http_reply(nc, 200, 0, "Content-Type: text/plain\n", "");
+        bootWiFi2();
     }else{
-        char status[14];
-        int64_t uptime = esp_timer_get_time();
-        uint32_t days;
-        uint8_t hours, minutes;
-        mqttconnstate connected = ismqttconnected();
-        switch(connected){
-            case MQTT_CONFIG_ERROR:
-                sprintf(status, "Config error");
-                break;
-            case MQTT_CONNECTED:
-                sprintf(status, "Connected");
-                break;
-            case MQTT_NOT_CONNECTED:
-            default:
-                sprintf(status, "Not connected");
-                break;
-        }
-        uptime /= 1000000;
-        days = uptime / 86400;
-        uptime -= (days * 86400);
-        hours = uptime / 3600;
-        uptime -= (hours * 3600);
-        minutes = uptime / 60;
-        uptime -= (minutes * 60);
-        char *htmlstr = malloc(strlen(connectedstatus) + strlen(connectionInfo.mqtturl) + strlen(connectionInfo.mqttid) + 15 + 10);
-        sprintf(htmlstr, connectedstatus, connectionInfo.mqtturl, connectionInfo.mqttid, status, days, hours, minutes, (uint8_t)uptime);
-        mongoose_serve_content(nc, htmlstr, true);
-        free(htmlstr);
-        //nc->flags |= MG_F_SEND_AND_CLOSE;
-    }            
-    return 0;
+        ESP_LOGI(tag, "Config applied in STA mode - reboot");
+        mongoose_serve_content(nc, (char *)rebooting, false);
+        schedule_reboot();
+    }
+}
+
+/* POST /sendCommand - the command page form */
+static void mongoose_serve_send_command(struct mg_connection *nc, struct mg_http_message *message){
+    char devstr[19];
+    char cmdstr[16];
+    char valstr[15];
+    char request[50];
+    struct form form;
+    form_parse(&form, (char *)message->body.ptr, message->body.len);
+    form_get_str(&form, "device", devstr, 18);
+    form_get_str(&form, "command", cmdstr, 15);
+    form_get_str(&form, "value", valstr, 14);
+    sprintf(request, "%s %s %s", devstr, cmdstr, valstr);
+    if(handle_request(request) == 0){
+        mongoose_serve_content(nc, (char *)commandsubmitted, true);
+    }else{
+        mongoose_serve_content(nc, (char *)commanderror, true);
+    }
 }
 
-/* Serve the upload page */
-static int mongoose_serve_upload(struct mg_connection *nc){
-    mongoose_serve_content(nc, (char *)upload, true);
-    //nc->flags |= MG_F_SEND_AND_CLOSE;
-    return 0;
+/* GET /getdevices */
+static void mongoose_serve_devices(struct mg_connection *nc, struct mg_http_message *message){
+    mongoose_stream_trvs(nc, devlisthead, mongoose_fill_device_list);
 }
 
-static esp_ota_handle_t ota_handle;
-static bool ota_handle_valid = false;
-static const esp_partition_t *update_partition = NULL;
-static uint32_t ota_size;
-static bool ota_success = false;
+/* GET /command */
+static void mongoose_serve_command(struct mg_connection *nc, struct mg_http_message *message){
+    mongoose_stream_trvs(nc, command_device_head, mongoose_fill_command_list);
+}
 
-/* Server the results page after the OTA completes/fails */
-static int mongoose_serve_ota_result(struct mg_connection *nc){
-    char *htmlstr = malloc(strlen(uploadsuccess) + 100);
-    printf("Report ota result %s\n", ota_success == true ? "success" : "fail");
-    if(ota_success == true)
-        sprintf(htmlstr, uploadsuccess, ota_size);
-    else
-        sprintf(htmlstr, uploadfailed);
-    mongoose_serve_content(nc, htmlstr, true);
-    free(htmlstr);
-    //nc->flags |= MG_F_SEND_AND_CLOSE;
-    return 0;
+/* GET /scan */
+static void mongoose_serve_scan(struct mg_connection *nc, struct mg_http_message *message){
+    start_scan();
+    mongoose_serve_content(nc, (char *)scanning, true);
+}
+
+/* GET /restartnow */
+static void mongoose_serve_restart(struct mg_connection *nc, struct mg_http_message *message){
+    mongoose_serve_content(nc, (char *)rebooting, false);
+    schedule_reboot();
+}
+
+/* POST /otaupload - small enough to arrive in one read (larger uploads arrive as MG_EV_HTTP_CHUNK).
+ * Mongoose also passes on what is left when a connection closes */
+static void mongoose_serve_ota_upload(struct mg_connection *nc, struct mg_http_message *message){
+    if(nc->is_closing == 0 && nc->is_draining == 0)
+        mongoose_ota_upload(nc, message, message->body.ptr, message->body.len, true);
+}
+
+static void mongoose_api_not_found(struct mg_connection *nc, struct mg_http_message *message){
+    mongoose_json_error(nc, 404, "Not found");
 }
 
-/* Get an argument value from the url query-string */
-static char *getqueryarg(const char *argstr, const char *argname){
-    char *tmpptr, *endptr, *retptr = NULL;
-    if((tmpptr = strstr(argstr, argname)) != NULL){
-        while(*tmpptr != '=' && *tmpptr != 0)
-            tmpptr++;
-        if(*tmpptr != 0){
-            int querylen;
-            tmpptr++;
-            endptr = tmpptr + 1;
-            while(*endptr != '&' && *endptr != 0)
-                endptr++;
-            querylen = (int)endptr - (int)tmpptr;
-            retptr = (char *)malloc(querylen + 1);
-            strncpy(retptr, tmpptr, querylen);
-            retptr[querylen] = 0;
+#define ROUTE_ENTRY(uri, methods, fn, page) {ROUTE(uri), methods, fn, page},
+
+static const struct route routes[] = {
+    EQ3_ROUTES(ROUTE_ENTRY)
+    {NULL}
+};
+
+/* Find the route for a request and run it. Urls the hub doesn't know get a bare 404 - except in AP
+ * mode where they all lead to the configuration page so phones show it as a captive portal */
+static void mongoose_route(struct mg_connection *nc, struct mg_http_message *message){
+    const struct route *route = route_find(routes, message->uri);
+    if(route != NULL){
+        if((route->methods & route_method(message)) == 0){
+            mg_http_reply(nc, 405, route->methods == ROUTE_GET ? "Allow: GET\r\n" : route->methods == ROUTE_POST ? "Allow: POST\r\n" : "Allow: GET, POST\r\n",
+                          "Method not allowed\n");
+        }else if(route->fn != NULL){
+            route->fn(nc, message);
+        }else{
+            mongoose_serve_page(nc, message, route->page);
         }
+    }else if(sta_configured == false){
+        mongoose_serve_page(nc, message, "/web/config.html");
+    }else{
+        mg_http_reply(nc, 404, "Content-Type: text/plain\r\n", "Not found\n");
     }
-    return retptr;
 }
-
 /**
  * Handle mongoose events.  These are mostly requests to process incoming
  * browser requests.
@@ -465,245 +1132,42 @@ static void mongoose_event_handler(struct mg_connection *nc, int ev, void *evDat
     switch (ev) {
         case MG_EV_HTTP_MSG: {
             struct mg_http_message *message = (struct mg_http_message *) evData;
-            char *uri = mgStrToStr(message->uri);
-            char *query = mgStrToStr(message->query);
-            ESP_LOGI(tag, "http request uri: %s", uri);
-            if(query != NULL)
-                ESP_LOGI(tag, "http query: %s", query);
-            /* ReST API set command */
-            if (strcmp(uri, "/set") ==0 ) {
-                char *devstr, *cmdstr, *valstr;
-                char request[50];
-                
-                devstr = getqueryarg(query, "device");
-                cmdstr = getqueryarg(query, "command");
-                valstr = getqueryarg(query, "value");
-                if(devstr != NULL && cmdstr != NULL){
-                    if(valstr != NULL)
-                        sprintf(request, "%s %s %s", devstr, cmdstr, valstr);
-                    else
-                        sprintf(request, "%s %s", devstr, cmdstr);
-                    ESP_LOGI(tag, "Http set command %s\n", request);
-                    if(handle_request(request) == 0){
-                        mg_http_reply(nc, 200, 0, "Content-Type: text/plain\n", "");
-                    }else{
-                        mg_http_reply(nc, 400, 0, "Content-Type: text/plain\n", "");
-                    }
-                }else{
-                    mg_http_reply(nc, 400, 0, "Content-Type: text/plain\n", "");
-                }
-                if(devstr != NULL)
-                    free(devstr);
-                if(cmdstr != NULL)
-                    free(cmdstr);
-                if(valstr != NULL)
-                    free(valstr);
-                //nc->flags |= MG_F_SEND_AND_CLOSE;
-            }else if (strcmp(uri, "/") == 0) {
-                if(sta_configured == false)
-                    mongoose_serve_config_page(nc);
-                else
-                    mongoose_serve_status(nc);
-            }else if(strcmp(uri, "/configSubmit") == 0) {
-                char newpass[PASSWORD_SIZE];
-                ESP_LOGD(tag, "- body: %.*s", message->body.len, message->body.ptr);
-                //connection_info_t connectionInfo;
-                mg_http_get_var(&message->body, "ssid",	connectionInfo.ssid, SSID_SIZE);
-                newpass[0] = 0;
-                mg_http_get_var(&message->body, "password", newpass, PASSWORD_SIZE);
-                if(strlen(newpass) > 0){
-                    strcpy(connectionInfo.password, newpass);
-                    ESP_LOGI(tag, "Set STA password to %s", newpass);
-                }
-                mg_http_get_var(&message->body, "mqtturl", connectionInfo.mqtturl, SSID_SIZE);
-                mg_http_get_var(&message->body, "mqttuser", connectionInfo.mqttuser, SSID_SIZE);
-                newpass[0] = 0;
-                mg_http_get_var(&message->body, "mqttpass", newpass, PASSWORD_SIZE);
-                if(strlen(newpass) > 0){
-                    strcpy(connectionInfo.mqttpass, newpass);
-                    ESP_LOGI(tag, "Set MQTT password to %s", newpass);
-                }
-                mg_http_get_var(&message->body, "mqttid", connectionInfo.mqttid, ID_SIZE);
-                
-                connectionInfo.ntpenabled = 0;
-                char enabled[10];
-                mg_http_get_var(&message->body, "ntpenabled", enabled, 10);
-                if(strncmp(enabled, "true", 4) == 0)
-                    connectionInfo.ntpenabled = 1;
-                mg_http_get_var(&message->body, "ntpserver1", connectionInfo.ntpserver, SERVER_SIZE);
-                mg_http_get_var(&message->body, "ntpserver2", connectionInfo.ntpserver2, SERVER_SIZE);
-                mg_http_get_var(&message->body, "ntptimezone", connectionInfo.ntptimezone, SNTP_TIMEZONE_SIZE);
-
-                char ipBuf[20];
-                if (mg_http_get_var(&message->body, "ip", ipBuf, sizeof(ipBuf)) > 0) {
-                    inet_pton(AF_INET, ipBuf, &connectionInfo.ipInfo.ip);
-                }else{
-                    connectionInfo.ipInfo.ip.addr = 0;
-                }
-                if (mg_http_get_var(&message->body, "gw", ipBuf, sizeof(ipBuf)) > 0) {
-                    inet_pton(AF_INET, ipBuf, &connectionInfo.ipInfo.gw);
-                }else{
-                    connectionInfo.ipInfo.gw.addr = 0;
-                }
-                if (mg_http_get_var(&message->body, "netmask", ipBuf, sizeof(ipBuf)) > 0) {
-                    inet_pton(AF_INET, ipBuf, &connectionInfo.ipInfo.netmask);
-                }else{
-                    connectionInfo.ipInfo.netmask.addr = 0;
-                }
-                mg_http_get_var(&message->body, "dns1ip", connectionInfo.dnsservers[0], SERVER_SIZE);
-                mg_http_get_var(&message->body, "dns2ip", connectionInfo.dnsservers[1], SERVER_SIZE);
-
-                ESP_LOGI(tag, "ssid: %s, password: %s", connectionInfo.ssid, connectionInfo.password);
-
-                saveConnectionInfo(&connectionInfo);
-                
-                if(sta_configured == false){
-                    ESP_LOGI(tag, "Config applied while in AP mode - switch to STA");
-                    mg_http_reply(nc, 200, 0, "Content-Type: text/plain\n", "");
-                    bootWiFi2();
-                }else{
-                    ESP_LOGI(tag, "Config applied in STA mode - reboot");
-                    mongoose_serve_content(nc, (char *)rebooting, false);
-                    schedule_reboot();
-                }
-                //nc->flags |= MG_F_SEND_AND_CLOSE;
-            }else if(strcmp(uri, "/sendCommand") == 0){
-                char devstr[19];
-                char cmdstr[16];
-                char valstr[15];
-                char request[50];
-                mg_http_get_var(&message->body, "device", devstr, 18);
-                mg_http_get_var(&message->body, "command", cmdstr, 15);
-                mg_http_get_var(&message->body, "value", valstr, 14);
-                sprintf(request, "%s %s %s", devstr, cmdstr, valstr);
-                if(handle_request(request) == 0){
-                    mongoose_serve_content(nc, (char *)commandsubmitted, true);
-                }else{
-                    mongoose_serve_content(nc, (char *)commanderror, true);
-                }
-                //nc->flags |= MG_F_SEND_AND_CLOSE;
-			}else if(strcmp(uri, "/getdevices") == 0){
-                mongoose_serve_device_list(nc);
-            }else if(strcmp(uri, "/status") == 0){
-                mongoose_serve_status(nc);
-            }else if(strcmp(uri, "/scan") == 0){
-                start_scan();
-                mongoose_serve_content(nc, (char *)scanning, true);
-                //nc->flags |= MG_F_SEND_AND_CLOSE;
-            }else if(strcmp(uri, "/upload") == 0){
-                mongoose_serve_upload(nc);
-            //}else if(strcmp(uri, "/otaupload") == 0){
-                /* Response to upload wait for 1 second before refreshing with the status page to allow update pass/fail to be decided */
-            //    mongoose_serve_content(nc, (char *)uploadcomplete, true);
-            //    nc->is_draining = 1;
-                //nc->flags |= MG_F_SEND_AND_CLOSE;
-            }else if(strcmp(uri, "/otastatus") == 0){
-                mongoose_serve_ota_result(nc);
-            }else if(strcmp(uri, "/command") == 0){    
-                mongoose_serve_command_list(nc);
-            }else if(strcmp(uri, "/viewlog") == 0){
-                mongoose_serve_log(nc);
-            }else if(strcmp(uri, "/restartnow") == 0){  
-                mongoose_serve_content(nc, (char *)rebooting, false);
-                //nc->flags |= MG_F_SEND_AND_CLOSE;
-                schedule_reboot();
-            }
-            // Else ... unknown URL
-            else {
-                mongoose_serve_config_page(nc);
-                //mg_send_head(nc, 404, 0, "Content-Type: text/plain");
-                //nc->flags |= MG_F_SEND_AND_CLOSE;
-            }
-            //nc->flags |= MG_F_SEND_AND_CLOSE;
-            free(uri);
-            if(query != NULL)
-                free(query);
-            break; 
-            
-        } // MG_EV_HTTP_REQUEST
+            ESP_LOGI(tag, "http request uri: %.*s", (int)message->uri.len, message->uri.ptr);
+            if(message->query.len > 0)
+                ESP_LOGI(tag, "http query: %.*s", (int)message->query.len, message->query.ptr);
+            mongoose_route(nc, message);
+            break;
+        } // MG_EV_HTTP_MSG
         case MG_EV_HTTP_CHUNK: {
             struct mg_http_message *message = (struct mg_http_message *) evData;
-            char *uri = mgStrToStr(message->uri);
-            //ESP_LOGI(tag, "httpchunk - uri: %s", uri);
-            if(strcmp(uri, "/otaupload") == 0){
-                esp_err_t err;
-                static int remlen = 0;
-                int writelen = message->chunk.len;
-                uint8_t *start = (uint8_t *)message->chunk.ptr;
-                /* MG_EV_HTTP_CHUNK received for each chunk */
-                
-                if(update_partition == NULL){
-                    remlen = message->body.len - writelen;
-                    /* On first chunk */
-                    update_partition = esp_ota_get_next_update_partition(NULL);
-                    ota_handle_valid = false;
-                    err = esp_ota_begin(update_partition, OTA_SIZE_UNKNOWN, &ota_handle);
-                    if(err == ESP_OK)
-                        ota_handle_valid = true;
-                    ota_size = 0;
-                    ota_success = false;
-                    //ESP_LOGI(tag, "Start of file:");
-                    //for(int i=0; i < 30; i++)
-                    //    ESP_LOGI(tag, "%2X %2x %2x %2x %2x", message->body.p[i * 5], message->body.p[(i * 5) + 1], message->body.p[(i * 5) + 2], message->body.p[(i * 5) + 3], message->body.p[(i * 5) + 4]);
-                    if(writelen >= 2 && start[0] == 0x2d && start[1] == 0x2d){
-                        writelen -= 2;
-                        /* Assume this is a multi-part header */
-                        start += 2;
-                        ESP_LOGI(tag, "Skipping multi-part header");
-                        while(writelen >= 4 && strncmp((char *)start, "\r\n\r\n", 4) != 0){
-                            writelen--;
-                            start++;
-                        }
-                        if(writelen < 4){
-                            writelen = 0;
-                        }else{
-                            writelen -= 4;
-                            start += 4;
-                        }
-                    }
-                }else{
-                    remlen -= writelen;
-                }
-                if(writelen > 0){
-                    if(ota_handle_valid == true){
-                        /* For each chunk */
-                        //ESP_LOGI(tag, "write %d bytes", writelen);
-                        ota_size += writelen;
-                        err = esp_ota_write(ota_handle, start, writelen);
-                        switch(err){
-                            case ESP_ERR_OTA_VALIDATE_FAILED:
-                                ESP_LOGI(tag, "Image validate failed");
-                                err = esp_ota_end(ota_handle);
-                                ota_handle_valid = false;
-                                break;
-                            case ESP_OK:
-                            default:
-                                break;
-                        }
-                    }
-                }
+            const struct route *route = route_find(routes, message->uri);
+            /* Only a firmware upload is taken a read at a time - anything else is dropped as it arrives */
+            if(nc->is_draining == 0 && route != NULL && route->fn == mongoose_serve_ota_upload && (route->methods & route_method(message)) != 0){
+                /* MG_EV_HTTP_CHUNK received for each read - drop what has been used */
+                message->chunk.len = mongoose_ota_upload(nc, message, message->chunk.ptr, message->chunk.len, false);
                 mg_http_delete_chunk(nc, message);
-                //ESP_LOGI(tag, "Remaining %d", remlen);
-                if(remlen <= 0){
-                    //ESP_LOGI(tag, "Bodylen is %d, Msglen is %d", message->body.len, message->message.len);
-                    if(ota_handle_valid == true){
-                        ESP_LOGI(tag, "OTA complete - %d bytes received", ota_size);
-                        ota_success = true;
-                        /* If ota_handle is set */
-                        err = esp_ota_end(ota_handle);
-                        ota_handle_valid = false;
-                        err = esp_ota_set_boot_partition(update_partition);
-                    }
-                    update_partition = NULL;
-                    mongoose_serve_content(nc, (char *)uploadcomplete, true);
-                    nc->is_draining = 1;
-                }
             }else{
                 mg_http_delete_chunk(nc, message);
             }
-            free(uri);
             break;
         } // MG_EV_HTTP_CHUNK
+        case MG_EV_POLL:
+        case MG_EV_WRITE:
+            /* Carry on with a streamed page */
+            mongoose_stream_more(nc);
+            break;
+        case MG_EV_CLOSE:
+            /* Closed part way through a firmware upload */
+            if(nc->id == ota_upload.conn){
+                ota_abort("Upload interrupted");
+                ota_upload.conn = 0;
+            }
+            /* Closed part way through a streamed page */
+            if(nc->fn_data != NULL){
+                free(nc->fn_data);
+                nc->fn_data = NULL;
+            }
+            break;
         default:
             //if(ev != 0 && ev != MG_EV_POLL)
             //    ESP_LOGI(tag, "Event %x", ev);
@@ -719,6 +1183,7 @@ static void mongooseTask(void *data) {
 
     ESP_LOGD(tag, ">> mongooseTask");
     g_mongooseStopRequest = 0; // Unset the stop request since we are being asked to start.
+    metrics_add_task(xTaskGetCurrentTaskHandle());
 
     mg_mgr_init(&mgr);
     connection = mg_http_listen(&mgr, "http://0.0.0.0:80", mongoose_event_handler, NULL);
@@ -726,16 +1191,32 @@ static void mongooseTask(void *data) {
         ESP_LOGE(tag, "No connection from the mg_bind().");
         mg_mgr_free(&mgr);
         ESP_LOGD(tag, "<< mongooseTask");
+        metrics_remove_task(xTaskGetCurrentTaskHandle());
         vTaskDelete(NULL);
         return;
     }
 
+    /* Work from the other tasks wakes the poll, live events for the web pages */
+    webtask_start(&mgr);
+    events_start();
+#ifdef CONFIG_EQ3_LOCAL_BROKER
+    broker_start(&mgr);
+#endif
+
     // Keep processing until we are flagged that there is a stop request.
+    // Anything that needs doing sooner than the next timer wakes the poll.
     while (!g_mongooseStopRequest) {
-        mg_mgr_poll(&mgr, 1000);
+        bool again = stream_yielded;
+        stream_yielded = false;
+        mg_mgr_poll(&mgr, again ? 0 : webtask_poll_ms(MONGOOSE_POLL_MAX_MS));
     }
 
     // We have received a stop request, so stop being a web server.
+#ifdef CONFIG_EQ3_LOCAL_BROKER
+    broker_stop();
+#endif
+    events_stop();
+    webtask_stop();
     mg_mgr_free(&mgr);
     g_mongooseStarted = 0;
 
@@ -747,15 +1228,19 @@ static void mongooseTask(void *data) {
 #endif
 
     ESP_LOGD(tag, "<< mongooseTask");
+    metrics_remove_task(xTaskGetCurrentTaskHandle());
     vTaskDelete(NULL);
     return;
 } // mongooseTask
 
 #define MAXCONNATTEMPTS 25
 static int connattempts = 0;
-//static connection_info_t connectionInfo;
-static void becomeStation(connection_info_t *pConnectionInfo);
+static void becomeStation(void);
 static void becomeAccessPoint();
+static void setStationConfig(bool fast);
+#ifdef CONFIG_EQ3_FAST_CONNECT
+static void saveFastConnect(void);
+#endif
 
 static int setStatusLed(int on) {
 #if defined(CONFIG_ENABLE_STATUS_LED) && defined(CONFIG_STATUS_LED_GPIO)
@@ -813,6 +1298,16 @@ static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_
         // If we fail to connect to an access point as a station, become an access point.
         case WIFI_EVENT_STA_DISCONNECTED: {
             ESP_LOGD(tag, "Station disconnected started");
+            if(sta_connected == true){
+                /* Lost an established connection - try the access point we were on first */
+                sta_connected = false;
+                connect_start = esp_timer_get_time();
+                if(sta_configured == true && fast_valid == true){
+                    setStationConfig(true);
+                    ESP_ERROR_CHECK(esp_wifi_connect());
+                    break;
+                }
+            }
             // We think we tried to connect as a station and failed! ... become
             // an access point.
             if(connattempts++ > MAXCONNATTEMPTS){
@@ -821,7 +1316,7 @@ static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_
                 becomeAccessPoint();
             }else{
                 setStatusLed(0);
-                becomeStation(&connectionInfo);
+                becomeStation();
             }
             break;
         } // WIFI_EVENT_AP_START
@@ -836,8 +1331,22 @@ static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_
             ESP_LOGI(tag, "********************************************");
             connattempts = 0;
 
+            /* Record how long it took to get here */
+            int64_t now = esp_timer_get_time();
+            timing.last_ms = (int)((now - connect_start) / 1000);
+            timing.fast = fast_attempt;
+            if(timing.boot_ms == 0)
+                timing.boot_ms = (int)(now / 1000);
+            else
+                timing.reconnects++;
+            sta_connected = true;
+            ESP_LOGI(tag, "IP address after %d ms%s (%d ms since boot)", timing.last_ms, fast_attempt ? " using fast connect" : "", (int)(now / 1000));
+#ifdef CONFIG_EQ3_FAST_CONNECT
+            saveFastConnect();
+#endif
+
 #ifdef OLD_MODE
-            g_mongooseStopRequest = 1; // Stop mongoose (if it is running).
+            g_mongooseStopRequest = 1; // Stop mongoose (if it is running) - seen at the end of its current poll.
             // Invoke the callback if Mongoose has NOT been started ... otherwise
             // we will invoke the callback when mongoose has ended.
             if (!g_mongooseStarted) {
@@ -862,93 +1371,80 @@ static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_
     } // Switch event
 } // esp32_wifi_eventHandler
 
-/* Retrieve the connection info.  A rc == 0 means ok. */
-int getConnectionInfo(connection_info_t *pConnectionInfo) {
+#ifdef CONFIG_EQ3_FAST_CONNECT
+/* Read the cached access point details */
+static bool loadFastConnect(void) {
     nvs_handle handle;
-    size_t size;
+    size_t size = sizeof(fast_connect_t);
     esp_err_t err;
-    uint32_t version;
-    err = nvs_open(BOOTWIFI_NAMESPACE, NVS_READWRITE, &handle);
-    if (err != 0) {
-        ESP_LOGE(tag, "nvs_open: %x", err);
-        return -1;
-    }
-
-    /* Default the newer parameters in case nvs still contains old config */
-    pConnectionInfo->ntptimezone[0] = 0;
-    pConnectionInfo->ntpenabled = 0;
-    sprintf(pConnectionInfo->ntpserver, "pool.ntp.org");
-    pConnectionInfo->ntpserver2[0] = 0;
-    pConnectionInfo->dnsservers[0][0] = 0;
-    pConnectionInfo->dnsservers[1][0] = 0;
-
-    // Get the version that the data was saved against.
-    err = nvs_get_u32(handle, KEY_VERSION, &version);
-    if (err != ESP_OK) {
-        ESP_LOGI(tag, "No version record found (%d).", err);
-        nvs_close(handle);
-        return -1;
-    }
 
-    err = nvs_get_blob(handle, KEY_CONNECTION_INFO, NULL, &size);
-    if (err != ESP_OK) {
-        ESP_LOGE(tag, "No connection record found (%d).", err);
-        nvs_close(handle);
-        return -1;
-    }
-    if ((version & 0xff00) != (g_version & 0xff00)) {
-        ESP_LOGI(tag, "Config versions differ ... current is %x, found is %x", g_version, version);
-        /* Check for previous config structure */
-        ESP_LOGI(tag, "Older version of config (%x), found. New options will be default. Please re-save", version);
-        if ((version & 0xff00) == (g_v1_version & 0xff00)) {
-            size = V1_CONNECTION_INFO_SIZE;
-        }else if ((version & 0xff00) == (g_v2_version & 0xff00)) {
-            size = V2_CONNECTION_INFO_SIZE;
-        }else{
-            ESP_LOGI(tag, "Incompatible versions ... current is %x, found is %x", g_version, version);
-            nvs_close(handle);
-            return -1;
-        }
-    }else{
-        ESP_LOGI(tag, "Config version %x found", g_version);
-        size = sizeof(connection_info_t);
-    }
+    if (nvs_open(BOOTWIFI_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+        return false;
+    err = nvs_get_blob(handle, KEY_FAST_CONNECT, &fastConnect, &size);
+    nvs_close(handle);
+    return err == ESP_OK && size == sizeof(fast_connect_t) && fastConnect.channel != 0;
+} // loadFastConnect
 
-    err = nvs_get_blob(handle, KEY_CONNECTION_INFO, pConnectionInfo, &size);
-    if (err != ESP_OK) {
-        ESP_LOGI(tag, "No connection record found (%d).", err);
-        nvs_close(handle);
-        return -1;
-    }
-    /* If the ntpserver is not configured flag ntp as disabled */
-    if(pConnectionInfo->ntpserver[0] == 0)
-        pConnectionInfo->ntpenabled = 0;
+/* Remember the access point we are connected to - flash is only written if it has changed */
+static void saveFastConnect(void) {
+    nvs_handle handle;
+    wifi_ap_record_t ap;
 
-    // Cleanup
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK)
+        return;
+    if (fast_valid == true && fastConnect.channel == ap.primary && memcmp(fastConnect.bssid, ap.bssid, sizeof(fastConnect.bssid)) == 0)
+        return;
+    memset(&fastConnect, 0, sizeof(fast_connect_t));
+    strncpy(fastConnect.ssid, config_get_str(CFG_SSID), SSID_SIZE - 1);
+    memcpy(fastConnect.bssid, ap.bssid, sizeof(fastConnect.bssid));
+    fastConnect.channel = ap.primary;
+    fast_valid = true;
+    ESP_LOGI(tag, "Caching access point %02x:%02x:%02x:%02x:%02x:%02x on channel %d", ap.bssid[0], ap.bssid[1], ap.bssid[2], ap.bssid[3], ap.bssid[4], ap.bssid[5], ap.primary);
+    if (nvs_open(BOOTWIFI_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+        return;
+    if (nvs_set_blob(handle, KEY_FAST_CONNECT, &fastConnect, sizeof(fast_connect_t)) == ESP_OK)
+        nvs_commit(handle);
     nvs_close(handle);
+} // saveFastConnect
+#endif
 
-    // Do a sanity check on the SSID
-    if (strlen(pConnectionInfo->ssid) == 0) {
-        ESP_LOGI(tag, "NULL ssid detected");
-        return -1;
+/* Set the station config - directed to the cached access point if fast is set */
+static void setStationConfig(bool fast) {
+    wifi_config_t sta_config;
+    memset(&sta_config, 0, sizeof(wifi_config_t));
+    strncpy((char *)sta_config.sta.ssid, config_get_str(CFG_SSID), sizeof(sta_config.sta.ssid));
+    strncpy((char *)sta_config.sta.password, config_get_str(CFG_PASSWORD), sizeof(sta_config.sta.password));
+    fast_attempt = fast && fast_valid;
+    if (fast_attempt == true) {
+        ESP_LOGI(tag, " - fast connect on channel %d", fastConnect.channel);
+        sta_config.sta.bssid_set = 1;
+        memcpy(sta_config.sta.bssid, fastConnect.bssid, sizeof(fastConnect.bssid));
+        sta_config.sta.channel = fastConnect.channel;
+    } else {
+        sta_config.sta.bssid_set = 0;
     }
-    return 0;
-} // getConnectionInfo
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &sta_config));
+} // setStationConfig
 
-/* Save our connection info for retrieval on a subsequent restart. */
-static void saveConnectionInfo(connection_info_t *pConnectionInfo) {
-    nvs_handle handle;
-    ESP_ERROR_CHECK(nvs_open(BOOTWIFI_NAMESPACE, NVS_READWRITE, &handle));
-    ESP_ERROR_CHECK(nvs_set_blob(handle, KEY_CONNECTION_INFO, pConnectionInfo, sizeof(connection_info_t)));
-    ESP_ERROR_CHECK(nvs_set_u32(handle, KEY_VERSION, g_version));
-    ESP_ERROR_CHECK(nvs_commit(handle));
-    nvs_close(handle);
-} // setConnectionInfo
+/* Is there a cached access point to connect to (so there is no need to delay wifi at boot) */
+bool wifi_fast_connect(void) {
+#ifdef CONFIG_EQ3_FAST_CONNECT
+    return loadFastConnect();
+#else
+    return false;
+#endif
+}
+
+/* Time taken to get an IP address */
+void wifi_get_timing(struct wifi_timing *t) {
+    *t = timing;
+}
 
 /* Become a station connecting to an existing access point. */
-static void becomeStation(connection_info_t *pConnectionInfo) {
-    ESP_LOGI(tag, "- Connecting to access point \"%s\" ...", pConnectionInfo->ssid);
-    assert(strlen(pConnectionInfo->ssid) > 0);
+static void becomeStation(void) {
+    const char *dns;
+    ESP_LOGI(tag, "- Connecting to access point \"%s\" ...", config_get_str(CFG_SSID));
+    assert(strlen(config_get_str(CFG_SSID)) > 0);
     
     /* If this is a retry don't re-initialise sta mode */
     if(sta_configured == false){
@@ -956,41 +1452,45 @@ static void becomeStation(connection_info_t *pConnectionInfo) {
 
         ESP_ERROR_CHECK(esp_wifi_stop());
         /* If we have a static IP address information, use that. */
-        if (pConnectionInfo->ipInfo.ip.addr != 0) {
-            ESP_LOGI(tag, " - using a static IP address of " IPSTR, IP2STR(&pConnectionInfo->ipInfo.ip));
+        if (config_get_u32(CFG_IP) != 0) {
+            esp_netif_ip_info_t ipInfo;
+            ipInfo.ip.addr = config_get_u32(CFG_IP);
+            ipInfo.gw.addr = config_get_u32(CFG_GW);
+            ipInfo.netmask.addr = config_get_u32(CFG_NETMASK);
+            ESP_LOGI(tag, " - using a static IP address of " IPSTR, IP2STR(&ipInfo.ip));
             esp_netif_dhcpc_stop(sta_netif);
-            esp_netif_set_ip_info(sta_netif, &pConnectionInfo->ipInfo);
+            esp_netif_set_ip_info(sta_netif, &ipInfo);
         } else {
             esp_netif_dhcpc_start(sta_netif);
         }
-        if(pConnectionInfo->dnsservers[0][0] != 0){
-            inet_pton(AF_INET, pConnectionInfo->dnsservers[0], &dnsaddr.ip.u_addr.ip4.addr);
+        if((dns = config_get_str(CFG_DNS1))[0] != 0){
+            inet_pton(AF_INET, dns, &dnsaddr.ip.u_addr.ip4.addr);
             dnsaddr.ip.type = ESP_IPADDR_TYPE_V4;
-            ESP_LOGI(tag, " - using a static DNS address of %s", pConnectionInfo->dnsservers[0]);
+            ESP_LOGI(tag, " - using a static DNS address of %s", dns);
             esp_netif_set_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &dnsaddr);
         }
-        if(pConnectionInfo->dnsservers[1][0] != 0){
-            inet_pton(AF_INET, pConnectionInfo->dnsservers[1], &dnsaddr.ip.u_addr.ip4.addr);
+        if((dns = config_get_str(CFG_DNS2))[0] != 0){
+            inet_pton(AF_INET, dns, &dnsaddr.ip.u_addr.ip4.addr);
             dnsaddr.ip.type = ESP_IPADDR_TYPE_V4;
-            ESP_LOGI(tag, " - using a static DNS2 address of %s", pConnectionInfo->dnsservers[1]);
+            ESP_LOGI(tag, " - using a static DNS2 address of %s", dns);
             esp_netif_set_dns_info(sta_netif, ESP_NETIF_DNS_BACKUP, &dnsaddr);
         }
-        if(strlen(pConnectionInfo->mqttid) == 0){
+        if(strlen(config_get_str(CFG_MQTTID)) == 0){
             esp_netif_set_hostname(sta_netif, "EQ3-heatcontroller");
             ESP_LOGI(tag, "Hostname EQ3-heatcontroller");
         }else{
-            esp_netif_set_hostname(sta_netif, pConnectionInfo->mqttid);
-            ESP_LOGI(tag, "Hostname %s", pConnectionInfo->mqttid);
+            esp_netif_set_hostname(sta_netif, config_get_str(CFG_MQTTID));
+            ESP_LOGI(tag, "Hostname %s", config_get_str(CFG_MQTTID));
         }
         ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_STA));
-        wifi_config_t sta_config;
-        memset(&sta_config, 0, sizeof(wifi_config_t));
-        sta_config.sta.bssid_set = 0;
-        memcpy(sta_config.sta.ssid, pConnectionInfo->ssid, SSID_SIZE);
-        memcpy(sta_config.sta.password, pConnectionInfo->password, PASSWORD_SIZE);
-        ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &sta_config));
+        setStationConfig(true);
         sta_configured = true;
+        connect_start = esp_timer_get_time();
         ESP_ERROR_CHECK(esp_wifi_start());
+    } else if (fast_attempt == true) {
+        /* The directed connect failed - the access point may have moved channel so fall back to a full scan */
+        ESP_LOGI(tag, " - fast connect failed, scanning");
+        setStationConfig(false);
     }
     ESP_ERROR_CHECK(esp_wifi_connect());
 } // becomeStation
@@ -1055,16 +1555,20 @@ static void bootWiFi2() {
         // against.  If that information doesn't exist, then again we become an
         // access point ourselves in order to allow a client to connect and bring
         // up a browser.
-        int rc = getConnectionInfo(&connectionInfo);
-        if (rc == 0) {
+        /* The config is loaded by config_init() at boot so this never touches flash */
+        if (strlen(config_get_str(CFG_SSID)) > 0) {
             // We have received connection information, let us now become a station
             // and attempt to connect to the access point.
             ESP_LOGI(tag, "Network config present - becoming client");
             setStatusLed(0);
             haveconninfo = true;
-            becomeStation(&connectionInfo);
+#ifdef CONFIG_EQ3_FAST_CONNECT
+            /* The cache is only used for the access point it was saved against */
+            fast_valid = loadFastConnect() && strncmp(fastConnect.ssid, config_get_str(CFG_SSID), SSID_SIZE) == 0;
+#endif
+            becomeStation();
             if(g_parms != NULL)
-                g_parms(connectionInfo.mqtturl, connectionInfo.mqttuser, connectionInfo.mqttpass, connectionInfo.mqttid);
+                g_parms((char *)config_get_str(CFG_MQTTURL), (char *)config_get_str(CFG_MQTTUSER), (char *)config_get_str(CFG_MQTTPASS), (char *)config_get_str(CFG_MQTTID));
 
         } else {
             // We do NOT have connection information.  Let us now become an access
@@ -1081,7 +1585,7 @@ static void bootWiFi2() {
 
 void restart_station(void){
     setStatusLed(0);
-    becomeStation(&connectionInfo);
+    becomeStation();
 }
 
 /* Main entry into bootWiFi */
@@ -1108,19 +1612,32 @@ void bootWiFi(bootwifi_callback_t callback, bootwifi_parms_t parmcb) {
     ESP_LOGD(tag, "<< bootWiFi");
 } // bootWiFi
 
-/* Is ntp enabled */
+/* Is ntp enabled - it can't be if no server is configured */
 bool ntp_enabled(void){
-    return connectionInfo.ntpenabled == 0 ? false : true;
+    return config_get_int(CFG_NTPENABLED) != 0 && config_get_str(CFG_NTPSERVER)[0] != 0;
+}
+
+/* Publish status to a retained topic per TRV */
+bool per_trv_status(void){
+    return config_get_int(CFG_PERTRVSTATUS) == 0 ? false : true;
+}
+
+/* Encoding(s) used for status reports */
+int status_format(void){
+    int statusformat = config_get_int(CFG_STATUSFORMAT);
+    if(statusformat < STATUS_FORMAT_JSON || statusformat > STATUS_FORMAT_BOTH)
+        return STATUS_FORMAT_JSON;
+    return statusformat;
 }
 
 /* Get ntp server details */
-char *getntpserver(int idx){
+const char *getntpserver(int idx){
     if(idx > 0)
-        return connectionInfo.ntpserver2;
-    return connectionInfo.ntpserver;
+        return config_get_str(CFG_NTPSERVER2);
+    return config_get_str(CFG_NTPSERVER);
 }
 
 /* Get the timezone */
-char *getntptimezone(void){
-    return connectionInfo.ntptimezone;
+const char *getntptimezone(void){
+    return config_get_str(CFG_NTPTIMEZONE);
 }
@@ -14,7 +14,24 @@ void bootWiFi();
 void restart_station(void);
 
 bool ntp_enabled(void);
-char *getntpserver(int idx);
-char *getntptimezone(void);
+const char *getntpserver(int idx);
+const char *getntptimezone(void);
+bool per_trv_status(void);
+
+/* Status report encodings - cbor is published on the parallel statuscbor topic */
+#define STATUS_FORMAT_JSON 0
+#define STATUS_FORMAT_CBOR 1
+#define STATUS_FORMAT_BOTH 2
+int status_format(void);
+
+/* Time taken to get an IP address - at boot (since power on) and for the last (re)connect */
+struct wifi_timing {
+    int boot_ms;
+    int last_ms;
+    int reconnects;
+    bool fast;              /* The last connect was directed to the cached access point */
+};
+void wifi_get_timing(struct wifi_timing *t);
+bool wifi_fast_connect(void);
 
 #endif /* MAIN_BOOTWIFI_H_ */
@@ -0,0 +1,246 @@
+/*
+ * EQ-3 local mqtt broker.
+ *
+ * A small qos 0 broker built on the mongoose mqtt parser. Subscriptions
+ * support the + and # wildcards. Retained messages and persistent sessions
+ * are not supported. Messages published by local clients are passed to the
+ * mqtt code which runs hub commands directly and bridges everything else to
+ * the upstream broker.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "eq3_broker.h"
+#include "eq3_webtask.h"
+#include "eq3_wifi.h"
+
+#define BROKER_TAG "EQ3_BROKER"
+
+#ifdef CONFIG_EQ3_LOCAL_BROKER_PORT
+#define BROKER_PORT CONFIG_EQ3_LOCAL_BROKER_PORT
+#else
+#define BROKER_PORT 1883
+#endif
+
+#define BROKER_MAX_SUBS    16
+#define BROKER_FILTER_LEN  64
+
+struct broker_sub {
+    struct mg_connection *conn;     /* NULL if the slot is free */
+    char filter[BROKER_FILTER_LEN];
+};
+
+/* Message posted to the mongoose task - topic followed by data in buf */
+struct broker_msg {
+    uint16_t topiclen;
+    uint16_t datalen;
+    char buf[];
+};
+
+static struct broker_sub subs[BROKER_MAX_SUBS];
+static volatile bool running = false;
+
+/* Does a topic match a subscription filter (with + and # wildcards) */
+static bool topic_match(const char *filter, const char *topic, int topiclen){
+    const char *t = topic, *tend = topic + topiclen;
+    while(*filter != 0){
+        if(*filter == '#')
+            return true;
+        if(*filter == '+'){
+            filter++;
+            while(t < tend && *t != '/')
+                t++;
+        }else{
+            while(*filter != 0 && *filter != '/'){
+                if(t >= tend || *t != *filter)
+                    return false;
+                t++;
+                filter++;
+            }
+            if(t < tend && *t != '/')
+                return false;
+        }
+        /* End of a level in the filter */
+        if(*filter == 0)
+            return t == tend;
+        filter++;
+        /* 'a/#' also matches 'a' */
+        if(t == tend)
+            return strcmp(filter, "#") == 0;
+        t++;
+    }
+    return t == tend;
+}
+
+/* Send a message to every local client with a matching subscription (mongoose task only) */
+static void broker_deliver(const char *topic, int topiclen, const char *data, int len){
+    struct mg_connection *sent[BROKER_MAX_SUBS];
+    struct mg_str mtopic = mg_str_n(topic, topiclen), mdata = mg_str_n(data, len);
+    int nsent = 0;
+    for(int i = 0; i < BROKER_MAX_SUBS; i++){
+        bool dup = false;
+        if(subs[i].conn == NULL || topic_match(subs[i].filter, topic, topiclen) == false)
+            continue;
+        /* A client with overlapping subscriptions gets the message once */
+        for(int j = 0; j < nsent; j++)
+            dup |= sent[j] == subs[i].conn;
+        if(dup)
+            continue;
+        mg_mqtt_pub(subs[i].conn, &mtopic, &mdata, 0, false);
+        sent[nsent++] = subs[i].conn;
+    }
+}
+
+static bool broker_subscribe(struct mg_connection *c, struct mg_str *filter){
+    int freeslot = -1;
+    for(int i = 0; i < BROKER_MAX_SUBS; i++){
+        if(subs[i].conn == c && strlen(subs[i].filter) == filter->len && strncmp(subs[i].filter, filter->ptr, filter->len) == 0)
+            return true;
+        if(subs[i].conn == NULL && freeslot < 0)
+            freeslot = i;
+    }
+    if(freeslot < 0 || filter->len >= BROKER_FILTER_LEN){
+        ESP_LOGE(BROKER_TAG, "Cannot add subscription %.*s", (int)filter->len, filter->ptr);
+        return false;
+    }
+    subs[freeslot].conn = c;
+    memcpy(subs[freeslot].filter, filter->ptr, filter->len);
+    subs[freeslot].filter[filter->len] = 0;
+    ESP_LOGI(BROKER_TAG, "Local subscription %s", subs[freeslot].filter);
+    return true;
+}
+
+/* Remove one subscription of a client or all of them if filter is NULL */
+static void broker_unsubscribe(struct mg_connection *c, struct mg_str *filter){
+    for(int i = 0; i < BROKER_MAX_SUBS; i++){
+        if(subs[i].conn == c && (filter == NULL ||
+           (strlen(subs[i].filter) == filter->len && strncmp(subs[i].filter, filter->ptr, filter->len) == 0)))
+            subs[i].conn = NULL;
+    }
+}
+
+/* Offset of the first topic in a (un)subscribe - after the fixed header and packet id */
+static size_t topics_pos(struct mg_mqtt_message *mm){
+    size_t pos = 1;
+    while(pos < mm->dgram.len && (mm->dgram.ptr[pos] & 0x80))
+        pos++;
+    return pos + 3;
+}
+
+static uint16_t packet_id(struct mg_mqtt_message *mm){
+    size_t pos = topics_pos(mm) - 2;
+    return (uint16_t)(((uint8_t)mm->dgram.ptr[pos] << 8) | (uint8_t)mm->dgram.ptr[pos + 1]);
+}
+
+static void send_ack(struct mg_connection *c, uint8_t cmd, uint16_t id){
+    uint16_t netid = mg_htons(id);
+    mg_mqtt_send_header(c, cmd, 0, sizeof(netid));
+    mg_send(c, &netid, sizeof(netid));
+}
+
+/* Local client connections */
+static void broker_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data){
+    if(ev == MG_EV_MQTT_CMD){
+        struct mg_mqtt_message *mm = (struct mg_mqtt_message *)ev_data;
+        struct mg_str topic;
+        size_t pos;
+        switch(mm->cmd){
+        case MQTT_CMD_CONNECT: {
+            /* Accept any client - the broker is only reachable from the local network */
+            uint8_t connack[2] = {0, 0};
+            mg_mqtt_send_header(c, MQTT_CMD_CONNACK, 0, sizeof(connack));
+            mg_send(c, connack, sizeof(connack));
+            break;
+        }
+        case MQTT_CMD_SUBSCRIBE: {
+            /* The SUBACK has a return code for every topic, however many are requested - count them first */
+            uint8_t qos, granted;
+            int count = 0;
+            uint16_t netid = mg_htons(mm->id);
+            pos = topics_pos(mm);
+            while((pos = mg_mqtt_next_sub(mm, &topic, &qos, pos)) > 0)
+                count++;
+            mg_mqtt_send_header(c, MQTT_CMD_SUBACK, 0, sizeof(netid) + count);
+            mg_send(c, &netid, sizeof(netid));
+            pos = topics_pos(mm);
+            while((pos = mg_mqtt_next_sub(mm, &topic, &qos, pos)) > 0){
+                /* Everything is delivered at qos 0 - 0x80 is a refused subscription (including when the table is full) */
+                granted = broker_subscribe(c, &topic) ? 0 : 0x80;
+                mg_send(c, &granted, sizeof(granted));
+            }
+            break;
+        }
+        case MQTT_CMD_UNSUBSCRIBE:
+            pos = topics_pos(mm);
+            while((pos = mg_mqtt_next_unsub(mm, &topic, pos)) > 0)
+                broker_unsubscribe(c, &topic);
+            send_ack(c, MQTT_CMD_UNSUBACK, packet_id(mm));
+            break;
+        case MQTT_CMD_PUBLISH:
+            if(mm->qos == 1)
+                send_ack(c, MQTT_CMD_PUBACK, mm->id);
+            else if(mm->qos == 2)
+                send_ack(c, MQTT_CMD_PUBREC, mm->id);
+            /* Messages bridged upstream on topics the hub subscribes to come back to local subscribers that way */
+            if(mqtt_local_publish(mm->topic.ptr, mm->topic.len, mm->data.ptr, mm->data.len) == false)
+                broker_deliver(mm->topic.ptr, mm->topic.len, mm->data.ptr, mm->data.len);
+            break;
+        case MQTT_CMD_PUBREL:
+            send_ack(c, MQTT_CMD_PUBCOMP, mm->id);
+            break;
+        case MQTT_CMD_PINGREQ:
+            mg_mqtt_pong(c);
+            break;
+        case MQTT_CMD_DISCONNECT:
+            c->is_closing = 1;
+            break;
+        }
+    }else if(ev == MG_EV_CLOSE){
+        broker_unsubscribe(c, NULL);
+    }
+}
+
+/* Runs in the mongoose task */
+static void broker_send(struct mg_mgr *mgr, void *arg){
+    struct broker_msg *msg = (struct broker_msg *)arg;
+    if(mgr != NULL && running == true)
+        broker_deliver(msg->buf, msg->topiclen, msg->buf + msg->topiclen, msg->datalen);
+    free(msg);
+}
+
+void broker_start(struct mg_mgr *mgr){
+    char url[32];
+    memset(subs, 0, sizeof(subs));
+
+    snprintf(url, sizeof(url), "mqtt://0.0.0.0:%d", BROKER_PORT);
+    if(mg_mqtt_listen(mgr, url, broker_cb, NULL) == NULL){
+        ESP_LOGE(BROKER_TAG, "Cannot listen on %s", url);
+        return;
+    }
+    running = true;
+    ESP_LOGI(BROKER_TAG, "Local broker listening on %s", url);
+}
+
+void broker_stop(void){
+    running = false;
+}
+
+void broker_publish(const char *topic, int topiclen, const char *data, int len){
+    struct broker_msg *msg;
+    if(running == false || (msg = malloc(sizeof(struct broker_msg) + topiclen + len)) == NULL)
+        return;
+    msg->topiclen = topiclen;
+    msg->datalen = len;
+    memcpy(msg->buf, topic, topiclen);
+    memcpy(msg->buf + topiclen, data, len);
+    if(webtask_post(broker_send, msg) == false){
+        ESP_LOGE(BROKER_TAG, "Local broker dropped message for %.*s", topiclen, topic);
+        free(msg);
+    }
+}
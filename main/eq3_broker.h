@@ -0,0 +1,21 @@
+
+#ifndef EQ3_BROKER_H
+#define EQ3_BROKER_H
+
+#include <stdbool.h>
+#include "mongoose.h"
+
+/* Local mqtt broker
+ * Runs in the mongoose task alongside the web server. Local clients can subscribe to
+ * anything the hub publishes and publish commands straight to the hub without a round
+ * trip through the upstream broker. Other tasks hand messages to the broker with
+ * broker_publish() which posts them to the mongoose task. */
+
+/* Called from the mongoose task */
+void broker_start(struct mg_mgr *mgr);
+void broker_stop(void);
+
+/* Deliver a message to local subscribers (any task) */
+void broker_publish(const char *topic, int topiclen, const char *data, int len);
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * EQ-3 CBOR encoder.
+ *
+ * Just enough of RFC 8949 to encode the flat TRV status maps -
+ * definite length maps, integers, booleans, single precision floats,
+ * text and byte strings.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "eq3_cbor.h"
+
+/* Major types */
+#define CBOR_UINT   0
+#define CBOR_NINT   1
+#define CBOR_BYTES  2
+#define CBOR_TEXT   3
+#define CBOR_MAP    5
+#define CBOR_SIMPLE 7
+
+#define CBOR_FALSE  20
+#define CBOR_TRUE   21
+#define CBOR_FLOAT32 26
+
+void cbor_init(struct cbor_enc *enc, uint8_t *buf, int cap){
+    enc->buf = buf;
+    enc->cap = cap;
+    enc->len = 0;
+    enc->overflow = false;
+}
+
+int cbor_len(const struct cbor_enc *enc){
+    return enc->overflow ? -1 : enc->len;
+}
+
+static bool cbor_room(struct cbor_enc *enc, int len){
+    if(enc->overflow || enc->len + len > enc->cap){
+        enc->overflow = true;
+        return false;
+    }
+    return true;
+}
+
+/* Initial byte plus the shortest big-endian argument */
+static void cbor_head(struct cbor_enc *enc, int major, uint32_t arg){
+    int extra = arg < 24 ? 0 : arg <= 0xff ? 1 : arg <= 0xffff ? 2 : 4;
+    if(cbor_room(enc, 1 + extra) == false)
+        return;
+    switch(extra){
+    case 0:
+        enc->buf[enc->len++] = (major << 5) | arg;
+        return;
+    case 1:
+        enc->buf[enc->len++] = (major << 5) | 24;
+        break;
+    case 2:
+        enc->buf[enc->len++] = (major << 5) | 25;
+        break;
+    default:
+        enc->buf[enc->len++] = (major << 5) | 26;
+        break;
+    }
+    while(extra-- > 0)
+        enc->buf[enc->len++] = (arg >> (extra * 8)) & 0xff;
+}
+
+void cbor_map(struct cbor_enc *enc, int pairs){
+    cbor_head(enc, CBOR_MAP, pairs);
+}
+
+void cbor_uint(struct cbor_enc *enc, uint32_t val){
+    cbor_head(enc, CBOR_UINT, val);
+}
+
+void cbor_int(struct cbor_enc *enc, int32_t val){
+    if(val < 0)
+        cbor_head(enc, CBOR_NINT, (uint32_t)(-1 - val));
+    else
+        cbor_head(enc, CBOR_UINT, val);
+}
+
+void cbor_bool(struct cbor_enc *enc, bool val){
+    cbor_head(enc, CBOR_SIMPLE, val ? CBOR_TRUE : CBOR_FALSE);
+}
+
+void cbor_float(struct cbor_enc *enc, float val){
+    uint32_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    if(cbor_room(enc, 5) == false)
+        return;
+    enc->buf[enc->len++] = (CBOR_SIMPLE << 5) | CBOR_FLOAT32;
+    for(int shift = 24; shift >= 0; shift -= 8)
+        enc->buf[enc->len++] = (bits >> shift) & 0xff;
+}
+
+void cbor_bytes(struct cbor_enc *enc, const uint8_t *data, int len){
+    cbor_head(enc, CBOR_BYTES, len);
+    if(cbor_room(enc, len) == false)
+        return;
+    memcpy(&enc->buf[enc->len], data, len);
+    enc->len += len;
+}
+
+void cbor_text(struct cbor_enc *enc, const char *str){
+    int len = strlen(str);
+    cbor_head(enc, CBOR_TEXT, len);
+    if(cbor_room(enc, len) == false)
+        return;
+    memcpy(&enc->buf[enc->len], str, len);
+    enc->len += len;
+}
@@ -0,0 +1,30 @@
+
+#ifndef EQ3_CBOR_H
+#define EQ3_CBOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Minimal fixed-capacity CBOR (RFC 8949) encoder
+ * Items are written straight into the caller's buffer. If the buffer fills up the
+ * encoder stops writing and cbor_len() returns -1. */
+
+struct cbor_enc {
+    uint8_t *buf;
+    int cap;
+    int len;
+    bool overflow;
+};
+
+void cbor_init(struct cbor_enc *enc, uint8_t *buf, int cap);
+int cbor_len(const struct cbor_enc *enc);
+
+void cbor_map(struct cbor_enc *enc, int pairs);
+void cbor_uint(struct cbor_enc *enc, uint32_t val);
+void cbor_int(struct cbor_enc *enc, int32_t val);
+void cbor_bool(struct cbor_enc *enc, bool val);
+void cbor_float(struct cbor_enc *enc, float val);
+void cbor_text(struct cbor_enc *enc, const char *str);
+void cbor_bytes(struct cbor_enc *enc, const uint8_t *data, int len);
+
+#endif
@@ -0,0 +1,316 @@
+/*
+ * EQ-3 hub configuration store.
+ *
+ * Typed settings kept one per NVS key in the "eq3config" namespace with a
+ * RAM copy loaded once at boot. Saving the config page only writes the
+ * settings that were changed. The connection info blob written by older
+ * firmware is migrated (and removed) the first time this version boots.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "nvs.h"
+
+#include "eq3_config.h"
+
+#define CONFIG_TAG "EQ3_CONFIG"
+
+#define CONFIG_NAMESPACE  "eq3config"
+#define KEY_SCHEMA        "schema"
+#define CONFIG_SCHEMA     1
+
+/* Older firmware kept everything in one blob in the bootwifi namespace */
+#define LEGACY_NAMESPACE  "bootwifi"
+#define KEY_CONNECTION_INFO "connectionInfo"
+#define KEY_VERSION       "version"
+#define LEGACY_V1_VERSION 0x0100
+#define LEGACY_V2_VERSION 0x0200
+#define LEGACY_V3_VERSION 0x0300
+
+typedef enum {
+    CFG_TYPE_STR = 0,
+    CFG_TYPE_INT,
+    CFG_TYPE_U32
+} config_type;
+
+struct config_field {
+    const char *name;       /* NVS key */
+    config_type type;
+    int size;               /* Buffer size of a string setting */
+    const char *defstr;     /* Default of a string setting */
+    int32_t defint;         /* Default of a numeric setting */
+};
+
+static const struct config_field fields[CFG_KEYS] = {
+    [CFG_SSID]         = {"ssid",         CFG_TYPE_STR, SSID_SIZE,          "",             0},
+    [CFG_PASSWORD]     = {"password",     CFG_TYPE_STR, PASSWORD_SIZE,      "",             0},
+    [CFG_MQTTURL]      = {"mqtturl",      CFG_TYPE_STR, MAX_URL_SIZE,       "",             0},
+    [CFG_MQTTUSER]     = {"mqttuser",     CFG_TYPE_STR, USERNAME_SIZE,      "",             0},
+    [CFG_MQTTPASS]     = {"mqttpass",     CFG_TYPE_STR, PASSWORD_SIZE,      "",             0},
+    [CFG_MQTTID]       = {"mqttid",       CFG_TYPE_STR, ID_SIZE,            "",             0},
+    [CFG_NTPENABLED]   = {"ntpenabled",   CFG_TYPE_INT, 0,                  NULL,           0},
+    [CFG_NTPSERVER]    = {"ntpserver",    CFG_TYPE_STR, SERVER_SIZE,        "pool.ntp.org", 0},
+    [CFG_NTPSERVER2]   = {"ntpserver2",   CFG_TYPE_STR, SERVER_SIZE,        "",             0},
+    [CFG_NTPTIMEZONE]  = {"ntptimezone",  CFG_TYPE_STR, SNTP_TIMEZONE_SIZE, "",             0},
+    [CFG_IP]           = {"ip",           CFG_TYPE_U32, 0,                  NULL,           0},
+    [CFG_GW]           = {"gw",           CFG_TYPE_U32, 0,                  NULL,           0},
+    [CFG_NETMASK]      = {"netmask",      CFG_TYPE_U32, 0,                  NULL,           0},
+    [CFG_DNS1]         = {"dns1",         CFG_TYPE_STR, SERVER_SIZE,        "",             0},
+    [CFG_DNS2]         = {"dns2",         CFG_TYPE_STR, SERVER_SIZE,        "",             0},
+    [CFG_PERTRVSTATUS] = {"pertrvstatus", CFG_TYPE_INT, 0,                  NULL,           0},
+    [CFG_STATUSFORMAT] = {"statusformat", CFG_TYPE_INT, 0,                  NULL,           0},
+};
+
+/* RAM cache - strings are allocated at init, numbers are held in nums */
+static char *strs[CFG_KEYS];
+static int32_t nums[CFG_KEYS];
+static uint32_t dirty = 0;
+
+/* Layout of the legacy blob (v1 and v2 are prefixes of it)
+ * v1/v2 used tcpip_adapter_ip_info_t which has the same layout as esp_netif_ip_info_t */
+typedef struct {
+    char ssid[SSID_SIZE];
+    char password[PASSWORD_SIZE];
+    char mqtturl[MAX_URL_SIZE];
+    char mqttuser[USERNAME_SIZE];
+    char mqttpass[PASSWORD_SIZE];
+    char mqttid[ID_SIZE];
+    esp_netif_ip_info_t ipInfo;
+    int ntpenabled;
+    char ntpserver[SERVER_SIZE];
+    char ntptimezone[SNTP_TIMEZONE_SIZE];
+    /* End of v1 */
+    char ntpserver2[SERVER_SIZE];
+    char dnsservers[2][SERVER_SIZE];
+    /* End of v2 */
+    int pertrvstatus;
+    int statusformat;
+    char spare[542];
+} legacy_connection_info_t;
+#define LEGACY_V1_SIZE offsetof(legacy_connection_info_t, ntpenabled)
+#define LEGACY_V2_SIZE offsetof(legacy_connection_info_t, ntpserver2)
+
+static void set_defaults(void){
+    for(int key = 0; key < CFG_KEYS; key++){
+        if(fields[key].type == CFG_TYPE_STR)
+            strcpy(strs[key], fields[key].defstr);
+        else
+            nums[key] = fields[key].defint;
+    }
+}
+
+/* Read every setting into the cache - missing settings keep their defaults */
+static void load_fields(nvs_handle handle){
+    for(int key = 0; key < CFG_KEYS; key++){
+        size_t size = fields[key].size;
+        switch(fields[key].type){
+        case CFG_TYPE_STR:
+            if(nvs_get_str(handle, fields[key].name, strs[key], &size) != ESP_OK)
+                strcpy(strs[key], fields[key].defstr);
+            break;
+        case CFG_TYPE_INT:
+            nvs_get_i32(handle, fields[key].name, &nums[key]);
+            break;
+        case CFG_TYPE_U32:
+            nvs_get_u32(handle, fields[key].name, (uint32_t *)&nums[key]);
+            break;
+        }
+    }
+}
+
+/* Copy the settings from the old connection info blob into the cache and remove the blob
+ * Returns false if there is no (usable) blob */
+static bool migrate_legacy(void){
+    nvs_handle handle;
+    legacy_connection_info_t *info;
+    uint32_t version;
+    size_t size;
+
+    if(nvs_open(LEGACY_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+        return false;
+    if(nvs_get_u32(handle, KEY_VERSION, &version) != ESP_OK || nvs_get_blob(handle, KEY_CONNECTION_INFO, NULL, &size) != ESP_OK){
+        nvs_close(handle);
+        return false;
+    }
+    switch(version & 0xff00){
+    case LEGACY_V1_VERSION:
+        size = LEGACY_V1_SIZE;
+        break;
+    case LEGACY_V2_VERSION:
+        size = LEGACY_V2_SIZE;
+        break;
+    case LEGACY_V3_VERSION:
+        size = sizeof(legacy_connection_info_t);
+        break;
+    default:
+        ESP_LOGI(CONFIG_TAG, "Incompatible config version %x", version);
+        nvs_close(handle);
+        return false;
+    }
+    if((info = calloc(1, sizeof(legacy_connection_info_t))) == NULL){
+        nvs_close(handle);
+        return false;
+    }
+    strcpy(info->ntpserver, fields[CFG_NTPSERVER].defstr);
+    if(nvs_get_blob(handle, KEY_CONNECTION_INFO, info, &size) != ESP_OK){
+        free(info);
+        nvs_close(handle);
+        return false;
+    }
+    ESP_LOGI(CONFIG_TAG, "Migrating config version %x", version);
+
+    config_set_str(CFG_SSID, info->ssid);
+    config_set_str(CFG_PASSWORD, info->password);
+    config_set_str(CFG_MQTTURL, info->mqtturl);
+    config_set_str(CFG_MQTTUSER, info->mqttuser);
+    config_set_str(CFG_MQTTPASS, info->mqttpass);
+    config_set_str(CFG_MQTTID, info->mqttid);
+    config_set_u32(CFG_IP, info->ipInfo.ip.addr);
+    config_set_u32(CFG_GW, info->ipInfo.gw.addr);
+    config_set_u32(CFG_NETMASK, info->ipInfo.netmask.addr);
+    config_set_int(CFG_NTPENABLED, info->ntpenabled);
+    config_set_str(CFG_NTPSERVER, info->ntpserver);
+    config_set_str(CFG_NTPTIMEZONE, info->ntptimezone);
+    config_set_str(CFG_NTPSERVER2, info->ntpserver2);
+    config_set_str(CFG_DNS1, info->dnsservers[0]);
+    config_set_str(CFG_DNS2, info->dnsservers[1]);
+    config_set_int(CFG_PERTRVSTATUS, info->pertrvstatus);
+    config_set_int(CFG_STATUSFORMAT, info->statusformat);
+    free(info);
+
+    /* Only remove the blob once the new settings are safely written */
+    if(config_commit() >= 0){
+        nvs_erase_key(handle, KEY_CONNECTION_INFO);
+        nvs_erase_key(handle, KEY_VERSION);
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return true;
+}
+
+void config_init(void){
+    nvs_handle handle;
+    uint32_t schema = 0;
+
+    for(int key = 0; key < CFG_KEYS; key++){
+        if(fields[key].type == CFG_TYPE_STR && strs[key] == NULL)
+            strs[key] = calloc(1, fields[key].size);
+    }
+    set_defaults();
+    dirty = 0;
+
+    if(nvs_open(CONFIG_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK){
+        ESP_LOGE(CONFIG_TAG, "Can't open config namespace");
+        return;
+    }
+    nvs_get_u32(handle, KEY_SCHEMA, &schema);
+    if(schema == 0){
+        nvs_close(handle);
+        /* First boot of this version (or no config at all) - if the migrated settings
+         * couldn't be saved the migration is tried again next boot */
+        if(migrate_legacy() == true && dirty != 0)
+            return;
+        if(nvs_open(CONFIG_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+            return;
+        nvs_set_u32(handle, KEY_SCHEMA, CONFIG_SCHEMA);
+        nvs_commit(handle);
+    }else{
+        /* Future schema changes are migrated here - new settings just take their defaults */
+        load_fields(handle);
+    }
+    nvs_close(handle);
+    ESP_LOGI(CONFIG_TAG, "Config schema %d loaded", CONFIG_SCHEMA);
+}
+
+const char *config_get_str(config_key key){
+    if(key >= CFG_KEYS || fields[key].type != CFG_TYPE_STR || strs[key] == NULL)
+        return "";
+    return strs[key];
+}
+
+int32_t config_get_int(config_key key){
+    if(key >= CFG_KEYS || fields[key].type == CFG_TYPE_STR)
+        return 0;
+    return nums[key];
+}
+
+uint32_t config_get_u32(config_key key){
+    return (uint32_t)config_get_int(key);
+}
+
+bool config_set_str(config_key key, const char *value){
+    if(key >= CFG_KEYS || fields[key].type != CFG_TYPE_STR || strs[key] == NULL)
+        return false;
+    if(strncmp(strs[key], value, fields[key].size - 1) == 0)
+        return false;
+    strncpy(strs[key], value, fields[key].size - 1);
+    strs[key][fields[key].size - 1] = 0;
+    dirty |= 1u << key;
+    return true;
+}
+
+bool config_set_int(config_key key, int32_t value){
+    if(key >= CFG_KEYS || fields[key].type == CFG_TYPE_STR || nums[key] == value)
+        return false;
+    nums[key] = value;
+    dirty |= 1u << key;
+    return true;
+}
+
+bool config_set_u32(config_key key, uint32_t value){
+    return config_set_int(key, (int32_t)value);
+}
+
+int config_commit(void){
+    nvs_handle handle;
+    esp_err_t err = ESP_OK;
+    int written = 0;
+
+    if(dirty == 0)
+        return 0;
+    if(nvs_open(CONFIG_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+        return -1;
+    for(int key = 0; key < CFG_KEYS && err == ESP_OK; key++){
+        if((dirty & (1u << key)) == 0)
+            continue;
+        switch(fields[key].type){
+        case CFG_TYPE_STR:
+            err = nvs_set_str(handle, fields[key].name, strs[key]);
+            break;
+        case CFG_TYPE_INT:
+            err = nvs_set_i32(handle, fields[key].name, nums[key]);
+            break;
+        case CFG_TYPE_U32:
+            err = nvs_set_u32(handle, fields[key].name, (uint32_t)nums[key]);
+            break;
+        }
+        if(err == ESP_OK){
+            dirty &= ~(1u << key);
+            written++;
+        }
+    }
+    if(err == ESP_OK)
+        err = nvs_commit(handle);
+    nvs_close(handle);
+    if(err != ESP_OK){
+        ESP_LOGE(CONFIG_TAG, "Config save failed (%x)", err);
+        return -1;
+    }
+    ESP_LOGI(CONFIG_TAG, "%d settings saved", written);
+    return written;
+}
+
+int config_text_size(void){
+    int size = 0;
+    for(int key = 0; key < CFG_KEYS; key++){
+        if(fields[key].type == CFG_TYPE_STR)
+            size += fields[key].size;
+    }
+    return size;
+}
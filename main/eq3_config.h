@@ -0,0 +1,59 @@
+#ifndef EQ3_CONFIG_H
+#define EQ3_CONFIG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Hub configuration
+ * Each setting is stored under its own NVS key and cached in RAM by config_init() at boot.
+ * Reads only ever touch the cache. Setters update the cache and config_commit() writes
+ * just the settings that have changed. Settings are only changed from the web server task. */
+
+#define SSID_SIZE (32)                       // Maximum SSID size
+#define USERNAME_SIZE (64)                   // Maximum username size
+#define PASSWORD_SIZE (64)                   // Maximum password size
+#define ID_SIZE       (32)                   // Maximum MQTT clientID size
+#define MAX_URL_SIZE  (256)                  // Maximum url length
+#define SERVER_SIZE      (64)                // Maximum length of sntp/dns server url
+#define SNTP_TIMEZONE_SIZE (35)              // Maximum length of timezone parameter
+
+typedef enum {
+    CFG_SSID = 0,
+    CFG_PASSWORD,
+    CFG_MQTTURL,
+    CFG_MQTTUSER,
+    CFG_MQTTPASS,
+    CFG_MQTTID,
+    CFG_NTPENABLED,
+    CFG_NTPSERVER,
+    CFG_NTPSERVER2,
+    CFG_NTPTIMEZONE,
+    CFG_IP,                 /* Optional static IP information (network byte order) */
+    CFG_GW,
+    CFG_NETMASK,
+    CFG_DNS1,
+    CFG_DNS2,
+    CFG_PERTRVSTATUS,       /* Publish retained status to a topic per TRV */
+    CFG_STATUSFORMAT,       /* STATUS_FORMAT_JSON, STATUS_FORMAT_CBOR or STATUS_FORMAT_BOTH */
+    CFG_KEYS
+} config_key;
+
+/* Load the cache - migrates the old connection info blob the first time */
+void config_init(void);
+
+const char *config_get_str(config_key key);
+int32_t config_get_int(config_key key);
+uint32_t config_get_u32(config_key key);
+
+/* Update the cache - returns true if the value changed */
+bool config_set_str(config_key key, const char *value);
+bool config_set_int(config_key key, int32_t value);
+bool config_set_u32(config_key key, uint32_t value);
+
+/* Write the changed settings to NVS - returns the number written or -1 */
+int config_commit(void);
+
+/* Room needed to hold every string setting */
+int config_text_size(void);
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * EQ-3 delta firmware updates.
+ *
+ * Applies a patch made by tools/mkdelta.py as it is received. The patch is
+ * a list of commands that copy runs of the running image and insert new
+ * bytes between them - firmware built from nearly the same source shares
+ * most of its bytes with the last build, shifted and with a few addresses
+ * changed, so the patch is a fraction of the size of the image.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+#include "mbedtls/sha256.h"
+
+#include "eq3_delta.h"
+
+#define DELTA_TAG "EQ3_DELTA"
+
+enum delta_state {
+    DELTA_HEADER,
+    DELTA_OP,                       /* Waiting for a command */
+    DELTA_ARG,                      /* Reading its argument */
+    DELTA_BYTES,                    /* Passing on DATA or REPLACE bytes */
+    DELTA_DONE,
+    DELTA_FAILED
+};
+
+struct delta {
+    enum delta_state state;
+    esp_ota_handle_t handle;
+    const esp_partition_t *source;
+    uint8_t header[DELTA_HEADER_LEN];
+    int headerlen;
+    uint32_t source_size;
+    uint32_t image_size;
+    uint32_t pos;                   /* Source position */
+    uint32_t written;               /* Image bytes written */
+    uint8_t op;
+    uint32_t arg;
+    int shift;
+    uint32_t remaining;             /* DATA or REPLACE bytes still to come */
+    const char *error;
+    uint8_t buf[DELTA_BUF_SIZE];
+};
+
+static uint32_t get32(const uint8_t *p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static esp_err_t delta_fail(struct delta *d, const char *why){
+    if(d->state != DELTA_FAILED){
+        ESP_LOGE(DELTA_TAG, "%s (at image offset %u)", why, d->written);
+        d->error = why;
+        d->state = DELTA_FAILED;
+    }
+    return ESP_FAIL;
+}
+
+/* sha256 of the first size bytes of a partition */
+static esp_err_t partition_sha256(struct delta *d, const esp_partition_t *part, uint32_t size, uint8_t *hash){
+    mbedtls_sha256_context ctx;
+    esp_err_t err = ESP_OK;
+    uint32_t n;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts_ret(&ctx, 0);
+    for(uint32_t off = 0; off < size && err == ESP_OK; off += n){
+        n = size - off < DELTA_BUF_SIZE ? size - off : DELTA_BUF_SIZE;
+        if((err = esp_partition_read(part, off, d->buf, n)) == ESP_OK)
+            mbedtls_sha256_update_ret(&ctx, d->buf, n);
+    }
+    mbedtls_sha256_finish_ret(&ctx, hash);
+    mbedtls_sha256_free(&ctx);
+    return err;
+}
+
+static esp_err_t delta_output(struct delta *d, const uint8_t *data, uint32_t len){
+    esp_err_t err;
+    if(len > d->image_size - d->written)
+        return delta_fail(d, "Patch builds a larger image than it says");
+    if((err = esp_ota_write(d->handle, data, len)) != ESP_OK)
+        return delta_fail(d, err == ESP_ERR_OTA_VALIDATE_FAILED ? "Not a firmware image" : "Flash write failed");
+    d->written += len;
+    return ESP_OK;
+}
+
+/* The whole header has arrived - check the patch is for the running image */
+static void delta_header(struct delta *d){
+    uint8_t hash[32];
+    d->source_size = get32(&d->header[8]);
+    d->image_size = get32(&d->header[44]);
+    if(get32(&d->header[4]) != DELTA_VERSION)
+        delta_fail(d, "Unsupported patch version");
+    else if(d->source_size > d->source->size)
+        delta_fail(d, "Patch is for a different firmware");
+    else if(partition_sha256(d, d->source, d->source_size, hash) != ESP_OK)
+        delta_fail(d, "Flash read failed");
+    else if(memcmp(hash, &d->header[12], sizeof(hash)) != 0)
+        delta_fail(d, "Patch is for a different firmware");
+    else
+        d->state = DELTA_OP;
+}
+
+/* A command and its argument have arrived */
+static void delta_command(struct delta *d){
+    uint32_t n;
+    int64_t pos;
+    d->state = DELTA_OP;
+    switch(d->op){
+        case DELTA_COPY:
+            if(d->arg > d->source_size - d->pos){
+                delta_fail(d, "Patch reads past the end of the running image");
+                break;
+            }
+            for(; d->arg > 0 && d->state != DELTA_FAILED; d->arg -= n){
+                n = d->arg < DELTA_BUF_SIZE ? d->arg : DELTA_BUF_SIZE;
+                if(esp_partition_read(d->source, d->pos, d->buf, n) != ESP_OK)
+                    delta_fail(d, "Flash read failed");
+                else
+                    delta_output(d, d->buf, n);
+                d->pos += n;
+            }
+            break;
+        case DELTA_REPLACE:
+            if(d->arg > d->source_size - d->pos){
+                delta_fail(d, "Patch reads past the end of the running image");
+                break;
+            }
+            d->pos += d->arg;
+            /* Fall through */
+        case DELTA_DATA:
+            d->remaining = d->arg;
+            if(d->remaining > 0)
+                d->state = DELTA_BYTES;
+            break;
+        case DELTA_SEEK:
+            pos = (int64_t)d->pos + ((int32_t)(d->arg >> 1) ^ -(int32_t)(d->arg & 1));
+            if(pos < 0 || pos > d->source_size)
+                delta_fail(d, "Patch reads past the end of the running image");
+            else
+                d->pos = (uint32_t)pos;
+            break;
+    }
+}
+
+bool delta_is_patch(const uint8_t *data, int len, uint32_t *image_size){
+    if(len < DELTA_HEADER_LEN || memcmp(data, DELTA_MAGIC, 4) != 0)
+        return false;
+    *image_size = get32(&data[44]);
+    return true;
+}
+
+struct delta *delta_begin(void){
+    struct delta *d = calloc(1, sizeof(struct delta));
+    if(d == NULL)
+        return NULL;
+    d->source = esp_ota_get_running_partition();
+    d->state = DELTA_HEADER;
+    return d;
+}
+
+void delta_set_output(struct delta *d, esp_ota_handle_t handle){
+    d->handle = handle;
+}
+
+esp_err_t delta_write(struct delta *d, const uint8_t *data, int len){
+    int used = 0, n;
+    uint8_t c;
+    while(used < len && d->state != DELTA_FAILED){
+        switch(d->state){
+            case DELTA_HEADER:
+                n = DELTA_HEADER_LEN - d->headerlen;
+                if(n > len - used)
+                    n = len - used;
+                memcpy(&d->header[d->headerlen], &data[used], n);
+                d->headerlen += n;
+                used += n;
+                if(d->headerlen == DELTA_HEADER_LEN)
+                    delta_header(d);
+                break;
+            case DELTA_OP:
+                d->op = data[used++];
+                d->arg = 0;
+                d->shift = 0;
+                if(d->op == DELTA_END)
+                    d->state = DELTA_DONE;
+                else if(d->op > DELTA_SEEK)
+                    delta_fail(d, "Not a valid patch");
+                else
+                    d->state = DELTA_ARG;
+                break;
+            case DELTA_ARG:
+                c = data[used++];
+                /* The argument is 32 bits - a fifth byte can only add the top 4 */
+                if(d->shift > 28 || (d->shift == 28 && (c & 0x70) != 0)){
+                    delta_fail(d, "Not a valid patch");
+                    break;
+                }
+                d->arg |= (uint32_t)(c & 0x7f) << d->shift;
+                d->shift += 7;
+                if((c & 0x80) == 0 && d->state != DELTA_FAILED)
+                    delta_command(d);
+                break;
+            case DELTA_BYTES:
+                n = d->remaining < (uint32_t)(len - used) ? (int)d->remaining : len - used;
+                if(delta_output(d, &data[used], n) == ESP_OK){
+                    used += n;
+                    if((d->remaining -= n) == 0)
+                        d->state = DELTA_OP;
+                }
+                break;
+            case DELTA_DONE:
+            default:
+                delta_fail(d, "Data after the end of the patch");
+                break;
+        }
+    }
+    return d->state == DELTA_FAILED ? ESP_FAIL : ESP_OK;
+}
+
+esp_err_t delta_finish(struct delta *d){
+    if(d->state == DELTA_FAILED)
+        return ESP_FAIL;
+    if(d->state != DELTA_DONE)
+        return delta_fail(d, "Patch incomplete");
+    if(d->written != d->image_size)
+        return delta_fail(d, "Patch builds a smaller image than it says");
+    return ESP_OK;
+}
+
+esp_err_t delta_verify(struct delta *d, const esp_partition_t *partition){
+    uint8_t hash[32];
+    if(partition_sha256(d, partition, d->image_size, hash) != ESP_OK)
+        return delta_fail(d, "Flash read failed");
+    if(memcmp(hash, &d->header[48], sizeof(hash)) != 0)
+        return delta_fail(d, "Patched image is not the one expected");
+    ESP_LOGI(DELTA_TAG, "Patched image checked - %u bytes", d->image_size);
+    return ESP_OK;
+}
+
+const char *delta_error(const struct delta *d){
+    return d->error;
+}
+
+void delta_free(struct delta *d){
+    free(d);
+}
@@ -0,0 +1,63 @@
+#ifndef EQ3_DELTA_H
+#define EQ3_DELTA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_ota_ops.h"
+
+/* Delta firmware updates
+ * A patch (made by tools/mkdelta.py) rebuilds the new image from the one that is running, so only
+ * the differences have to be uploaded. It is applied as it arrives: source bytes are read from the
+ * running partition a DELTA_BUF_SIZE block at a time and the result is passed to esp_ota_write(),
+ * so the RAM needed doesn't depend on the size of the image or the patch.
+ *
+ * Patch format (little endian)
+ *   "EQ3D", u32 version
+ *   u32 source size, u8[32] source sha256     the image the patch applies to
+ *   u32 image size,  u8[32] image sha256      the image it builds
+ * then commands - a byte followed (except for END) by an unsigned LEB128 argument n
+ *   COPY n      n bytes from the source position, which moves on by n
+ *   DATA n      the n bytes that follow
+ *   REPLACE n   the n bytes that follow, in place of the next n source bytes (the position moves on by n)
+ *   SEEK n      move the source position by n (zigzag encoded so it can go back)
+ *   END
+ * The source is checked before the update partition is erased and the image is read back and checked once it
+ * has been written, before it is made the boot image. */
+
+#define DELTA_MAGIC      "EQ3D"
+#define DELTA_VERSION    1
+#define DELTA_HEADER_LEN 80
+#define DELTA_BUF_SIZE   2048           /* Source read size */
+
+enum delta_command {
+    DELTA_END,
+    DELTA_COPY,
+    DELTA_DATA,
+    DELTA_REPLACE,
+    DELTA_SEEK
+};
+
+struct delta;
+
+/* True if data (the start of an upload) is a patch - image_size is set to the size of the image it builds */
+bool delta_is_patch(const uint8_t *data, int len, uint32_t *image_size);
+
+/* Start applying a patch to the running image - NULL if there is no memory. The header (the first
+ * DELTA_HEADER_LEN bytes) can be written before there is an output: it is checked against the
+ * running image as soon as it is complete, so a patch for other firmware fails before the update
+ * partition is erased */
+struct delta *delta_begin(void);
+/* Where the new image is written - set before anything after the header */
+void delta_set_output(struct delta *d, esp_ota_handle_t handle);
+/* The next part of the patch */
+esp_err_t delta_write(struct delta *d, const uint8_t *data, int len);
+/* The whole patch has been given - fails if it was cut short */
+esp_err_t delta_finish(struct delta *d);
+/* Check partition holds the image the patch describes (after esp_ota_end) */
+esp_err_t delta_verify(struct delta *d, const esp_partition_t *partition);
+/* Why delta_write, delta_finish or delta_verify failed */
+const char *delta_error(const struct delta *d);
+void delta_free(struct delta *d);
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * EQ-3 live events for the web interface.
+ *
+ * Events are formatted by the task that raises them and posted to the
+ * mongoose task (eq3_webtask) which sends them to every websocket client
+ * straight away. A browser that isn't keeping up misses events
+ * rather than holding an ever growing send buffer - it can fetch the
+ * current state from the json api and carry on.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_log.h"
+
+#include "eq3_events.h"
+#include "eq3_webtask.h"
+
+#define EVENTS_TAG "EQ3_EVENTS"
+
+#define EVENTS_MAX_CLIENTS 4
+#define EVENTS_SEND_MAX    4096     /* Events are skipped for a client with more than this unsent */
+
+/* Event posted to the mongoose task */
+struct events_msg {
+    uint16_t len;
+    char buf[];
+};
+
+static volatile int clients = 0;
+
+static void events_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data){
+    switch(ev){
+        case MG_EV_WS_OPEN:
+            clients++;
+            ESP_LOGI(EVENTS_TAG, "Event client connected (%d)", clients);
+            break;
+        case MG_EV_CLOSE:
+            if(c->is_websocket && clients > 0)
+                clients--;
+            break;
+        default:
+            /* Anything the browser sends is ignored */
+            break;
+    }
+}
+
+/* Runs in the mongoose task */
+static void events_send(struct mg_mgr *mgr, void *arg){
+    struct events_msg *msg = (struct events_msg *)arg;
+    for(struct mg_connection *client = mgr != NULL ? mgr->conns : NULL; client != NULL; client = client->next){
+        if(client->fn != events_cb || client->is_websocket == 0 || client->is_closing)
+            continue;
+        if(client->send.len <= EVENTS_SEND_MAX)
+            mg_ws_send(client, msg->buf, msg->len, WEBSOCKET_OP_TEXT);
+    }
+    free(msg);
+}
+
+void events_start(void){
+    clients = 0;
+}
+
+void events_stop(void){
+    clients = 0;
+}
+
+/* Take over an http connection for /ws */
+void events_upgrade(struct mg_connection *nc, struct mg_http_message *message){
+    if(clients >= EVENTS_MAX_CLIENTS){
+        mg_http_reply(nc, 503, "Content-Type: text/plain\r\n", "Too many event clients\n");
+        return;
+    }
+    nc->fn = events_cb;
+    nc->fn_data = NULL;
+    mg_ws_upgrade(nc, message, NULL);
+}
+
+bool events_wanted(void){
+    return clients > 0;
+}
+
+void events_push(const char *event, const char *data, int len){
+    struct events_msg *msg;
+    int msglen = len + strlen(event) + 24;     /* Room for the wrapper and terminator */
+    if(clients == 0 || (msg = malloc(sizeof(struct events_msg) + msglen)) == NULL)
+        return;
+    msg->len = snprintf(msg->buf, msglen, "{\"event\":\"%s\",\"data\":%.*s}", event, len, data);
+    if(webtask_post(events_send, msg) == false){
+        ESP_LOGE(EVENTS_TAG, "Dropped %s event", event);
+        free(msg);
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef EQ3_EVENTS_H
+#define EQ3_EVENTS_H
+
+#include <stdbool.h>
+#include "mongoose.h"
+
+/* Live events for the web interface
+ * Browsers open a websocket on /ws and are sent every TRV status report, command queue
+ * change and scan result as it happens as {"event":"<name>","data":<json>}. Other tasks
+ * hand events over with events_push() which posts them to the mongoose task. */
+
+/* Called from the mongoose task */
+void events_start(void);
+void events_stop(void);
+void events_upgrade(struct mg_connection *nc, struct mg_http_message *message);
+
+/* Is anyone listening - saves building events nobody will see (any task) */
+bool events_wanted(void);
+
+/* Send an event to the connected browsers - data is a json value (any task) */
+void events_push(const char *event, const char *data, int len);
+
+#endif
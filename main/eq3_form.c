@@ -0,0 +1,85 @@
+/*
+ * EQ-3 form and query string parser.
+ *
+ * Replaces looking each field up with mg_http_get_var(), which scans and
+ * decodes the text again for every field, with a single pass that leaves
+ * an index of decoded slices.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "eq3_form.h"
+
+static int hexval(char c){
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+int form_parse(struct form *form, char *text, size_t len){
+    char *p = text, *end = text + len;
+    form->count = 0;
+    while(p < end && form->count < FORM_FIELDS_MAX){
+        struct form_field *field = &form->fields[form->count];
+        /* Decoded characters are written back from the start of the field */
+        char *out = p;
+        int hi, lo;
+        if(*p == '&'){
+            p++;
+            continue;
+        }
+        field->name = mg_str_n(out, 0);
+        field->value = mg_str_n(NULL, 0);
+        for(; p < end && *p != '&'; p++){
+            if(*p == '=' && field->value.ptr == NULL){
+                field->name.len = out - field->name.ptr;
+                field->value.ptr = out;
+            }else if(*p == '+'){
+                *out++ = ' ';
+            }else if(*p == '%' && end - p > 2 && (hi = hexval(p[1])) >= 0 && (lo = hexval(p[2])) >= 0){
+                *out++ = (char)(hi << 4 | lo);
+                p += 2;
+            }else{
+                /* Including a % that doesn't start an escape */
+                *out++ = *p;
+            }
+        }
+        if(field->value.ptr == NULL){
+            field->name.len = out - field->name.ptr;
+            field->value.ptr = out;
+        }else{
+            field->value.len = out - field->value.ptr;
+        }
+        form->count++;
+    }
+    return form->count;
+}
+
+const struct mg_str *form_get(const struct form *form, const char *name){
+    size_t len = strlen(name);
+    for(int i = 0; i < form->count; i++){
+        if(form->fields[i].name.len == len && mg_ncasecmp(form->fields[i].name.ptr, name, len) == 0)
+            return &form->fields[i].value;
+    }
+    return NULL;
+}
+
+int form_get_str(const struct form *form, const char *name, char *buf, size_t size){
+    const struct mg_str *value = form_get(form, name);
+    size_t len;
+    buf[0] = 0;
+    if(value == NULL)
+        return -1;
+    len = value->len < size - 1 ? value->len : size - 1;
+    memcpy(buf, value->ptr, len);
+    buf[len] = 0;
+    return len < value->len ? -2 : (int)len;
+}
@@ -0,0 +1,34 @@
+#ifndef EQ3_FORM_H
+#define EQ3_FORM_H
+
+#include <stdbool.h>
+#include "mongoose.h"
+
+/* application/x-www-form-urlencoded forms and url query strings
+ * form_parse() splits the text into name/value slices in one pass, decoding + and %xx in place
+ * (the decoded text is never longer), so handlers look fields up without rescanning the text or
+ * allocating. The text is overwritten - parse a request's body or query once, when nothing else
+ * needs the raw text. Names are matched without regard to case and the first of a repeated name
+ * wins, as mg_http_get_var() does. Fields after the first FORM_FIELDS_MAX are ignored. */
+
+#define FORM_FIELDS_MAX 24                  /* The configuration form has 17 */
+
+struct form_field {
+    struct mg_str name;
+    struct mg_str value;                    /* Empty if the field has no = */
+};
+
+struct form {
+    int count;
+    struct form_field fields[FORM_FIELDS_MAX];
+};
+
+/* Split and decode text - returns the number of fields */
+int form_parse(struct form *form, char *text, size_t len);
+/* The value of a field - NULL if it isn't in the form */
+const struct mg_str *form_get(const struct form *form, const char *name);
+/* Copy a field into buf - returns its length, -1 (and buf is "") if it isn't in the form or -2 if it
+ * didn't fit (buf has as much as fits), as mg_http_get_var() fails on an over-long value */
+int form_get_str(const struct form *form, const char *name, char *buf, size_t size);
+
+#endif
@@ -42,6 +42,9 @@
 
 #include "eq3_wifi.h"
 #include "eq3_gap.h"
+#include "eq3_hubs.h"
+#include "eq3_trvs.h"
+#include "eq3_events.h"
 
 #define EQ3_DBG_TAG "EQ3_CTRL"
 
@@ -172,11 +175,19 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
                         if (strlen(remote_device_names[i]) == adv_name_len
                             && strncmp( (char *)adv_name, remote_device_names[i], adv_name_len) == 0)
                         {
+                            trv_seen(scan_result->scan_rst.bda, scan_result->scan_rst.rssi);
                             if(add_found_device(&scan_result->scan_rst.bda, scan_result->scan_rst.rssi) == 0){
                                 ESP_LOGI(EQ3_DBG_TAG, "Found device %s - rssi %d, ble_addr_type: %d", remote_device_names[i], scan_result->scan_rst.rssi
                                 		, scan_result->scan_rst.ble_addr_type
 										);
                                 esp_log_buffer_hex(EQ3_DBG_TAG, scan_result->scan_rst.bda, 6);
+                                if(events_wanted()){
+                                    uint8_t *bda = scan_result->scan_rst.bda;
+                                    char found[64];
+                                    int len = sprintf(found, "{\"bleaddr\":\"%02X:%02X:%02X:%02X:%02X:%02X\",\"rssi\":%d}",
+                                                      bda[0], bda[1], bda[2], bda[3], bda[4], bda[5], scan_result->scan_rst.rssi);
+                                    events_push("found", found, len);
+                                }
                             }
                         }
                     }
@@ -243,42 +254,40 @@ void start_scan(){
     gap_initialised = true;
     
     ret = esp_ble_gap_set_scan_params(&ble_scan_params);
+    events_push("scan", "{\"state\":\"started\"}", 19);
     
 }
 
-/* Scan complete */
+/* Scan complete - the device list is published from the registry so it includes every known TRV */
 static void scan_done(){
     ESP_LOGI(EQ3_DBG_TAG, "Scan complete\nDevices found:\n");
 
-    /* Yuck - magic numbers */
-    char *report = malloc((44 * num_devices) + 15);
-    int wridx = 12;
     struct found_device *devwalk = found_devices;
-    sprintf(report, "{\"devices\":[");
+    int found = 0;
     if(devwalk != NULL){
-        int devnum = 0;
         while(devwalk != NULL){
+            found++;
             ESP_LOGI(EQ3_DBG_TAG, "Device:");
             esp_log_buffer_hex(EQ3_DBG_TAG, devwalk->bda, 6);
             ESP_LOGI(EQ3_DBG_TAG, "rssi %d", devwalk->rssi);
-	
-            /* {"devices":[{"rssi":-123,"bleaddr":"00:00:00:00:00:00"},....]} */
-
-	    wridx += sprintf(&report[wridx], "{\"rssi\":%d,\"bleaddr\":\"%02X:%02X:%02X:%02X:%02X:%02X\"},", 
-                 devwalk->rssi, devwalk->bda[0], devwalk->bda[1], devwalk->bda[2], 
-                 devwalk->bda[3], devwalk->bda[4], devwalk->bda[5]);
-	
-	    devnum++;
+            hub_record_rssi((uint8_t *)devwalk->bda, devwalk->rssi);
             devwalk = devwalk->next;
         }
-        if(devnum > 0)
-            wridx--;
-        sprintf(&report[wridx], "]}");
-	    send_device_list(report);    
-        //free(report);
     }else{
         ESP_LOGI(EQ3_DBG_TAG, "None");
     }
+    if(events_wanted()){
+        char complete[40];
+        int len = sprintf(complete, "{\"state\":\"complete\",\"found\":%d}", found);
+        events_push("scan", complete, len);
+    }
+    if(trv_count() > 0){
+        char *report = trv_devlist();
+        if(report != NULL){
+            events_push("devices", report, strlen(report));
+            send_device_list(report);
+        }
+    }
 }
 
 /* Make the device list available to others */
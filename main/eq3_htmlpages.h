@@ -26,42 +26,12 @@ const char pageemptyfooter[] = "</div> \
 </body> \
 </html>";
 
-const char selectap[] = "<div style='text-align:center;'><h1>Select WiFi</h1></div> \
-<form action=\"configSubmit\" method=\"post\"> \
-<table style=\"margin:1em auto;\"> \
-<tbody> \
-<tr><td>SSID:</td><td><input type=\"text\" autocorrect=\"off\" autocapitalize=\"none\" name=\"ssid\" value=\"%s\" /></td></tr> \
-<tr><td>Password:</td><td><input type=\"password\" autocorrect=\"off\" autocapitalize=\"none\" name=\"password\" value=\"%s\" placeholder=\"hidden\" /></td></tr> \
-<tr><td>MQTT URL:</td><td><input type=\"text\" autocorrect=\"off\" autocapitalize=\"none\" name=\"mqtturl\" value=\"%s\" /></td></tr> \
-<tr><td>MQTT username:</td><td><input type=\"text\" autocorrect=\"off\" autocapitalize=\"none\" name=\"mqttuser\" value=\"%s\" /></td></tr> \
-<tr><td>MQTT password:</td><td><input type=\"password\" autocorrect=\"off\" autocapitalize=\"none\" name=\"mqttpass\" value=\"%s\" placeholder=\"hidden\" /></td></tr> \
-<tr><td>MQTT ID:</td><td><input type=\"text\" autocorrect=\"off\" autocapitalize=\"none\" name=\"mqttid\" value=\"%s\" /></td></tr> \
-<tr><td>NTP enabled:</td><td><input type=\"checkbox\" name=\"ntpenabled\" value=\"true\" %s/></td></tr> \
-<tr><td>NTP server 1:</td><td><input type=\"text\" autocorrect=\"off\" autocapitalize=\"none\" name=\"ntpserver1\" value=\"%s\" /></td></tr> \
-<tr><td>NTP server 2:</td><td><input type=\"text\" autocorrect=\"off\" autocapitalize=\"none\" name=\"ntpserver2\" value=\"%s\" /></td></tr> \
-<tr><td>Timezone:</td><td><input type=\"text\" autocorrect=\"off\" autocapitalize=\"none\" name=\"ntptimezone\" value=\"%s\" /></td></tr> \
-<tr><td>IP address:</td><td><input type=\"text\" autocorrect=\"off\" autocapitalize=\"none\" name=\"ip\" value=\"%s\" /></td></tr> \
-<tr><td>Gateway address:</td><td><input type=\"text\" autocorrect=\"off\" autocapitalize=\"none\" name=\"gw\" value=\"%s\" /></td></tr> \
-<tr><td>Netmask:</td><td><input type=\"text\" autocorrect=\"off\" autocapitalize=\"none\" name=\"netmask\" value=\"%s\" /></td></tr> \
-<tr><td>DNS server 1:</td><td><input type=\"text\" autocorrect=\"off\" autocapitalize=\"none\" name=\"dns1ip\" value=\"%s\" /></td></tr> \
-<tr><td>DNS server 2:</td><td><input type=\"text\" autocorrect=\"off\" autocapitalize=\"none\" name=\"dns2ip\" value=\"%s\" /></td></tr> \
-</tbody> \
-</table> \
- <p> \
-<div style='text-align:center;'><input type=\"submit\" value=\"Submit\"></div> \
-</p> \
-</form> \
-<div style=\"text-align:center;\"> \
-The IP address, gateway address and netmask are optional.  If not supplied \
-these values will be issued by the WiFi access point." ;
-
-
 const char devlisthead[] = "<title>EQ3 devices</title> \
 <div style='text-align:center;'><h1>EQ3 devices found</h1></div> \
 <table style=\"margin:1em auto;\"> \
 <tbody> ";
 
-const char devlistentry[] = "<tr><td>Device:</td><td>%02X:%02X:%02X:%02X:%02X:%02X</td><td>rssi</td><td>%d</td></tr>";
+const char devlistentry[] = "<tr><td>%s</td><td>%02X:%02X:%02X:%02X:%02X:%02X</td><td>rssi</td><td>%d</td><td>%s</td></tr>";
 
 const char devlistfoot[] = "</tbody> \
 </table>" ;
@@ -74,46 +44,29 @@ const char loglisthead[] = "<title>EQ3 device log</title> \
 <table style=\"margin:1em auto;\"> \
 <tbody> ";
 
-//const char loglistentry[] = "<tr><td>%s</td></tr>";
-
 const char loglistfoot[] = "</tbody> \
 </table>";
 
-const char connectedstatus[] = "<title>EQ3 status</title> \
-<div style='text-align:center;'><h1>EQ3 relay status</h1></div> \
-<table style=\"margin:1em auto;\"> \
-<tr><td>MQTT URL:</td><td>%s</td></tr> \
-<tr><td>MQTT ID:</td><td>%s</td></tr> \
-<tr><td>MQTT status:</td><td>%s</td></tr> \
-<tr><td>Uptime:</td><td>%d days %02d:%02d:%02d</td></tr> \
-</table>";
-
-const char apstatus[] = "<title>Please configure me</title> \
-<div style='text-align:center;'><h1>Please configure me</h1></div>";
-
-const char upload[] = "<title>upload firmware</title> \
-<div style='text-align:center;'><h1>Upload new software</h1></div> \
-<table style=\"margin:1em auto;\"><tr><td> \
-<form action=\"otaupload\" method=\"POST\" enctype=\"multipart/form-data\"> \
-</td></tr><tr><td> \
-<input type=\"file\" name=\"fileupload\" value=\"fileupload\" id=\"fileupload\"> \
-</td></tr><tr><td> \
-<input type=\"submit\" value=\"Upload and apply\"> \
-</td></tr> \
-</form>";
-
 const char uploadsuccess[] = "<title>uploaded firmware</title> \
 <div style='text-align:center;'> \
 <h1>Upload status</h1> \
 Firmware upload success \
-%d bytes transferred \
+<br>%u bytes transferred in %d.%d s (%d KB/s) \
+<br>Flash erase and write %d ms, upload paused %d ms (%d times) waiting for the flash \
 <br><a href=\"/restartnow\">Reboot ESP</a> to apply new image \
 </div>";
 
 const char uploadfailed[] = "<title>uploaded firmware</title> \
 <div style='text-align:center;'> \
 <h1>Upload status</h1> \
-Firmware upload failed \
+Firmware upload failed - %s \
+</div>";
+
+const char uploadrunning[] = "<meta http-equiv=\"refresh\" content=\"2;URL='/otastatus'\"> \
+<title>uploading firmware</title> \
+<div style='text-align:center;'> \
+<h1>Upload status</h1> \
+Firmware update in progress - %u bytes received \
 </div>";
 
 const char uploadcomplete[] = "<meta http-equiv=\"refresh\" content=\"1;URL='/otastatus'\"> \
@@ -0,0 +1,300 @@
+/*
+ * EQ-3 multi-hub support code.
+ *
+ * Hubs share the link quality they see to each TRV on a common mqtt topic
+ * and elect a single owner hub per TRV. Commands published to the shared
+ * command topic are only run by the owner. If the owner keeps failing to
+ * reach a TRV (or stops reporting) ownership moves to the next best hub.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "eq3_hubs.h"
+#include "eq3_wifi.h"
+
+#define HUB_TAG "EQ3_HUBS"
+
+#define HUB_MAX_LINKS         48     /* Link table entries shared between all hubs */
+#define HUB_ID_LEN            32
+#define HUB_RSSI_UNKNOWN      -127
+#define HUB_FAILOVER_STREAK   3      /* Consecutive failures before a hub loses ownership */
+#define HUB_FAILOVER_RETRY_S  600    /* A hub that lost ownership is allowed to try again after this */
+#define HUB_RESULT_WINDOW     32     /* Success/fail counters are halved when they reach this */
+#define HUB_REPORT_INTERVAL_S 300    /* Republish our link reports this often */
+#define HUB_REPORT_TTL_S      (3 * HUB_REPORT_INTERVAL_S) /* Forget hubs that stop reporting */
+
+#define US_PER_S 1000000LL
+
+struct hub_link {
+    bool used;
+    bool local;                 /* Link from this hub */
+    char hub[HUB_ID_LEN];       /* Reporting hub (remote links only) */
+    esp_bd_addr_t bda;
+    int rssi;
+    uint16_t ok;
+    uint16_t fail;
+    uint16_t streak;            /* Consecutive failures */
+    int64_t failed;             /* Time of last failure (local links only) */
+    int64_t seen;               /* Time of last report */
+};
+
+static struct hub_link links[HUB_MAX_LINKS];
+static SemaphoreHandle_t hub_lock = NULL;
+static char myid[HUB_ID_LEN] = {0};
+static int64_t last_publish = 0;
+
+void hub_init(void){
+    memset(links, 0, sizeof(links));
+    if(hub_lock == NULL)
+        hub_lock = xSemaphoreCreateMutex();
+}
+
+void hub_set_id(const char *hubid){
+    strncpy(myid, hubid, HUB_ID_LEN - 1);
+    myid[HUB_ID_LEN - 1] = 0;
+}
+
+/* Find the link entry for a hub/TRV pair - allocate one if needed (call with hub_lock held) */
+static struct hub_link *find_link(esp_bd_addr_t bda, bool local, const char *hub, bool create){
+    struct hub_link *freeslot = NULL, *oldest = NULL;
+    for(int i = 0; i < HUB_MAX_LINKS; i++){
+        struct hub_link *l = &links[i];
+        if(l->used == false){
+            if(freeslot == NULL)
+                freeslot = l;
+            continue;
+        }
+        if(memcmp(l->bda, bda, sizeof(esp_bd_addr_t)) == 0 && l->local == local && (local || strcmp(l->hub, hub) == 0))
+            return l;
+        /* Prefer to evict the stalest remote link */
+        if(oldest == NULL || (oldest->local && !l->local) || (oldest->local == l->local && l->seen < oldest->seen))
+            oldest = l;
+    }
+    if(create == false)
+        return NULL;
+    if(freeslot == NULL)
+        freeslot = oldest;
+    memset(freeslot, 0, sizeof(struct hub_link));
+    freeslot->used = true;
+    freeslot->local = local;
+    freeslot->rssi = HUB_RSSI_UNKNOWN;
+    memcpy(freeslot->bda, bda, sizeof(esp_bd_addr_t));
+    if(!local)
+        strncpy(freeslot->hub, hub, HUB_ID_LEN - 1);
+    return freeslot;
+}
+
+/* Publish the report for one of our links */
+static void publish_link(struct hub_link *l){
+    char report[140];
+    if(myid[0] == 0)
+        return;
+    snprintf(report, sizeof(report), "{\"hub\":\"%s\",\"trv\":\"%02X:%02X:%02X:%02X:%02X:%02X\",\"rssi\":%d,\"ok\":%u,\"fail\":%u,\"streak\":%u}",
+             myid, l->bda[0], l->bda[1], l->bda[2], l->bda[3], l->bda[4], l->bda[5], l->rssi, l->ok, l->fail, l->streak);
+    send_hub_report(report);
+}
+
+void hub_record_rssi(esp_bd_addr_t bda, int rssi){
+    struct hub_link snapshot;
+    if(hub_lock == NULL)
+        return;
+    xSemaphoreTake(hub_lock, portMAX_DELAY);
+    struct hub_link *l = find_link(bda, true, NULL, true);
+    l->rssi = rssi;
+    l->seen = esp_timer_get_time();
+    snapshot = *l;
+    xSemaphoreGive(hub_lock);
+    /* Never publish with hub_lock held - the mqtt task takes it to deliver reports */
+    publish_link(&snapshot);
+}
+
+void hub_record_result(esp_bd_addr_t bda, bool success){
+    struct hub_link snapshot;
+    if(hub_lock == NULL)
+        return;
+    xSemaphoreTake(hub_lock, portMAX_DELAY);
+    struct hub_link *l = find_link(bda, true, NULL, true);
+    if(success){
+        l->ok++;
+        l->streak = 0;
+    }else{
+        l->fail++;
+        l->streak++;
+        l->failed = esp_timer_get_time();
+    }
+    /* Age the counters so the success rate follows recent behaviour */
+    if(l->ok + l->fail >= HUB_RESULT_WINDOW){
+        l->ok >>= 1;
+        l->fail >>= 1;
+    }
+    l->seen = esp_timer_get_time();
+    snapshot = *l;
+    xSemaphoreGive(hub_lock);
+    publish_link(&snapshot);
+}
+
+/* Minimal json field extraction for the flat link report */
+static const char *json_field(const char *json, const char *key){
+    char pattern[16];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *val = strstr(json, pattern);
+    return val == NULL ? NULL : val + strlen(pattern);
+}
+
+static bool json_str(const char *json, const char *key, char *out, int outlen){
+    const char *val = json_field(json, key);
+    int idx = 0;
+    if(val == NULL || *val++ != '"')
+        return false;
+    while(*val != '"' && *val != 0 && idx < outlen - 1)
+        out[idx++] = *val++;
+    out[idx] = 0;
+    return *val == '"';
+}
+
+static int json_int(const char *json, const char *key, int defval){
+    const char *val = json_field(json, key);
+    return val == NULL ? defval : (int)strtol(val, NULL, 10);
+}
+
+/* Parse a bluetooth address from the start of a command/report string */
+static bool parse_bda(const char *str, esp_bd_addr_t bda){
+    char *endptr = (char *)str;
+    for(int adidx = 0; adidx < ESP_BD_ADDR_LEN; adidx++){
+        while(*endptr != 0 && !isxdigit((int)*endptr))
+            endptr++;
+        if(*endptr == 0)
+            return false;
+        bda[adidx] = strtol(endptr, &endptr, 16);
+    }
+    return true;
+}
+
+void hub_handle_report(const char *report, int len){
+    char buf[160];
+    char hub[HUB_ID_LEN], trv[20];
+    esp_bd_addr_t bda;
+
+    if(hub_lock == NULL || len <= 0 || len >= sizeof(buf))
+        return;
+    memcpy(buf, report, len);
+    buf[len] = 0;
+    if(json_str(buf, "hub", hub, sizeof(hub)) == false || json_str(buf, "trv", trv, sizeof(trv)) == false || parse_bda(trv, bda) == false){
+        ESP_LOGI(HUB_TAG, "Ignoring malformed hub report");
+        return;
+    }
+    /* Our own reports come back to us through the shared subscription */
+    if(strcmp(hub, myid) == 0)
+        return;
+
+    xSemaphoreTake(hub_lock, portMAX_DELAY);
+    struct hub_link *l = find_link(bda, false, hub, true);
+    l->rssi = json_int(buf, "rssi", HUB_RSSI_UNKNOWN);
+    l->ok = json_int(buf, "ok", 0);
+    l->fail = json_int(buf, "fail", 0);
+    l->streak = json_int(buf, "streak", 0);
+    l->seen = esp_timer_get_time();
+    xSemaphoreGive(hub_lock);
+}
+
+void hub_publish_all(void){
+    struct hub_link snapshot;
+    if(hub_lock == NULL)
+        return;
+    xSemaphoreTake(hub_lock, portMAX_DELAY);
+    last_publish = esp_timer_get_time();
+    xSemaphoreGive(hub_lock);
+    /* One link at a time - a copy of the whole table is too big for the stacks this runs on */
+    for(int i = 0; i < HUB_MAX_LINKS; i++){
+        xSemaphoreTake(hub_lock, portMAX_DELAY);
+        snapshot = links[i];
+        xSemaphoreGive(hub_lock);
+        if(snapshot.used && snapshot.local)
+            publish_link(&snapshot);
+    }
+}
+
+/* Link score - rssi penalised by failure rate (50% failures costs 25dB) */
+static int link_score(const struct hub_link *l){
+    int total = l->ok + l->fail;
+    int rate = total == 0 ? 100 : (l->ok * 100) / total;
+    return l->rssi + (rate - 100) / 2;
+}
+
+static const char *link_hub(const struct hub_link *l){
+    return l->local ? myid : l->hub;
+}
+
+bool hub_owns_command(const char *cmdstr){
+    esp_bd_addr_t bda;
+    struct hub_link *best = NULL;
+    bool owner;
+    int64_t now = esp_timer_get_time();
+
+    if(hub_lock == NULL || parse_bda(cmdstr, bda) == false)
+        return false;
+
+    xSemaphoreTake(hub_lock, portMAX_DELAY);
+    /* First pass skips hubs with a failure streak (failover), second pass accepts them if no other hub can reach the TRV */
+    for(int pass = 0; pass < 2 && best == NULL; pass++){
+        for(int i = 0; i < HUB_MAX_LINKS; i++){
+            struct hub_link *l = &links[i];
+            if(l->used == false || memcmp(l->bda, bda, sizeof(esp_bd_addr_t)) != 0)
+                continue;
+            if(l->local == false && now - l->seen > HUB_REPORT_TTL_S * US_PER_S)
+                continue;
+            if(pass == 0 && l->streak >= HUB_FAILOVER_STREAK)
+                continue;
+            if(best == NULL || link_score(l) > link_score(best) ||
+               (link_score(l) == link_score(best) && strcmp(link_hub(l), link_hub(best)) < 0))
+                best = l;
+        }
+    }
+    owner = best != NULL && best->local;
+    if(best == NULL)
+        ESP_LOGI(HUB_TAG, "No hub has reported this TRV - ignoring shared command");
+    else
+        ESP_LOGI(HUB_TAG, "Owner hub for shared command is %s", link_hub(best));
+    xSemaphoreGive(hub_lock);
+    return owner;
+}
+
+/* A hub that lost ownership of a TRV runs no more commands for it, so nothing would ever clear
+ * its streak. Once it has been quiet for a while clear the streak and publish, so every hub
+ * hands ownership back and the link gets another try. */
+static void retry_failed_links(void){
+    struct hub_link snapshot;
+    bool retry;
+    int64_t now = esp_timer_get_time();
+    for(int i = 0; i < HUB_MAX_LINKS; i++){
+        xSemaphoreTake(hub_lock, portMAX_DELAY);
+        struct hub_link *l = &links[i];
+        retry = l->used && l->local && l->streak >= HUB_FAILOVER_STREAK && now - l->failed > HUB_FAILOVER_RETRY_S * US_PER_S;
+        if(retry){
+            l->streak = 0;
+            snapshot = *l;
+        }
+        xSemaphoreGive(hub_lock);
+        if(retry){
+            ESP_LOGI(HUB_TAG, "Retrying a TRV link after failover");
+            publish_link(&snapshot);
+        }
+    }
+}
+
+void hub_poll(void){
+    if(hub_lock == NULL)
+        return;
+    retry_failed_links();
+    if(myid[0] != 0 && esp_timer_get_time() - last_publish > HUB_REPORT_INTERVAL_S * US_PER_S)
+        hub_publish_all();
+}
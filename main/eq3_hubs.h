@@ -0,0 +1,31 @@
+
+#ifndef EQ3_HUBS_H
+#define EQ3_HUBS_H
+
+#include "esp_bt_defs.h"
+
+/* Multi-hub TRV ownership
+ * Each hub publishes the link quality it has to every TRV it can reach on the shared topic.
+ * All hubs see the same reports so all hubs elect the same owner for each TRV and only
+ * the owner executes commands published to the shared command topic. */
+
+void hub_init(void);
+void hub_set_id(const char *hubid);
+
+/* Local link quality updates */
+void hub_record_rssi(esp_bd_addr_t bda, int rssi);
+void hub_record_result(esp_bd_addr_t bda, bool success);
+
+/* A link report published by any hub (including this one) */
+void hub_handle_report(const char *report, int len);
+
+/* Republish all local link reports (on connect and when another hub asks for sync) */
+void hub_publish_all(void);
+
+/* Is this hub the elected owner of the TRV addressed by a command string */
+bool hub_owns_command(const char *cmdstr);
+
+/* Called from the main loop for periodic re-publishing */
+void hub_poll(void);
+
+#endif
@@ -0,0 +1,396 @@
+/*
+ * EQ-3 event journal.
+ *
+ * Fixed size binary records are written one after the other to the journal
+ * partition. Record n (its sequence number) always lives in slot
+ * n % slots, so the partition is a circular log: a sector is erased just
+ * before the first record is written to it, dropping the oldest sector of
+ * history, and every sector is erased once per trip round the partition.
+ * At boot the newest sector is found from the first record of each sector.
+ * Records are added from the ble callbacks, which mustn't wait for a sector
+ * erase, so they are queued and written from the main loop.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+
+#include "eq3_journal.h"
+#include "eq3_main.h"
+#include "eq3_trvs.h"
+#include "eq3_wifi.h"
+
+#define JOURNAL_TAG "EQ3_JOURNAL"
+
+#define SECTOR_SIZE      4096
+#define RECS_PER_SECTOR  (SECTOR_SIZE / sizeof(struct journal_rec))
+#define EMPTY_SEQ        0xffffffff
+#define CHECK_SEED       0x5a
+#define SCAN_BATCH       256        /* Records examined per journal_query_read() */
+#define POLL_READS       4          /* journal_query_read() calls per mqtt batch from journal_poll() */
+#define QUEUE_LEN        16         /* Records waiting to be written */
+#define MQTT_BATCH_LEN   1536       /* Largest mqtt journal message */
+
+/* Times before 2019 mean the clock hasn't been set */
+#define VALID_TIME       1546300800
+
+/* Result codes - the error reports a command can end with */
+#define RESULT_OK        0
+#define RESULT_OTHER     0xff
+static const char *results[] = {
+    "ok",
+    "TRV not available",
+    "TRV error",
+    "Not an EQ-3",
+    "EQ-3 notify error",
+    "Unable to write to EQ-3",
+    "Device unavailable",
+    "BLE system failure",
+};
+
+/* 32 bytes so a sector holds a whole number of records */
+struct journal_rec {
+    uint32_t seq;               /* EMPTY_SEQ in an erased slot */
+    uint32_t time;              /* 0 if the time wasn't known */
+    uint8_t bda[6];
+    uint8_t cmd;                /* JOURNAL_NO_CMD for a status without a command */
+    uint8_t param;
+    uint8_t result;
+    uint8_t attempts;
+    uint8_t temp_x2;            /* 0 if the TRV didn't report its state */
+    int8_t offset_x2;
+    uint8_t valve;
+    uint8_t flags;
+    uint16_t wait_ms;
+    uint16_t exec_ms;
+    uint8_t reserved[5];
+    uint8_t check;              /* Xor of the other bytes - catches records torn by a reset */
+};
+
+static const esp_partition_t *journal_part = NULL;
+static SemaphoreHandle_t journal_lock = NULL;
+static QueueHandle_t journal_queue = NULL;
+static uint32_t slots = 0;
+static uint32_t oldest_seq = 0;     /* Oldest record still in flash */
+static uint32_t next_seq = 0;       /* Sequence number of the next record written */
+
+/* Query from mqtt - run a batch at a time by journal_poll() */
+static struct journal_query mqtt_query;
+static bool mqtt_query_active = false;
+static int mqtt_query_id = 0;       /* Changes when a new query replaces the running one */
+
+static uint8_t rec_check(const struct journal_rec *rec){
+    const uint8_t *bytes = (const uint8_t *)rec;
+    uint8_t check = CHECK_SEED;
+    for(int idx = 0; idx < offsetof(struct journal_rec, check); idx++)
+        check ^= bytes[idx];
+    return check;
+}
+
+static size_t slot_offset(uint32_t seq){
+    return (seq % slots) * sizeof(struct journal_rec);
+}
+
+void journal_init(void){
+    uint32_t sectors, newest = EMPTY_SEQ, newest_sector = 0;
+    bool found = false;
+
+    if(journal_lock == NULL)
+        journal_lock = xSemaphoreCreateMutex();
+    if(journal_queue == NULL)
+        journal_queue = xQueueCreate(QUEUE_LEN, sizeof(struct journal_rec));
+    journal_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "journal");
+    if(journal_part == NULL){
+        ESP_LOGI(JOURNAL_TAG, "No journal partition - events are not journalled");
+        return;
+    }
+    sectors = journal_part->size / SECTOR_SIZE;
+    slots = sectors * RECS_PER_SECTOR;
+
+    /* The newest sector starts with the highest sequence number, the oldest with the lowest */
+    for(uint32_t sector = 0; sector < sectors; sector++){
+        uint32_t seq;
+        if(esp_partition_read(journal_part, sector * SECTOR_SIZE, &seq, sizeof(seq)) != ESP_OK || seq == EMPTY_SEQ)
+            continue;
+        /* A record in the wrong place (torn first write or a resized partition) - the sector is unusable */
+        if(seq % slots != sector * RECS_PER_SECTOR){
+            ESP_LOGE(JOURNAL_TAG, "Journal sector %u invalid - erasing", (unsigned)sector);
+            esp_partition_erase_range(journal_part, sector * SECTOR_SIZE, SECTOR_SIZE);
+            continue;
+        }
+        if(found == false || seq < oldest_seq)
+            oldest_seq = seq;
+        if(found == false || seq > newest){
+            newest = seq;
+            newest_sector = sector;
+        }
+        found = true;
+    }
+    if(found == false){
+        oldest_seq = next_seq = 0;
+    }else{
+        /* Carry on after the last used slot of the newest sector */
+        uint32_t used;
+        for(used = 1; used < RECS_PER_SECTOR; used++){
+            uint32_t seq;
+            if(esp_partition_read(journal_part, newest_sector * SECTOR_SIZE + used * sizeof(struct journal_rec), &seq, sizeof(seq)) != ESP_OK || seq == EMPTY_SEQ)
+                break;
+        }
+        next_seq = newest + used;
+    }
+    ESP_LOGI(JOURNAL_TAG, "Journal holds records %u to %u (%u slots)", (unsigned)oldest_seq, (unsigned)next_seq, (unsigned)slots);
+}
+
+void journal_add(const struct journal_event *event){
+    struct journal_rec rec;
+    time_t now = 0;
+
+    if(journal_part == NULL || journal_queue == NULL)
+        return;
+    time(&now);
+    memset(&rec, 0, sizeof(rec));
+    rec.time = now > VALID_TIME ? (uint32_t)now : 0;
+    memcpy(rec.bda, event->bda, sizeof(rec.bda));
+    rec.cmd = event->cmd;
+    rec.param = event->param;
+    rec.attempts = event->attempts;
+    rec.result = RESULT_OK;
+    if(event->error != NULL){
+        rec.result = RESULT_OTHER;
+        for(int idx = 1; idx < sizeof(results) / sizeof(results[0]); idx++){
+            if(strcmp(event->error, results[idx]) == 0)
+                rec.result = idx;
+        }
+    }
+    if(event->has_state == true){
+        rec.temp_x2 = event->temp_x2;
+        rec.offset_x2 = event->offset_x2;
+        rec.valve = event->valve;
+        rec.flags = event->flags;
+    }
+    rec.wait_ms = event->wait_ms > 0xffff ? 0xffff : event->wait_ms;
+    rec.exec_ms = event->exec_ms > 0xffff ? 0xffff : event->exec_ms;
+    if(xQueueSend(journal_queue, &rec, 0) != pdTRUE)
+        ESP_LOGE(JOURNAL_TAG, "Journal queue full - record dropped");
+}
+
+/* Write a queued record - can erase a sector (main loop) */
+static void journal_write(struct journal_rec *rec){
+    size_t offset;
+
+    xSemaphoreTake(journal_lock, portMAX_DELAY);
+    offset = slot_offset(next_seq);
+    if(offset % SECTOR_SIZE == 0){
+        /* Starting a sector - it holds the oldest records if the journal has wrapped */
+        if(esp_partition_erase_range(journal_part, offset, SECTOR_SIZE) != ESP_OK){
+            ESP_LOGE(JOURNAL_TAG, "Journal erase failed");
+            xSemaphoreGive(journal_lock);
+            return;
+        }
+        if(next_seq >= slots && next_seq - slots + RECS_PER_SECTOR > oldest_seq)
+            oldest_seq = next_seq - slots + RECS_PER_SECTOR;
+    }
+    rec->seq = next_seq;
+    rec->check = rec_check(rec);
+    if(esp_partition_write(journal_part, offset, rec, sizeof(struct journal_rec)) != ESP_OK)
+        ESP_LOGE(JOURNAL_TAG, "Journal write failed");
+    /* The slot is used even if the write failed */
+    next_seq++;
+    xSemaphoreGive(journal_lock);
+}
+
+/* Parse an unsigned decimal value */
+static bool parse_u32(const char *str, int len, uint32_t *value){
+    uint32_t result = 0;
+    if(len == 0 || len > 10)
+        return false;
+    for(int idx = 0; idx < len; idx++){
+        if(!isdigit((int)str[idx]))
+            return false;
+        result = result * 10 + (str[idx] - '0');
+    }
+    *value = result;
+    return true;
+}
+
+bool journal_query_parse(struct journal_query *query, const char *args, int len){
+    int pos = 0;
+
+    memset(query, 0, sizeof(struct journal_query));
+    while(pos < len){
+        int start, keylen, vallen;
+        const char *value;
+        uint32_t number;
+
+        while(pos < len && (args[pos] == ' ' || args[pos] == '&'))
+            pos++;
+        start = pos;
+        while(pos < len && args[pos] != ' ' && args[pos] != '&')
+            pos++;
+        if(pos == start)
+            break;
+        for(keylen = 0; start + keylen < pos && args[start + keylen] != '='; keylen++)
+            ;
+        if(start + keylen == pos)
+            return false;
+        value = &args[start + keylen + 1];
+        vallen = pos - start - keylen - 1;
+
+        if(keylen == 3 && strncmp(&args[start], "trv", 3) == 0){
+            if(trv_parse(value, vallen, query->bda) == false)
+                return false;
+            query->by_trv = true;
+        }else if(parse_u32(value, vallen, &number) == false){
+            return false;
+        }else if(keylen == 4 && strncmp(&args[start], "from", 4) == 0){
+            query->from = number;
+        }else if(keylen == 2 && strncmp(&args[start], "to", 2) == 0){
+            query->to = number;
+        }else if(keylen == 5 && strncmp(&args[start], "after", 5) == 0){
+            query->next = number + 1;
+        }else if(keylen == 5 && strncmp(&args[start], "limit", 5) == 0){
+            query->limit = number;
+        }else{
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool rec_matches(const struct journal_query *query, const struct journal_rec *rec){
+    if(query->by_trv == true && memcmp(rec->bda, query->bda, sizeof(rec->bda)) != 0)
+        return false;
+    /* Records from before the time was known can't be placed in a time range */
+    if((query->from != 0 || query->to != 0) && rec->time == 0)
+        return false;
+    if(query->from != 0 && rec->time < query->from)
+        return false;
+    if(query->to != 0 && rec->time > query->to)
+        return false;
+    return true;
+}
+
+static int sprint_half(char *str, int x2){
+    return sprintf(str, "%s%d.%d", x2 < 0 ? "-" : "", abs(x2) >> 1, (abs(x2) & 0x01) ? 5 : 0);
+}
+
+static int format_rec(char *buf, const struct journal_rec *rec){
+    int idx = 0;
+    idx += sprintf(&buf[idx], "{\"seq\":%u,\"time\":%u,\"trv\":\"%02X:%02X:%02X:%02X:%02X:%02X\"", (unsigned)rec->seq, (unsigned)rec->time,
+                   rec->bda[0], rec->bda[1], rec->bda[2], rec->bda[3], rec->bda[4], rec->bda[5]);
+    if(eq3_command_name(rec->cmd) != NULL)
+        idx += sprintf(&buf[idx], ",\"cmd\":\"%s\",\"param\":%d,\"attempts\":%d", eq3_command_name(rec->cmd), rec->param, rec->attempts);
+    idx += sprintf(&buf[idx], ",\"result\":\"%s\"", rec->result < sizeof(results) / sizeof(results[0]) ? results[rec->result] : "error");
+    idx += sprintf(&buf[idx], ",\"wait_ms\":%d,\"exec_ms\":%d", rec->wait_ms, rec->exec_ms);
+    if(rec->temp_x2 != 0){
+        idx += sprintf(&buf[idx], ",\"temp\":\"");
+        idx += sprint_half(&buf[idx], rec->temp_x2);
+        idx += sprintf(&buf[idx], "\",\"offsetTemp\":\"");
+        idx += sprint_half(&buf[idx], rec->offset_x2);
+        idx += sprintf(&buf[idx], "\",\"valve\":%d", rec->valve);
+        idx += sprintf(&buf[idx], ",\"mode\":\"%s\"", (rec->flags & MANUAL) ? "manual" : (rec->flags & AWAY) ? "holiday" : "auto");
+        idx += sprintf(&buf[idx], ",\"boost\":%s,\"window\":%s,\"locked\":%s", (rec->flags & BOOST) ? "true" : "false",
+                       (rec->flags & WINDOW) ? "true" : "false", (rec->flags & LOCKED) ? "true" : "false");
+        idx += sprintf(&buf[idx], ",\"battery\":\"%s\"", (rec->flags & LOW_BATTERY) ? "LOW" : "GOOD");
+    }
+    idx += sprintf(&buf[idx], "}");
+    return idx;
+}
+
+int journal_query_read(struct journal_query *query, char *buf, int size){
+    char entry[JOURNAL_JSON_MAX];
+    int len = 0;
+
+    if(journal_part == NULL){
+        query->done = true;
+        return 0;
+    }
+    xSemaphoreTake(journal_lock, portMAX_DELAY);
+    /* Anything older has been overwritten */
+    if(query->next < oldest_seq)
+        query->next = oldest_seq;
+    for(int examined = 0; examined < SCAN_BATCH && query->next < next_seq; examined++){
+        struct journal_rec rec;
+        if(query->limit != 0 && query->count >= query->limit)
+            break;
+        if(esp_partition_read(journal_part, slot_offset(query->next), &rec, sizeof(rec)) == ESP_OK &&
+           rec.seq == query->next && rec.check == rec_check(&rec) && rec_matches(query, &rec)){
+            int entrylen = format_rec(entry, &rec);
+            /* No room - the record is picked up by the next call */
+            if(len + entrylen + 1 >= size)
+                break;
+            if(query->comma == true)
+                buf[len++] = ',';
+            query->comma = true;
+            query->count++;
+            memcpy(&buf[len], entry, entrylen);
+            len += entrylen;
+        }
+        query->next++;
+    }
+    query->done = query->next >= next_seq || (query->limit != 0 && query->count >= query->limit);
+    xSemaphoreGive(journal_lock);
+    buf[len] = 0;
+    return len;
+}
+
+bool journal_mqtt_request(const char *args, int len){
+    if(journal_lock == NULL)
+        return false;
+    /* A new query replaces one that is still running */
+    xSemaphoreTake(journal_lock, portMAX_DELAY);
+    mqtt_query_active = journal_query_parse(&mqtt_query, args, len);
+    mqtt_query_id++;
+    xSemaphoreGive(journal_lock);
+    return mqtt_query_active;
+}
+
+/* Write the queued records, then publish the next batch of an mqtt query - {"records":[...],"more":true} until the last batch */
+void journal_poll(void){
+    struct journal_rec rec;
+    struct journal_query query;
+    char *report;
+    int idx = 0, start, id;
+
+    while(journal_queue != NULL && xQueueReceive(journal_queue, &rec, 0) == pdTRUE)
+        journal_write(&rec);
+    if(mqtt_query_active == false)
+        return;
+    if((report = malloc(MQTT_BATCH_LEN)) == NULL)
+        return;
+    xSemaphoreTake(journal_lock, portMAX_DELAY);
+    query = mqtt_query;
+    id = mqtt_query_id;
+    xSemaphoreGive(journal_lock);
+
+    /* Each batch is a json document of its own */
+    query.comma = false;
+    idx += sprintf(&report[idx], "{\"records\":[");
+    start = idx;
+    /* Keep reading until the batch has something in it or the query is finished - a query that matches
+     * little carries on next time round the main loop rather than scanning the whole journal now */
+    for(int reads = 0; reads < POLL_READS && idx == start && query.done == false; reads++)
+        idx += journal_query_read(&query, &report[idx], MQTT_BATCH_LEN - idx - 20);
+    sprintf(&report[idx], "],\"more\":%s}", query.done ? "false" : "true");
+
+    xSemaphoreTake(journal_lock, portMAX_DELAY);
+    if(id == mqtt_query_id){
+        mqtt_query = query;
+        if(query.done == true)
+            mqtt_query_active = false;
+    }
+    xSemaphoreGive(journal_lock);
+    if(idx > start || query.done == true)
+        send_journal(report);
+    free(report);
+}
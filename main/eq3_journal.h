@@ -0,0 +1,67 @@
+#ifndef EQ3_JOURNAL_H
+#define EQ3_JOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_bt_defs.h"
+
+/* Event journal
+ * The outcome of every TRV command (and any status a TRV reports) is appended as a compact
+ * binary record to the journal flash partition, which is used as a circular log so weeks of
+ * valve history survive reboots. Records are queried by time range and/or TRV over http
+ * (/journal) and mqtt (<intopicbase>/journal -> <outtopicbase>/journal) and streamed as json. */
+
+#define JOURNAL_NO_CMD 0xff
+
+/* A command outcome to record */
+struct journal_event {
+    esp_bd_addr_t bda;
+    uint8_t cmd;                /* Command (eq3_bt_cmd) or JOURNAL_NO_CMD */
+    uint8_t param;              /* First parameter byte of the command */
+    uint8_t attempts;           /* Attempts made (including this one) */
+    const char *error;          /* Error report or NULL if the command succeeded */
+    bool has_state;             /* The TRV reported its state */
+    uint8_t temp_x2;
+    int8_t offset_x2;
+    uint8_t valve;
+    uint8_t flags;
+    int wait_ms;                /* Time queued */
+    int exec_ms;                /* Time from the first attempt */
+};
+
+/* Query cursor - records are returned oldest first */
+struct journal_query {
+    uint32_t from;              /* Time range (0 for open ended) */
+    uint32_t to;
+    uint32_t next;              /* Sequence number of the next record to examine */
+    bool by_trv;
+    esp_bd_addr_t bda;
+    int limit;                  /* Most records to return (0 for no limit) */
+    int count;                  /* Records returned so far */
+    bool comma;                 /* Separate the next record from the output before it */
+    bool done;
+};
+
+void journal_init(void);
+/* Queue a record - it is written by journal_poll() as writing can erase a sector (any task) */
+void journal_add(const struct journal_event *event);
+
+/* Set up a query from "trv=<address or name> from=<time> to=<time> after=<seq> limit=<n>"
+ * (any order, all optional, separated by spaces or '&'). Returns false if it is invalid */
+bool journal_query_parse(struct journal_query *query, const char *args, int len);
+
+/* Format the next matching records as comma separated json objects - the caller supplies the
+ * enclosing array (and clears query->comma to start a new one). Only a bounded number of records
+ * is examined per call so call again until query->done is set - the result can be empty before
+ * then. Returns the length written */
+int journal_query_read(struct journal_query *query, char *buf, int size);
+
+/* Worst case length of one formatted record */
+#define JOURNAL_JSON_MAX 400
+
+/* Mqtt query - the records are published in batches from journal_poll() */
+bool journal_mqtt_request(const char *args, int len);
+/* Called from the main loop - writes queued records and publishes the next mqtt batch */
+void journal_poll(void);
+
+#endif
@@ -28,7 +28,10 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "driver/uart.h"
@@ -42,6 +45,7 @@
 #include "esp_bt_main.h"
 
 #include "esp_sleep.h"
+#include "esp_timer.h"
 #include "lwip/err.h"
 #include "lwip/apps/sntp.h"
 
@@ -49,6 +53,14 @@
 #include "eq3_gap.h"
 #include "eq3_timer.h"
 #include "eq3_wifi.h"
+#include "eq3_hubs.h"
+#include "eq3_outq.h"
+#include "eq3_metrics.h"
+#include "eq3_cbor.h"
+#include "eq3_config.h"
+#include "eq3_trvs.h"
+#include "eq3_journal.h"
+#include "eq3_events.h"
 
 #include "eq3_bootwifi.h"
 
@@ -77,17 +89,6 @@
 #define PROP_BOOST               0x45
 #define PROP_LOCK                0x80
 
-/* Status bits */
-#define AUTO                     0x00
-#define MANUAL                   0x01
-#define AWAY                     0x02
-#define BOOST                    0x04
-#define DST                      0x08
-#define WINDOW                   0x10
-#define LOCKED                   0x20
-#define UNKNOWN                  0x40
-#define LOW_BATTERY              0x80
-
 static bool wifistartdelay = true;     /* Should we delay before connecting wifi at boot */
 static bool reboot_requested = false;  /* This never gets reset once a reboot is requested */
 
@@ -177,6 +178,9 @@ struct _action {
     bool ble_operation_in_progress;
     int ble_operation_time;
     bool outstanding_timer;
+    int64_t op_start;          /* Time the connection for this attempt was requested */
+    int64_t stage_start;       /* Start of the current BLE stage (for metrics) */
+    bool cached_handles;       /* Service discovery was skipped using the handles from the registry */
 };
 
 /* Current TRV command being sent to EQ-3 */
@@ -227,16 +231,51 @@ static struct gattc_profile_inst gl_profile_tab[PROFILE_NUM] = {
     },
 };
 
+/* Request details of the command a report is for */
+struct request_info {
+    bool valid;
+    char reqid[EQ3_REQID_LEN];
+    int wait_ms;
+    int exec_ms;
+    int cmd;                    /* eq3_bt_cmd */
+    uint8_t param;              /* First parameter byte */
+    int attempts;
+};
+
+/* Decoded TRV status notification */
+struct trv_state {
+    bool has_temp, has_offset, has_valve, has_flags;
+    int temp_x2;                /* Set temperature in half degrees */
+    int offset_x2;              /* Offset temperature in half degrees */
+    int valve;                  /* Valve open percentage */
+    uint8_t flags;              /* MANUAL, AWAY, BOOST ... */
+    struct request_info req;
+};
+
+static void get_request_info(esp_bd_addr_t bleda, struct request_info *info);
+static void decode_trv_state(struct trv_state *state, const uint8_t *value, int len);
+static void send_status_report(char *trv, esp_bd_addr_t bleda, struct trv_state *state, const char *error);
+static void remember_trv_state(esp_bd_addr_t bleda, struct trv_state *state);
+
+/* The handles from the registry didn't work - forget them so the retry runs service discovery */
+static void drop_cached_handles(esp_bd_addr_t bleda){
+    if(current_action.cached_handles == true){
+        ESP_LOGI(GATTC_TAG, "Cached handles failed");
+        trv_set_handles(bleda, 0, 0);
+        current_action.cached_handles = false;
+    }
+}
+
 static void gattc_command_error(esp_bd_addr_t bleda, char *error){
+    struct trv_state state;
+    /* Collect the request details before command_complete() removes the command */
+    memset(&state, 0, sizeof(state));
+    get_request_info(bleda, &state.req);
     /* Only send the response if there are no retries available */
     if(command_complete(false) == EQ3_CMD_FAILED){
-        char statrep[120];
-        int statidx = 0;
-        statidx += sprintf(&statrep[statidx], "{");
-        statidx += sprintf(&statrep[statidx], "\"trv\":\"%02X:%02X:%02X:%02X:%02X:%02X\",", bleda[0], bleda[1], bleda[2], bleda[3], bleda[4], bleda[5]);
-        statidx += sprintf(&statrep[statidx], "\"error\":\"%s\"}", error);
-        send_trv_status(statrep);
-        eq3_add_log(statrep);
+        char trv[18];
+        sprintf(trv, "%02X:%02X:%02X:%02X:%02X:%02X", bleda[0], bleda[1], bleda[2], bleda[3], bleda[4], bleda[5]);
+        send_status_report(trv, bleda, &state, error);
     }
     /* 2 second delay until disconnect to allow any background GATTC stuff to complete */
     setnextcmd(EQ3_DISCONNECT, 2);
@@ -299,6 +338,8 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
         }else{
             ESP_LOGI(GATTC_TAG, "open success");
             current_action.connection_open = true;
+            metrics_ble_stage(METRICS_BLE_CONNECT, current_action.stage_start);
+            current_action.stage_start = esp_timer_get_time();
         }
         break;
     case ESP_GATTC_CLOSE_EVT:
@@ -320,6 +361,15 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
             break;
         }
         ESP_LOGI(GATTC_TAG, "ESP_GATTC_CFG_MTU_EVT, Status %d, MTU %d, conn_id %d", param->cfg_mtu.status, param->cfg_mtu.mtu, param->cfg_mtu.conn_id);
+        /* If the registry knows the characteristic handles of this TRV go straight to registering for notifications */
+        current_action.cached_handles = trv_get_handles(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, &gl_profile_tab[PROFILE_A_APP_ID].char_handle,
+                                                        &gl_profile_tab[PROFILE_A_APP_ID].resp_char_handle);
+        if(current_action.cached_handles == true){
+            ESP_LOGI(GATTC_TAG, "Using cached handles");
+            current_action.get_server = true;
+            esp_ble_gattc_register_for_notify(gattc_if, gl_profile_tab[PROFILE_A_APP_ID].remote_bda, gl_profile_tab[PROFILE_A_APP_ID].resp_char_handle);
+            break;
+        }
         /* Search for the EQ-3 service */
         esp_ble_gattc_search_service(gattc_if, param->cfg_mtu.conn_id, NULL);
 
@@ -446,6 +496,10 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
                 }else{
                     ESP_LOGE(GATTC_TAG, "No command attribute found!");
                 }
+                /* Remember the handles so the next command to this TRV can skip discovery */
+                if(gl_profile_tab[PROFILE_A_APP_ID].char_handle != 0 && gl_profile_tab[PROFILE_A_APP_ID].resp_char_handle != 0)
+                    trv_set_handles(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, gl_profile_tab[PROFILE_A_APP_ID].char_handle,
+                                    gl_profile_tab[PROFILE_A_APP_ID].resp_char_handle);
                     
             }else{
                 ESP_LOGE(GATTC_TAG, "EQ-3 characteristics not found");
@@ -463,11 +517,14 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
     case ESP_GATTC_REG_FOR_NOTIFY_EVT: {
         if (p_data->reg_for_notify.status != ESP_GATT_OK){
             ESP_LOGE(GATTC_TAG, "REG FOR NOTIFY failed: error status = %d", p_data->reg_for_notify.status);
+            drop_cached_handles(gl_profile_tab[PROFILE_A_APP_ID].remote_bda);
             /* Disconnect */
             gattc_command_error(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, "EQ-3 notify error");
         }else{
             /* Now we're ready to send our command to the EQ-3 trv */
             ESP_LOGI(GATTC_TAG, "Send eq3 command");
+            metrics_ble_stage(METRICS_BLE_DISCOVER, current_action.stage_start);
+            current_action.stage_start = esp_timer_get_time();
             esp_ble_gattc_write_char( gattc_if, gl_profile_tab[PROFILE_A_APP_ID].conn_id, gl_profile_tab[PROFILE_A_APP_ID].char_handle,
                                   current_action.cmd_len, current_action.cmd_val, ESP_GATT_WRITE_TYPE_RSP, ESP_GATT_AUTH_REQ_NONE);
         }
@@ -479,90 +536,19 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
         ESP_LOGI(GATTC_TAG, "ESP_GATTC_NOTIFY_EVT, Receive notify value:");
         esp_log_buffer_hex(GATTC_TAG, p_data->notify.value, p_data->notify.value_len);
 
-        uint8_t tempval, temphalf = 0;
-        char statrep[240];
-        int statidx = 0;
+        struct trv_state state;
+        char trv[18];
 
-        statidx += sprintf(&statrep[statidx], "{");
-        statidx += sprintf(&statrep[statidx], "\"trv\":\"%02X:%02X:%02X:%02X:%02X:%02X\",", gl_profile_tab[PROFILE_A_APP_ID].remote_bda[0], gl_profile_tab[PROFILE_A_APP_ID].remote_bda[1],
+        sprintf(trv, "%02X:%02X:%02X:%02X:%02X:%02X", gl_profile_tab[PROFILE_A_APP_ID].remote_bda[0], gl_profile_tab[PROFILE_A_APP_ID].remote_bda[1],
             gl_profile_tab[PROFILE_A_APP_ID].remote_bda[2], gl_profile_tab[PROFILE_A_APP_ID].remote_bda[3], gl_profile_tab[PROFILE_A_APP_ID].remote_bda[4], gl_profile_tab[PROFILE_A_APP_ID].remote_bda[5]);
 
         if(p_data->notify.value[0] == PROP_INFO_RETURN && p_data->notify.value[1] == 1){
-            if(p_data->notify.value_len > 5){
-                tempval = p_data->notify.value[5];
-                if(tempval & 0x01)
-                    temphalf = 5;
-                tempval >>= 1;
-                ESP_LOGI(GATTC_TAG, "eq3 settemp is %d.%d C", tempval, temphalf);
-                statidx += sprintf(&statrep[statidx], "\"temp\":\"%d.%d\"", tempval, temphalf);
-            }
-            if(p_data->notify.value_len >= 14){
-                int8_t offsetval, offsethalf = 0;
-                offsetval = p_data->notify.value[14];
-                offsetval -= 7; // The offset temperature is encoded in steps of 0.5°C between -3.5°C and 3.5°C
-
-                if(offsetval & 0x01)
-                    offsethalf = 5;
-                offsetval >>= 1;
-                ESP_LOGI(GATTC_TAG, "eq3 offsettemp is %d.%d C", offsetval, offsethalf);
-                statidx += sprintf(&statrep[statidx], ",\"offsetTemp\":\"%d.%d\"", offsetval, offsethalf);
-            }
-            if(p_data->notify.value_len > 3){
-                tempval = p_data->notify.value[3];
-                ESP_LOGI(GATTC_TAG, "eq3 valve %d%% open\n", tempval);
-                statidx += sprintf(&statrep[statidx], ",\"valve\":\"%d%% open\"", tempval);
-            }
-            if(p_data->notify.value_len > 2){
-                tempval = p_data->notify.value[2];
-                statidx += sprintf(&statrep[statidx], ",\"mode\":");
-                if(tempval & MANUAL){
-                    ESP_LOGI(GATTC_TAG, "eq3 set manual");
-                    statidx += sprintf(&statrep[statidx], "\"manual\"");
-                }else if(tempval & AWAY){
-                    ESP_LOGI(GATTC_TAG, "eq3 set holiday");
-                    statidx += sprintf(&statrep[statidx], "\"holiday\"");
-                }else{
-                    ESP_LOGI(GATTC_TAG, "eq3 set auto");
-                    statidx += sprintf(&statrep[statidx], "\"auto\"");
-                }
-                statidx += sprintf(&statrep[statidx], ",\"boost\":");
-                if(tempval & BOOST){
-                    ESP_LOGI(GATTC_TAG, "eq3 boost");
-                    statidx += sprintf(&statrep[statidx], "\"active\"");
-                }else{
-                    ESP_LOGI(GATTC_TAG, "eq3 no boost");
-                    statidx += sprintf(&statrep[statidx], "\"inactive\"");
-                }
-                statidx += sprintf(&statrep[statidx], ",\"window\":");
-                if(tempval & WINDOW){
-                    ESP_LOGI(GATTC_TAG, "eq3 window open");
-                    statidx += sprintf(&statrep[statidx], "\"open\"");
-                }else{
-                    ESP_LOGI(GATTC_TAG, "eq3 window closed");
-                    statidx += sprintf(&statrep[statidx], "\"closed\"");
-                }
-                statidx += sprintf(&statrep[statidx], ",\"state\":");
-                if(tempval & LOCKED){
-                    ESP_LOGI(GATTC_TAG, "eq3 locked");
-                    statidx += sprintf(&statrep[statidx], "\"locked\"");
-                }else{
-                    ESP_LOGI(GATTC_TAG, "eq3 unlocked");
-                    statidx += sprintf(&statrep[statidx], "\"unlocked\"");
-                }
-                statidx += sprintf(&statrep[statidx], ",\"battery\":");
-                if(tempval & LOW_BATTERY){
-                    ESP_LOGI(GATTC_TAG, "eq3 battery LOW");
-                    statidx += sprintf(&statrep[statidx], "\"LOW\"");
-                }else{
-                    ESP_LOGI(GATTC_TAG, "eq3 battery good");
-                    statidx += sprintf(&statrep[statidx], "\"GOOD\"");
-                }
-            }
-            statidx += sprintf(&statrep[statidx], "}");
-            /* Send the status report we just collated */
-            send_trv_status(statrep);
-            /* Add to the log */
-            eq3_add_log(statrep);
+            metrics_ble_stage(METRICS_BLE_RESPONSE, current_action.stage_start);
+            decode_trv_state(&state, p_data->notify.value, p_data->notify.value_len);
+            remember_trv_state(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, &state);
+            get_request_info(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, &state.req);
+            /* Send the status report in the configured encoding(s) */
+            send_status_report(trv, gl_profile_tab[PROFILE_A_APP_ID].remote_bda, &state, NULL);
         }else{
             ESP_LOGI(GATTC_TAG, "eq3 got response 0x%x, 0x%x\n", p_data->notify.value[0], p_data->notify.value[1]);
         }
@@ -597,6 +583,7 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
         /* Characteristic write complete */
         if (p_data->write.status != ESP_GATT_OK){
             ESP_LOGE(GATTC_TAG, "write char failed, error status = %x", p_data->write.status);
+            drop_cached_handles(gl_profile_tab[PROFILE_A_APP_ID].remote_bda);
             /* Disconnect */
             gattc_command_error(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, "Unable to write to EQ-3");
             break;
@@ -669,17 +656,57 @@ typedef enum {
     EQ3_UNLOCK,
 }eq3_bt_cmd;
 
+/* Command names in eq3_bt_cmd order */
+static const char *command_names[] = {
+    "boost", "unboost", "auto", "manual", "eco", "settemp", "offset", "settime", "lock", "unlock",
+};
+
+const char *eq3_command_name(int cmd){
+    if(cmd < 0 || cmd >= sizeof(command_names) / sizeof(command_names[0]))
+        return NULL;
+    return command_names[cmd];
+}
+
 struct eq3cmd{
+    uint32_t id;                /* Reported to http clients so they can follow the command */
     esp_bd_addr_t bleda;
     eq3_bt_cmd cmd;
     unsigned char cmdparms[MAX_CMD_BYTES];
     int retries;
+    char reqid[EQ3_REQID_LEN];  /* Optional request id echoed in the status/error report */
+    int64_t queued;             /* Time the command was queued */
+    int64_t started;            /* Time of the first attempt to send the command */
     struct eq3cmd *next;
 };
 
-static void enqueue_command(struct eq3cmd *newcmd);
+static bool enqueue_command(struct eq3cmd *newcmd, struct eq3_queued *queued);
+
+/* queue_request() results */
+#define EQ3_REQ_QUEUED  0
+#define EQ3_REQ_PENDING 1
 
 struct eq3cmd *cmdqueue = NULL;
+/* settime commands using ntp time waiting for the first sntp synchronisation */
+#define MAX_TIMEWAIT_CMDS 16
+static struct eq3cmd *timewaitq = NULL;
+/* Commands are added by the mqtt and web tasks - the lock guards the queue links and command ids */
+static SemaphoreHandle_t queue_lock = NULL;
+static uint32_t last_cmd_id = 0;
+static volatile bool time_synced = false;
+
+/* Encode the current local time as settime parameters */
+static void time_parms(unsigned char *cmdparms){
+    time_t now = 0;
+    struct tm timeinfo = { 0 };
+    time(&now);
+    localtime_r(&now, &timeinfo);
+    cmdparms[0] = timeinfo.tm_year - 100;
+    cmdparms[1] = timeinfo.tm_mon + 1;
+    cmdparms[2] = timeinfo.tm_mday;
+    cmdparms[3] = timeinfo.tm_hour;
+    cmdparms[4] = timeinfo.tm_min;
+    cmdparms[5] = timeinfo.tm_sec;
+}
 
 /* Task to handle local UART and accept EQ-3 commands for test/debug */
 static void uart_task()
@@ -743,13 +770,87 @@ void schedule_reboot(void){
         runtimer();
 }
 
-/* Handle an EQ-3 command from uart or mqtt */
-int handle_request(char *cmdstr){
+/* Remove an optional 'id=<request id>' word from a command string
+ * Returns false if the id is too long or contains characters that can't go into the json reports */
+static bool take_request_id(char *cmdstr, char *reqid){
+    char *idptr = cmdstr, *endptr;
+    int idlen;
+
+    reqid[0] = 0;
+    while((idptr = strstr(idptr, "id=")) != NULL && idptr != cmdstr && idptr[-1] != ' ')
+        idptr += 3;
+    if(idptr == NULL)
+        return true;
+    for(endptr = idptr + 3; *endptr != 0 && *endptr != ' '; endptr++){
+        if(!isalnum((int)*endptr) && strchr("-_.:", *endptr) == NULL)
+            return false;
+    }
+    idlen = endptr - (idptr + 3);
+    if(idlen >= EQ3_REQID_LEN)
+        return false;
+    memcpy(reqid, idptr + 3, idlen);
+    reqid[idlen] = 0;
+    /* Close the gap left in the command string */
+    while(*endptr == ' ')
+        endptr++;
+    memmove(idptr, endptr, strlen(endptr) + 1);
+    idlen = strlen(cmdstr);
+    while(idlen > 0 && cmdstr[idlen - 1] == ' ')
+        cmdstr[--idlen] = 0;
+    return true;
+}
+
+/* Replace a TRV name at the start of a command with its address from the registry
+ * Returns false (leaving the command as it is) if the command starts with an address or an unknown name */
+static bool resolve_trv_name(const char *cmdstr, char *named, int size){
+    esp_bd_addr_t bda;
+    const char *start = cmdstr, *end;
+    while(*start == ' ')
+        start++;
+    for(end = start; *end != 0 && *end != ' '; end++)
+        ;
+    if(end - start == 17 && start[2] == ':')
+        return false;
+    if(trv_find_name(start, end - start, bda) == false)
+        return false;
+    snprintf(named, size, "%02X:%02X:%02X:%02X:%02X:%02X%s", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5], end);
+    return true;
+}
+
+/* Tell the web clients about a change to the command queue (call without queue_lock held) */
+static void queue_event(const char *action, uint32_t id, const esp_bd_addr_t bda, int cmd){
+    char data[160];
+    int len;
+    if(events_wanted() == false)
+        return;
+    len = snprintf(data, sizeof(data), "{\"action\":\"%s\",\"id\":%u,\"bleaddr\":\"%02X:%02X:%02X:%02X:%02X:%02X\",\"command\":\"%s\",\"length\":%d}",
+                   action, (unsigned)id, bda[0], bda[1], bda[2], bda[3], bda[4], bda[5], eq3_command_name(cmd), queue_list(NULL, 0));
+    events_push("queue", data, len);
+}
+
+/* Parse an EQ-3 command and add it to the queue without starting the ble operation - where it went is returned in queued (if not NULL)
+ * Returns EQ3_REQ_QUEUED, EQ3_REQ_PENDING if the same command is already the last one queued for the valve, or -1 */
+static int queue_request(char *cmdstr, struct eq3_queued *queued){
     char *cmdptr = cmdstr;
     struct eq3cmd *newcmd;
     eq3_bt_cmd command; 
-    unsigned char cmdparms[MAX_CMD_BYTES];  
+    unsigned char cmdparms[MAX_CMD_BYTES] = {0};
+    char reqid[EQ3_REQID_LEN];
+    char named[EQ3_MAX_REQUEST_LEN];
     bool start = false;
+    bool needtime = false;
+    int rc = EQ3_REQ_QUEUED;
+    const char *action = "queued";
+    esp_bd_addr_t bda;
+    uint32_t id;
+
+    if(take_request_id(cmdstr, reqid) == false){
+        ESP_LOGI(GATTC_TAG, "Invalid request id in %s", cmdstr);
+        return -1;
+    }
+    /* A TRV can be addressed by its name */
+    if(resolve_trv_name(cmdstr, named, sizeof(named)) == true)
+        cmdstr = cmdptr = named;
 
     // Skip the bleaddr
     while(*cmdptr != 0 && !isxdigit((int)*cmdptr))
@@ -780,18 +881,9 @@ int handle_request(char *cmdstr){
                 cmdparms[dig] = (unsigned char)strtol(hexdigit, NULL, 16);
             }
         }else{
-            /* TODO - only if time is synchronised */
+            /* The time is read when the command is queued - or once sntp has synchronised */
             if(ntp_enabled() == true){
-                time_t now = 0;
-                struct tm timeinfo = { 0 };
-                time(&now);
-                localtime_r(&now, &timeinfo);
-                cmdparms[0] = timeinfo.tm_year - 100;
-                cmdparms[1] = timeinfo.tm_mon + 1;
-                cmdparms[2] = timeinfo.tm_mday;
-                cmdparms[3] = timeinfo.tm_hour;
-                cmdparms[4] = timeinfo.tm_min;
-                cmdparms[5] = timeinfo.tm_sec;
+                needtime = true;
             }else{
                 ESP_LOGI(GATTC_TAG, "Cannot set valve time via ntp as ntp is not enabled");
                 return -1;
@@ -872,13 +964,16 @@ int handle_request(char *cmdstr){
 
         eq3_add_log(cmdstr);
         newcmd = malloc(sizeof(struct eq3cmd));
-
-        // TODO - what if malloc fails?
+        if(newcmd == NULL)
+            return -1;
 
         newcmd->cmd = command;
         for(parm=0; parm < MAX_CMD_BYTES; parm++)
             newcmd->cmdparms[parm] = cmdparms[parm];
         newcmd->retries = MAX_CMD_RETRIES;
+        strcpy(newcmd->reqid, reqid);
+        newcmd->queued = esp_timer_get_time();
+        newcmd->started = 0;
 
         while(*cmdstr != 0 && !isxdigit((int)*cmdstr))
             cmdstr++;
@@ -895,27 +990,183 @@ int handle_request(char *cmdstr){
         esp_log_buffer_hex(GATTC_TAG, newcmd->bleda, sizeof(esp_bd_addr_t));
 
         newcmd->next = NULL;
-    
-        enqueue_command(newcmd);
-
-        if(current_action.ble_operation_in_progress == false){
-            /* Only schedule the command if ble is currently idle */
-            //if(timer_running() == false){
-            //    ESP_LOGI(GATTC_TAG, "Timer not running so starting it");
-                runtimer();
-            //}
+
+        /* The command can be run and freed as soon as the lock is released */
+        memcpy(bda, newcmd->bleda, sizeof(esp_bd_addr_t));
+        xSemaphoreTake(queue_lock, portMAX_DELAY);
+        id = newcmd->id = ++last_cmd_id;
+        if(needtime == true && time_synced == false){
+            /* Hold the command back until the time is known - the parameters are only filled in then, so
+             * a second settime for the same valve and request id is the same command */
+            struct eq3cmd **tail = &timewaitq, *same = NULL;
+            int waiting = 0;
+            for(; *tail != NULL; tail = &(*tail)->next, waiting++){
+                if(memcmp((*tail)->bleda, newcmd->bleda, sizeof(esp_bd_addr_t)) == 0 && (*tail)->cmd == newcmd->cmd &&
+                   strcmp((*tail)->reqid, newcmd->reqid) == 0)
+                    same = *tail;
+            }
+            if(same != NULL){
+                ESP_LOGI(GATTC_TAG, "Command still pending");
+                if(queued != NULL){
+                    queued->id = same->id;
+                    queued->position = -1;
+                    queued->pending = true;
+                }
+                free(newcmd);
+                rc = EQ3_REQ_PENDING;
+            }else if(waiting >= MAX_TIMEWAIT_CMDS){
+                /* Without ntp the list would otherwise grow for ever */
+                ESP_LOGE(GATTC_TAG, "Too many commands waiting for ntp time - dropped settime");
+                free(newcmd);
+                rc = -1;
+            }else{
+                *tail = newcmd;
+                if(queued != NULL){
+                    queued->id = newcmd->id;
+                    queued->position = -1;
+                    queued->pending = false;
+                }
+                ESP_LOGI(GATTC_TAG, "settime deferred until ntp time is synchronised");
+                action = "deferred";
+            }
+        }else{
+            if(needtime == true)
+                time_parms(newcmd->cmdparms);
+            if(enqueue_command(newcmd, queued) == false){
+                free(newcmd);
+                rc = EQ3_REQ_PENDING;
+            }
         }
+        xSemaphoreGive(queue_lock);
+        if(rc == EQ3_REQ_QUEUED)
+            queue_event(action, id, bda, command);
+        else if(rc < 0)
+            eq3_add_log((char *)"settime dropped - waiting for ntp time");
     }else{
         ESP_LOGI(GATTC_TAG, "Invalid command %s", cmdptr);
         return -1;
     }
+    return rc;
+}
+
+/* Start running queued commands */
+static void start_commands(void){
+    if(current_action.ble_operation_in_progress == false){
+        /* Only schedule the command if ble is currently idle */
+        //if(timer_running() == false){
+        //    ESP_LOGI(GATTC_TAG, "Timer not running so starting it");
+            runtimer();
+        //}
+    }
+}
+
+/* Queue the settime commands that were waiting for ntp now the time is known */
+static void release_time_commands(void){
+    struct eq3cmd *newcmd;
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    while((newcmd = timewaitq) != NULL){
+        timewaitq = newcmd->next;
+        newcmd->next = NULL;
+        time_parms(newcmd->cmdparms);
+        if(enqueue_command(newcmd, NULL) == false)
+            free(newcmd);
+    }
+    xSemaphoreGive(queue_lock);
+    start_commands();
+}
+
+/* Handle an EQ-3 command from uart or mqtt */
+int handle_request(char *cmdstr){
+    return handle_request_queued(cmdstr, NULL);
+}
+
+/* Handle an EQ-3 command and report its id and place in the queue (for the web api) */
+int handle_request_queued(char *cmdstr, struct eq3_queued *queued){
+    if(queue_request(cmdstr, queued) < 0)
+        return -1;
+    start_commands();
     return 0;
 }
 
-/* Enqueue a command into the list */
-static void enqueue_command(struct eq3cmd *newcmd){
+/* Handle a batch of EQ-3 commands - either one command per line or a json array of command strings
+ * e.g. ["ab:cd:ef:gh:ij:kl settemp 20.0","ab:cd:ef:gh:ij:km off"]
+ * Commands are queued in order as they are parsed and the ble operation is kicked once at the end */
+void handle_batch_request(const char *batch, int len, struct eq3_batch_result *result){
+    char cmdstr[EQ3_MAX_REQUEST_LEN];
+    const char *end = batch + len;
+    bool json, instring = false, invalid = false;
+    int cmdlen = 0;
+
+    memset(result, 0, sizeof(struct eq3_batch_result));
+    while(batch < end && isspace((int)*batch))
+        batch++;
+    json = batch < end && *batch == '[';
+    if(json)
+        batch++;
+
+    for(; batch <= end; batch++){
+        bool endcmd;
+        char ch = batch < end ? *batch : 0;
+        if(json){
+            /* Only characters inside a quoted string form a command */
+            if(instring == false){
+                if(ch == '"')
+                    instring = true;
+                if(ch != ']' && ch != 0)
+                    continue;
+                break;
+            }
+            if(ch == '\\' && batch + 1 < end)
+                ch = *++batch;
+            else if(ch == '"')
+                instring = false;
+            else if(ch == 0){
+                /* Unterminated string */
+                instring = false;
+                invalid = true;
+            }
+            endcmd = instring == false;
+        }else{
+            endcmd = ch == '\n' || ch == '\r' || ch == 0;
+        }
+
+        if(endcmd == false){
+            if(cmdlen < sizeof(cmdstr) - 1)
+                cmdstr[cmdlen++] = ch;
+            else
+                invalid = true;
+            continue;
+        }
+        /* Blank lines are not commands */
+        cmdstr[cmdlen] = 0;
+        if(cmdlen > 0 || json){
+            int rc = invalid ? -1 : queue_request(cmdstr, NULL);
+            if(rc == EQ3_REQ_QUEUED)
+                result->accepted++;
+            else if(rc == EQ3_REQ_PENDING)
+                result->pending++;
+            else{
+                if(result->rejected < EQ3_BATCH_MAX_REJECTS)
+                    result->rejects[result->rejected] = result->count;
+                result->rejected++;
+            }
+            result->count++;
+        }
+        cmdlen = 0;
+        invalid = false;
+    }
+
+    if(result->accepted > 0)
+        start_commands();
+    ESP_LOGI(GATTC_TAG, "Batch of %d commands - %d queued, %d already pending, %d rejected", result->count, result->accepted, result->pending, result->rejected);
+}
+
+/* Enqueue a command into the list (call with queue_lock held) - where it went is returned in queued (if not NULL)
+ * Returns false if the same command is already the last one queued for the device */
+static bool enqueue_command(struct eq3cmd *newcmd, struct eq3_queued *queued){
     struct eq3cmd *qwalk = cmdqueue;
     struct eq3cmd *lastCommandForDevice = NULL;
+    int position = 0, lastPosition = 0;
 
     if(cmdqueue == NULL){
         cmdqueue = newcmd;
@@ -926,22 +1177,39 @@ static void enqueue_command(struct eq3cmd *newcmd){
 
         while(qwalk->next != NULL){
             qwalk = qwalk->next;
-            if(memcmp(qwalk->bleda, newcmd->bleda, sizeof(esp_bd_addr_t)) == 0)
+            position++;
+            if(memcmp(qwalk->bleda, newcmd->bleda, sizeof(esp_bd_addr_t)) == 0){
                 lastCommandForDevice = qwalk;
+                lastPosition = position;
+            }
         }
 
         //don't add the same command again if it already is the last command for a specific device
+        //(commands with different request ids are separate requests that each need a reply)
         if(lastCommandForDevice != NULL
                 && lastCommandForDevice->cmd == newcmd->cmd
-                && memcmp(lastCommandForDevice->cmdparms, newcmd->cmdparms, MAX_CMD_BYTES) == 0)
+                && memcmp(lastCommandForDevice->cmdparms, newcmd->cmdparms, MAX_CMD_BYTES) == 0
+                && strcmp(lastCommandForDevice->reqid, newcmd->reqid) == 0)
         {
             ESP_LOGI(GATTC_TAG, "Command still pending");
-            return;
+            if(queued != NULL){
+                queued->id = lastCommandForDevice->id;
+                queued->position = lastPosition;
+                queued->pending = true;
+            }
+            return false;
         }
 
         qwalk->next = newcmd;
+        position++;
         ESP_LOGI(GATTC_TAG, "Add queue end");
      }
+    if(queued != NULL){
+        queued->id = newcmd->id;
+        queued->position = position;
+        queued->pending = false;
+    }
+    return true;
 }
 
 /* Get the next command off the queue and encode the characteristic parameters */
@@ -1011,9 +1279,15 @@ static int command_complete(bool success){
     bool deletehead = false;
     int rc = EQ3_CMD_RETRY;
 
+    /* Every attempt counts towards this hub's link quality for the TRV */
+    if(cmdqueue != NULL)
+        hub_record_result(cmdqueue->bleda, success);
+
     if(success == true){
         deletehead = true;
         rc = EQ3_CMD_DONE;
+        metrics_command_done();
+        metrics_ble_stage(METRICS_BLE_TOTAL, current_action.op_start);
     }else if(cmdqueue == NULL){
         rc = EQ3_CMD_DONE;
     }else{
@@ -1026,10 +1300,14 @@ static int command_complete(bool success){
             deletehead = true;
             ESP_LOGE(GATTC_TAG, "Command failed - retries exhausted");
             rc = EQ3_CMD_FAILED;
+            metrics_command_failed();
         }else{
+            metrics_command_retried();
+            queue_event("retry", cmdqueue->id, cmdqueue->bleda, cmdqueue->cmd);
 #ifdef REQUEUE_RETRY
             ESP_LOGE(GATTC_TAG, "Command failed - requeue for retry");
             /* If there are no other queued commands just retry this one */
+            xSemaphoreTake(queue_lock, portMAX_DELAY);
             if(cmdqueue->next != NULL){
                 struct eq3cmd *mvcmd = cmdqueue;
                 while(mvcmd->next != NULL)
@@ -1040,6 +1318,7 @@ static int command_complete(bool success){
                 /* Detach head from new tail */
                 mvcmd->next->next = NULL;
             }
+            xSemaphoreGive(queue_lock);
 #else
             ESP_LOGE(GATTC_TAG, "Command failed - retry");
 #endif  
@@ -1047,22 +1326,256 @@ static int command_complete(bool success){
     }
     if(deletehead && cmdqueue != NULL){
         /* Delete this command from the queue */
-        struct eq3cmd *delcmd = cmdqueue;
+        struct eq3cmd *delcmd;
+        xSemaphoreTake(queue_lock, portMAX_DELAY);
+        delcmd = cmdqueue;
         cmdqueue = cmdqueue->next;
+        xSemaphoreGive(queue_lock);
+        queue_event(rc == EQ3_CMD_DONE ? "done" : "failed", delcmd->id, delcmd->bleda, delcmd->cmd);
         free(delcmd);
     }
     return rc;
 }
 
+/* Request id, time spent queued and time since the first attempt of the command for a TRV
+ * Only the command at the head of the queue is being run so anything else has no details */
+static void get_request_info(esp_bd_addr_t bleda, struct request_info *info){
+    memset(info, 0, sizeof(struct request_info));
+    if(cmdqueue == NULL || cmdqueue->started == 0 || memcmp(cmdqueue->bleda, bleda, sizeof(esp_bd_addr_t)) != 0)
+        return;
+    info->valid = true;
+    strcpy(info->reqid, cmdqueue->reqid);
+    info->wait_ms = (int)((cmdqueue->started - cmdqueue->queued) / 1000);
+    info->exec_ms = (int)((esp_timer_get_time() - cmdqueue->started) / 1000);
+    info->cmd = cmdqueue->cmd;
+    info->param = cmdqueue->cmdparms[0];
+    info->attempts = MAX_CMD_RETRIES - cmdqueue->retries + 1;
+}
+
+/* Decode the status notification from a TRV */
+static void decode_trv_state(struct trv_state *state, const uint8_t *value, int len){
+    memset(state, 0, sizeof(struct trv_state));
+    if(len > 5){
+        state->has_temp = true;
+        state->temp_x2 = value[5];
+        ESP_LOGI(GATTC_TAG, "eq3 settemp is %d.%d C", state->temp_x2 >> 1, (state->temp_x2 & 0x01) ? 5 : 0);
+    }
+    if(len > 14){
+        /* The offset temperature is encoded in steps of 0.5°C between -3.5°C and 3.5°C */
+        state->has_offset = true;
+        state->offset_x2 = value[14] - 7;
+        ESP_LOGI(GATTC_TAG, "eq3 offsettemp is %d half degrees", state->offset_x2);
+    }
+    if(len > 3){
+        state->has_valve = true;
+        state->valve = value[3];
+        ESP_LOGI(GATTC_TAG, "eq3 valve %d%% open\n", state->valve);
+    }
+    if(len > 2){
+        state->has_flags = true;
+        state->flags = value[2];
+        ESP_LOGI(GATTC_TAG, "eq3 mode %s, boost %d, window %d, locked %d, battery %s", (state->flags & MANUAL) ? "manual" : (state->flags & AWAY) ? "holiday" : "auto",
+                 (state->flags & BOOST) != 0, (state->flags & WINDOW) != 0, (state->flags & LOCKED) != 0, (state->flags & LOW_BATTERY) ? "LOW" : "good");
+    }
+}
+
+/* Keep the last state in the registry */
+static void remember_trv_state(esp_bd_addr_t bleda, struct trv_state *state){
+    struct trv_last_state last;
+    if(state->has_temp == false)
+        return;
+    memset(&last, 0, sizeof(last));
+    last.valid = true;
+    last.temp_x2 = state->temp_x2;
+    last.valve = state->valve;
+    last.flags = state->flags;
+    last.has_offset = state->has_offset;
+    last.offset_x2 = state->offset_x2;
+    trv_set_state(bleda, &last);
+}
+
+/* Format a half degree temperature as "-3.5" */
+static int sprint_half(char *str, int x2){
+    return sprintf(str, "%s%d.%d", x2 < 0 ? "-" : "", abs(x2) >> 1, (abs(x2) & 0x01) ? 5 : 0);
+}
+
+/* Json status (or error) report */
+static int status_json(char *statrep, char *trv, struct trv_state *state, const char *error){
+    int statidx = 0;
+    statidx += sprintf(&statrep[statidx], "{");
+    statidx += sprintf(&statrep[statidx], "\"trv\":\"%s\"", trv);
+    if(error != NULL){
+        statidx += sprintf(&statrep[statidx], ",\"error\":\"%s\"", error);
+    }else{
+        if(state->has_temp){
+            statidx += sprintf(&statrep[statidx], ",\"temp\":\"");
+            statidx += sprint_half(&statrep[statidx], state->temp_x2);
+            statidx += sprintf(&statrep[statidx], "\"");
+        }
+        if(state->has_offset){
+            statidx += sprintf(&statrep[statidx], ",\"offsetTemp\":\"");
+            statidx += sprint_half(&statrep[statidx], state->offset_x2);
+            statidx += sprintf(&statrep[statidx], "\"");
+        }
+        if(state->has_valve)
+            statidx += sprintf(&statrep[statidx], ",\"valve\":\"%d%% open\"", state->valve);
+        if(state->has_flags){
+            statidx += sprintf(&statrep[statidx], ",\"mode\":\"%s\"", (state->flags & MANUAL) ? "manual" : (state->flags & AWAY) ? "holiday" : "auto");
+            statidx += sprintf(&statrep[statidx], ",\"boost\":\"%s\"", (state->flags & BOOST) ? "active" : "inactive");
+            statidx += sprintf(&statrep[statidx], ",\"window\":\"%s\"", (state->flags & WINDOW) ? "open" : "closed");
+            statidx += sprintf(&statrep[statidx], ",\"state\":\"%s\"", (state->flags & LOCKED) ? "locked" : "unlocked");
+            statidx += sprintf(&statrep[statidx], ",\"battery\":\"%s\"", (state->flags & LOW_BATTERY) ? "LOW" : "GOOD");
+        }
+    }
+    if(state->req.valid){
+        if(state->req.reqid[0] != 0)
+            statidx += sprintf(&statrep[statidx], ",\"id\":\"%s\"", state->req.reqid);
+        statidx += sprintf(&statrep[statidx], ",\"wait_ms\":%d,\"exec_ms\":%d", state->req.wait_ms, state->req.exec_ms);
+    }
+    statidx += sprintf(&statrep[statidx], "}");
+    return statidx;
+}
+
+/* Cbor status (or error) report - the same state with typed values */
+static int status_cbor(uint8_t *buf, int cap, esp_bd_addr_t bleda, struct trv_state *state, const char *error){
+    struct cbor_enc enc;
+    int pairs = 1;
+    if(error != NULL)
+        pairs++;
+    else
+        pairs += (state->has_temp ? 1 : 0) + (state->has_offset ? 1 : 0) + (state->has_valve ? 1 : 0) + (state->has_flags ? 5 : 0);
+    if(state->req.valid)
+        pairs += state->req.reqid[0] != 0 ? 3 : 2;
+
+    cbor_init(&enc, buf, cap);
+    cbor_map(&enc, pairs);
+    cbor_text(&enc, "trv");
+    cbor_bytes(&enc, bleda, sizeof(esp_bd_addr_t));
+    if(error != NULL){
+        cbor_text(&enc, "error");
+        cbor_text(&enc, error);
+    }else{
+        if(state->has_temp){
+            cbor_text(&enc, "temp");
+            cbor_float(&enc, state->temp_x2 / 2.0f);
+        }
+        if(state->has_offset){
+            cbor_text(&enc, "offsetTemp");
+            cbor_float(&enc, state->offset_x2 / 2.0f);
+        }
+        if(state->has_valve){
+            cbor_text(&enc, "valve");
+            cbor_uint(&enc, state->valve);
+        }
+        if(state->has_flags){
+            /* mode 0 = auto, 1 = manual, 2 = holiday */
+            cbor_text(&enc, "mode");
+            cbor_uint(&enc, (state->flags & MANUAL) ? 1 : (state->flags & AWAY) ? 2 : 0);
+            cbor_text(&enc, "boost");
+            cbor_bool(&enc, (state->flags & BOOST) != 0);
+            cbor_text(&enc, "window");
+            cbor_bool(&enc, (state->flags & WINDOW) != 0);
+            cbor_text(&enc, "locked");
+            cbor_bool(&enc, (state->flags & LOCKED) != 0);
+            cbor_text(&enc, "batteryLow");
+            cbor_bool(&enc, (state->flags & LOW_BATTERY) != 0);
+        }
+    }
+    if(state->req.valid){
+        if(state->req.reqid[0] != 0){
+            cbor_text(&enc, "id");
+            cbor_text(&enc, state->req.reqid);
+        }
+        cbor_text(&enc, "wait_ms");
+        cbor_uint(&enc, state->req.wait_ms);
+        cbor_text(&enc, "exec_ms");
+        cbor_uint(&enc, state->req.exec_ms);
+    }
+    return cbor_len(&enc);
+}
+
+/* Record the outcome of a command in the journal */
+static void journal_status(esp_bd_addr_t bleda, struct trv_state *state, const char *error){
+    struct journal_event event;
+    memset(&event, 0, sizeof(event));
+    memcpy(event.bda, bleda, sizeof(esp_bd_addr_t));
+    event.cmd = JOURNAL_NO_CMD;
+    if(state->req.valid == true){
+        event.cmd = state->req.cmd;
+        event.param = state->req.param;
+        event.attempts = state->req.attempts;
+        event.wait_ms = state->req.wait_ms;
+        event.exec_ms = state->req.exec_ms;
+    }
+    event.error = error;
+    if(error == NULL && state->has_temp == true){
+        event.has_state = true;
+        event.temp_x2 = state->temp_x2;
+        event.offset_x2 = state->offset_x2;
+        event.valve = state->valve;
+        event.flags = state->flags;
+    }
+    journal_add(&event);
+}
+
+/* Send a status report (or an error report if error is set) and add it to the log
+ * Errors are not retained so the last good state stays available to new subscribers */
+static void send_status_report(char *trv, esp_bd_addr_t bleda, struct trv_state *state, const char *error){
+    char statrep[320];
+    uint8_t cborrep[160];
+    int format = status_format();
+    bool retain = error == NULL;
+    int cborlen;
+
+    status_json(statrep, trv, state, error);
+    if(format != STATUS_FORMAT_CBOR)
+        send_trv_status(trv, statrep, retain);
+    if(format != STATUS_FORMAT_JSON){
+        if((cborlen = status_cbor(cborrep, sizeof(cborrep), bleda, state, error)) > 0)
+            send_trv_status_cbor(trv, cborrep, cborlen, retain);
+        else
+            ESP_LOGE(GATTC_TAG, "Cbor status report too long");
+    }
+    /* Add to the log and the journal and tell the web clients */
+    eq3_add_log(statrep);
+    journal_status(bleda, state, error);
+    events_push("status", statrep, strlen(statrep));
+}
+
+int queue_list(struct eq3_queue_entry *list, int max){
+    int count = 0;
+    int64_t now = esp_timer_get_time();
+    if(queue_lock == NULL)
+        return 0;
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    for(struct eq3cmd *qwalk = cmdqueue; qwalk != NULL; qwalk = qwalk->next, count++){
+        if(count < max){
+            struct eq3_queue_entry *entry = &list[count];
+            entry->id = qwalk->id;
+            memcpy(entry->bda, qwalk->bleda, sizeof(esp_bd_addr_t));
+            entry->command = eq3_command_name(qwalk->cmd);
+            entry->param = qwalk->cmdparms[0];
+            strcpy(entry->reqid, qwalk->reqid);
+            entry->age_ms = (int)((now - qwalk->queued) / 1000);
+            entry->attempts = qwalk->started == 0 ? 0 : MAX_CMD_RETRIES - qwalk->retries + 1;
+        }
+    }
+    xSemaphoreGive(queue_lock);
+    return count;
+}
+
 /* Run the next EQ-3 command from the list */
 static int run_command(void){
     if(cmdqueue != NULL){
         ESP_LOGI(GATTC_TAG, "Sending next command");
+        if(cmdqueue->started == 0)
+            cmdqueue->started = esp_timer_get_time();
         setup_command();
         ESP_LOGI(GATTC_TAG, "Open virtual server connection for BLE device:");
         esp_log_buffer_hex(GATTC_TAG, current_action.cmd_bleda, sizeof(esp_bd_addr_t));
         current_action.ble_operation_in_progress = true;
         current_action.ble_operation_time = 0;
+        current_action.op_start = current_action.stage_start = esp_timer_get_time();
         esp_ble_gattc_open(gl_profile_tab[PROFILE_A_APP_ID].gattc_if, current_action.cmd_bleda, 0x00, true);
         /*
         #define BLE_ADDR_PUBLIC         0x00
@@ -1113,6 +1626,16 @@ void confparms(char *mqtturl, char *mqttuser, char *mqttpass, char *mqttid){
     }
 }
 
+/* sntp callback (from the lwip task) - the first synchronisation releases any deferred settime commands */
+static void time_sync_cb(struct timeval *tv){
+    char strftime_buf[64];
+    struct tm timeinfo;
+    localtime_r(&tv->tv_sec, &timeinfo);
+    strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
+    ESP_LOGI(GATTC_TAG, "Time synchronised - the current date/time is: %s", strftime_buf);
+    time_synced = true;
+}
+
 /* Callback when we're associated with an AP or have fallen back into STA mode */
 void wifidone(int rc){
     static bool server_started = false;
@@ -1126,39 +1649,27 @@ void wifidone(int rc){
         /* We are station and connected */
         ESP_LOGI(GATTC_TAG, "WiFi network connected\n");
         
-        /* If ntp is configured start up sntp and synchronise the time */
-        char *ntpserver = getntpserver(0);
-        char *ntptimezone = getntptimezone();
+        /* If ntp is configured start up sntp - the time is set in the background and
+         * time_sync_cb() is called once it is synchronised. sntp keeps polling across wifi reconnects */
+        static bool sntp_started = false;
+        const char *ntpserver = getntpserver(0);
+        const char *ntptimezone = getntptimezone();
         if(ntp_enabled() == true && ntpserver[0] != 0){
-            ESP_LOGI(GATTC_TAG, "Initializing SNTP");
-            sntp_setoperatingmode(SNTP_OPMODE_POLL);
-        
-            sntp_setservername(0, ntpserver);
-            ntpserver = getntpserver(1);
-            sntp_setservername(1, ntpserver);
-            sntp_init();
-        
-            // wait for time to be set
-            time_t now = 0;
-            struct tm timeinfo = { 0 };
-            int retry = 0;
-            const int retry_count = 30;
-            while(timeinfo.tm_year < (2019 - 1900) && ++retry < retry_count) {
-                ESP_LOGI(GATTC_TAG, "Waiting for system time to be set... (%d/%d)", retry, retry_count);
-                vTaskDelay(2000 / portTICK_PERIOD_MS);
-                time(&now);
-                localtime_r(&now, &timeinfo);
-            }
-            char strftime_buf[64];
-        
+            if(sntp_started == false){
+                ESP_LOGI(GATTC_TAG, "Initializing SNTP");
 //#define TZVAL "GMT0BST,M3.5.0/2,M11.1.0"
-//        setenv("TZ", TZVAL, 1);
-        
-            setenv("TZ", (const char *)ntptimezone, 1);
-            tzset();
-            localtime_r(&now, &timeinfo);
-            strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
-            ESP_LOGI(GATTC_TAG, "The current date/time is: %s", strftime_buf);
+//              setenv("TZ", TZVAL, 1);
+                setenv("TZ", ntptimezone, 1);
+                tzset();
+
+                sntp_setoperatingmode(SNTP_OPMODE_POLL);
+                sntp_setservername(0, ntpserver);
+                ntpserver = getntpserver(1);
+                sntp_setservername(1, ntpserver);
+                sntp_set_time_sync_notification_cb(time_sync_cb);
+                sntp_init();
+                sntp_started = true;
+            }
             eq3_add_log((char *)"WiFi connected");
         }else{
             ESP_LOGI(GATTC_TAG, "SNTP not enabled\n");
@@ -1185,6 +1696,8 @@ void app_main(){
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK( ret );
+    /* Load the hub config (and migrate the config from older versions) */
+    config_init();
     
     esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
     ret = esp_bt_controller_init(&bt_cfg);
@@ -1223,8 +1736,21 @@ void app_main(){
     /* Add a boot record */
     eq3_add_log((char *)"Boot");
 
+    /* Initialise the multi-hub link table, the outbound mqtt queue, metrics, the TRV registry and the journal */
+    hub_init();
+    outq_init();
+    metrics_init();
+    trv_init();
+    journal_init();
+    metrics_add_task(xTaskGetCurrentTaskHandle());
+
+    /* The command queue can be added to by any task */
+    queue_lock = xSemaphoreCreateMutex();
+
     /* Start uart task and create msg and timer queues */ 
-    xTaskCreate(uart_task, "uart_task", 4096, NULL, 10, NULL);    
+    TaskHandle_t uarttask = NULL;
+    xTaskCreate(uart_task, "uart_task", 4096, NULL, 10, &uarttask);
+    metrics_add_task(uarttask);
     msgQueue = xQueueCreate( 10, sizeof( uint8_t * ) );
     timer_queue = xQueueCreate(10, sizeof(timer_event_t));
 
@@ -1250,7 +1776,8 @@ void app_main(){
     nextcmd.running = false;
 
     if(wifistartdelay == true){
-        setnextcmd(START_WIFI, 5);
+        /* No need to wait long if we can connect straight to the access point we were on */
+        setnextcmd(START_WIFI, wifi_fast_connect() ? 1 : 5);
         runtimer();
     }else{
         ESP_LOGI(GATTC_TAG, "Init wifi");
@@ -1312,6 +1839,7 @@ void app_main(){
                 }else{
                     if(++current_action.ble_operation_time >= BLE_OPERATION_TIMEOUT){
                         ESP_LOGE(GATTC_TAG, "BLE operation timed out\n");
+                        drop_cached_handles(current_action.cmd_bleda);
                         current_action.ble_operation_in_progress = false;
                         current_action.ble_operation_time = 0;
                         gattc_command_error(current_action.cmd_bleda, "BLE system failure");
@@ -1323,6 +1851,17 @@ void app_main(){
                 }
             }
         }
+        /* Deferred settime commands can run once the time is known */
+        if(time_synced == true && timewaitq != NULL)
+            release_time_commands();
+        /* Keep the other hubs up-to-date with our TRV link quality */
+        hub_poll();
+        /* Periodic hub health report */
+        metrics_poll(queue_list(NULL, 0));
+        /* Next batch of an mqtt journal query */
+        journal_poll();
+        /* Save TRV states reported since the last pass */
+        trv_poll();
         //ESP_LOGI(GATTC_TAG, "Loop");
     }
 }
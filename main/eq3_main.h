@@ -1,6 +1,10 @@
 #ifndef EQ3_MAIN_H
 #define EQ3_MAIN_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_bt_defs.h"
+
 #define EQ3_MAJVER "1"
 #define EQ3_MINVER "64"
 #define EQ3_EXTRAVER "-beta"
@@ -10,6 +14,57 @@ void eq3_add_log(char *log);
 
 int handle_request(char *cmdstr);
 
+/* TRV status notification flag bits */
+#define AUTO                     0x00
+#define MANUAL                   0x01
+#define AWAY                     0x02
+#define BOOST                    0x04
+#define DST                      0x08
+#define WINDOW                   0x10
+#define LOCKED                   0x20
+#define UNKNOWN                  0x40
+#define LOW_BATTERY              0x80
+
+/* Longest single command string */
+#define EQ3_MAX_REQUEST_LEN 128
+/* Longest request id (including terminator) given with 'id=<request id>' in a command */
+#define EQ3_REQID_LEN 24
+
+/* Where handle_request_queued() put a command */
+struct eq3_queued {
+    uint32_t id;                /* Command id */
+    int position;               /* Commands ahead of it (0 if it runs next), -1 while a settime waits for ntp */
+    bool pending;               /* The same command was already queued - id and position are of that command */
+};
+int handle_request_queued(char *cmdstr, struct eq3_queued *queued);
+
+/* Snapshot of a queued command */
+struct eq3_queue_entry {
+    uint32_t id;
+    esp_bd_addr_t bda;
+    const char *command;        /* Command name */
+    uint8_t param;              /* First parameter byte */
+    char reqid[EQ3_REQID_LEN];
+    int age_ms;                 /* Time since it was queued */
+    int attempts;               /* Attempts made so far */
+};
+/* Copy up to max queued commands, head first - returns the number queued (which can be more than max) */
+int queue_list(struct eq3_queue_entry *list, int max);
+
+/* Name of an eq3_bt_cmd command (NULL if it is out of range) */
+const char *eq3_command_name(int cmd);
+
+/* Aggregate result of a batch of commands */
+#define EQ3_BATCH_MAX_REJECTS 16
+struct eq3_batch_result {
+    int count;                              /* Commands in the batch */
+    int accepted;                           /* Commands queued */
+    int pending;                            /* Same command already queued for the valve */
+    int rejected;                           /* Invalid commands */
+    int rejects[EQ3_BATCH_MAX_REJECTS];     /* Index in the batch of the first rejected commands */
+};
+void handle_batch_request(const char *batch, int len, struct eq3_batch_result *result);
+
 void schedule_reboot(void);
 
 /* LOLIN_OLED can be defined if using a LOLIN OLED ESP32 board */
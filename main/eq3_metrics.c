@@ -0,0 +1,198 @@
+/*
+ * EQ-3 hub health metrics.
+ *
+ * Keeps command counters and a short history of BLE stage latencies and
+ * periodically publishes them together with heap, wifi, mqtt and task
+ * stack figures so a degrading hub can be spotted before it falls over.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "esp_heap_caps.h"
+#include "sdkconfig.h"
+
+#include "eq3_metrics.h"
+#include "eq3_wifi.h"
+#include "eq3_outq.h"
+#include "eq3_bootwifi.h"
+
+#define METRICS_TAG "EQ3_METRICS"
+
+#ifdef CONFIG_EQ3_METRICS_INTERVAL
+#define METRICS_INTERVAL_S CONFIG_EQ3_METRICS_INTERVAL
+#else
+#define METRICS_INTERVAL_S 300
+#endif
+
+#define METRICS_SAMPLES   32     /* Latency history kept for each BLE stage */
+#define METRICS_MAX_TASKS 6
+
+#define US_PER_S 1000000LL
+
+static const char *stage_names[METRICS_BLE_STAGES] = {"connect", "discover", "response", "total"};
+
+struct stage_history {
+    int32_t ms[METRICS_SAMPLES];
+    int count;                  /* Samples held (up to METRICS_SAMPLES) */
+    int next;                   /* Next slot to overwrite */
+};
+
+static struct stage_history stages[METRICS_BLE_STAGES];
+static TaskHandle_t tasks[METRICS_MAX_TASKS];
+static int done = 0, retried = 0, failed = 0;
+static SemaphoreHandle_t metrics_lock = NULL;
+static int64_t last_publish = 0;
+
+void metrics_init(void){
+    memset(stages, 0, sizeof(stages));
+    memset(tasks, 0, sizeof(tasks));
+    if(metrics_lock == NULL)
+        metrics_lock = xSemaphoreCreateMutex();
+    last_publish = esp_timer_get_time();
+}
+
+void metrics_add_task(TaskHandle_t task){
+    if(metrics_lock == NULL || task == NULL)
+        return;
+    xSemaphoreTake(metrics_lock, portMAX_DELAY);
+    for(int i = 0; i < METRICS_MAX_TASKS; i++){
+        if(tasks[i] == task)
+            break;
+        if(tasks[i] == NULL){
+            tasks[i] = task;
+            break;
+        }
+    }
+    xSemaphoreGive(metrics_lock);
+}
+
+void metrics_remove_task(TaskHandle_t task){
+    if(metrics_lock == NULL || task == NULL)
+        return;
+    xSemaphoreTake(metrics_lock, portMAX_DELAY);
+    for(int i = 0; i < METRICS_MAX_TASKS; i++){
+        if(tasks[i] == task){
+            /* Keep the list packed */
+            memmove(&tasks[i], &tasks[i + 1], (METRICS_MAX_TASKS - i - 1) * sizeof(TaskHandle_t));
+            tasks[METRICS_MAX_TASKS - 1] = NULL;
+            break;
+        }
+    }
+    xSemaphoreGive(metrics_lock);
+}
+
+void metrics_ble_stage(metrics_stage stage, int64_t start){
+    struct stage_history *h;
+    if(metrics_lock == NULL || stage >= METRICS_BLE_STAGES || start == 0)
+        return;
+    xSemaphoreTake(metrics_lock, portMAX_DELAY);
+    h = &stages[stage];
+    h->ms[h->next] = (int32_t)((esp_timer_get_time() - start) / 1000);
+    h->next = (h->next + 1) % METRICS_SAMPLES;
+    if(h->count < METRICS_SAMPLES)
+        h->count++;
+    xSemaphoreGive(metrics_lock);
+}
+
+void metrics_command_done(void){
+    done++;
+}
+
+void metrics_command_retried(void){
+    retried++;
+}
+
+void metrics_command_failed(void){
+    failed++;
+}
+
+static int cmp_ms(const void *a, const void *b){
+    return *(const int32_t *)a - *(const int32_t *)b;
+}
+
+/* "name":[p50,p90,max] for one stage (call with metrics_lock held) */
+static int add_stage(char *report, int len, metrics_stage stage){
+    int32_t sorted[METRICS_SAMPLES];
+    struct stage_history *h = &stages[stage];
+    if(h->count == 0)
+        return snprintf(report, len, "%s\"%s\":[]", stage == 0 ? "" : ",", stage_names[stage]);
+    memcpy(sorted, h->ms, h->count * sizeof(int32_t));
+    qsort(sorted, h->count, sizeof(int32_t), cmp_ms);
+    return snprintf(report, len, "%s\"%s\":[%d,%d,%d]", stage == 0 ? "" : ",", stage_names[stage],
+                    sorted[(h->count - 1) / 2], sorted[((h->count - 1) * 9) / 10], sorted[h->count - 1]);
+}
+
+/* The length of the report after an append - held at len - 1 if it was truncated so the next append
+ * (which then adds nothing) still gets a valid buffer */
+static int report_used(int idx, int added, int len){
+    idx += added > 0 ? added : 0;
+    return idx < len ? idx : len - 1;
+}
+
+int metrics_report(char *report, int len, int queued){
+    int idx = 0;
+    int64_t now = esp_timer_get_time();
+    struct mqtt_stats mqtt;
+    struct outq_stats outq;
+    struct wifi_timing wifi;
+    wifi_ap_record_t ap;
+
+    if(metrics_lock == NULL || len < METRICS_REPORT_LEN)
+        return 0;
+    mqtt_get_stats(&mqtt);
+    outq_get_stats(&outq);
+    wifi_get_timing(&wifi);
+    if(esp_wifi_sta_get_ap_info(&ap) != ESP_OK)
+        ap.rssi = 0;
+
+    idx = report_used(idx, snprintf(report + idx, len - idx,
+                                    "{\"uptime\":%d,\"heap\":%d,\"minheap\":%d,\"maxblock\":%d,\"rssi\":%d,\"queue\":%d,\"done\":%d,\"retried\":%d,\"failed\":%d",
+                                    (int)(now / US_PER_S), (int)heap_caps_get_free_size(MALLOC_CAP_8BIT), (int)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+                                    (int)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT), ap.rssi, queued, done, retried, failed), len);
+    idx = report_used(idx, snprintf(report + idx, len - idx,
+                                    ",\"mqtt\":{\"published\":%d,\"failed\":%d,\"queued\":%d,\"dropped\":%d}",
+                                    mqtt.published, mqtt.failed, outq.queued, outq.dropped), len);
+    /* Time to get an IP address in ms */
+    idx = report_used(idx, snprintf(report + idx, len - idx,
+                                    ",\"wifi\":{\"boot\":%d,\"last\":%d,\"reconnects\":%d,\"fast\":%s}",
+                                    wifi.boot_ms, wifi.last_ms, wifi.reconnects, wifi.fast ? "true" : "false"), len);
+
+    xSemaphoreTake(metrics_lock, portMAX_DELAY);
+    /* Latency in ms as [median, 90th percentile, max] over the last METRICS_SAMPLES commands */
+    idx = report_used(idx, snprintf(report + idx, len - idx, ",\"ble\":{"), len);
+    for(int stage = 0; stage < METRICS_BLE_STAGES; stage++)
+        idx = report_used(idx, add_stage(report + idx, len - idx, stage), len);
+    /* Unused stack in bytes */
+    idx = report_used(idx, snprintf(report + idx, len - idx, "},\"stack\":{"), len);
+    for(int i = 0; i < METRICS_MAX_TASKS && tasks[i] != NULL; i++)
+        idx = report_used(idx, snprintf(report + idx, len - idx, "%s\"%s\":%d", i == 0 ? "" : ",",
+                                        pcTaskGetTaskName(tasks[i]), (int)uxTaskGetStackHighWaterMark(tasks[i])), len);
+    xSemaphoreGive(metrics_lock);
+    idx = report_used(idx, snprintf(report + idx, len - idx, "}}"), len);
+    return idx;
+}
+
+void metrics_poll(int queued){
+    char *report;
+    int64_t now = esp_timer_get_time();
+
+    if(METRICS_INTERVAL_S <= 0 || metrics_lock == NULL || now - last_publish < METRICS_INTERVAL_S * US_PER_S)
+        return;
+    last_publish = now;
+    if((report = malloc(METRICS_REPORT_LEN)) == NULL)
+        return;
+    metrics_report(report, METRICS_REPORT_LEN, queued);
+
+    ESP_LOGI(METRICS_TAG, "%s", report);
+    send_metrics(report);
+    free(report);
+}
@@ -0,0 +1,39 @@
+
+#ifndef EQ3_METRICS_H
+#define EQ3_METRICS_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/* Hub health metrics
+ * Counters and BLE latencies are collected as commands run and a compact json report
+ * is published on <outtopicbase>/metrics every CONFIG_EQ3_METRICS_INTERVAL seconds. */
+
+/* BLE command stages */
+typedef enum {
+    METRICS_BLE_CONNECT = 0,    /* Open request until the connection is open */
+    METRICS_BLE_DISCOVER,       /* Connection open until the command is written */
+    METRICS_BLE_RESPONSE,       /* Command written until the TRV notifies its status */
+    METRICS_BLE_TOTAL,          /* Open request until the command is complete */
+    METRICS_BLE_STAGES
+} metrics_stage;
+
+void metrics_init(void);
+
+/* Tasks whose stack high-water mark is reported - remove a task before it deletes itself */
+void metrics_add_task(TaskHandle_t task);
+void metrics_remove_task(TaskHandle_t task);
+
+void metrics_ble_stage(metrics_stage stage, int64_t start);
+void metrics_command_done(void);
+void metrics_command_retried(void);
+void metrics_command_failed(void);
+
+/* Called from the main loop with the current command queue depth */
+void metrics_poll(int queued);
+
+/* The json report with the current command queue depth - returns its length (0 if len is less than METRICS_REPORT_LEN) */
+#define METRICS_REPORT_LEN 768
+int metrics_report(char *report, int len, int queued);
+
+#endif
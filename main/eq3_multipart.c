@@ -0,0 +1,191 @@
+/*
+ * EQ-3 multipart/form-data parser.
+ *
+ * A state machine over the body as it arrives. Part data is never copied -
+ * the caller is given runs of it in its own input - and the only look ahead
+ * needed (a header line or a delimiter split across reads) is left in the
+ * caller's input until the next read completes it.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "eq3_multipart.h"
+
+/* Copy the value of key from a header's ; separated parameters (without quotes) - false if it isn't there */
+static bool header_param(const char *s, int len, const char *key, char *out, int size){
+    const char *end = s + len;
+    int keylen = strlen(key);
+    bool quoted = false;
+    for(const char *p = s; p < end; p++){
+        if(*p == '"')
+            quoted = !quoted;
+        if(*p != ';' || quoted == true)
+            continue;
+        const char *k = p + 1, *v, *vend;
+        while(k < end && (*k == ' ' || *k == '\t'))
+            k++;
+        if(end - k <= keylen || k[keylen] != '=' || mg_ncasecmp(k, key, keylen) != 0)
+            continue;
+        v = k + keylen + 1;
+        if(v < end && *v == '"'){
+            v++;
+            if((vend = memchr(v, '"', end - v)) == NULL)
+                vend = end;
+        }else{
+            for(vend = v; vend < end && *vend != ';' && *vend != ' ' && *vend != '\t'; vend++)
+                ;
+        }
+        if(vend - v >= size)
+            vend = v + size - 1;
+        memcpy(out, v, vend - v);
+        out[vend - v] = 0;
+        return true;
+    }
+    return false;
+}
+
+/* Note the part headers we care about */
+static void part_header(struct multipart *mp, const char *line, int len){
+    if(len >= 20 && mg_ncasecmp(line, "Content-Disposition:", 20) == 0){
+        header_param(line, len, "name", mp->part.name, sizeof(mp->part.name));
+        header_param(line, len, "filename", mp->part.filename, sizeof(mp->part.filename));
+    }else if(len >= 13 && mg_ncasecmp(line, "Content-Type:", 13) == 0){
+        struct mg_str type = mg_strstrip(mg_str_n(line + 13, len - 13));
+        if(type.len >= sizeof(mp->part.content_type))
+            type.len = sizeof(mp->part.content_type) - 1;
+        memcpy(mp->part.content_type, type.ptr, type.len);
+        mp->part.content_type[type.len] = 0;
+    }
+}
+
+/* Offset of the first delimiter in in or -1 */
+static int find_delim(const struct multipart *mp, const char *in, int len){
+    const char *p = in, *last = in + len - mp->delimlen;
+    while(p <= last && (p = memchr(p, '\r', last - p + 1)) != NULL){
+        if(memcmp(p, mp->delim, mp->delimlen) == 0)
+            return p - in;
+        p++;
+    }
+    return -1;
+}
+
+/* Length of the end of in that could be the start of a delimiter */
+static int delim_prefix(const struct multipart *mp, const char *in, int len){
+    for(int i = len > mp->delimlen ? len - mp->delimlen + 1 : 0; i < len; i++){
+        if(in[i] == '\r' && memcmp(&in[i], mp->delim, len - i) == 0)
+            return len - i;
+    }
+    return 0;
+}
+
+bool multipart_init(struct multipart *mp, struct mg_str content_type){
+    char boundary[MULTIPART_BOUNDARY_MAX + 2];
+    int blen;
+    memset(mp, 0, sizeof(struct multipart));
+    mp->state = MULTIPART_ERROR;
+    mp->part.index = -1;
+    if(content_type.len < 10 || mg_ncasecmp(content_type.ptr, "multipart/", 10) != 0)
+        return false;
+    if(header_param(content_type.ptr, content_type.len, "boundary", boundary, sizeof(boundary)) == false)
+        return false;
+    blen = strlen(boundary);
+    if(blen == 0 || blen > MULTIPART_BOUNDARY_MAX)
+        return false;
+    memcpy(mp->delim, "\r\n--", 4);
+    memcpy(&mp->delim[4], boundary, blen);
+    mp->delimlen = blen + 4;
+    mp->state = MULTIPART_PREAMBLE;
+    return true;
+}
+
+int multipart_parse(struct multipart *mp, const char *in, int len, int *datalen){
+    int used = 0;
+    *datalen = 0;
+    while(used < len){
+        const char *p = &in[used];
+        int left = len - used;
+        int n;
+        const char *eol;
+        switch(mp->state){
+            case MULTIPART_PREAMBLE:
+                /* The body normally starts with the first delimiter (without the CRLF in front) */
+                n = mp->delimlen - 2;
+                if(memcmp(p, &mp->delim[2], left < n ? left : n) == 0){
+                    if(left < n)
+                        return used;
+                    used += n;
+                    mp->state = MULTIPART_DELIMITER;
+                    break;
+                }
+                /* Otherwise skip the preamble */
+                if((n = find_delim(mp, p, left)) < 0)
+                    return used + left - delim_prefix(mp, p, left);
+                used += n + mp->delimlen;
+                mp->state = MULTIPART_DELIMITER;
+                break;
+            case MULTIPART_DELIMITER:
+                /* "--" ends the body, otherwise (optional white space and) CRLF start the next part */
+                for(n = 0; n < left && (p[n] == ' ' || p[n] == '\t'); n++)
+                    ;
+                if(n == 0 && p[0] == '-'){
+                    if(left < 2)
+                        return used;
+                    mp->state = p[1] == '-' ? MULTIPART_DONE : MULTIPART_ERROR;
+                    break;
+                }
+                if(left - n < 2)
+                    return used + n;
+                if(p[n] != '\r' || p[n + 1] != '\n'){
+                    mp->state = MULTIPART_ERROR;
+                    return used;
+                }
+                used += n + 2;
+                n = mp->part.index + 1;
+                memset(&mp->part, 0, sizeof(mp->part));
+                mp->part.index = n;
+                mp->state = MULTIPART_HEADERS;
+                break;
+            case MULTIPART_HEADERS:
+                /* A line at a time - an empty line ends them */
+                if((eol = memchr(p, '\n', left)) == NULL){
+                    if(left > MULTIPART_LINE_MAX)
+                        mp->state = MULTIPART_ERROR;
+                    return used;
+                }
+                n = eol - p;
+                /* However it arrived */
+                if(n > MULTIPART_LINE_MAX){
+                    mp->state = MULTIPART_ERROR;
+                    return used;
+                }
+                used += n + 1;
+                if(n > 0 && p[n - 1] == '\r')
+                    n--;
+                if(n == 0)
+                    mp->state = MULTIPART_DATA;
+                else
+                    part_header(mp, p, n);
+                break;
+            case MULTIPART_DATA:
+                /* Everything up to the next delimiter - which includes the CRLF in front of it */
+                if((n = find_delim(mp, p, left)) == 0){
+                    used += mp->delimlen;
+                    mp->state = MULTIPART_DELIMITER;
+                    break;
+                }
+                *datalen = n > 0 ? n : left - delim_prefix(mp, p, left);
+                return used;
+            case MULTIPART_DONE:
+                /* The epilogue is ignored */
+                return len;
+            case MULTIPART_ERROR:
+            default:
+                return used;
+        }
+    }
+    return used;
+}
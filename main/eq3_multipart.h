@@ -0,0 +1,59 @@
+#ifndef EQ3_MULTIPART_H
+#define EQ3_MULTIPART_H
+
+#include <stdbool.h>
+#include "mongoose.h"
+
+/* multipart/form-data parser
+ * Parses an upload as it arrives without holding any of it. Framing (the delimiters and part
+ * headers) is skipped and runs of part data are handed back to the caller, pointing into the
+ * input. Anything the parser can't decide on yet - a part header line or a possible delimiter
+ * split across reads - isn't used, so the caller leaves it at the front of its input (the
+ * mongoose receive buffer) and passes it again with the next read appended.
+ *
+ *   for(;;){
+ *       used += multipart_parse(&mp, &in[used], len - used, &datalen);
+ *       if(datalen == 0) break;                         (more input needed, done or error)
+ *       taken = consume(&mp.part, &in[used], datalen);  (data for the part in mp.part)
+ *       used += taken;
+ *       if(taken < datalen) break;
+ *   }
+ */
+
+#define MULTIPART_BOUNDARY_MAX 70           /* RFC 2046 */
+#define MULTIPART_LINE_MAX     512          /* Longest part header line */
+#define MULTIPART_VALUE_MAX    64
+
+enum multipart_state {
+    MULTIPART_PREAMBLE,                     /* Before the first delimiter */
+    MULTIPART_DELIMITER,                    /* After a delimiter - another part or the end follows */
+    MULTIPART_HEADERS,
+    MULTIPART_DATA,
+    MULTIPART_DONE,                         /* The closing delimiter has been seen */
+    MULTIPART_ERROR
+};
+
+/* Headers of the current part - values longer than MULTIPART_VALUE_MAX are truncated */
+struct multipart_part {
+    int index;                              /* Part number from 0 */
+    char name[MULTIPART_VALUE_MAX];         /* Content-Disposition name */
+    char filename[MULTIPART_VALUE_MAX];     /* Content-Disposition filename - empty if it isn't a file */
+    char content_type[MULTIPART_VALUE_MAX];
+};
+
+struct multipart {
+    enum multipart_state state;
+    char delim[MULTIPART_BOUNDARY_MAX + 4]; /* "\r\n--<boundary>" */
+    int delimlen;
+    struct multipart_part part;
+};
+
+/* Set up for a body with this Content-Type - false if it isn't multipart or has no usable boundary */
+bool multipart_init(struct multipart *mp, struct mg_str content_type);
+
+/* Use framing from the start of in and find the part data that follows. Returns the number of
+ * framing bytes used - *datalen bytes of data for mp->part follow them. No data means the rest of
+ * in has to wait for more input, or mp->state is MULTIPART_DONE or MULTIPART_ERROR */
+int multipart_parse(struct multipart *mp, const char *in, int len, int *datalen);
+
+#endif
@@ -0,0 +1,303 @@
+/*
+ * EQ-3 firmware update writer.
+ *
+ * The partition erase in esp_ota_begin() takes seconds and each flash
+ * write stalls for milliseconds, so they run in their own task. The
+ * upload fills one buffer while the other is written and is paused
+ * (rather than buffering more of the image) when the flash falls behind.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
+
+#include "eq3_ota.h"
+#include "eq3_delta.h"
+#include "eq3_metrics.h"
+
+#define OTA_TAG "EQ3_OTA"
+
+#define OTA_BUFFERS    2
+#define OTA_TASK_STACK 4096
+#define OTA_TASK_PRIO  4            /* Below the mongoose task so the network stays responsive */
+
+struct ota_buf {
+    int len;
+    bool last;                      /* Finish the update once this has been written */
+    uint8_t data[OTA_BUF_SIZE];
+};
+
+static SemaphoreHandle_t ota_lock = NULL;
+static QueueHandle_t free_queue = NULL;     /* Buffers for the upload to fill */
+static QueueHandle_t full_queue = NULL;     /* Buffers for the writer */
+static struct ota_buf *bufs[OTA_BUFFERS];
+static struct ota_buf *filling = NULL;      /* Buffer being filled (mongoose task) */
+static const esp_partition_t *update_partition = NULL;
+static webtask_fn notify_fn = NULL;
+static void *notify_arg = NULL;
+static volatile bool waiting = false;       /* The upload is paused until a buffer is free */
+static volatile bool aborted = false;
+static int64_t start_us = 0;
+static int64_t stall_start = 0;
+static int64_t flash_us = 0;
+static int64_t stall_us = 0;
+static struct ota_status status;
+
+static void ota_release(void){
+    for(int i = 0; i < OTA_BUFFERS; i++){
+        free(bufs[i]);
+        bufs[i] = NULL;
+    }
+    if(free_queue != NULL)
+        vQueueDelete(free_queue);
+    if(full_queue != NULL)
+        vQueueDelete(full_queue);
+    free_queue = full_queue = NULL;
+    filling = NULL;
+}
+
+/* The first buffer says whether the upload is an image or a patch - a patch says how big the
+ * image will be so only that much of the partition is erased. A patch's header is checked against
+ * the running image first so the previous image is left alone if it doesn't apply - *used is set
+ * to the header length */
+static esp_err_t ota_start(const struct ota_buf *buf, esp_ota_handle_t *handle, struct delta **delta, int *used){
+    uint32_t size = OTA_SIZE_UNKNOWN;
+    esp_err_t err;
+    if(delta_is_patch(buf->data, buf->len, &size) == true){
+        if((*delta = delta_begin()) == NULL){
+            status.error = "No memory";
+            return ESP_ERR_NO_MEM;
+        }
+        if((err = delta_write(*delta, buf->data, DELTA_HEADER_LEN)) != ESP_OK){
+            status.error = delta_error(*delta);
+            return err;
+        }
+        *used = DELTA_HEADER_LEN;
+        ESP_LOGI(OTA_TAG, "Applying a patch for a %u byte image", size);
+    }
+    if((err = esp_ota_begin(update_partition, size, handle)) != ESP_OK){
+        ESP_LOGE(OTA_TAG, "Cannot start the update: %s", esp_err_to_name(err));
+        status.error = err == ESP_ERR_INVALID_SIZE ? "Image too large" : "Cannot erase the update partition";
+        return err;
+    }
+    if(*delta != NULL)
+        delta_set_output(*delta, *handle);
+    return ESP_OK;
+}
+
+static void ota_task(void *arg){
+    esp_ota_handle_t handle;
+    struct delta *delta = NULL;
+    struct ota_buf *buf;
+    bool begun = false, last = false;
+    int64_t t;
+    esp_err_t err = ESP_OK;
+
+    metrics_add_task(xTaskGetCurrentTaskHandle());
+
+    /* Anything received after a failure is discarded so the upload can finish and report it */
+    while(last == false && aborted == false){
+        xQueueReceive(full_queue, &buf, portMAX_DELAY);
+        if(err == ESP_OK && buf->len > 0){
+            int used = 0;
+            t = esp_timer_get_time();
+            if(begun == false && (err = ota_start(buf, &handle, &delta, &used)) == ESP_OK)
+                begun = true;
+            if(err == ESP_OK && delta != NULL){
+                if((err = delta_write(delta, &buf->data[used], buf->len - used)) != ESP_OK)
+                    status.error = delta_error(delta);
+            }else if(err == ESP_OK){
+                if((err = esp_ota_write(handle, buf->data, buf->len)) != ESP_OK){
+                    ESP_LOGE(OTA_TAG, "Write failed: %s", esp_err_to_name(err));
+                    status.error = err == ESP_ERR_OTA_VALIDATE_FAILED ? "Not a firmware image" : "Flash write failed";
+                }
+            }
+            flash_us += esp_timer_get_time() - t;
+        }
+        last = buf->last;
+        buf->len = 0;
+        buf->last = false;
+        xQueueSend(free_queue, &buf, 0);
+        if(waiting == true){
+            waiting = false;
+            webtask_post(notify_fn, notify_arg);
+        }
+    }
+
+    if(begun == true){
+        if(err == ESP_OK && aborted == false && delta != NULL && (err = delta_finish(delta)) != ESP_OK)
+            status.error = delta_error(delta);
+        if(err == ESP_OK && aborted == false){
+            t = esp_timer_get_time();
+            if((err = esp_ota_end(handle)) != ESP_OK){
+                status.error = "Image check failed";
+            }else if(delta != NULL && (err = delta_verify(delta, update_partition)) != ESP_OK){
+                /* A patch has to have rebuilt exactly the image it was made from */
+                status.error = delta_error(delta);
+            }else if((err = esp_ota_set_boot_partition(update_partition)) != ESP_OK){
+                status.error = "Cannot select the new image";
+            }
+            flash_us += esp_timer_get_time() - t;
+            if(err != ESP_OK)
+                ESP_LOGE(OTA_TAG, "Image check failed: %s", esp_err_to_name(err));
+        }else{
+            esp_ota_abort(handle);
+        }
+    }else if(err == ESP_OK && aborted == false){
+        err = ESP_FAIL;
+        status.error = "Nothing was uploaded";
+    }
+    delta_free(delta);
+
+    xSemaphoreTake(ota_lock, portMAX_DELAY);
+    ota_release();
+    status.upload_ms = (int)((esp_timer_get_time() - start_us) / 1000);
+    status.flash_ms = (int)(flash_us / 1000);
+    status.state = err == ESP_OK && aborted == false ? OTA_SUCCESS : OTA_FAILED;
+    xSemaphoreGive(ota_lock);
+    ESP_LOGI(OTA_TAG, "Update %s - %u bytes in %d ms, %d ms flash, %d ms paused", status.state == OTA_SUCCESS ? "complete" : "failed",
+             status.size, status.upload_ms, status.flash_ms, status.stall_ms);
+    webtask_post(notify_fn, notify_arg);
+
+    metrics_remove_task(xTaskGetCurrentTaskHandle());
+    vTaskDelete(NULL);
+}
+
+bool ota_begin(webtask_fn notify, void *arg){
+    bool ok = false;
+    if(ota_lock == NULL)
+        ota_lock = xSemaphoreCreateMutex();
+    xSemaphoreTake(ota_lock, portMAX_DELAY);
+    if(status.state == OTA_RUNNING || status.state == OTA_FINISHING){
+        xSemaphoreGive(ota_lock);
+        return false;
+    }
+    memset(&status, 0, sizeof(status));
+    status.state = OTA_FAILED;
+    notify_fn = notify;
+    notify_arg = arg;
+    waiting = aborted = false;
+    start_us = esp_timer_get_time();
+    stall_start = flash_us = stall_us = 0;
+
+    if((update_partition = esp_ota_get_next_update_partition(NULL)) == NULL){
+        status.error = "No update partition";
+    }else{
+        int nbufs = 0;
+        free_queue = xQueueCreate(OTA_BUFFERS, sizeof(struct ota_buf *));
+        full_queue = xQueueCreate(OTA_BUFFERS, sizeof(struct ota_buf *));
+        for(int i = 0; i < OTA_BUFFERS && free_queue != NULL; i++){
+            if((bufs[i] = calloc(1, sizeof(struct ota_buf))) != NULL){
+                xQueueSend(free_queue, &bufs[i], 0);
+                nbufs++;
+            }
+        }
+        if(nbufs < OTA_BUFFERS || full_queue == NULL){
+            status.error = "No memory";
+        }else{
+            status.state = OTA_RUNNING;
+            if(xTaskCreate(ota_task, "ota_task", OTA_TASK_STACK, NULL, OTA_TASK_PRIO, NULL) == pdPASS){
+                ok = true;
+                ESP_LOGI(OTA_TAG, "Updating partition %s", update_partition->label);
+            }else{
+                status.state = OTA_FAILED;
+                status.error = "Cannot start the writer";
+            }
+        }
+    }
+    if(ok == false)
+        ota_release();
+    xSemaphoreGive(ota_lock);
+    return ok;
+}
+
+/* Get a buffer to fill - false (and the upload is paused) if both are waiting for the flash */
+static bool ota_get_buffer(void){
+    if(filling == NULL && xQueueReceive(free_queue, &filling, 0) != pdTRUE){
+        waiting = true;
+        /* The writer may have freed one before it could see waiting */
+        if(xQueueReceive(free_queue, &filling, 0) != pdTRUE){
+            if(stall_start == 0){
+                stall_start = esp_timer_get_time();
+                status.stalls++;
+            }
+            return false;
+        }
+        waiting = false;
+    }
+    if(stall_start != 0){
+        stall_us += esp_timer_get_time() - stall_start;
+        status.stall_ms = (int)(stall_us / 1000);
+        stall_start = 0;
+    }
+    return true;
+}
+
+int ota_write(const uint8_t *data, int len){
+    int taken = 0;
+    /* Anything after the update has been abandoned is dropped */
+    if(status.state != OTA_RUNNING)
+        return len;
+    while(taken < len && ota_get_buffer() == true){
+        int n = len - taken;
+        if(n > OTA_BUF_SIZE - filling->len)
+            n = OTA_BUF_SIZE - filling->len;
+        memcpy(&filling->data[filling->len], &data[taken], n);
+        filling->len += n;
+        taken += n;
+        status.size += n;
+        if(filling->len == OTA_BUF_SIZE){
+            xQueueSend(full_queue, &filling, 0);
+            filling = NULL;
+        }
+    }
+    return taken;
+}
+
+bool ota_finish(void){
+    if(status.state != OTA_RUNNING)
+        return true;
+    if(ota_get_buffer() == false)
+        return false;
+    filling->last = true;
+    status.state = OTA_FINISHING;
+    xQueueSend(full_queue, &filling, 0);
+    filling = NULL;
+    return true;
+}
+
+void ota_abort(const char *why){
+    if(ota_lock == NULL)
+        return;
+    xSemaphoreTake(ota_lock, portMAX_DELAY);
+    if(status.state == OTA_RUNNING){
+        ESP_LOGI(OTA_TAG, "Update abandoned after %u bytes: %s", status.size, why);
+        status.error = why;
+        status.state = OTA_FINISHING;
+        aborted = true;
+        /* Wake the writer if it is waiting for data - otherwise it stops after the buffer it is writing */
+        if(filling != NULL || xQueueReceive(free_queue, &filling, 0) == pdTRUE){
+            filling->last = true;
+            xQueueSend(full_queue, &filling, 0);
+        }
+        filling = NULL;
+    }
+    xSemaphoreGive(ota_lock);
+}
+
+void ota_get_status(struct ota_status *st){
+    *st = status;
+    if(st->state == OTA_RUNNING || st->state == OTA_FINISHING){
+        st->upload_ms = (int)((esp_timer_get_time() - start_us) / 1000);
+        st->flash_ms = (int)(flash_us / 1000);
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef EQ3_OTA_H
+#define EQ3_OTA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eq3_webtask.h"
+
+/* Firmware update
+ * The upload is received in the mongoose task and handed to an ota writer task through two
+ * OTA_BUF_SIZE buffers, so the partition erase and flash writes never hold up the network.
+ * While the writer flashes one buffer the upload fills the other. When both are waiting for
+ * the flash ota_write() takes less than it is given and the upload stops reading from its
+ * socket until the writer calls notify (in the mongoose task) to say there is room again.
+ * notify is called once more when the update has finished.
+ * The upload can be a patch against the running image instead of a whole image (see eq3_delta.h). */
+
+#define OTA_BUF_SIZE 4096           /* One flash sector */
+
+enum ota_state {
+    OTA_IDLE,
+    OTA_RUNNING,                    /* Receiving the image */
+    OTA_FINISHING,                  /* All received - flushing and checking the image */
+    OTA_SUCCESS,                    /* Boots the new image after a restart */
+    OTA_FAILED
+};
+
+struct ota_status {
+    enum ota_state state;
+    uint32_t size;                  /* Image bytes received */
+    int upload_ms;                  /* From the start of the upload until the image was checked (so far if running) */
+    int flash_ms;                   /* Time spent erasing, writing and checking the flash */
+    int stall_ms;                   /* Time the upload was paused waiting for the flash */
+    int stalls;
+    const char *error;              /* Why it failed */
+};
+
+/* Called from the mongoose task */
+/* Start an update - false if one is already running or it can't be started (see ota_get_status) */
+bool ota_begin(webtask_fn notify, void *arg);
+/* Add image data - returns how much was taken, wait for notify before giving it the rest */
+int ota_write(const uint8_t *data, int len);
+/* The whole image has been given - false if the last buffer has to wait for notify (call again) */
+bool ota_finish(void);
+/* Give up on the update - why is reported as the error */
+void ota_abort(const char *why);
+
+/* Progress and timing of the current or last update (any task) */
+void ota_get_status(struct ota_status *status);
+
+#endif
@@ -0,0 +1,342 @@
+/*
+ * EQ-3 outbound mqtt store-and-forward queue.
+ *
+ * Status, error and device list messages produced while the broker is
+ * unreachable are held here and replayed in order on reconnect.
+ * The RAM queue is bounded by size. When it is full the oldest message is
+ * moved to the flash partition (if spill is enabled and the partition is
+ * present) or dropped. Flash always holds older messages than RAM so replay
+ * drains flash first. Spilled messages survive a restart, RAM ones do not.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+#ifdef CONFIG_EQ3_OUTQ_FLASH_SPILL
+#include "esp_partition.h"
+#endif
+
+#include "eq3_outq.h"
+
+#define OUTQ_TAG "EQ3_OUTQ"
+
+#ifdef CONFIG_EQ3_OUTQ_RAM_SIZE
+#define OUTQ_RAM_SIZE CONFIG_EQ3_OUTQ_RAM_SIZE
+#else
+#define OUTQ_RAM_SIZE 4096
+#endif
+
+/* Queued message - topic, data and compaction key are stored nul-terminated one after the other in buf */
+struct outq_msg {
+    struct outq_msg *next;
+    uint16_t topiclen;
+    uint16_t datalen;
+    uint16_t keylen;
+    bool retain;
+    char buf[];
+};
+
+#define MSG_SIZE(m) (sizeof(struct outq_msg) + (m)->topiclen + (m)->datalen + (m)->keylen + 3)
+#define MSG_TOPIC(m) ((m)->buf)
+#define MSG_DATA(m) ((m)->buf + (m)->topiclen + 1)
+#define MSG_KEY(m) ((m)->buf + (m)->topiclen + (m)->datalen + 2)
+
+static struct outq_msg *qhead = NULL;
+static SemaphoreHandle_t outq_lock = NULL;
+static struct outq_stats stats;
+
+#ifdef CONFIG_EQ3_OUTQ_FLASH_SPILL
+/* Flash spill area is a linear log reset once it has been fully replayed. Sectors are erased as the write offset reaches them.
+ * A record's magic is zeroed once it has been published so what is left after a reboot can be found and replayed */
+#define SPILL_MAGIC       0x5153
+#define SPILL_CONSUMED    0x0000
+#define SPILL_SECTOR_SIZE 4096
+
+struct spill_hdr {
+    uint16_t magic;
+    uint16_t reclen;    /* Record length including header and padding */
+    uint16_t topiclen;
+    uint16_t datalen;
+    uint8_t retain;
+    uint8_t pad[3];
+};
+
+static const esp_partition_t *spill_part = NULL;
+static size_t spill_rd = 0, spill_wr = 0, spill_erased = 0;
+static int spill_count = 0;
+
+/* Append a message to flash (call with outq_lock held) */
+static bool spill_write(struct outq_msg *msg){
+    struct spill_hdr hdr = {
+        .magic = SPILL_MAGIC,
+        .topiclen = msg->topiclen,
+        .datalen = msg->datalen,
+        .retain = msg->retain ? 1 : 0,
+    };
+    size_t payload = msg->topiclen + msg->datalen + 2;
+    hdr.reclen = (sizeof(hdr) + payload + 3) & ~3;
+
+    if(spill_part == NULL || spill_wr + hdr.reclen > spill_part->size)
+        return false;
+    /* Keep the sector holding the next header erased too so recovery finds the end of the log */
+    while(spill_erased <= spill_wr + hdr.reclen && spill_erased < spill_part->size){
+        if(esp_partition_erase_range(spill_part, spill_erased, SPILL_SECTOR_SIZE) != ESP_OK)
+            return false;
+        spill_erased += SPILL_SECTOR_SIZE;
+    }
+    if(esp_partition_write(spill_part, spill_wr, &hdr, sizeof(hdr)) != ESP_OK ||
+       esp_partition_write(spill_part, spill_wr + sizeof(hdr), msg->buf, payload) != ESP_OK)
+        return false;
+    spill_wr += hdr.reclen;
+    spill_count++;
+    return true;
+}
+
+/* Read the oldest message back from flash without consuming it (call with outq_lock held)
+ * Only the replay path reads flash so the record stays put until spill_consume() */
+static struct outq_msg *spill_peek(void){
+    struct spill_hdr hdr;
+    struct outq_msg *msg = NULL;
+
+    if(spill_count == 0)
+        return NULL;
+    if(esp_partition_read(spill_part, spill_rd, &hdr, sizeof(hdr)) == ESP_OK && hdr.magic == SPILL_MAGIC){
+        msg = malloc(sizeof(struct outq_msg) + hdr.topiclen + hdr.datalen + 3);
+        if(msg != NULL){
+            msg->next = NULL;
+            msg->topiclen = hdr.topiclen;
+            msg->datalen = hdr.datalen;
+            msg->keylen = 0;
+            msg->retain = hdr.retain != 0;
+            if(esp_partition_read(spill_part, spill_rd + sizeof(hdr), msg->buf, hdr.topiclen + hdr.datalen + 2) != ESP_OK){
+                free(msg);
+                msg = NULL;
+            }else{
+                MSG_KEY(msg)[0] = 0;
+            }
+        }
+    }
+    if(msg == NULL){
+        /* Unreadable flash - abandon everything spilled */
+        ESP_LOGE(OUTQ_TAG, "Spilled messages unreadable - dropping %d", spill_count);
+        stats.dropped += spill_count;
+        stats.queued -= spill_count;
+        spill_count = 0;
+        spill_rd = spill_wr = spill_erased = 0;
+    }
+    return msg;
+}
+
+/* The oldest flash record has been published (call with outq_lock held) */
+static void spill_consume(void){
+    struct spill_hdr hdr;
+    uint16_t consumed = SPILL_CONSUMED;
+    if(spill_count == 0 || esp_partition_read(spill_part, spill_rd, &hdr, sizeof(hdr)) != ESP_OK)
+        return;
+    /* Clearing bits needs no erase */
+    esp_partition_write(spill_part, spill_rd, &consumed, sizeof(consumed));
+    spill_rd += hdr.reclen;
+    spill_count--;
+    stats.queued--;
+    if(spill_count == 0)
+        spill_rd = spill_wr = spill_erased = 0;
+}
+
+/* Find messages spilled before a reboot that were never published - the log runs from the start of the
+ * partition to the first erased or invalid header */
+static void spill_recover(void){
+    struct spill_hdr hdr;
+    size_t offset = 0;
+    bool first = true;
+
+    while(offset + sizeof(hdr) <= spill_part->size && esp_partition_read(spill_part, offset, &hdr, sizeof(hdr)) == ESP_OK){
+        if((hdr.magic != SPILL_MAGIC && hdr.magic != SPILL_CONSUMED) ||
+           hdr.reclen < sizeof(hdr) + hdr.topiclen + hdr.datalen + 2 || offset + hdr.reclen > spill_part->size)
+            break;
+        if(hdr.magic == SPILL_MAGIC){
+            if(first)
+                spill_rd = offset;
+            first = false;
+            spill_count++;
+        }
+        offset += hdr.reclen;
+    }
+    if(spill_count == 0)
+        return;
+    spill_wr = offset;
+    spill_erased = (offset + SPILL_SECTOR_SIZE - 1) & ~(SPILL_SECTOR_SIZE - 1);
+    stats.queued = spill_count;
+    ESP_LOGI(OUTQ_TAG, "Recovered %d spilled messages from before the last restart", spill_count);
+}
+#endif
+
+void outq_init(void){
+    if(outq_lock == NULL)
+        outq_lock = xSemaphoreCreateMutex();
+    memset(&stats, 0, sizeof(stats));
+#ifdef CONFIG_EQ3_OUTQ_FLASH_SPILL
+    spill_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "mqttq");
+    if(spill_part == NULL)
+        ESP_LOGI(OUTQ_TAG, "No mqttq partition - outbound queue is RAM only");
+    else
+        spill_recover();
+#endif
+}
+
+/* Make room for a message by spilling or dropping the oldest (call with outq_lock held) */
+static void outq_make_room(int size){
+    while(qhead != NULL && stats.bytes + size > OUTQ_RAM_SIZE){
+        struct outq_msg *oldest = qhead;
+        qhead = oldest->next;
+        stats.bytes -= MSG_SIZE(oldest);
+#ifdef CONFIG_EQ3_OUTQ_FLASH_SPILL
+        if(spill_write(oldest) == true){
+            stats.spilled++;
+        }else
+#endif
+        {
+            stats.dropped++;
+            stats.queued--;
+            ESP_LOGE(OUTQ_TAG, "Outbound queue full - dropped message for %s (%d dropped)", MSG_TOPIC(oldest), stats.dropped);
+        }
+        free(oldest);
+    }
+}
+
+int outq_push(const char *topic, const char *data, int len, bool retain, const char *compactkey){
+    struct outq_msg *msg, **walk;
+    int topiclen = strlen(topic);
+    int keylen = compactkey == NULL ? 0 : strlen(compactkey);
+    int size = sizeof(struct outq_msg) + topiclen + len + keylen + 3;
+    int queued;
+
+    if(outq_lock == NULL)
+        return -1;
+    msg = size > OUTQ_RAM_SIZE ? NULL : malloc(size);
+    if(msg == NULL){
+        xSemaphoreTake(outq_lock, portMAX_DELAY);
+        stats.dropped++;
+        xSemaphoreGive(outq_lock);
+        return -1;
+    }
+    msg->next = NULL;
+    msg->topiclen = topiclen;
+    msg->datalen = len;
+    msg->keylen = keylen;
+    msg->retain = retain;
+    memcpy(MSG_TOPIC(msg), topic, topiclen + 1);
+    memcpy(MSG_DATA(msg), data, len);
+    MSG_DATA(msg)[len] = 0;
+    memcpy(MSG_KEY(msg), keylen ? compactkey : "", keylen + 1);
+
+    xSemaphoreTake(outq_lock, portMAX_DELAY);
+    /* Latest only - remove a queued message with the same key */
+    if(keylen > 0){
+        for(walk = &qhead; *walk != NULL; walk = &(*walk)->next){
+            if((*walk)->keylen == keylen && strcmp(MSG_KEY(*walk), compactkey) == 0){
+                struct outq_msg *oldmsg = *walk;
+                *walk = oldmsg->next;
+                stats.bytes -= MSG_SIZE(oldmsg);
+                stats.queued--;
+                stats.compacted++;
+                free(oldmsg);
+                break;
+            }
+        }
+    }
+    outq_make_room(MSG_SIZE(msg));
+    for(walk = &qhead; *walk != NULL; walk = &(*walk)->next)
+        ;
+    *walk = msg;
+    stats.bytes += MSG_SIZE(msg);
+    queued = ++stats.queued;
+    xSemaphoreGive(outq_lock);
+    ESP_LOGI(OUTQ_TAG, "Queued message for %s (%d queued)", topic, queued);
+    return 0;
+}
+
+bool outq_pending(void){
+    bool pending;
+    if(outq_lock == NULL)
+        return false;
+    xSemaphoreTake(outq_lock, portMAX_DELAY);
+    pending = stats.queued > 0;
+    xSemaphoreGive(outq_lock);
+    return pending;
+}
+
+/* Take the oldest message off the queue - messages from flash are only consumed once sent */
+static struct outq_msg *outq_pop(bool *fromflash){
+    struct outq_msg *msg = NULL;
+    xSemaphoreTake(outq_lock, portMAX_DELAY);
+#ifdef CONFIG_EQ3_OUTQ_FLASH_SPILL
+    msg = spill_peek();
+#endif
+    *fromflash = msg != NULL;
+    if(msg == NULL && qhead != NULL){
+        msg = qhead;
+        qhead = msg->next;
+        stats.bytes -= MSG_SIZE(msg);
+        stats.queued--;
+    }
+    xSemaphoreGive(outq_lock);
+    return msg;
+}
+
+/* Put a message that could not be sent back at the front of the queue */
+static void outq_requeue(struct outq_msg *msg){
+    xSemaphoreTake(outq_lock, portMAX_DELAY);
+    msg->next = qhead;
+    qhead = msg;
+    stats.bytes += MSG_SIZE(msg);
+    stats.queued++;
+    outq_make_room(0);
+    xSemaphoreGive(outq_lock);
+}
+
+/* Publish everything queued, oldest first. The lock is not held while publishing */
+int outq_replay(outq_publish_t publish){
+    struct outq_msg *msg;
+    bool fromflash;
+    int sent = 0, dropped = 0;
+    if(outq_lock == NULL)
+        return 0;
+    while((msg = outq_pop(&fromflash)) != NULL){
+        if(publish(MSG_TOPIC(msg), MSG_DATA(msg), msg->datalen, msg->retain) < 0){
+            if(fromflash)
+                free(msg);
+            else
+                outq_requeue(msg);
+            break;
+        }
+        xSemaphoreTake(outq_lock, portMAX_DELAY);
+#ifdef CONFIG_EQ3_OUTQ_FLASH_SPILL
+        if(fromflash)
+            spill_consume();
+#endif
+        stats.replayed++;
+        dropped = stats.dropped;
+        xSemaphoreGive(outq_lock);
+        free(msg);
+        sent++;
+    }
+    if(sent > 0)
+        ESP_LOGI(OUTQ_TAG, "Replayed %d queued messages (%d dropped while disconnected)", sent, dropped);
+    return sent;
+}
+
+void outq_get_stats(struct outq_stats *s){
+    if(outq_lock == NULL){
+        *s = stats;
+        return;
+    }
+    xSemaphoreTake(outq_lock, portMAX_DELAY);
+    *s = stats;
+    xSemaphoreGive(outq_lock);
+}
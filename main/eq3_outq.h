@@ -0,0 +1,29 @@
+
+#ifndef EQ3_OUTQ_H
+#define EQ3_OUTQ_H
+
+/* Outbound mqtt store-and-forward queue
+ * Messages published while the broker is unreachable are held here (in RAM, optionally
+ * spilling the oldest to a flash partition) and replayed in order once connected again.
+ * Messages queued with a compaction key replace any queued message with the same key. */
+
+struct outq_stats {
+    int queued;        /* Messages currently held (RAM + flash) */
+    int bytes;         /* RAM bytes currently held */
+    int dropped;       /* Messages lost because the queue was full */
+    int compacted;     /* Messages replaced by a newer message with the same key */
+    int spilled;       /* Messages moved from RAM to flash */
+    int replayed;      /* Messages published after a reconnect */
+};
+
+void outq_init(void);
+int outq_push(const char *topic, const char *data, int len, bool retain, const char *compactkey);
+bool outq_pending(void);
+
+/* Publish function used for replay - returns <0 if the message could not be sent */
+typedef int (*outq_publish_t)(const char *topic, const char *data, int len, bool retain);
+int outq_replay(outq_publish_t publish);
+
+void outq_get_stats(struct outq_stats *stats);
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * EQ-3 request routes.
+ *
+ * The lookup from a request's uri to its entry in the route table. Kept
+ * apart from the handlers (in eq3_bootwifi.c) so it builds on the host for
+ * tools/bench_routes.c.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "eq3_routes.h"
+
+bool route_match(const struct route *route, struct mg_str uri){
+    if(route->uri[route->len - 1] == '#')
+        return uri.len >= route->len - 1 && memcmp(uri.ptr, route->uri, route->len - 1) == 0;
+    return uri.len == route->len && memcmp(uri.ptr, route->uri, route->len) == 0;
+}
+
+const struct route *route_find(const struct route *routes, struct mg_str uri){
+    for(const struct route *route = routes; route->uri != NULL; route++){
+        if(route_match(route, uri))
+            return route;
+    }
+    return NULL;
+}
+
+uint8_t route_method(const struct mg_http_message *message){
+    if(mg_vcmp(&message->method, "GET") == 0)
+        return ROUTE_GET;
+    if(mg_vcmp(&message->method, "POST") == 0)
+        return ROUTE_POST;
+    return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef EQ3_ROUTES_H
+#define EQ3_ROUTES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mongoose.h"
+
+/* Request routes
+ * The urls the web server answers, matched in order against the request's uri. A route ending in #
+ * matches any url that starts with the rest (as mg_http_match_uri() does). The table is kept here as
+ * EQ3_ROUTES() so tools/bench_routes.c times the same list the firmware dispatches - expand it with a
+ * macro taking (uri, methods, handler, page) where the handler is NULL for a static page. */
+
+#define ROUTE_GET  0x01
+#define ROUTE_POST 0x02
+
+/* A url the hub answers - the handler, or the static page served for it */
+struct route {
+    const char *uri;
+    uint8_t len;
+    uint8_t methods;
+    void (*fn)(struct mg_connection *nc, struct mg_http_message *message);
+    const char *page;
+};
+
+#define ROUTE(uri) uri, sizeof(uri) - 1
+
+/* Matched in order - the busiest first */
+#define EQ3_ROUTES(R) \
+    R("/status.json",        ROUTE_GET,  mongoose_serve_status_json,   NULL) \
+    R("/web/#",              ROUTE_GET,  mongoose_serve_web,           NULL) \
+    R("/ws",                 ROUTE_GET,  events_upgrade,               NULL) \
+    R("/set",                ROUTE_GET,  mongoose_serve_set,           NULL) \
+    R("/",                   ROUTE_GET,  mongoose_serve_root,          NULL) \
+    R("/api/v1/devices",     ROUTE_GET,  mongoose_api_devices,         NULL) \
+    R("/api/v1/devices/#",   ROUTE_GET,  mongoose_api_device,          NULL) \
+    R("/api/v1/queue",       ROUTE_GET,  mongoose_api_queue,           NULL) \
+    R("/api/v1/metrics",     ROUTE_GET,  mongoose_api_metrics,         NULL) \
+    R("/api/v1/log",         ROUTE_GET,  mongoose_api_log,             NULL) \
+    R("/api/v1/journal",     ROUTE_GET,  mongoose_serve_journal,       NULL) \
+    R("/api/v1/status",      ROUTE_GET,  mongoose_serve_status_json,   NULL) \
+    R("/api/v1/set",         ROUTE_GET,  mongoose_serve_set,           NULL) \
+    R("/api/v1/#",           ROUTE_GET | ROUTE_POST, mongoose_api_not_found, NULL) \
+    R("/config.json",        ROUTE_GET,  mongoose_serve_config_json,   NULL) \
+    R("/configSubmit",       ROUTE_POST, mongoose_serve_config_submit, NULL) \
+    R("/sendCommand",        ROUTE_POST, mongoose_serve_send_command,  NULL) \
+    R("/getdevices",         ROUTE_GET,  mongoose_serve_devices,       NULL) \
+    R("/command",            ROUTE_GET,  mongoose_serve_command,       NULL) \
+    R("/viewlog",            ROUTE_GET,  mongoose_serve_log,           NULL) \
+    R("/journal",            ROUTE_GET,  mongoose_serve_journal,       NULL) \
+    R("/scan",               ROUTE_GET,  mongoose_serve_scan,          NULL) \
+    R("/otaupload",          ROUTE_POST, mongoose_serve_ota_upload,    NULL) \
+    R("/otastatus",          ROUTE_GET,  mongoose_serve_ota_result,    NULL) \
+    R("/restartnow",         ROUTE_GET,  mongoose_serve_restart,       NULL) \
+    R("/status",             ROUTE_GET,  NULL, "/web/index.html") \
+    R("/config",             ROUTE_GET,  NULL, "/web/config.html") \
+    R("/upload",             ROUTE_GET,  NULL, "/web/upload.html")
+
+/* Same as mg_http_match_uri() for the patterns used here, without rescanning the pattern for each request */
+bool route_match(const struct route *route, struct mg_str uri);
+/* The first route in routes (ended by one with a NULL uri) matching uri - NULL if there isn't one */
+const struct route *route_find(const struct route *routes, struct mg_str uri);
+/* ROUTE_GET or ROUTE_POST for the request's method - 0 for any other */
+uint8_t route_method(const struct mg_http_message *message);
+
+#endif
@@ -0,0 +1,463 @@
+/*
+ * EQ-3 TRV registry.
+ *
+ * Known TRVs are held in RAM and mirrored in NVS (one record per TRV keyed
+ * by its address plus an index of addresses) so the hub knows its valves,
+ * their names, groups, GATT handles and last state as soon as it boots.
+ * Only changes to those details are written - rssi from scans is RAM only.
+ * State reports arrive on the bluetooth task so they are written later from
+ * trv_poll() in the main loop, at most once every STATE_SAVE_S for each TRV.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "eq3_trvs.h"
+
+#define TRVS_TAG "EQ3_TRVS"
+
+#define TRVS_NAMESPACE "eq3trvs"
+#define KEY_INDEX      "index"
+
+/* Times before 2019 mean the clock hasn't been set */
+#define VALID_TIME     1546300800
+
+/* Shortest time between state writes for a TRV - the valve position changes with nearly every report */
+#define STATE_SAVE_S   300
+
+/* What is stored in NVS for each TRV */
+struct trv_record {
+    char name[TRV_NAME_LEN];
+    uint8_t groups;
+    uint16_t cmd_handle;
+    uint16_t resp_handle;
+    struct trv_last_state state;
+};
+
+static struct trv_info trvs[TRV_MAX];
+static int num_trvs = 0;
+/* When each TRV's record was last written and whether its state has changed since - kept in step with trvs */
+static struct {
+    int64_t saved;
+    bool dirty;
+} saves[TRV_MAX];
+static SemaphoreHandle_t trvs_lock = NULL;
+
+/* NVS key for a TRV - its address as 12 hex digits */
+static void trv_key(const esp_bd_addr_t bda, char *key){
+    sprintf(key, "%02x%02x%02x%02x%02x%02x", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+}
+
+static int find_trv(const esp_bd_addr_t bda){
+    for(int idx = 0; idx < num_trvs; idx++){
+        if(memcmp(trvs[idx].bda, bda, sizeof(esp_bd_addr_t)) == 0)
+            return idx;
+    }
+    return -1;
+}
+
+/* Write the address index - called with the lock held */
+static void save_index(nvs_handle handle){
+    uint8_t index[TRV_MAX * sizeof(esp_bd_addr_t)];
+    for(int idx = 0; idx < num_trvs; idx++)
+        memcpy(&index[idx * sizeof(esp_bd_addr_t)], trvs[idx].bda, sizeof(esp_bd_addr_t));
+    if(num_trvs > 0)
+        nvs_set_blob(handle, KEY_INDEX, index, num_trvs * sizeof(esp_bd_addr_t));
+    else
+        nvs_erase_key(handle, KEY_INDEX);
+}
+
+/* Copy what is stored for a TRV - called with the lock held. The state is then up to date in NVS */
+static void trv_record(int idx, struct trv_record *record){
+    memset(record, 0, sizeof(struct trv_record));
+    strcpy(record->name, trvs[idx].name);
+    record->groups = trvs[idx].groups;
+    record->cmd_handle = trvs[idx].cmd_handle;
+    record->resp_handle = trvs[idx].resp_handle;
+    record->state = trvs[idx].state;
+    saves[idx].saved = esp_timer_get_time();
+    saves[idx].dirty = false;
+}
+
+static void write_record(nvs_handle handle, const esp_bd_addr_t bda, const struct trv_record *record){
+    char key[13];
+    trv_key(bda, key);
+    nvs_set_blob(handle, key, record, sizeof(struct trv_record));
+}
+
+/* Write the record of a TRV (and the index if it is new) - called with the lock held */
+static void save_trv(int idx, bool newtrv){
+    nvs_handle handle;
+    struct trv_record record;
+
+    if(nvs_open(TRVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK){
+        ESP_LOGE(TRVS_TAG, "Can't open registry");
+        return;
+    }
+    trv_record(idx, &record);
+    write_record(handle, trvs[idx].bda, &record);
+    if(newtrv == true)
+        save_index(handle);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+/* Add a TRV - called with the lock held. Returns the index or -1 if the registry is full */
+static int add_trv(const esp_bd_addr_t bda){
+    if(num_trvs >= TRV_MAX){
+        ESP_LOGE(TRVS_TAG, "Registry full");
+        return -1;
+    }
+    memset(&trvs[num_trvs], 0, sizeof(struct trv_info));
+    memset(&saves[num_trvs], 0, sizeof(saves[0]));
+    memcpy(trvs[num_trvs].bda, bda, sizeof(esp_bd_addr_t));
+    return num_trvs++;
+}
+
+void trv_init(void){
+    nvs_handle handle;
+    uint8_t index[TRV_MAX * sizeof(esp_bd_addr_t)];
+    size_t size = sizeof(index);
+
+    if(trvs_lock == NULL)
+        trvs_lock = xSemaphoreCreateMutex();
+    num_trvs = 0;
+    if(nvs_open(TRVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+        return;
+    if(nvs_get_blob(handle, KEY_INDEX, index, &size) == ESP_OK){
+        for(int entry = 0; entry < size / sizeof(esp_bd_addr_t); entry++){
+            struct trv_record record;
+            size_t recsize = sizeof(record);
+            char key[13];
+            int idx = add_trv(&index[entry * sizeof(esp_bd_addr_t)]);
+            if(idx < 0)
+                break;
+            trv_key(trvs[idx].bda, key);
+            if(nvs_get_blob(handle, key, &record, &recsize) == ESP_OK && recsize == sizeof(record)){
+                record.name[TRV_NAME_LEN - 1] = 0;
+                strcpy(trvs[idx].name, record.name);
+                trvs[idx].groups = record.groups;
+                trvs[idx].cmd_handle = record.cmd_handle;
+                trvs[idx].resp_handle = record.resp_handle;
+                trvs[idx].state = record.state;
+            }
+        }
+    }
+    nvs_close(handle);
+    ESP_LOGI(TRVS_TAG, "%d TRVs in the registry", num_trvs);
+}
+
+void trv_seen(esp_bd_addr_t bda, int rssi){
+    int idx;
+    if(trvs_lock == NULL)
+        return;
+    xSemaphoreTake(trvs_lock, portMAX_DELAY);
+    if((idx = find_trv(bda)) < 0){
+        if((idx = add_trv(bda)) >= 0)
+            save_trv(idx, true);
+    }
+    if(idx >= 0)
+        trvs[idx].rssi = rssi;
+    xSemaphoreGive(trvs_lock);
+}
+
+bool trv_get_index(int idx, struct trv_info *info){
+    bool found = false;
+    if(trvs_lock == NULL)
+        return false;
+    xSemaphoreTake(trvs_lock, portMAX_DELAY);
+    if(idx >= 0 && idx < num_trvs){
+        *info = trvs[idx];
+        found = true;
+    }
+    xSemaphoreGive(trvs_lock);
+    return found;
+}
+
+int trv_count(void){
+    return num_trvs;
+}
+
+bool trv_find_name(const char *name, int namelen, esp_bd_addr_t bda){
+    bool found = false;
+    if(trvs_lock == NULL || namelen <= 0 || namelen >= TRV_NAME_LEN)
+        return false;
+    xSemaphoreTake(trvs_lock, portMAX_DELAY);
+    for(int idx = 0; idx < num_trvs && found == false; idx++){
+        if(strlen(trvs[idx].name) == namelen && strncasecmp(trvs[idx].name, name, namelen) == 0){
+            memcpy(bda, trvs[idx].bda, sizeof(esp_bd_addr_t));
+            found = true;
+        }
+    }
+    xSemaphoreGive(trvs_lock);
+    return found;
+}
+
+bool trv_parse(const char *str, int len, esp_bd_addr_t bda){
+    int pos = 0;
+    for(int byte = 0; byte < sizeof(esp_bd_addr_t); byte++){
+        if(byte > 0){
+            if(pos < len && str[pos] == ':')
+                pos++;
+            else if(pos + 3 <= len && strncasecmp(&str[pos], "%3a", 3) == 0)
+                pos += 3;
+            else
+                return trv_find_name(str, len, bda);
+        }
+        if(pos + 2 > len || !isxdigit((int)str[pos]) || !isxdigit((int)str[pos + 1]))
+            return trv_find_name(str, len, bda);
+        char hex[3] = {str[pos], str[pos + 1], 0};
+        bda[byte] = (uint8_t)strtol(hex, NULL, 16);
+        pos += 2;
+    }
+    return pos == len;
+}
+
+bool trv_get(const esp_bd_addr_t bda, struct trv_info *info){
+    int idx;
+    if(trvs_lock == NULL)
+        return false;
+    xSemaphoreTake(trvs_lock, portMAX_DELAY);
+    if((idx = find_trv(bda)) >= 0)
+        *info = trvs[idx];
+    xSemaphoreGive(trvs_lock);
+    return idx >= 0;
+}
+
+bool trv_get_handles(esp_bd_addr_t bda, uint16_t *cmd_handle, uint16_t *resp_handle){
+    int idx;
+    bool found = false;
+    if(trvs_lock == NULL)
+        return false;
+    xSemaphoreTake(trvs_lock, portMAX_DELAY);
+    if((idx = find_trv(bda)) >= 0 && trvs[idx].cmd_handle != 0 && trvs[idx].resp_handle != 0){
+        *cmd_handle = trvs[idx].cmd_handle;
+        *resp_handle = trvs[idx].resp_handle;
+        found = true;
+    }
+    xSemaphoreGive(trvs_lock);
+    return found;
+}
+
+void trv_set_handles(esp_bd_addr_t bda, uint16_t cmd_handle, uint16_t resp_handle){
+    int idx;
+    bool newtrv = false;
+    if(trvs_lock == NULL)
+        return;
+    xSemaphoreTake(trvs_lock, portMAX_DELAY);
+    /* A TRV commanded by address before any scan found it is added here */
+    if((idx = find_trv(bda)) < 0 && cmd_handle != 0){
+        idx = add_trv(bda);
+        newtrv = true;
+    }
+    if(idx >= 0 && (newtrv || trvs[idx].cmd_handle != cmd_handle || trvs[idx].resp_handle != resp_handle)){
+        trvs[idx].cmd_handle = cmd_handle;
+        trvs[idx].resp_handle = resp_handle;
+        save_trv(idx, newtrv);
+    }
+    xSemaphoreGive(trvs_lock);
+}
+
+void trv_set_state(esp_bd_addr_t bda, const struct trv_last_state *state){
+    int idx;
+    time_t now = 0;
+    if(trvs_lock == NULL)
+        return;
+    time(&now);
+    xSemaphoreTake(trvs_lock, portMAX_DELAY);
+    if((idx = find_trv(bda)) >= 0){
+        struct trv_last_state *last = &trvs[idx].state;
+        /* Only the settings are compared - a new time alone isn't worth a flash write */
+        bool changed = last->valid != state->valid || last->temp_x2 != state->temp_x2 || last->valve != state->valve ||
+                       last->flags != state->flags || last->has_offset != state->has_offset || last->offset_x2 != state->offset_x2;
+        *last = *state;
+        last->time = now > VALID_TIME ? (uint32_t)now : 0;
+        if(changed)
+            saves[idx].dirty = true;
+    }
+    xSemaphoreGive(trvs_lock);
+}
+
+void trv_poll(void){
+    nvs_handle handle;
+    esp_bd_addr_t bda;
+    struct trv_record record;
+    int64_t now = esp_timer_get_time();
+    bool opened = false;
+    if(trvs_lock == NULL)
+        return;
+    for(int idx = 0; ; idx++){
+        bool due;
+        /* Copy each record under the lock but write it without, so a state report never waits on flash */
+        xSemaphoreTake(trvs_lock, portMAX_DELAY);
+        if(idx >= num_trvs){
+            xSemaphoreGive(trvs_lock);
+            break;
+        }
+        due = saves[idx].dirty && now - saves[idx].saved > STATE_SAVE_S * 1000000LL;
+        if(due){
+            memcpy(bda, trvs[idx].bda, sizeof(esp_bd_addr_t));
+            trv_record(idx, &record);
+        }
+        xSemaphoreGive(trvs_lock);
+        if(due == false)
+            continue;
+        if(opened == false){
+            if(nvs_open(TRVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK){
+                ESP_LOGE(TRVS_TAG, "Can't open registry");
+                return;
+            }
+            opened = true;
+        }
+        write_record(handle, bda, &record);
+    }
+    if(opened){
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+}
+
+/* Parse a TRV address - returns the number of characters used or 0 */
+static int parse_bda(const char *str, int len, esp_bd_addr_t bda){
+    int pos = 0;
+    for(int byte = 0; byte < sizeof(esp_bd_addr_t); byte++){
+        if(byte > 0){
+            if(pos >= len || str[pos] != ':')
+                return 0;
+            pos++;
+        }
+        if(pos + 2 > len || !isxdigit((int)str[pos]) || !isxdigit((int)str[pos + 1]))
+            return 0;
+        char hex[3] = {str[pos], str[pos + 1], 0};
+        bda[byte] = (uint8_t)strtol(hex, NULL, 16);
+        pos += 2;
+    }
+    return pos;
+}
+
+/* Remove a TRV - called with the lock held */
+static void forget_trv(int idx){
+    nvs_handle handle;
+    char key[13];
+    trv_key(trvs[idx].bda, key);
+    memmove(&trvs[idx], &trvs[idx + 1], (num_trvs - idx - 1) * sizeof(struct trv_info));
+    memmove(&saves[idx], &saves[idx + 1], (num_trvs - idx - 1) * sizeof(saves[0]));
+    num_trvs--;
+    if(nvs_open(TRVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+        return;
+    nvs_erase_key(handle, key);
+    save_index(handle);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+bool trv_handle_info(const char *request, int len){
+    esp_bd_addr_t bda;
+    char name[TRV_NAME_LEN];
+    bool setname = false, setgroups = false, forget = false;
+    uint8_t groups = 0;
+    int pos, idx;
+
+    if(trvs_lock == NULL || (pos = parse_bda(request, len, bda)) == 0)
+        return false;
+    /* Space separated name=<name>, groups=<n>[,<n>...] or forget */
+    while(pos < len){
+        int start, toklen;
+        while(pos < len && request[pos] == ' ')
+            pos++;
+        start = pos;
+        while(pos < len && request[pos] != ' ')
+            pos++;
+        if((toklen = pos - start) == 0)
+            break;
+        if(toklen > 5 && strncmp(&request[start], "name=", 5) == 0 && toklen - 5 < TRV_NAME_LEN){
+            /* Names are single words so they can be used in place of the address in commands */
+            for(int ch = start + 5; ch < pos; ch++){
+                if(!isalnum((int)request[ch]) && request[ch] != '-' && request[ch] != '_')
+                    return false;
+            }
+            memcpy(name, &request[start + 5], toklen - 5);
+            name[toklen - 5] = 0;
+            setname = true;
+        }else if(toklen == 5 && strncmp(&request[start], "name=", 5) == 0){
+            name[0] = 0;
+            setname = true;
+        }else if(toklen >= 7 && strncmp(&request[start], "groups=", 7) == 0){
+            for(int ch = start + 7; ch < pos; ch++){
+                if(request[ch] >= '1' && request[ch] < '1' + TRV_GROUPS)
+                    groups |= 1 << (request[ch] - '1');
+                else if(request[ch] != ',')
+                    return false;
+            }
+            setgroups = true;
+        }else if(toklen == 6 && strncmp(&request[start], "forget", 6) == 0){
+            forget = true;
+        }else{
+            return false;
+        }
+    }
+
+    xSemaphoreTake(trvs_lock, portMAX_DELAY);
+    idx = find_trv(bda);
+    if(forget == true){
+        if(idx >= 0)
+            forget_trv(idx);
+    }else if(setname || setgroups){
+        bool newtrv = idx < 0;
+        if(newtrv)
+            idx = add_trv(bda);
+        if(idx >= 0){
+            if(setname)
+                strcpy(trvs[idx].name, name);
+            if(setgroups)
+                trvs[idx].groups = groups;
+            save_trv(idx, newtrv);
+        }
+    }
+    xSemaphoreGive(trvs_lock);
+    return idx >= 0 || forget;
+}
+
+/* Worst case json for one TRV */
+#define DEVLIST_ENTRY_LEN (60 + TRV_NAME_LEN + 11 + TRV_GROUPS * 2)
+
+char *trv_devlist(void){
+    char *report;
+    int wridx;
+    if(trvs_lock == NULL)
+        return NULL;
+    xSemaphoreTake(trvs_lock, portMAX_DELAY);
+    if((report = malloc(DEVLIST_ENTRY_LEN * num_trvs + 15)) != NULL){
+        wridx = sprintf(report, "{\"devices\":[");
+        for(int idx = 0; idx < num_trvs; idx++){
+            struct trv_info *trv = &trvs[idx];
+            wridx += sprintf(&report[wridx], "%s{\"rssi\":%d,\"bleaddr\":\"%02X:%02X:%02X:%02X:%02X:%02X\"", idx > 0 ? "," : "",
+                             trv->rssi, trv->bda[0], trv->bda[1], trv->bda[2], trv->bda[3], trv->bda[4], trv->bda[5]);
+            if(trv->name[0] != 0)
+                wridx += sprintf(&report[wridx], ",\"name\":\"%s\"", trv->name);
+            if(trv->groups != 0){
+                int count = 0;
+                wridx += sprintf(&report[wridx], ",\"groups\":[");
+                for(int group = 0; group < TRV_GROUPS; group++){
+                    if(trv->groups & (1 << group))
+                        wridx += sprintf(&report[wridx], "%s%d", count++ > 0 ? "," : "", group + 1);
+                }
+                wridx += sprintf(&report[wridx], "]");
+            }
+            wridx += sprintf(&report[wridx], "}");
+        }
+        sprintf(&report[wridx], "]}");
+    }
+    xSemaphoreGive(trvs_lock);
+    return report;
+}
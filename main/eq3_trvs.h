@@ -0,0 +1,73 @@
+#ifndef EQ3_TRVS_H
+#define EQ3_TRVS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_bt_defs.h"
+
+/* Persistent TRV registry
+ * Every TRV found by a scan (or commanded) is kept in NVS with its friendly name, group
+ * membership, GATT handles and last known state so the device list, web pages and
+ * commands by name work straight after boot. Scans only refresh the rssi and add new TRVs. */
+
+#define TRV_MAX          32
+#define TRV_NAME_LEN     24     /* Including terminator */
+#define TRV_GROUPS       8      /* Groups 1-8 */
+
+/* Last state reported by the TRV */
+struct trv_last_state {
+    bool valid;
+    uint8_t temp_x2;            /* Set temperature * 2 */
+    uint8_t valve;              /* Valve open % */
+    uint8_t flags;              /* Mode/status flags from the status notification */
+    int8_t offset_x2;           /* Temperature offset * 2 (if has_offset) */
+    bool has_offset;
+    uint32_t time;              /* Time of the report (0 if the time isn't synchronised) */
+};
+
+struct trv_info {
+    esp_bd_addr_t bda;
+    char name[TRV_NAME_LEN];
+    uint8_t groups;             /* Bit n set for membership of group n + 1 */
+    int8_t rssi;                /* Rssi from the most recent scan (0 if not seen since boot) */
+    uint16_t cmd_handle;        /* Cached GATT handles (0 if not known) */
+    uint16_t resp_handle;
+    struct trv_last_state state;
+};
+
+void trv_init(void);
+
+/* A TRV seen by a scan - added to the registry if it is new */
+void trv_seen(esp_bd_addr_t bda, int rssi);
+
+/* Copy of the TRV at idx in the registry - false past the end. Walks the registry one entry at a time */
+bool trv_get_index(int idx, struct trv_info *info);
+int trv_count(void);
+
+/* Look up a TRV by its friendly name */
+bool trv_find_name(const char *name, int namelen, esp_bd_addr_t bda);
+
+/* A TRV address (with ':' or '%3A' separators) or name */
+bool trv_parse(const char *str, int len, esp_bd_addr_t bda);
+
+/* Copy of one TRV's entry - false if it isn't in the registry */
+bool trv_get(const esp_bd_addr_t bda, struct trv_info *info);
+
+/* Cached GATT handles - clear them (0, 0) if they turn out to be wrong */
+bool trv_get_handles(esp_bd_addr_t bda, uint16_t *cmd_handle, uint16_t *resp_handle);
+void trv_set_handles(esp_bd_addr_t bda, uint16_t cmd_handle, uint16_t resp_handle);
+
+/* A state report - kept in RAM and written to NVS by trv_poll() */
+void trv_set_state(esp_bd_addr_t bda, const struct trv_last_state *state);
+/* Write changed states - called from the main loop */
+void trv_poll(void);
+
+/* Update the registry from a trvinfo request e.g. "ab:cd:ef:gh:ij:kl name=lounge groups=1,3" or "ab:cd:ef:gh:ij:kl forget"
+ * Returns false if the request is invalid */
+bool trv_handle_info(const char *request, int len);
+
+/* Device list json {"devices":[{"rssi":-71,"bleaddr":"AB:CD:EF:GH:IJ:KL","name":"lounge","groups":[1,3]},...]}
+ * The caller frees it. NULL if there is no memory */
+char *trv_devlist(void);
+
+#endif
@@ -0,0 +1,328 @@
+/* Generated by tools/packweb.sh from main/web - do not edit */
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+static const unsigned char v1[] = {
+  31, 139,   8,   0,   0,   0,   0,   0,   2,   3, 181,  87, // ...........W
+ 223, 111, 219,  54,  16, 126, 247,  95, 113, 213,  30, 228, // .o.6.~._q...
+  20, 177,   5,  59,  47, 131, 109, 249, 161,  77,  54, 100, // ...;/.m..M6d
+ 216, 146,  52, 246,  54,  12, 195,  16,  80, 228, 201,  98, // ..4.6...P..b
+  35, 145,  42,  73, 217, 113, 135, 254, 239,  59, 234,  71, // #.*I.q...;.G
+ 227, 108,  83, 218,   2, 206, 147,  76, 222, 221, 247, 221, // .lS....L....
+ 157, 143, 226, 167, 197, 171, 243, 235, 183, 235,  63, 110, // ..........?n
+  46,  32, 115,  69, 190,  28,  44, 186,   7,  50,  65, 143, // . sE..,..2A.
+   2,  29,   3, 158,  49,  99, 209, 197,  97, 229, 210, 209, // ....1c..a...
+ 247, 225, 178, 217,  85, 172, 192,  56, 216,  74, 220, 149, // ....U..8.J..
+ 218, 184,   0, 184,  86,  14, 149, 139, 131, 157,  20,  46, // ....V.......
+ 139,   5, 110,  37, 199,  81, 189,  56, 149,  74,  58, 201, // ..n%.Q.8.J:.
+ 242, 145, 229,  44, 199, 120, 114,  90,  89,  52, 245, 130, // ...,.xrZY4..
+  37, 180,  86,  58, 136, 136, 203,  73, 151, 227, 242, 226, // %.V:...I....
+ 221, 153, 135,  74, 229, 166,  50, 204,  73, 173,  22,  81, // ...J..2.I..Q
+  99,  24,  44,  44,  55, 178, 116,  96,  13, 143, 131, 104, // c.,,7.t`...h
+ 135,  73, 132,  31, 206, 198, 239, 109, 176,  92,  68, 141, // .I.....m..D.
+ 137, 124, 162,  54, 241,  68, 139,  61,  61, 132, 220, 130, // .|.6.D.==...
+ 117, 123,  34,   9,  29,  62, 184,  17, 203, 229,  70, 205, // u{"..>....F.
+  56, 229, 137, 102,  30, 250,  58,  39, 203,  21, 230, 200, // 8..f..:'....
+  29, 252,  46, 127, 144,  20,  62, 161, 205,  84, 155,   2, // ......>..T..
+  24, 247, 236, 113, 208,  36, 179, 170, 146,  66,  82, 149, // ...q.$...BR.
+  84, 122, 166,  69,  28, 148, 218, 210,  74, 138, 206,  30, // Tz.E....J...
+ 248,   2, 124,  53,  45,  93,  80,  48, 179, 145, 106,  54, // ..|5-]P0..j6
+  65,  66, 170, 156, 158, 215,  14, 109,  86, 206,  44,  23, // AB.....mV.,.
+  78,  44,  87, 171, 203, 243,  25, 149,  39, 234, 213,  66, // N,W.....'..B
+ 170, 178, 114, 224, 246,  37,  69, 251, 100, 131,  58, 144, // ..r..%E.d.:.
+ 107,  99,  40, 189,  56, 208, 105, 218, 238, 176,  82,  58, // kc(.8.i...R:
+  42, 228,  35, 249,  41, 173,  48, 104, 255,  10, 107, 165, // *.#.).0h..k.
+   8,  32,  90,  54, 136,  17, 145, 124, 102, 186,  97, 214, // . Z6...|f.a.
+ 238, 180,  17,  61, 108, 101, 107, 254,  86, 198, 199, 184, // ...=lek.V...
+  50, 103,  28,  51, 157,  11,  52, 113, 144,  73,  33,  80, // 2g.3..4q.I!P
+ 245, 164, 242, 203, 187, 245,  26, 126, 189, 253, 249, 136, // .......~....
+ 133,  23,  31, 156, 171,  76, 254,  28, 161,  31,  56, 239, // .....L....8.
+ 124, 108,  86, 130, 125, 142, 182, 124, 153, 190, 123, 106, // |lV.}..|..{j
+  31, 251, 205, 125,  63, 234, 188, 249,  44, 122,  39, 238, // ...}?...,z'.
+ 106, 125,   3, 168, 252, 129, 232,  43, 158, 103, 200, 239, // j}.....+.g..
+  19, 253, 208, 193,  41,  87, 182,   1,   1, 108,  89,  94, // ....)W...lY^
+ 249, 172,  76, 133, 207, 224,  83, 243, 183, 104,  96, 114, // ..L...S..h`r
+ 196, 154,  40, 137,   6, 117, 242, 101, 222, 233,  75, 240, // ..(..u.e..K.
+  78, 123, 120, 215, 178, 192, 143,  20, 112,  92,  78, 215, // N{x.....p.N.
+ 162, 246, 144,  94, 222,   0,  19, 194, 160, 181,  71, 164, // ...^......G.
+ 149, 101,  15, 219, 143, 204, 225, 142, 237,  95, 128, 114, // .e......._.r
+ 179, 235, 251,  55, 209,  21, 204, 222,  31, 179, 169,  13, // ...7........
+  98,  15, 223, 249, 213, 234,  37, 166,  86,  40,  59, 233, // b.....%.V(;.
+ 109, 235,   1, 231, 244, 184, 156, 211,  94, 206, 149,  99, // m.......^..c
+ 244, 110,   4, 167,  75, 201, 161,  36, 230, 245, 237, 111, // .n..K..$...o
+  95, 249,  26,  32, 111, 103, 182, 182,   6, 248, 154,  23, // _.. og......
+  65,  75, 133, 138, 107,  33, 213, 230, 128, 197,  54, 247, // AK..k!....6.
+ 122, 123,  57, 214, 110, 254,  98, 103, 142,   4, 131,  46, // z{9.n.bg....
+ 253, 229, 222, 193, 191, 183,  90,   5, 203, 159,  86, 215, // ......Z...V.
+  87, 139, 168, 177, 252, 219, 131,  39, 218,   4, 203, 183, // W......'....
+ 111, 174, 111, 251,  60,  18, 237, 178,   6,   3, 152,  18, // o.o.<.......
+ 240, 212,  53, 106, 114, 121, 146, 127, 212, 169, 129, 168, // ..5jry......
+ 214,  13, 244, 163, 252, 178,  96, 121, 210,  58, 219, 106, // ......`y.:.j
+ 146,  54, 131,  86, 162,  16,  62, 129, 120,  92, 143,  23, // .6.V..>.x...
+ 249, 146, 159, 224,   6, 255, 197,  37, 109, 178, 206,  16, // .......%m...
+  30, 143, 251,  41, 108, 158,  30, 198, 186, 166, 118, 182, // ...)l.....v.
+ 129,  25, 132, 166,  50, 150, 143,   1,  46,  83,  80, 154, // ....2....SP.
+ 100,  89,  85, 150, 185,  68,  49, 112,  25,  90, 108, 146, // dYU..D1p.Zl.
+ 178, 176, 147, 121,  14,   9, 130, 180, 182,  66,   1, 201, // ...y.....B..
+  30, 200,  92, 107,  45,  18,  88, 220,  35, 151,  90,  42, // ...k-.X.#.Z*
+  55,  30, 116,  89, 251,  68, 189, 172,  82, 108, 123,  80, // 7.tY.D..Rl{P
+ 202, 163, 173, 183,  57,  41, 233, 207, 145, 165,  57, 157, // ....9)....9.
+  77, 166, 229, 131, 239,  85, 102, 104,  98,  24, 100,   6, // M....Ufhb.d.
+ 211,  56, 204, 232, 202, 180, 179,  40, 218,  72, 151,  85, // .8.....(.H.U
+ 201, 152, 235,  34, 178,  58, 165,  70,  74,  23, 161,  45, // ...".:.FJ..-
+ 207, 166, 119, 254,  62, 187,  35,  73,  25, 130,  35, 237, // ..w.>.#I..#.
+ 230, 245, 238,  93, 146,  51, 117,  31, 118, 156,  92, 231, // ...].3u.v...
+ 218, 204, 190,  99, 140, 205, 195,  58,  71,  58,  83,  86, // ...c...:G:SV
+ 250, 209,  33, 209,  58, 242,  23, 236, 232,  98, 117, 115, // ..!.:....bus
+  54,  93,  68, 236, 115, 230, 157,  48,  37, 220, 146, 109, // 6]D.s..0%..m
+ 112, 120,  50,  31,  68, 175, 161, 211,  99, 182, 238, 165, // px2.D...c...
+  66, 127,  56,  45, 149,   1,   9, 227, 247,  93, 147,  40, // B.8-.....].(
+  77, 120,  29, 249,  72,  74, 102,  24,  70, 141, 208,  28, // Mx..HJf.F...
+ 251,  97,  13,  79,  33, 173,  84,  45,  80,  97, 216, 236, // .a.O!.T-Pa..
+ 159, 192, 223,   3, 160, 174,  27, 168, 213, 107,  12,  66, // .........k.B
+ 243, 170,  32, 204,  49,  69,  95, 228, 232, 127, 190, 217, // .. .1E_.....
+  95, 138,  97, 216, 248, 135,  39,  99, 108, 118, 237, 156, // _.a...'clv..
+   2,  41,   8, 134,  62, 218,  31,  23, 144,  10,  14,  81, // .)..>......Q
+  91,  92, 137, 185,  32,  96, 143, 255, 167, 119, 251, 107, // [... `...w.k
+  94, 219, 100,  10, 195,  87, 181, 241, 164, 254,   8, 144, // ^.d..W......
+ 170, 194,  71,  75, 109,  24, 251, 129, 133,  56, 134, 176, // ..GKm....8..
+  59, 238, 225,  73, 131,  55, 174,  55, 208, 227,  54, 140, // ;..I.7.7..6.
+ 135, 200, 152, 211,  32,  53, 110, 245,  56, 253, 143, 211, // .... 5n.8...
+ 167, 193,  39, 106, 233, 225,   7,  64, 119, 170, 154,  15, // ..'j...@w...
+ 153, 127,   0, 148, 246, 144, 120, 224,  12,   0,   0, 0 // ......x....
+};
+static const unsigned char v2[] = {
+  31, 139,   8,   0,   0,   0,   0,   0,   2,   3, 149,  85, // ...........U
+ 219, 114, 219,  54,  16, 125, 247,  87, 236, 232,   5, 148, // .r.6.}.W....
+ 107, 145, 106,  60, 237, 180, 178, 196, 206, 212,  99,  55, // k.j<......c7
+ 201, 216,  77,  98, 169, 151,  87, 136,  88,  74, 108,  72, // ..Mb..W.XJlH
+ 128,   6,  64, 178, 154, 218, 255, 212, 111, 232, 151, 117, // ..@.....o..u
+   1,  82, 148, 196,  36,  77, 250,  96,  25,  90,  28,  28, // .R..$M.`.Z..
+ 156,  93, 236,  30,  69, 231, 176, 220, 114, 141,   2, 214, // .]..E...r...
+  59, 176,  91, 132, 155, 119, 151, 176, 173, 214,  80, 242, // ;.[..w....P.
+  13,  26, 152,  64, 138,  54, 217, 194,  31,  70,  73,  72, // ...@.6...FIH
+ 181,  42,  60, 198, 237, 115,  41,  64, 104, 222, 248, 128, // .*<..s)@h...
+ 228, 117, 182, 225,  54, 115,  32, 165,  44, 106,  56, 143, // .u..6s .,j8.
+ 206, 210,  74,  38,  62, 132, 143, 151,  27, 180,  65, 165, // ..J&>.....A.
+ 243,  11,  72, 229,  24, 254,  58,   3, 168, 185,   6, 141, // ..H...:.....
+ 143, 176,   0, 137,  13, 252, 126, 127, 247, 210, 218, 242, // ......~.....
+   1,  31,  43,  52,  54,  24,  95,  17, 130, 118,  67,  37, // ..+46._..vC%
+ 115, 197,   5, 129, 122, 174, 128, 142,  67, 150,  66, 224, // s...z...C.B.
+ 182, 141, 229, 182,  50, 176,  88, 192, 139, 233, 116,  76, // ....2.X...tL
+ 220, 193, 235, 229, 155, 159, 195, 146, 107, 131,  30, 160, // ........k...
+ 209, 148,  74,  26,  92, 225, 159, 118,  60, 190, 130, 231, // ..J....v<...
+ 158, 184,  68,  25, 176, 159, 110,  86, 236,   2,  72,  87, // ..D...nV..HW
+ 127, 161,  65,  41, 220, 245, 207, 103,  39, 242,  13, 201, // ..A)...g'...
+ 207, 196,   5,  88, 199, 211, 235, 199, 156, 148,   9, 149, // ...X........
+  84,   5,  74,  27,  82, 138,  55,  57, 186, 229, 143, 187, // T.J.R.79....
+  87, 130, 224, 158, 212,  73, 197, 124,  76, 216, 208,  29, // W....I.|L...
+ 190,  86, 210,  18, 130, 206, 185, 111,  31, 220,  67, 117, // .V.....o..Cu
+  12, 218, 164, 218,  91,  62,  69, 206,   8, 200, 198,  97, // ....[>E....a
+  38,  37, 234, 151, 171, 251,  59,  88,  16,  24, 128, 205, // &%....;X....
+  45,  95, 231,   8, 198, 238, 114,  92, 140,  10, 174,  55, // -_....r....7
+ 153, 156, 125, 141,   5, 240, 202, 170, 171,  81, 204, 224, // ..}......Q..
+ 171,  61,  80, 199, 115,  43, 226,  57, 135, 173, 198, 116, // .=P.s+.9...t
+  49, 138,  18,  85,  20, 244, 166, 163, 216,  73, 212,  42, // 1..U.....I.*
+ 247, 141,  32, 176, 206,  18, 156,  71,  60, 158,  71,  14, // .. ....G<.G.
+  77, 127, 240,   4, 237,  58,  34, 138, 255, 224, 171,  51, // M....:"....3
+ 108, 114, 181,  25, 197, 191, 210, 194, 147, 117, 175,  69, // lr.......u.E
+ 193, 143,  19,  14, 228, 200,  52, 163, 211, 243, 148, 228, // ......4.....
+  64, 162, 114, 165,  23, 163, 235, 239, 190, 255, 118,  58, // @.r.......v:
+ 245,  18, 105, 179, 210, 190, 227, 230, 145, 131, 196,   7, // ..i.........
+ 206, 207,   8, 163,  82, 182, 105, 153,  81, 124, 151,  25, // ....R.i.Q|..
+  11,  42,  61, 202, 213, 128,  65, 148,  95,  32, 176,  42, // .*=...A._ .*
+  93, 107, 126,  66, 224,  47, 165, 224, 150, 222,  65, 165, // ]k~B./....A.
+ 182, 161, 225, 250, 191,  18,  77, 194, 229,  40, 126,  64, // ......M..(~@
+ 247, 159,   6,  74,  31, 235, 251,   2, 105, 212, 245, 150, // ...J....i...
+ 107,  43,  85,  51, 144, 119, 123,  59, 157,  58, 121,  15, // k+U3.w{;.:y.
+ 184, 166,  41, 133, 155, 229, 219, 207,  40, 139, 124,  63, // ..).....(.|?
+ 197, 204, 117, 114,  55,   6, 172,  70, 109, 168, 236,  52, // ..ur7..Fm..4
+  56, 140, 100,  77, 238, 223, 173,  86,  19,  98, 186, 124, // 8.dM...V.b.|
+   1, 116, 174, 123, 228, 176,   3,  81, 128,  57,  99,  89, // .t.{...Q.9cY
+  82,  33, 118, 111,  95, 173,  88,  59,  90, 209,  57, 220, // R!vo_.X;Z.9.
+  16,  98, 231,  77,   6, 204,  86,  53, 102, 104,  35,  19, // .b.M..V5fh#.
+ 218,  51, 134,  70,  26, 172, 130, 202, 160, 223, 239,  58, // .3.F.......:
+ 136,  27, 104,  48, 207, 135,  30, 227, 200, 130, 189, 191, // ..h0........
+ 116, 158, 195, 162,  78, 144,  51,  48, 146, 124, 240, 145, // t...N.30.|..
+ 227,  49, 131, 193, 236,  93, 249, 152,  27,  93,  71,  71, // .1...]...]GG
+ 182, 114,  20, 127, 238,  83, 184, 203, 106,   4, 172, 105, // .r...S..j..i
+  38, 205, 169,  53,  54, 184,  54,  42, 121, 143, 150, 178, // &..56.6*y...
+ 208,  72, 157,  44,  49,  33,  12, 241, 237,  17,  66, 171, // .H.,1!....B.
+ 178,  77, 185, 219, 117, 146,   6, 233, 180, 204, 193, 177, // .M..u.......
+  97,  82, 153,  90, 191, 252,  13, 215,  75, 127,  67,  16, // aR.Z....K.C.
+ 228,  42, 241,  21,  11,  75, 173, 172, 162, 135, 118, 118, // .*...K....vv
+ 200, 182, 228, 166, 102, 198, 224,   7,  96, 141,  49, 179, // ....f...`.1.
+  40,  98,  48, 115,  75, 183,  26, 211, 171, 244, 167, 182, // (b0sK.......
+ 138,  38, 128,  94,  41, 106,  12, 243, 249,  53, 134,  92, // .&.^)j...5..
+ 183,  64,  99, 220, 211,  28,  27, 111,  97,  54, 206, 123, // .@c....oa6.{
+  79,  77, 150, 130,  33, 181,  58, 239, 205, 213,  31,  79, // OM..!.:....O
+ 114, 101, 240,   3, 215, 166, 238,  89, 101,   5, 170, 202, // re.....Ye...
+   6, 167,  27,  39, 201,  18, 207,   5, 124,  67, 109, 218, // ...'....|Cm.
+  50, 182, 165, 126,  35,  17, 242, 140,  62,   4, 205, 132, // 2..~#...>...
+ 206,  74, 127, 150, 230, 150, 198, 195, 159,  28, 214, 174, // .J..........
+ 133, 173,  49, 192, 250,  80,  61, 247,  59, 130, 181, 151, // ..1..P=.;...
+ 235, 148, 154,  38, 115, 191, 108,   4,   9,  61,  71,  11, // ...&s.l..=G.
+  76,  56,  41, 103, 237, 123, 179, 153, 239,   3, 141, 182, // L8)g.{......
+ 210,  18,  68, 104, 117,  77, 165,  10,  68, 136,  90, 211, // ..DhuM..D.Z.
+  80,  82, 109, 193, 175, 102, 190, 243, 247,  97, 247, 141, // PRm..f...a..
+ 181,  56, 139,  69,   9,  79,  79, 192, 124, 205, 217,  63, // .8.E.OO.|..?
+ 127,  95, 239, 119, 106, 158,  83, 243,  28, 182, 246, 241, // ._.wj.S.....
+  66, 137, 125, 216, 191,  70,  43, 135, 126,  21,  43,  60, // B.}..F+.~.+<
+  85, 195, 174,  91, 191, 238, 174, 206,  68, 207,  34, 194, // U..[....D.".
+ 206, 202, 143,  34,  52, 196,  92,   8, 125,  20, 225, 109, // ..."4...}..m
+ 173,  92,  32, 104,  35,  57, 202, 141, 221, 250, 136, 191, // .. h#9......
+  79, 140, 217,  65,  65, 170,  42,  41,   6,  10, 110,  93, // O..AA.*)..n]
+ 236,  35,  23, 104,  99, 178,  46, 236, 150,   7,  18, 103, // .#.hc......g
+ 103, 195, 154, 186,  74, 163, 111,  89, 239,  89,  40, 124, // g...J.oY.Y(|
+ 207,  46, 157, 241, 245, 129,  89,  23, 160, 188, 202,  28, // ......Y.....
+   9,  62, 233, 232, 189,  42, 127, 103, 171, 239, 112,  85, // .>...*.g..pU
+ 103, 150, 195, 219, 186, 240, 113, 174, 239, 201,  38, 229, // g.....q...&.
+ 222,  92,  61, 195, 243,  89, 127,  98, 223,  27, 174,  15, // ..=..Y.b....
+ 255,   5, 121,  93, 253, 224,  42,   9,   0,   0, 0 // ..y]..*...
+};
+static const unsigned char v3[] = {
+  31, 139,   8,   0,   0,   0,   0,   0,   2,   3, 133,  85, // ...........U
+ 223, 111, 219,  56,  12, 126, 207,  95, 161, 121,  56, 200, // .o.8.~._.y8.
+ 193,  26,  59,  63, 134,  98,  72, 236,  28, 176, 182, 192, // ..;?.bH.....
+  13,  88, 177, 110, 235,  30, 246,  84,  40,  22,  19, 107, // .X.n...T(..k
+ 179, 101,  79, 162, 157, 229,  14, 253, 223, 143, 146, 157, // .eO.........
+  44, 105, 151, 187,  39, 217, 228, 247, 137, 228,  71, 210, // ,i..'.....G.
+  78,  94,  92, 127, 184, 186, 255, 122, 119, 195, 114,  44, // N^.....zw.r,
+ 139, 229,  32, 217,  31,  32,  36,  29,  37, 160,  96,  89, // .. .. $.%.`Y
+  46, 140,   5,  76, 121, 131, 235, 209,  27, 190, 236, 172, // ...Ly.......
+  90, 148, 144,   6, 173, 130, 109,  93,  25,  12,  88,  86, // Z.....m]..XV
+ 105,   4, 141, 105, 176,  85,  18, 243,  84,  66, 171,  50, // i..i.U..TB.2
+  24, 249, 151,  11, 165,  21,  42,  81, 140, 108,  38,  10, // ......*Q.l&.
+  72,  39,  23, 141,   5, 227,  95, 196, 138, 222, 117,  21, // H'...._...u.
+ 196,  20,  11,  21,  22, 176, 188, 249,  56,  99,  22,   5, // ........8c..
+  54,  54, 137,  59, 203,  32, 177, 153,  81,  53,  50, 107, // 66.;. ..Q52k
+ 178,  52, 136, 183, 176, 138, 225, 199,  44, 250, 102, 131, // .4......,.f.
+ 101,  18, 119,  46, 194, 196, 125, 198, 171,  74, 238, 232, // e.w...}..J..
+ 144, 170, 165, 107, 118, 116,  59,  71, 248, 137,  35,  81, // ...kvt;G..#Q
+ 168, 141, 158, 103, 148,  32, 152,   5, 239,   1,  74, 166, // ...g. ....J.
+   1, 165, 189,  86, 155, 198, 128,  12, 122,  66,  32, 149, // ...V....zB .
+ 173,  11, 177, 155, 235,  74,  67, 224, 180, 152, 248, 172, // .....JC.....
+  12, 144, 241, 144,  27,  25,  41, 101, 151, 255, 158,  86, // ......)e...V
+  10, 179,  81, 122,  62, 129, 146, 137,   6, 171, 133, 163, // ..Qz>.......
+ 162,  89,  38,  40, 151, 183,  31, 239, 239, 217, 151,  79, // .Y&(.......O
+ 239, 231,  84, 147, 116,  22,  31, 186, 252, 129, 216, 152, // ..T.t.......
+ 194, 149, 225, 172,  49, 129,  79,  25, 239, 174, 159,  19, // ....1.O.....
+ 148,  60, 143, 239, 114, 123, 206, 249,  45, 227,  75, 141, // .<..r{..-.K.
+ 170, 132,  83, 112, 227, 109, 167, 240, 216,  23, 233,  30, // ..Sp.m......
+  72, 178,  35, 225,  26, 253, 191, 210,  57, 229, 238,  10, // H.#.....9...
+  16,  22, 216,   1, 203,  74, 240, 226,  61, 189, 174,  80, // .....J..=..P
+  45, 156, 239, 192, 108, 249, 158, 252,  76, 100, 168,  90, // -...l...Ld.Z
+ 133,  59, 186,  97, 118, 144, 223, 177, 161, 165, 206, 218, // .;.av.......
+ 224,  92,  43, 142,  70, 160, 128,  53,  46, 124, 133, 191, // ..+.F..5.|..
+  47,  75, 139,  54,  56,  36, 119, 228,  59,  59,  76, 107, // /K.68$w.;;Lk
+ 154, 251, 145,  85, 127, 195, 124,  50, 173, 127, 210, 108, // ...U..|2...l
+  37, 185, 137, 151, 137,  96, 185, 129, 117, 202, 115, 196, // %....`..u.s.
+ 218, 206, 227, 120, 163,  48, 111,  86,  81,  86, 149, 177, // ...x.0oVQV..
+ 173, 214, 184, 171,  21, 198,  96, 235, 217, 244, 193, 117, // ......`....u
+ 232, 129,  38, 154,  51, 164, 180, 221, 158,  61, 172,  10, // ..&.3....=..
+ 161, 191, 243, 125, 204, 172,  42,  42,  51, 127,  41, 132, // ...}..**3.).
+  88, 112, 159,  99,  11, 198, 170,  74,   7, 110,  44,  71, // Xp.c...J.n,G
+ 174, 243, 163, 155, 207, 119, 179, 105,  18, 139,  67, 230, // .....w.i..C.
+ 251, 189,  88,  83, 155, 144, 176, 172,  22,  50, 212,  67, // ..XS.....2.C
+ 246,  15, 141,  49,  13, 157, 102, 161, 102,   9, 155, 140, // ...1..f.f...
+ 217, 159, 140, 143,  57, 155,  51, 206, 135, 236,  21, 211, // ....9.3.....
+  11, 246,  56, 160,  92, 106, 177, 129, 240, 192,  13, 187, // ..8..j......
+ 193,  34, 246, 128,  49,  89, 101,  77,  73, 165,  71, 148, // ."..1YeMI.G.
+ 234,  77,   1, 238, 241, 237, 238, 157, 236,  49, 209, 175, // .M.......1..
+ 161, 112,  87, 255, 122, 243,  49, 142, 103, 134,  15,  35, // .pW.z.1.g..#
+  95,  95, 212,  55, 155, 165, 140, 175, 138,  42, 251, 206, // __.7.....*..
+  23,  20, 133, 114, 160,  79,  78, 200, 251,  29, 225,  23, // ...r.ON.....
+ 253, 112,  71, 189,  97, 248,  20, 164, 228,  41,  70, 201, // .pG.a....)F.
+ 103, 144,  83, 128, 119, 183, 194, 176, 166, 166, 208, 189, // g.S.w.......
+ 163,  91, 128,  99,  98, 103,  33, 234, 173, 192,  60,  90, // .[.cbg!...<Z
+  23,  85, 101,  66,  98, 196, 236, 205, 229, 235, 241, 216, // .UeBb.......
+ 105, 198, 153,  20,  59,  75, 199,  43,  47, 242,  83, 220, // i...;K.+/.S.
+ 236, 210, 193, 254,  96, 211, 215,  30,  60,  63, 135, 187, // ....`...<?..
+ 244, 168, 203, 241,  41, 138,  92, 222, 232, 179,  85, 107, // ....).....Uk
+ 246,  92, 230, 174,  43, 231, 251, 194, 221, 102, 253, 183, // ....+....f..
+ 216, 190, 218, 110, 133, 142, 154,  14, 237, 254, 234,  78, // ...n.......N
+ 167, 110, 219, 210, 243, 129, 186,  27, 248, 112, 113,  68, // .n.......pqD
+  50, 213, 150,  40, 158,  26,  41,  77, 159, 125, 252,  84, // 2..(..)M.}.T
+ 109, 195, 241, 240, 130, 105, 239, 209, 176, 101, 215,   2, // m....i...e..
+  33,  60, 176, 136, 209,  35, 175, 160,  40,   8,  26, 185, // !<...#..(...
+ 157, 187, 234, 254,  46, 196, 240, 131,  76,  24, 138, 254, // ........L...
+  87, 213,  24,  27,  14,  79,  21, 235, 125, 183,  74,  55, // W....O..}.J7
+   8, 231, 188, 159, 129,   4, 148, 206, 123,  38, 236, 228, // ........{&..
+ 105,  88,  82,  72, 130, 219, 170,  21,  56, 101, 246, 180, // iXRH....8e..
+ 109, 174,  72, 148, 176,  43, 144, 238, 176,  81,   1, 122, // m.H..+...Q.z
+ 131,  57,  91, 178,  41, 181, 178, 179,  75,  40,   0, 193, // .9[.)...K(..
+  21,  78, 182, 142, 249, 232, 207, 199, 129,  59, 143, 255, // .N.......;..
+  98, 253, 239,  43, 238, 126, 195, 255,   2,  50, 228, 141, // b..+.~...2..
+ 157, 158,   7,   0,   0, 0 // .....
+};
+static const unsigned char v4[] = {
+  31, 139,   8,   0,   0,   0,   0,   0,   2,   3, 125,  83, // ..........}S
+ 193, 110, 219,  48,  12, 189, 247,  43,  52, 237, 224,  13, // .n.0...+4...
+ 168,  43,  36, 185,  12, 137, 237, 203, 150, 227, 208,  20, // .+$.........
+ 205,  14,  59,   5, 180,  77, 199, 218, 100,  73, 149, 104, // ..;..M..dI.h
+ 187, 217, 215,  79, 178, 157,  96,  29, 134,  29,  12, 138, // ...O..`.....
+  34, 253, 248, 248,  72, 101, 239, 190,  60, 126,  62, 126, // "...He..<~>~
+  63, 236,  89,  75, 157,  42, 238, 178, 171,  65, 168, 131, // ?.YK.*...A..
+ 233, 144, 128,  85,  45,  56, 143, 148,  39,  61,  53, 233, // ...U-8..'=5.
+ 167, 164, 152, 111,  53, 116, 152, 243,  65, 226, 104, 141, // ...o5t..A.h.
+  35, 206,  42, 163,   9,  53, 229, 124, 148,  53, 181, 121, // #.*..5.|.5.y
+ 141, 131, 172,  48, 157, 156, 123, 169,  37,  73,  80, 169, // ...0..{.%IP.
+ 175,  64,  97, 190, 186, 239,  61, 186, 201, 129,  50, 248, // .@a...=...2.
+ 218, 112,  17, 106, 145,  36, 133, 197, 254, 105, 195, 188, // .p.j.$...i..
+ 105, 104,   4, 135, 172, 183,  53,  16, 102,  98,  14, 221, // ih....5.fb..
+ 101, 190, 114, 210,  18, 243, 174, 202, 185,  24, 177,  20, // e.r.........
+ 248, 178, 121, 248, 225, 121, 145, 137,  57,  20, 114, 196, // ..y..y..9.r.
+  66, 189,  52, 245,  37, 152,  90,  14, 204, 211,  37, 148, // B.4.%.Z...%.
+  73,   8,  95,  41,   5,  37, 207, 122,  91,   5, 166, 232, // I._).%.z[...
+ 118,  73, 236, 116,  85, 124, 179, 202,  64, 205,  52, 142, // vI.tU|..@.4.
+ 183, 210,   1, 102,  21, 130, 141, 113,  29, 131, 138, 164, // ...f...q....
+ 209,  57,  55,   4, 253, 148, 201,  89,  80, 160,  53, 117, // .97....YP.5u
+ 206,  15, 143, 207,  71, 206,  80,  87, 116, 177,  65, 141, // ....G.PWt.A.
+ 174,  87,  36,  45,  56,  18, 241, 199,  52, 144,   7,  30, // .W$-8...4...
+  59, 139, 109,  46,  44, 120,   7, 238,  44, 245, 118, 133, // ;.m.,x..,.v.
+   1, 184,  39, 179, 155,  18,  92, 145,  81,  93, 100,  82, // ..'.....Q]dR
+ 219, 158, 216, 140, 213,  72, 133, 124,  81,  57, 158, 175, // .....H.|Q9..
+ 165,   7,  80, 253,  95,  87, 178, 126, 227,   7,  53,  34, // ..P._W.~..5"
+ 152,   8, 168, 255, 134, 246, 125, 217,  73, 186,  65,  45, // ......}.I.A-
+ 237, 131,  14, 159, 181, 234, 242,  22,  64,  76, 236, 227, // ........@L..
+  33, 246, 180,  40,  26,  43, 106,  24,  98, 102, 112,  99, // !..(.+j.bfpc
+ 112,  54, 255,  85, 187,   9,  27, 146, 122, 249,  11, 183, // p6.U....z...
+ 171, 181, 125,  13, 226, 103, 173,  19,  69,   6, 172, 117, // ..}..g..E..u
+ 216, 228,  73,  75, 100, 253,  86, 136, 179, 164, 182,  47, // ..IKd.V..../
+  31,  42, 211, 137,  56, 141, 139, 149,  36, 208, 219, 205, // .*..8...$...
+ 250, 212, 189,  16, 157, 194, 200,  19,  70,  65, 196, 184, // ........FA..
+ 145, 167,  82, 129, 254, 153,  92, 107,  86,  70,  25, 183, // ..R....kVF..
+ 125,  15,   0, 187, 100, 226,  56, 160, 243,  97, 118,  60, // }...d.8..av<
+ 174,  85, 250, 245, 233, 120,  76, 247, 207, 135, 205,  58, // .U...xL....:
+  19, 112,  99, 190,  44,  78, 128, 181, 112, 198,  15,  31, // .pc.,N..p...
+ 119, 127, 238, 210, 178,  68,  98, 126,  21, 191,   1, 188, // w....Db~....
+  47,  67,  41,  45,   3,   0,   0, 0 // /C)-...
+};
+
+static const struct packed_file {
+  const char *name;
+  const unsigned char *data;
+  size_t size;
+  time_t mtime;
+} packed_files[] = {
+  {"/web/config.html", v1, sizeof(v1), 1792399586},
+  {"/web/eq3.js", v2, sizeof(v2), 1792400031},
+  {"/web/index.html", v3, sizeof(v3), 1792400031},
+  {"/web/upload.html", v4, sizeof(v4), 1792399574},
+  {NULL, NULL, 0, 0}
+};
+
+const char *mg_unlist(size_t no) {
+  return packed_files[no].name;
+}
+const char *mg_unpack(const char *name, size_t *size, time_t *mtime) {
+  const struct packed_file *p;
+  for (p = packed_files; p->name != NULL; p++) {
+    if (strcmp(p->name, name) != 0) continue;
+    if (size != NULL) *size = p->size - 1;
+    if (mtime != NULL) *mtime = p->mtime;
+    return (const char *) p->data;
+  }
+  return NULL;
+}
@@ -0,0 +1,98 @@
+/*
+ * EQ-3 mongoose task work queue.
+ *
+ * Other tasks post a function and argument which the mongoose task runs
+ * next time round its loop. A single pipe wakes the task so the broker,
+ * the web events and anything else with work for the web side share one
+ * queue and one socket pair. With nothing to wake it the task sleeps until
+ * the next mongoose timer is due rather than ticking once a second.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "eq3_webtask.h"
+
+#define WEBTASK_TAG "EQ3_WEBTASK"
+
+#define WEBTASK_QUEUE_LEN 32
+
+struct webtask_work {
+    webtask_fn fn;
+    void *arg;
+};
+
+static struct mg_connection *wakepipe = NULL;
+static QueueHandle_t work_queue = NULL;
+static SemaphoreHandle_t webtask_lock = NULL;
+
+/* Woken through the pipe - run everything that has been posted */
+static void pipe_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data){
+    struct webtask_work work;
+    if(ev != MG_EV_READ)
+        return;
+    while(xQueueReceive(work_queue, &work, 0) == pdTRUE)
+        work.fn(c->mgr, work.arg);
+}
+
+void webtask_start(struct mg_mgr *mgr){
+    if(webtask_lock == NULL)
+        webtask_lock = xSemaphoreCreateMutex();
+    if(work_queue == NULL)
+        work_queue = xQueueCreate(WEBTASK_QUEUE_LEN, sizeof(struct webtask_work));
+    xSemaphoreTake(webtask_lock, portMAX_DELAY);
+    wakepipe = mg_mkpipe(mgr, pipe_cb, NULL);
+    xSemaphoreGive(webtask_lock);
+    if(wakepipe == NULL)
+        ESP_LOGE(WEBTASK_TAG, "Cannot create the wakeup pipe");
+}
+
+/* Nothing can be posted once this returns - anything still queued is discarded */
+void webtask_stop(void){
+    struct webtask_work work;
+    if(webtask_lock == NULL)
+        return;
+    xSemaphoreTake(webtask_lock, portMAX_DELAY);
+    wakepipe = NULL;
+    xSemaphoreGive(webtask_lock);
+    while(xQueueReceive(work_queue, &work, 0) == pdTRUE)
+        work.fn(NULL, work.arg);
+}
+
+int webtask_poll_ms(int max_ms){
+    unsigned long now = mg_millis();
+    int ms = max_ms;
+    for(struct mg_timer *t = g_timers; t != NULL; t = t->next){
+        /* A new timer is armed by the next poll so poll straight away */
+        if(t->expire == 0 || t->expire <= now)
+            return 0;
+        if(t->expire - now < (unsigned long)ms)
+            ms = (int)(t->expire - now);
+    }
+    return ms;
+}
+
+bool webtask_post(webtask_fn fn, void *arg){
+    struct webtask_work work = {fn, arg};
+    bool posted = false;
+    if(webtask_lock == NULL)
+        return false;
+    xSemaphoreTake(webtask_lock, portMAX_DELAY);
+    if(wakepipe != NULL){
+        if(xQueueSend(work_queue, &work, 0) == pdTRUE){
+            mg_mgr_wakeup(wakepipe);
+            posted = true;
+        }else{
+            ESP_LOGE(WEBTASK_TAG, "Work queue full");
+        }
+    }
+    xSemaphoreGive(webtask_lock);
+    return posted;
+}
@@ -0,0 +1,25 @@
+#ifndef EQ3_WEBTASK_H
+#define EQ3_WEBTASK_H
+
+#include <stdbool.h>
+#include "mongoose.h"
+
+/* Work for the mongoose task
+ * Mongoose isn't thread safe so the ble, mqtt and timer tasks hand anything that has to touch
+ * a connection to the mongoose task through a queue. Posting wakes the task through a mongoose
+ * pipe so the work is done straight away rather than at the end of a poll interval. */
+
+/* Called with mgr NULL if the work is discarded (the web server stopped) - arg must still be freed */
+typedef void (*webtask_fn)(struct mg_mgr *mgr, void *arg);
+
+/* Called from the mongoose task */
+void webtask_start(struct mg_mgr *mgr);
+void webtask_stop(void);
+
+/* Poll timeout until the next mongoose timer is due, at most max_ms */
+int webtask_poll_ms(int max_ms);
+
+/* Run fn(mgr, arg) in the mongoose task - false (nothing called) if it isn't running or the queue is full (any task) */
+bool webtask_post(webtask_fn fn, void *arg);
+
+#endif
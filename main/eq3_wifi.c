@@ -34,9 +34,23 @@
 #include "eq3_main.h"
 #include "eq3_wifi.h"
 #include "eq3_gap.h"
+#include "eq3_hubs.h"
+#include "eq3_bootwifi.h"
+#include "eq3_outq.h"
+#include "eq3_metrics.h"
+#include "eq3_broker.h"
+#include "eq3_trvs.h"
+#include "eq3_journal.h"
 
 static const char *MQTT_TAG = "mqtt";
 
+/* Topic prefix shared by all hubs for TRV ownership and shared commands */
+#ifdef CONFIG_EQ3_SHARED_TOPIC
+#define SHARED_TOPIC CONFIG_EQ3_SHARED_TOPIC
+#else
+#define SHARED_TOPIC ""
+#endif
+
 /* =========================================
  * MQTT support code
  */
@@ -47,7 +61,28 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event);
 
 static esp_mqtt_client_handle_t repclient = NULL;
 static bool mqtt_config_error = false;
-static char *devlist = NULL;
+static struct mqtt_stats mqttstats;
+
+/* Publish and count the result for the metrics */
+static int mqtt_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, bool retain){
+    int rc = esp_mqtt_client_publish(client, topic, data, len, 0, retain ? 1 : 0);
+    if(rc < 0)
+        mqttstats.failed++;
+    else
+        mqttstats.published++;
+    return rc;
+}
+
+void mqtt_get_stats(struct mqtt_stats *stats){
+    *stats = mqttstats;
+}
+
+/* Deliver a message to clients of the local broker */
+static void local_publish(const char *topic, const char *data, int len){
+#ifdef CONFIG_EQ3_LOCAL_BROKER
+    broker_publish(topic, strlen(topic), data, len);
+#endif
+}
 
 static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event){
     switch (event->event_id) {
@@ -101,6 +136,28 @@ mqttconnstate ismqttconnected(void){
     return repclient == NULL ? MQTT_NOT_CONNECTED : MQTT_CONNECTED;
 }
 
+/* Publish a message held in the outbound queue */
+static int outq_publish(const char *topic, const char *data, int len, bool retain){
+    if(repclient == NULL)
+        return -1;
+    return mqtt_publish(repclient, topic, data, len, retain);
+}
+
+/* Publish now if connected, otherwise hold the message in the outbound queue until we are
+ * Local broker clients get the message straight away (and not again on replay) */
+static void publish_or_queue(const char *topic, const char *data, int len, bool retain, const char *compactkey){
+    local_publish(topic, data, len);
+    if(repclient == NULL || mqtt_publish(repclient, topic, data, len, retain) < 0)
+        outq_push(topic, data, len, retain, compactkey);
+}
+
+/* Reply to a request that may have come from the upstream broker or a local client */
+static void publish_reply(const char *topic, const char *data, int len){
+    local_publish(topic, data, len);
+    if(repclient != NULL)
+        mqtt_publish(repclient, topic, data, len, false);
+}
+
 /* MQTT connected callback */
 static void connected_cb(esp_mqtt_event_handle_t event){
     esp_log_level_set("MQTT_CLIENT", ESP_LOG_VERBOSE);
@@ -109,6 +166,7 @@ static void connected_cb(esp_mqtt_event_handle_t event){
 
     char topic[38];
     char startmsg[35];
+    metrics_add_task(xTaskGetCurrentTaskHandle());
     sprintf(topic, "%s/#", intopicbase);
     repclient = client;
 
@@ -119,90 +177,309 @@ static void connected_cb(esp_mqtt_event_handle_t event){
     /* Publish welcome message to /espradout */
     sprintf(topic, "%s/connect", outtopicbase);
     sprintf(startmsg, "Heating control v%s.%s%s active", EQ3_MAJVER, EQ3_MINVER, EQ3_EXTRAVER);
-    esp_mqtt_client_publish(client, topic, startmsg, strlen(startmsg), 0, 0);
+    mqtt_publish(client, topic, startmsg, strlen(startmsg), false);
 
     ESP_LOGI(MQTT_TAG, "[APP] Start publish, topic: %s", topic);
     ESP_LOGI(MQTT_TAG, "[APP] Start publish, msg: %s", startmsg);
 
-    if(devlist != NULL){
-        sprintf(topic, "%s/devlist", outtopicbase);
-        /* Publish discovered EQ-3 device list to /espradout/devlist */
-        esp_mqtt_client_publish(client, topic, devlist, strlen(devlist), 0, 0);
+    /* Publish status/devlist messages queued while we were disconnected */
+    outq_replay(outq_publish);
 
-        ESP_LOGI(MQTT_TAG, "[APP] Start publish, topic: %s", topic);
-        ESP_LOGI(MQTT_TAG, "[APP] Start publish, devlist: %s", devlist);
+    /* The known TRVs are available straight away - the boot scan only refreshes them */
+    if(trv_count() > 0){
+        char *devlist = trv_devlist();
+        if(devlist != NULL)
+            send_device_list(devlist);
+    }
 
-        free(devlist);
-        devlist = NULL;
+    if(SHARED_TOPIC[0] != 0){
+        /* Subscribe to the shared hub topics, ask the other hubs for their link reports and send ours */
+        snprintf(topic, sizeof(topic), "%s/#", SHARED_TOPIC);
+        esp_mqtt_client_subscribe(client, topic, 0);
+        snprintf(topic, sizeof(topic), "%s/sync", SHARED_TOPIC);
+        mqtt_publish(client, topic, "", 0, false);
+        hub_publish_all();
     }
 }
 
-/* MQTT data received (subscribed topic receives data) */
-static void data_cb(esp_mqtt_event_handle_t event){
-    esp_mqtt_client_handle_t client = event->client;
+/* =========================================
+ * Inbound topic routing
+ * Topics are matched exactly as <prefix><suffix> where the prefix is the inbound topic base
+ * or the shared hub topic. Handlers get the topic and payload as slices of the event buffer
+ * (or of the reassembly buffer when the broker sent the payload in fragments).
+ */
+
+/* Largest payload reassembled from fragments */
+#define MQTT_RX_MAX      1024
 
-    bool trvcmd = false, trvscan = false;
-    if(event->current_data_offset == 0) {
-        char *topic = malloc(event->topic_len + 1);
-        memcpy(topic, event->topic, event->topic_len);
-        topic[event->topic_len] = 0;
-        /* /trv is a command to an EQ3 valve */
-        if(strstr(topic, "/trv") != NULL)
-            trvcmd = true;
-        /* /scan is a request to run a BLE scan for EQ3 valves */
-        if(strstr(topic, "/scan") != NULL)
-            trvscan = true;
-        /* /check is a simple 'ping' check that the ESP is connected */
-        if(strstr(topic, "/check") != NULL){
-            char rsptopic[45];
-            char msg[35];
-            sprintf(rsptopic, "%s/checkresp", outtopicbase);
-            sprintf(msg, "sw ver %s.%s%s", EQ3_MAJVER, EQ3_MINVER, EQ3_EXTRAVER);
-            esp_mqtt_client_publish(client, rsptopic, msg, strlen(msg), 0, 0);
+/* Longest topic bridged from the local broker */
+#define MQTT_TOPIC_MAX   64
+
+typedef void (*mqtt_route_fn)(const char *data, int len);
+
+struct mqtt_route {
+    bool shared;                /* Suffix follows SHARED_TOPIC rather than intopicbase */
+    const char *suffix;
+    mqtt_route_fn handler;
+};
+
+/* Run a command string - handle_request() needs it nul-terminated */
+static void run_command(const char *data, int len, bool shared){
+    char cmdstr[EQ3_MAX_REQUEST_LEN];
+    if(len <= 0 || len >= sizeof(cmdstr)){
+        ESP_LOGE(MQTT_TAG, "Ignoring trv command of %d bytes", len);
+        return;
+    }
+    memcpy(cmdstr, data, len);
+    cmdstr[len] = 0;
+    if(shared == true && hub_owns_command(cmdstr) == false)
+        return;
+    ESP_LOGI(MQTT_TAG, "Handle %strv msg", shared ? "shared " : "");
+    handle_request(cmdstr);
+}
+
+/* /trv is a command to an EQ3 valve */
+static void route_trv(const char *data, int len){
+    run_command(data, len, false);
+}
+
+/* /trvbatch is a list of commands (one per line or a json array) answered with one report on /batchresp
+ * e.g. {"count":3,"accepted":2,"pending":0,"rejected":1,"rejects":[2]} */
+static void route_trv_batch(const char *data, int len){
+    struct eq3_batch_result result;
+    char rsptopic[45];
+    char msg[100 + EQ3_BATCH_MAX_REJECTS * 5];
+    int msglen, idx;
+
+    handle_batch_request(data, len, &result);
+    msglen = sprintf(msg, "{\"count\":%d,\"accepted\":%d,\"pending\":%d,\"rejected\":%d,\"rejects\":[",
+                     result.count, result.accepted, result.pending, result.rejected);
+    for(idx = 0; idx < result.rejected && idx < EQ3_BATCH_MAX_REJECTS; idx++)
+        msglen += sprintf(msg + msglen, "%s%d", idx > 0 ? "," : "", result.rejects[idx]);
+    msglen += sprintf(msg + msglen, "]}");
+    sprintf(rsptopic, "%s/batchresp", outtopicbase);
+    publish_reply(rsptopic, msg, msglen);
+}
+
+/* /trvinfo names, groups or forgets a TRV in the registry e.g. "ab:cd:ef:gh:ij:kl name=lounge groups=1,3"
+ * The updated device list is published in reply */
+static void route_trv_info(const char *data, int len){
+    char *devlist;
+    if(trv_handle_info(data, len) == false){
+        ESP_LOGE(MQTT_TAG, "Invalid trvinfo request %.*s", len, data);
+        return;
+    }
+    if((devlist = trv_devlist()) != NULL)
+        send_device_list(devlist);
+}
+
+/* /journal queries the event journal e.g. "trv=lounge from=1700000000 limit=50"
+ * The records are published in batches on <outtopicbase>/journal */
+static void route_journal(const char *data, int len){
+    if(journal_mqtt_request(data, len) == false)
+        ESP_LOGE(MQTT_TAG, "Invalid journal query %.*s", len, data);
+}
+
+/* /scan is a request to run a BLE scan for EQ3 valves */
+static void route_scan(const char *data, int len){
+    start_scan();
+}
+
+/* /check is a simple 'ping' check that the ESP is connected */
+static void route_check(const char *data, int len){
+    char rsptopic[45];
+    char msg[35];
+    sprintf(rsptopic, "%s/checkresp", outtopicbase);
+    sprintf(msg, "sw ver %s.%s%s", EQ3_MAJVER, EQ3_MINVER, EQ3_EXTRAVER);
+    publish_reply(rsptopic, msg, strlen(msg));
+}
+
+/* Shared hub topics - a command for whichever hub owns the TRV, a link report or a sync request */
+static void route_shared_trv(const char *data, int len){
+    run_command(data, len, true);
+}
+
+static void route_hub_link(const char *data, int len){
+    hub_handle_report(data, len);
+}
+
+static void route_hub_sync(const char *data, int len){
+    hub_publish_all();
+}
+
+static const struct mqtt_route mqtt_routes[] = {
+    { false, "/trv",   route_trv },
+    { false, "/trvbatch", route_trv_batch },
+    { false, "/trvinfo", route_trv_info },
+    { false, "/journal", route_journal },
+    { false, "/scan",  route_scan },
+    { false, "/check", route_check },
+    { true,  "/trv",   route_shared_trv },
+    { true,  "/link",  route_hub_link },
+    { true,  "/sync",  route_hub_sync },
+};
+
+/* Does topic equal prefix followed by suffix */
+static bool topic_match(const char *topic, int topiclen, const char *prefix, const char *suffix){
+    int prefixlen = strlen(prefix);
+    int suffixlen = strlen(suffix);
+    return prefixlen > 0 && topiclen == prefixlen + suffixlen &&
+           memcmp(topic, prefix, prefixlen) == 0 && memcmp(topic + prefixlen, suffix, suffixlen) == 0;
+}
+
+/* Is topic below prefix (covered by a <prefix>/# subscription) */
+static bool topic_under(const char *topic, int topiclen, const char *prefix){
+    int prefixlen = strlen(prefix);
+    return prefixlen > 0 && topiclen > prefixlen && memcmp(topic, prefix, prefixlen) == 0 && topic[prefixlen] == '/';
+}
+
+static const struct mqtt_route *find_route(const char *topic, int topiclen){
+    for(int i = 0; i < sizeof(mqtt_routes) / sizeof(mqtt_routes[0]); i++){
+        const struct mqtt_route *route = &mqtt_routes[i];
+        if(topic_match(topic, topiclen, route->shared ? SHARED_TOPIC : intopicbase, route->suffix))
+            return route;
+    }
+    return NULL;
+}
+
+/* Payload reassembly - only touched from the mqtt task */
+static char rxbuf[MQTT_RX_MAX];
+static char rxtopic[MQTT_TOPIC_MAX];
+static const struct mqtt_route *rxroute = NULL;
+static int rxtotal = 0;
+
+/* MQTT data received (subscribed topic receives data)
+ * A payload bigger than the client buffer arrives as several events - only the first carries the topic */
+static void data_cb(esp_mqtt_event_handle_t event){
+    if(event->current_data_offset == 0){
+        rxroute = find_route(event->topic, event->topic_len);
+        rxtotal = event->total_data_len;
+        ESP_LOGI(MQTT_TAG, "[APP] Publish topic: %.*s%s", event->topic_len, event->topic, rxroute == NULL ? " (no route)" : "");
+        /* Unfragmented - bridge to local broker clients and hand the event buffer straight to the handler */
+        if(event->data_len == rxtotal){
+#ifdef CONFIG_EQ3_LOCAL_BROKER
+            broker_publish(event->topic, event->topic_len, event->data, event->data_len);
+#endif
+            if(rxroute != NULL)
+                rxroute->handler(event->data, event->data_len);
+            rxroute = NULL;
+            return;
+        }
+        if(rxroute == NULL)
+            return;
+        if(rxtotal > sizeof(rxbuf) || event->topic_len >= sizeof(rxtopic)){
+            ESP_LOGE(MQTT_TAG, "Dropping %d byte payload (max %d)", rxtotal, (int)sizeof(rxbuf));
+            rxroute = NULL;
+            return;
         }
-        ESP_LOGI(MQTT_TAG, "[APP] Publish topic: %s", topic);
-        free(topic);
+        memcpy(rxtopic, event->topic, event->topic_len);
+        rxtopic[event->topic_len] = 0;
     }
 
-    if(trvcmd == true){
-        char *data = malloc(event->data_len + 1);
-        memcpy(data, event->data, event->data_len);
-        data[event->data_len] = 0;
-        ESP_LOGI(MQTT_TAG, "Handle trv msg");
-        handle_request(data);
-        free(data);
+    /* Fragment of a routed payload - ignore anything that doesn't follow on from what we hold */
+    if(rxroute == NULL || event->total_data_len != rxtotal || event->current_data_offset + event->data_len > rxtotal)
+        return;
+    memcpy(rxbuf + event->current_data_offset, event->data, event->data_len);
+    if(event->current_data_offset + event->data_len == rxtotal){
+        local_publish(rxtopic, rxbuf, rxtotal);
+        rxroute->handler(rxbuf, rxtotal);
+        rxroute = NULL;
     }
-    
-    if(trvscan == true){
-        start_scan();
+}
+
+/* A message published by a client of the local broker (called from the mongoose task)
+ * Commands for this hub are run directly and not sent upstream. Everything else is bridged to
+ * the upstream broker - shared hub topics come back through our subscription so they are only
+ * run here when there is no upstream connection.
+ * Returns true if the upstream broker will echo the message back to us (and so to local subscribers) */
+bool mqtt_local_publish(const char *topic, int topiclen, const char *data, int len){
+    const struct mqtt_route *route = find_route(topic, topiclen);
+    char upstreamtopic[MQTT_TOPIC_MAX];
+
+    if(route != NULL && (route->shared == false || repclient == NULL)){
+        route->handler(data, len);
+        return false;
+    }
+    if(repclient == NULL || topiclen >= sizeof(upstreamtopic))
+        return false;
+    memcpy(upstreamtopic, topic, topiclen);
+    upstreamtopic[topiclen] = 0;
+    return mqtt_publish(repclient, upstreamtopic, data, len, false) >= 0 &&
+           (topic_under(topic, topiclen, intopicbase) || topic_under(topic, topiclen, SHARED_TOPIC));
+}
+
+/* Publish a status message to <outtopicbase>/<subtopic>
+ * If per-TRV status is configured the message goes to <outtopicbase>/<subtopic>/<trv> and is
+ * retained (when requested) so new subscribers immediately get the current TRV state */
+static void publish_status(const char *subtopic, char *trv, const char *status, int len, bool retain){
+    char topic[60];
+    char *compactkey = NULL;
+#ifdef CONFIG_EQ3_OUTQ_COMPACT_STATUS
+    /* While disconnected only the latest good status for each TRV needs to be kept */
+    char statuskey[32];
+    if(retain == true){
+        sprintf(statuskey, "%s/%s", subtopic, trv);
+        compactkey = statuskey;
+    }
+#endif
+    if(per_trv_status() == true){
+        sprintf(topic, "%s/%s/%s", outtopicbase, subtopic, trv);
+        publish_or_queue(topic, status, len, retain, compactkey);
+    }else{
+        sprintf(topic, "%s/%s", outtopicbase, subtopic);
+        publish_or_queue(topic, status, len, false, compactkey);
     }
-    
 }
 
-/* Publish a status message */
-int send_trv_status(char *status){
+int send_trv_status(char *trv, char *status, bool retain){
 	ESP_LOGI(MQTT_TAG, "send_trv_status");
-    if(repclient != NULL){
+    publish_status("status", trv, status, strlen(status), retain);
+    return 0;
+}
+
+/* Cbor encoded status on the parallel statuscbor topic */
+int send_trv_status_cbor(char *trv, uint8_t *status, int len, bool retain){
+	ESP_LOGI(MQTT_TAG, "send_trv_status_cbor");
+    publish_status("statuscbor", trv, (const char *)status, len, retain);
+    return 0;
+}
+
+/* Publish a link report to the other hubs */
+int send_hub_report(char *report){
+    if(repclient != NULL && SHARED_TOPIC[0] != 0){
         char topic[38];
-        sprintf(topic, "%s/status", outtopicbase);
-        esp_mqtt_client_publish(repclient, topic, status, strlen(status), 0, 0);
+        snprintf(topic, sizeof(topic), "%s/link", SHARED_TOPIC);
+        mqtt_publish(repclient, topic, report, strlen(report), false);
     }
     return 0;
 }
 
+/* Publish a metrics report - not queued while disconnected as it would be stale by the time it is sent */
+int send_metrics(char *metrics){
+    char topic[38];
+    sprintf(topic, "%s/metrics", outtopicbase);
+    publish_reply(topic, metrics, strlen(metrics));
+    return 0;
+}
+
+/* Publish a batch of journal records - a reply to a query so not queued */
+int send_journal(char *records){
+    char topic[38];
+    sprintf(topic, "%s/journal", outtopicbase);
+    publish_reply(topic, records, strlen(records));
+    return 0;
+}
+
 /* Publish a discovered device list */
 int send_device_list(char *list){
-    if(repclient != NULL){
-        char topic[38];
-        sprintf(topic, "%s/devlist", outtopicbase);
-        esp_mqtt_client_publish(repclient, topic, list, strlen(list), 0, 0);
-	    free(list);
-    }else{
-        if(devlist != NULL)
-	    free(devlist);
-	    ESP_LOGI(MQTT_TAG, "Queue device list message to publish");
-        devlist = list;
-    }
+    char topic[38];
+    sprintf(topic, "%s/devlist", outtopicbase);
+#ifdef CONFIG_EQ3_OUTQ_COMPACT_DEVLIST
+    publish_or_queue(topic, list, strlen(list), false, "devlist");
+#else
+    publish_or_queue(topic, list, strlen(list), false, NULL);
+#endif
+    free(list);
     return 0;
 }
 
@@ -210,7 +487,7 @@ int connect_server(char *url, char *user, char *password, char *id){
     int rc = 0;
     mqtt_config_error = false;
     
-    if(id == NULL || url == NULL){
+    if(id == NULL){
         mqtt_config_error = true;
         return -1;
     }
@@ -218,6 +495,13 @@ int connect_server(char *url, char *user, char *password, char *id){
     snprintf(lwt_topic_buff, LWT_TOPIC_LEN, "/%sradout", id);
     snprintf(intopicbase, IN_TOPIC_LEN, "/%sradin", id);
     snprintf(outtopicbase, OUT_TOPIC_LEN,  "/%sradout", id);
+    hub_set_id(id);
+
+    /* The topics are set up so the local broker can run without an upstream broker */
+    if(url == NULL || url[0] == 0){
+        mqtt_config_error = true;
+        return -1;
+    }
 
     esp_mqtt_client_config_t settings = {
 #if defined(CONFIG_MQTT_SECURITY_ON)
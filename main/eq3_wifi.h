@@ -8,7 +8,20 @@ typedef enum {MQTT_NOT_CONNECTED = 0, MQTT_CONNECTED, MQTT_CONFIG_ERROR}mqttconn
 mqttconnstate ismqttconnected(void);
 
 int send_device_list(char *list);
-int send_trv_status(char *status);
+int send_trv_status(char *trv, char *status, bool retain);
+int send_trv_status_cbor(char *trv, uint8_t *status, int len, bool retain);
+int send_hub_report(char *report);
+int send_metrics(char *metrics);
+int send_journal(char *records);
+
+struct mqtt_stats {
+    int published;      /* Messages handed to the mqtt client */
+    int failed;         /* Publish calls the mqtt client refused */
+};
+void mqtt_get_stats(struct mqtt_stats *stats);
+
+/* Message from a client of the local broker */
+bool mqtt_local_publish(const char *topic, int topiclen, const char *data, int len);
 
 int connect_server(char *url, char *user, char *password, char *id);
 
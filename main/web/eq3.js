@@ -0,0 +1,56 @@
+/* Shared by the EQ3 hub pages - fetch json from the hub and draw the navigation footer */
+function eq3get(url, fn) {
+  var req = new XMLHttpRequest();
+  req.onload = function () { if (req.status == 200) fn(JSON.parse(req.responseText)); };
+  req.open('GET', url);
+  req.send();
+}
+
+function eq3set(id, text) {
+  var el = document.getElementById(id);
+  if (el) el.textContent = text;
+}
+
+function eq3nav(status) {
+  document.getElementById('nav').innerHTML =
+    '<table style="margin:1em auto;">' +
+    '<tr><td><a href="/command">Control EQ3 device</a></td><td> | </td></tr>' +
+    '<tr><td><a href="/viewlog">View EQ3 status log</a></td><td> | </td><td><a href="/config"><font color="C89600">Configuration</font></a></td></tr>' +
+    '<tr><td><a href="/getdevices">List of EQ3 devices seen</a></td><td> | </td><td><a href="/upload"><font color="C89600">Update software</font></a></td></tr>' +
+    '<tr><td><a href="/scan">Rescan for EQ3 devices</a></td><td> | </td><td><a href="/restartnow"><font color="FF0000">Reboot ESP</font></a></td></tr>' +
+    '</table>';
+  eq3set('version', 'EQ3-MQTT-ESP32 ' + status.version + ' by SoftyPIT');
+}
+
+/* Every page shows the navigation - pass fn to use the status as well */
+function eq3page(fn) {
+  eq3get('/status.json', function (status) {
+    eq3nav(status);
+    if (fn) fn(status);
+  });
+}
+
+/* Live events from the hub websocket - reconnects if the hub drops the connection */
+function eq3events(fn) {
+  var ws = new WebSocket((location.protocol == 'https:' ? 'wss://' : 'ws://') + location.host + '/ws');
+  ws.onmessage = function (msg) { fn(JSON.parse(msg.data)); };
+  ws.onclose = function () { setTimeout(function () { eq3events(fn); }, 5000); };
+}
+
+/* One line description of an event */
+function eq3describe(ev) {
+  var d = ev.data;
+  switch (ev.event) {
+  case 'status':
+    return d.trv + (d.error ? ' error: ' + d.error : ' ' + (d.temp || '') + '°C ' + (d.valve || '') + ' ' + (d.mode || ''));
+  case 'queue':
+    return 'Command ' + d.id + ' ' + d.command + ' ' + d.bleaddr + ' ' + d.action + ' (' + d.length + ' queued)';
+  case 'found':
+    return 'Found ' + d.bleaddr + ' rssi ' + d.rssi;
+  case 'scan':
+    return d.state == 'started' ? 'Scan started' : 'Scan complete - ' + d.found + ' found';
+  case 'devices':
+    return d.devices.length + ' known devices';
+  }
+  return ev.event;
+}
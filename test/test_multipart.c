@@ -0,0 +1,320 @@
+/*
+ * Host tests for the multipart/form-data parser (main/eq3_multipart.c).
+ *
+ * The uploads are fed to the parser the way mongoose_ota_upload() does -
+ * whatever isn't used stays at the front of the buffer and the next read
+ * is appended to it - at every read size from one byte to the whole body,
+ * so every delimiter and header line is split at every possible place.
+ *
+ * uploads/curl.http was captured from curl 7.88. uploads/chrome.http and
+ * uploads/firefox.http reproduce the requests those browsers send from
+ * the software update page (their boundary styles and header order).
+ * Each carries uploads/firmware.bin, which is full of CRLFs, dashes and
+ * near misses of the boundaries.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "eq3_multipart.h"
+
+static int failures = 0, checks = 0;
+
+#define CHECK(cond, ...) do{ \
+    checks++; \
+    if(!(cond)){ \
+        failures++; \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+    } \
+}while(0)
+
+/* What a parse produced */
+struct result {
+    enum multipart_state state;
+    char *data;                 /* Data of the first part with a filename */
+    int datalen;
+    int file_part;
+    char name[MULTIPART_VALUE_MAX];
+    char filename[MULTIPART_VALUE_MAX];
+    char content_type[MULTIPART_VALUE_MAX];
+    int parts;
+};
+
+static char *load(const char *path, int *len){
+    FILE *fp = fopen(path, "rb");
+    char *buf;
+    long size;
+    if(fp == NULL){
+        printf("Cannot open %s\n", path);
+        exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    buf = malloc(size + 1);
+    if(buf == NULL || fread(buf, 1, size, fp) != (size_t)size){
+        printf("Cannot read %s\n", path);
+        exit(1);
+    }
+    fclose(fp);
+    buf[size] = 0;
+    *len = (int)size;
+    return buf;
+}
+
+/* Split a captured request into its Content-Type and body */
+static bool split_request(char *request, int len, struct mg_str *content_type, char **body, int *bodylen){
+    char *end = strstr(request, "\r\n\r\n");
+    char *line;
+    if(end == NULL)
+        return false;
+    *content_type = mg_str_n(NULL, 0);
+    for(line = request; line < end; line = strstr(line, "\r\n") + 2){
+        if(mg_ncasecmp(line, "Content-Type:", 13) == 0){
+            char *eol = strstr(line, "\r\n");
+            *content_type = mg_strstrip(mg_str_n(line + 13, eol - line - 13));
+        }
+    }
+    *body = end + 4;
+    *bodylen = len - (int)(*body - request);
+    return true;
+}
+
+/* Feed body to the parser in reads of step bytes (step <= 0 for random sizes from the seed) */
+static void parse(struct mg_str content_type, const char *body, int len, int step, unsigned seed, struct result *res){
+    struct multipart mp;
+    char *buf = malloc(len + 1);
+    int buflen = 0, fed = 0;
+
+    memset(res, 0, sizeof(struct result));
+    res->data = malloc(len + 1);
+    res->file_part = -1;
+    res->parts = 0;
+    if(multipart_init(&mp, content_type) == false){
+        res->state = MULTIPART_ERROR;
+        free(buf);
+        return;
+    }
+    srand(seed);
+    while(fed < len && mp.state != MULTIPART_ERROR && mp.state != MULTIPART_DONE){
+        int n = step > 0 ? step : rand() % 700 + 1, used = 0, datalen;
+        if(n > len - fed)
+            n = len - fed;
+        memcpy(&buf[buflen], &body[fed], n);
+        buflen += n;
+        fed += n;
+        for(;;){
+            used += multipart_parse(&mp, &buf[used], buflen - used, &datalen);
+            if(mp.part.index + 1 > res->parts)
+                res->parts = mp.part.index + 1;
+            if(datalen == 0)
+                break;
+            if(res->file_part < 0 && mp.part.filename[0] != 0){
+                res->file_part = mp.part.index;
+                strcpy(res->name, mp.part.name);
+                strcpy(res->filename, mp.part.filename);
+                strcpy(res->content_type, mp.part.content_type);
+            }
+            if(mp.part.index == res->file_part){
+                memcpy(&res->data[res->datalen], &buf[used], datalen);
+                res->datalen += datalen;
+            }
+            used += datalen;
+        }
+        /* What wasn't used waits for the next read */
+        memmove(buf, &buf[used], buflen - used);
+        buflen -= used;
+    }
+    res->state = mp.state;
+    free(buf);
+}
+
+static void free_result(struct result *res){
+    free(res->data);
+    res->data = NULL;
+}
+
+/* A captured upload gives back the image at every read size */
+static void test_capture(const char *path, const char *image, int imagelen){
+    struct mg_str content_type;
+    struct result res;
+    char *request, *body = NULL;
+    int len, bodylen = 0, bad = 0;
+    bool split;
+
+    request = load(path, &len);
+    split = split_request(request, len, &content_type, &body, &bodylen);
+    CHECK(split, "%s: no request headers", path);
+    if(split == false){
+        free(request);
+        return;
+    }
+    for(int step = 1; step <= bodylen && bad < 5; step++){
+        parse(content_type, body, bodylen, step, 0, &res);
+        CHECK(res.state == MULTIPART_DONE, "%s: read size %d ends in state %d", path, step, res.state);
+        CHECK(res.datalen == imagelen && memcmp(res.data, image, imagelen) == 0,
+              "%s: read size %d gives %d bytes of image (%d expected)", path, step, res.datalen, imagelen);
+        CHECK(strcmp(res.name, "fileupload") == 0 && strcmp(res.filename, "firmware.bin") == 0 &&
+              strcmp(res.content_type, "application/octet-stream") == 0,
+              "%s: read size %d part headers name \"%s\" filename \"%s\" type \"%s\"", path, step, res.name, res.filename, res.content_type);
+        if(res.state != MULTIPART_DONE || res.datalen != imagelen)
+            bad++;
+        free_result(&res);
+    }
+    for(unsigned seed = 1; seed <= 50; seed++){
+        parse(content_type, body, bodylen, 0, seed, &res);
+        CHECK(res.state == MULTIPART_DONE && res.datalen == imagelen && memcmp(res.data, image, imagelen) == 0,
+              "%s: random reads (seed %u) state %d, %d bytes", path, seed, res.state, res.datalen);
+        free_result(&res);
+    }
+    free(request);
+}
+
+/* Parse a body at every read size and check the file it carries */
+static void check_body(const char *what, const char *content_type, const char *body, int len,
+                       enum multipart_state state, const char *file, int filelen){
+    struct result res;
+    for(int step = 1; step <= len; step++){
+        parse(mg_str(content_type), body, len, step, 0, &res);
+        CHECK(res.state == state, "%s: read size %d ends in state %d (%d expected)", what, step, res.state, state);
+        if(file != NULL)
+            CHECK(res.datalen == filelen && memcmp(res.data, file, filelen) == 0,
+                  "%s: read size %d gives %d bytes of file (%d expected)", what, step, res.datalen, filelen);
+        free_result(&res);
+    }
+}
+
+static void test_quoted_boundary(void){
+    static const char body[] =
+        "--a b:c\r\n"
+        "Content-Disposition: form-data; name=\"fileupload\"; filename=\"fw;1.bin\"\r\n"
+        "\r\n"
+        "IMAGE\r\n--a b\r\n--a b:c--\r\n";
+    struct result res;
+    check_body("quoted boundary", "multipart/form-data; boundary=\"a b:c\"", body, sizeof(body) - 1,
+               MULTIPART_DONE, "IMAGE\r\n--a b", 12);
+    /* The ; inside the quoted filename doesn't end the parameter */
+    parse(mg_str("multipart/form-data; boundary=\"a b:c\""), body, sizeof(body) - 1, sizeof(body) - 1, 0, &res);
+    CHECK(strcmp(res.filename, "fw;1.bin") == 0, "quoted boundary: filename \"%s\"", res.filename);
+    free_result(&res);
+}
+
+static void test_split_delimiter(void){
+    /* The data ends with most of a delimiter - it is only data once the next byte shows it isn't one */
+    static const char body[] =
+        "--XyZ\r\n"
+        "Content-Disposition: form-data; name=\"fileupload\"; filename=\"a.bin\"\r\n"
+        "\r\n"
+        "ab\r\n--XyQ\r\n--Xy\r\n\r\n--XyZ--";
+    struct mg_str type = mg_str("multipart/form-data; boundary=XyZ");
+    struct multipart mp;
+    const char *data = strstr(body, "\r\n\r\n") + 4;
+    int headers = (int)(data - body), used, datalen;
+
+    check_body("split delimiter", "multipart/form-data; boundary=XyZ", body, sizeof(body) - 1,
+               MULTIPART_DONE, "ab\r\n--XyQ\r\n--Xy\r\n", 17);
+
+    /* Stopping in the middle of the closing delimiter hands back the data before it and keeps the rest */
+    multipart_init(&mp, type);
+    used = multipart_parse(&mp, body, headers + 4, &datalen);
+    CHECK(used == headers && datalen == 2, "split delimiter: used %d data %d", used, datalen);
+    used = multipart_parse(&mp, data, 6, &datalen);
+    CHECK(used == 0 && mp.state == MULTIPART_DATA && datalen == 2, "split delimiter: \"ab\\r\\n--\" gives %d bytes of data", datalen);
+}
+
+static void test_field_before_file(void){
+    static const char body[] =
+        "--bound\r\n"
+        "Content-Disposition: form-data; name=\"note\"\r\n"
+        "\r\n"
+        "not the image\r\n"
+        "--bound\r\n"
+        "Content-Disposition: form-data; name=\"fileupload\"; filename=\"fw.bin\"\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "\r\n"
+        "the image\r\n"
+        "--bound\r\n"
+        "Content-Disposition: form-data; name=\"other\"; filename=\"second.bin\"\r\n"
+        "\r\n"
+        "second file\r\n"
+        "--bound--\r\n";
+    struct result res;
+    check_body("field before file", "multipart/form-data; boundary=bound", body, sizeof(body) - 1,
+               MULTIPART_DONE, "the image", 9);
+    parse(mg_str("multipart/form-data; boundary=bound"), body, sizeof(body) - 1, 7, 0, &res);
+    CHECK(res.file_part == 1 && res.parts == 3 && strcmp(res.name, "fileupload") == 0,
+          "field before file: file is part %d of %d (%s)", res.file_part, res.parts, res.name);
+    free_result(&res);
+}
+
+static void test_missing_close(void){
+    /* Everything arrives but the closing delimiter never does - the caller has to notice */
+    static const char body[] =
+        "--bound\r\n"
+        "Content-Disposition: form-data; name=\"fileupload\"; filename=\"fw.bin\"\r\n"
+        "\r\n"
+        "the image";
+    static const char cut[] =
+        "--bound\r\n"
+        "Content-Disposition: form-data; name=\"fileupload\"; filename=\"fw.bin\"\r\n"
+        "\r\n"
+        "the image\r\n--bou";
+    check_body("missing close", "multipart/form-data; boundary=bound", body, sizeof(body) - 1,
+               MULTIPART_DATA, "the image", 9);
+    check_body("cut in the close", "multipart/form-data; boundary=bound", cut, sizeof(cut) - 1,
+               MULTIPART_DATA, "the image", 9);
+}
+
+static void test_long_header(void){
+    char *body = malloc(MULTIPART_LINE_MAX * 2 + 100);
+    int len = sprintf(body, "--bound\r\nContent-Disposition: form-data; name=\"fileupload\"; filename=\"");
+    struct result res;
+    memset(&body[len], 'x', MULTIPART_LINE_MAX + 10);
+    len += MULTIPART_LINE_MAX + 10;
+    len += sprintf(&body[len], "\"\r\n\r\nimage\r\n--bound--\r\n");
+    for(int step = 1; step <= len; step++){
+        parse(mg_str("multipart/form-data; boundary=bound"), body, len, step, 0, &res);
+        CHECK(res.state == MULTIPART_ERROR && res.datalen == 0, "long header: read size %d ends in state %d", step, res.state);
+        free_result(&res);
+    }
+    free(body);
+}
+
+static void test_content_types(void){
+    struct multipart mp;
+    CHECK(multipart_init(&mp, mg_str("application/octet-stream")) == false, "raw body taken as a form");
+    CHECK(multipart_init(&mp, mg_str("multipart/form-data")) == false, "form without a boundary accepted");
+    CHECK(multipart_init(&mp, mg_str("multipart/form-data; boundary=")) == false, "empty boundary accepted");
+    CHECK(multipart_init(&mp, mg_str("Multipart/Form-Data; charset=utf-8; BOUNDARY=abc")) == true && mp.delimlen == 7,
+          "parameters not matched without regard to case");
+}
+
+int main(int argc, char **argv){
+    const char *dir = argc > 1 ? argv[1] : "uploads";
+    char path[256], *image;
+    int imagelen;
+
+    snprintf(path, sizeof(path), "%s/firmware.bin", dir);
+    image = load(path, &imagelen);
+    snprintf(path, sizeof(path), "%s/chrome.http", dir);
+    test_capture(path, image, imagelen);
+    snprintf(path, sizeof(path), "%s/firefox.http", dir);
+    test_capture(path, image, imagelen);
+    snprintf(path, sizeof(path), "%s/curl.http", dir);
+    test_capture(path, image, imagelen);
+    test_quoted_boundary();
+    test_split_delimiter();
+    test_field_before_file();
+    test_missing_close();
+    test_long_header();
+    test_content_types();
+    free(image);
+
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,182 @@
+/*
+ * Host benchmark of the web server's request dispatch.
+ *
+ * Parses a set of requests once with mg_http_parse() and then times, for
+ * each, finding and running its handler through the route table in
+ * eq3_routes.h (what mongoose_route() in eq3_bootwifi.c does) against the
+ * strcmp chain it replaced, which copied the uri and query to the heap for
+ * every request. Handlers are stubs, so only the dispatch is measured.
+ *
+ * Build and run with "make -C test bench".
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mongoose.h"
+#include "eq3_routes.h"
+
+#define BENCH_ROUNDS 5000000
+
+static const char *requests[] = {
+    "GET /status.json HTTP/1.1\r\nHost: eq3hub\r\n\r\n",
+    "GET /web/index.html HTTP/1.1\r\nHost: eq3hub\r\n\r\n",
+    "GET /set?device=lounge&command=settemp&value=21.5 HTTP/1.1\r\nHost: eq3hub\r\n\r\n",
+    "GET /api/v1/devices/lounge HTTP/1.1\r\nHost: eq3hub\r\n\r\n",
+    "GET /api/v1/queue HTTP/1.1\r\nHost: eq3hub\r\n\r\n",
+    "POST /otaupload HTTP/1.1\r\nHost: eq3hub\r\nContent-Length: 0\r\n\r\n",
+    "GET /restartnow HTTP/1.1\r\nHost: eq3hub\r\n\r\n",
+    "GET /favicon.ico HTTP/1.1\r\nHost: eq3hub\r\n\r\n",
+};
+#define REQUESTS (sizeof(requests) / sizeof(requests[0]))
+
+/* Counted so the compiler can't drop the dispatch */
+static volatile unsigned long handled, pages, refused, unknown;
+
+static void handler(struct mg_connection *nc, struct mg_http_message *message){
+    handled++;
+}
+
+/* The firmware's table with every handler replaced by the stub */
+#define BENCH_ENTRY(uri, methods, fn, page) {ROUTE(uri), methods, NULL, page},
+
+static struct route routes[] = {
+    EQ3_ROUTES(BENCH_ENTRY)
+    {NULL}
+};
+
+/* As mongoose_route() */
+static void table_route(struct mg_connection *nc, struct mg_http_message *message){
+    const struct route *route = route_find(routes, message->uri);
+    if(route == NULL)
+        unknown++;
+    else if((route->methods & route_method(message)) == 0)
+        refused++;
+    else if(route->fn != NULL)
+        route->fn(nc, message);
+    else
+        pages++;
+}
+
+/* The dispatch before the route table */
+static char *mgStrToStr(struct mg_str mgStr){
+    char *str;
+    if(mgStr.len == 0)
+        return NULL;
+    str = malloc(mgStr.len + 1);
+    memcpy(str, mgStr.ptr, mgStr.len);
+    str[mgStr.len] = 0;
+    return str;
+}
+
+static void chain_api(struct mg_connection *nc, struct mg_http_message *message, const char *resource){
+    if(strcmp(resource, "devices") == 0)
+        handler(nc, message);
+    else if(strncmp(resource, "devices/", 8) == 0)
+        handler(nc, message);
+    else if(strcmp(resource, "queue") == 0)
+        handler(nc, message);
+    else if(strcmp(resource, "metrics") == 0)
+        handler(nc, message);
+    else if(strcmp(resource, "log") == 0)
+        handler(nc, message);
+    else if(strcmp(resource, "journal") == 0)
+        handler(nc, message);
+    else if(strcmp(resource, "status") == 0)
+        handler(nc, message);
+    else if(strcmp(resource, "set") == 0)
+        handler(nc, message);
+    else
+        unknown++;
+}
+
+static void chain_route(struct mg_connection *nc, struct mg_http_message *message){
+    char *uri = mgStrToStr(message->uri);
+    char *query = mgStrToStr(message->query);
+    if(strcmp(uri, "/set") == 0)
+        handler(nc, message);
+    else if(strcmp(uri, "/ws") == 0)
+        handler(nc, message);
+    else if(strncmp(uri, "/api/v1/", 8) == 0)
+        chain_api(nc, message, uri + 8);
+    else if(strcmp(uri, "/") == 0)
+        pages++;
+    else if(strncmp(uri, "/web/", 5) == 0)
+        pages++;
+    else if(strcmp(uri, "/status.json") == 0)
+        handler(nc, message);
+    else if(strcmp(uri, "/config.json") == 0)
+        handler(nc, message);
+    else if(strcmp(uri, "/configSubmit") == 0)
+        handler(nc, message);
+    else if(strcmp(uri, "/sendCommand") == 0)
+        handler(nc, message);
+    else if(strcmp(uri, "/getdevices") == 0)
+        handler(nc, message);
+    else if(strcmp(uri, "/status") == 0)
+        pages++;
+    else if(strcmp(uri, "/scan") == 0)
+        handler(nc, message);
+    else if(strcmp(uri, "/upload") == 0)
+        pages++;
+    else if(strcmp(uri, "/otaupload") == 0)
+        handler(nc, message);
+    else if(strcmp(uri, "/otastatus") == 0)
+        handler(nc, message);
+    else if(strcmp(uri, "/command") == 0)
+        handler(nc, message);
+    else if(strcmp(uri, "/viewlog") == 0)
+        handler(nc, message);
+    else if(strcmp(uri, "/journal") == 0)
+        handler(nc, message);
+    else if(strcmp(uri, "/restartnow") == 0)
+        handler(nc, message);
+    else
+        unknown++;
+    free(uri);
+    free(query);
+}
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Millions of requests per second */
+static double bench(void (*route)(struct mg_connection *nc, struct mg_http_message *message), struct mg_http_message *message){
+    double start = now();
+    for(long i = 0; i < BENCH_ROUNDS; i++)
+        route(NULL, message);
+    return BENCH_ROUNDS / (now() - start) / 1e6;
+}
+
+int main(int argc, char **argv){
+    struct mg_http_message messages[REQUESTS];
+    double table_total = 0, chain_total = 0;
+    for(struct route *route = routes; route->uri != NULL; route++){
+        if(route->page == NULL)
+            route->fn = handler;
+    }
+    for(size_t i = 0; i < REQUESTS; i++){
+        if(mg_http_parse(requests[i], strlen(requests[i]), &messages[i]) <= 0){
+            fprintf(stderr, "Can't parse %s", requests[i]);
+            return 1;
+        }
+    }
+    printf("%-28s %14s %14s\n", "Mreq/s", "table", "strcmp chain");
+    for(size_t i = 0; i < REQUESTS; i++){
+        double table = bench(table_route, &messages[i]);
+        double chain = bench(chain_route, &messages[i]);
+        printf("%-4.*s %-23.*s %14.1f %14.1f\n", (int)messages[i].method.len, messages[i].method.ptr,
+               (int)messages[i].uri.len, messages[i].uri.ptr, table, chain);
+        table_total += table;
+        chain_total += chain;
+    }
+    printf("%-28s %14.1f %14.1f\n", "mean", table_total / REQUESTS, chain_total / REQUESTS);
+    return 0;
+}
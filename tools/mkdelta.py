@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+"""Make a delta firmware update.
+
+    tools/mkdelta.py <running image> <new image> <patch>
+
+The patch rebuilds <new image> from <running image> on the hub and is
+uploaded on the software update page (or posted to /otaupload) in place
+of the image. It only applies to a hub running exactly <running image> -
+keep the .bin of each release you install. The format is described in
+main/eq3_delta.h.
+
+The new image is scanned for runs that are in the running image, either
+where the last run left off or (through an index of the running image)
+anywhere else. Short differences inside a run, typically addresses that
+moved, are sent as REPLACE so the run carries on after them.
+"""
+
+import hashlib
+import struct
+import sys
+
+MAGIC = b"EQ3D"
+VERSION = 1
+END, COPY, DATA, REPLACE, SEEK = range(5)
+
+KEY = 16        # bytes that must match to find a run elsewhere in the running image
+STEP = 4        # the running image is indexed every STEP bytes
+MIN_RUN = 8     # shortest run worth a COPY where the last one left off
+MIN_SEEK = 24   # shortest run worth a SEEK and a COPY
+
+
+def varint(n):
+    out = bytearray()
+    while True:
+        byte = n & 0x7f
+        n >>= 7
+        if n == 0:
+            out.append(byte)
+            return bytes(out)
+        out.append(byte | 0x80)
+
+
+def zigzag(n):
+    return n << 1 if n >= 0 else (-n << 1) - 1
+
+
+def match_len(new, j, old, i):
+    """Length of the run from new[j] that matches old[i]"""
+    end = min(len(new) - j, len(old) - i)
+    n = 0
+    while n + 64 <= end and new[j + n:j + n + 64] == old[i + n:i + n + 64]:
+        n += 64
+    while n < end and new[j + n] == old[i + n]:
+        n += 1
+    return n
+
+
+def diff(old, new):
+    index = {}
+    for i in range(0, len(old) - KEY + 1, STEP):
+        index.setdefault(old[i:i + KEY], i)
+
+    out = bytearray()
+    pos = 0         # source position on the hub
+    j = 0
+    pending = 0     # start of the new bytes not yet sent
+    while j < len(new):
+        start = j
+        expected = pos + (j - pending)
+        run = match_len(new, j, old, expected) if expected < len(old) else 0
+        if run >= MIN_RUN:
+            src = expected
+        else:
+            src = index.get(new[j:j + KEY]) if j + KEY <= len(new) else None
+            if src is None:
+                j += 1
+                continue
+            # The run may start before the indexed position
+            while start > pending and src > 0 and new[start - 1] == old[src - 1]:
+                start -= 1
+                src -= 1
+            run = match_len(new, start, old, src)
+            if run < MIN_SEEK:
+                j += 1
+                continue
+        if start > pending:
+            if src == pos + (start - pending):
+                out += bytes([REPLACE]) + varint(start - pending) + new[pending:start]
+                pos = src
+            else:
+                out += bytes([DATA]) + varint(start - pending) + new[pending:start]
+        if src != pos:
+            out += bytes([SEEK]) + varint(zigzag(src - pos))
+        out += bytes([COPY]) + varint(run)
+        pos = src + run
+        j = pending = start + run
+    if pending < len(new):
+        out += bytes([DATA]) + varint(len(new) - pending) + new[pending:]
+    out.append(END)
+
+    header = MAGIC + struct.pack("<II", VERSION, len(old)) + hashlib.sha256(old).digest() + \
+        struct.pack("<I", len(new)) + hashlib.sha256(new).digest()
+    return header + out
+
+
+def apply(old, patch):
+    """What the hub does - used to check the patch before it is written"""
+    new = bytearray()
+    pos = 0
+    p = 80
+    while True:
+        op = patch[p]
+        p += 1
+        if op == END:
+            break
+        arg = shift = 0
+        while True:
+            arg |= (patch[p] & 0x7f) << shift
+            shift += 7
+            p += 1
+            if patch[p - 1] & 0x80 == 0:
+                break
+        if op == COPY:
+            new += old[pos:pos + arg]
+            pos += arg
+        elif op in (DATA, REPLACE):
+            new += patch[p:p + arg]
+            p += arg
+            if op == REPLACE:
+                pos += arg
+        elif op == SEEK:
+            pos += (arg >> 1) ^ -(arg & 1)
+    return bytes(new)
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit("usage: tools/mkdelta.py <running image> <new image> <patch>")
+    with open(sys.argv[1], "rb") as f:
+        old = f.read()
+    with open(sys.argv[2], "rb") as f:
+        new = f.read()
+    patch = diff(old, new)
+    if apply(old, patch) != new:
+        sys.exit("mkdelta: patch check failed")
+    with open(sys.argv[3], "wb") as f:
+        f.write(patch)
+    print("%s: %d bytes (%d%% of the image)" % (sys.argv[3], len(patch), len(patch) * 100 // max(len(new), 1)))
+
+
+if __name__ == "__main__":
+    main()
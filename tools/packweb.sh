@@ -0,0 +1,21 @@
+#!/bin/sh
+# Regenerate main/eq3_webfs.c from the static web pages in main/web.
+# Each page is gzip compressed (the hub serves them with Content-Encoding: gzip)
+# and packed into a C array with mongoose's pack utility. The pages are served
+# from /web/<name> and their ETag is built from the size and modification time.
+set -e
+cd "$(dirname "$0")/.."
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+${CC:-cc} -o "$tmp/pack" components/mongoose/test/pack.c
+mkdir "$tmp/web"
+for page in main/web/*; do
+    name=$(basename "$page")
+    gzip -9 -n -c "$page" > "$tmp/web/$name"
+    touch -r "$page" "$tmp/web/$name"
+done
+{
+    echo "/* Generated by tools/packweb.sh from main/web - do not edit */"
+    (cd "$tmp" && ./pack web/*)
+} > main/eq3_webfs.c
+echo "main/eq3_webfs.c updated"